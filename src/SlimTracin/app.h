@@ -131,6 +131,8 @@ void initScene(Scene *scene, SceneSettings *settings, Memory *memory, Platform *
     scene->materials    = null;
     scene->lights       = null;
     scene->area_lights  = null;
+    scene->emissive_quads = null;
+    scene->emissive_quad_count = 0;
     scene->cameras      = null;
     scene->meshes       = null;
     scene->mesh_triangle_counts = null;
@@ -153,11 +155,12 @@ void initScene(Scene *scene, SceneSettings *settings, Memory *memory, Platform *
         for (u32 i = 0; i < settings->meshes; i++) {
             loadMeshFromFile(&scene->meshes[i], settings->mesh_files[i].char_ptr, platform, memory);
             scene->mesh_bvh_node_counts[i] = scene->meshes[i].bvh.node_count;
-            scene->mesh_triangle_counts[i] = scene->meshes[i].triangle_count;
+            scene->mesh_triangle_counts[i] = scene->meshes[i].triangle_reference_count;
         }
     }
     if (settings->materials)   {
         Material *material = scene->materials = (Material*)allocateMemory(memory, sizeof(Material) * settings->materials);
+        scene->material_ranks = (u32*)allocateMemory(memory, sizeof(u32) * settings->materials);
         for (u32 i = 0; i < settings->materials; i++, material++)
             initMaterial(material);
     }
@@ -182,6 +185,7 @@ void initScene(Scene *scene, SceneSettings *settings, Memory *memory, Platform *
     }
 
     if (settings->primitives) {
+        scene->emissive_quads = (EmissiveQuad*)allocateMemory(memory, sizeof(EmissiveQuad) * settings->primitives);
         scene->primitives = (Primitive*)allocateMemory(memory, sizeof(Primitive) * settings->primitives);
         if (scene->primitives)
             for (u32 i = 0; i < settings->primitives; i++) {
@@ -194,6 +198,7 @@ void initScene(Scene *scene, SceneSettings *settings, Memory *memory, Platform *
     scene->last_io_is_save = false;
 
     initBVH(&scene->bvh, settings->primitives, memory);
+    initWideBVH(&scene->wide_bvh, settings->primitives, memory);
 
     allocateDeviceScene(scene);
 }
@@ -245,11 +250,12 @@ void _initApp(Defaults *defaults, void* window_content_memory) {
     memory_size += scene_settings->primitives * sizeof(Primitive);
     memory_size += scene_settings->primitives * sizeof(Rect);
     memory_size += scene_settings->primitives * sizeof(vec3);
+    memory_size += scene_settings->primitives * sizeof(EmissiveQuad);
     memory_size += scene_settings->meshes     * sizeof(Mesh);
     memory_size += scene_settings->textures   * sizeof(Texture);
     memory_size += scene_settings->meshes     * sizeof(u32) * 2;
     memory_size += scene_settings->cameras    * sizeof(Camera);
-    memory_size += scene_settings->materials  * sizeof(Material);
+    memory_size += scene_settings->materials  * (sizeof(Material) + sizeof(u32));
     memory_size += scene_settings->area_lights * sizeof(AreaLight);
     memory_size += scene_settings->lights * sizeof(Light);
     memory_size += viewport_settings->hud_line_count * sizeof(HUDLine);
@@ -259,7 +265,7 @@ void _initApp(Defaults *defaults, void* window_content_memory) {
         for (u32 i = 0; i < scene_settings->textures; i++)
             memory_size += getTextureMemorySize(scene_settings->texture_files[i].char_ptr, &app->platform);
 
-    u32 max_triangle_count = 0;
+    u32 max_mesh_leaf_count = 0;
     u32 max_vertex_count = 0;
     u32 max_normal_count = 0;
     u32 max_bvh_depth = 0;
@@ -268,16 +274,33 @@ void _initApp(Defaults *defaults, void* window_content_memory) {
         for (u32 i = 0; i < scene_settings->meshes; i++) {
             u64 mesh_size = getMeshMemorySize(&mesh, scene_settings->mesh_files[i].char_ptr, &app->platform);
             memory_size += mesh_size;
-            if (mesh.triangle_count > max_triangle_count) max_triangle_count = mesh.triangle_count;
             if (mesh.vertex_count > max_vertex_count) max_vertex_count = mesh.vertex_count;
             if (mesh.normals_count > max_normal_count) max_normal_count = mesh.normals_count;
             if (mesh.bvh.height > max_bvh_depth) max_bvh_depth = mesh.bvh.height;
+
+            // Meshes that get their BVHs rebuilt are moved into memory with room for the references of their strategy:
+            if (scene_settings->mesh_bvh_strategies) {
+                enum BVHBuildStrategy strategy = scene_settings->mesh_bvh_strategies[i];
+                u32 leaf_count = getMeshBVHLeafCount(&mesh, strategy);
+                memory_size += getMeshBVHMemorySize(getMeshTriangleReferenceCapacity(&mesh, strategy));
+                if (leaf_count > max_mesh_leaf_count) max_mesh_leaf_count = leaf_count;
+                if (getBVHHeightEstimate(leaf_count) > max_bvh_depth) max_bvh_depth = getBVHHeightEstimate(leaf_count);
+            }
         }
     }
-    u32 max_leaf_count = scene_settings->primitives > max_triangle_count ? scene_settings->primitives : max_triangle_count;
+    u32 thread_count = platform->runParallelJob ? platform->thread_count : 1;
+    if (thread_count > MAX_THREAD_COUNT) thread_count = MAX_THREAD_COUNT;
+    if (thread_count < 1) thread_count = 1;
+
+    u32 max_leaf_count = scene_settings->primitives > max_mesh_leaf_count ? scene_settings->primitives : max_mesh_leaf_count;
     memory_size += getBVHMemorySize(scene_settings->primitives);
-    memory_size += getBVHBuilderMemorySize(&app->scene, max_leaf_count);
-    memory_size += sizeof(u32) * (scene_settings->primitives + max_bvh_depth + 2); // Trace stack sizes
+    memory_size += getWideBVHMemorySize(scene_settings->primitives);
+    memory_size += getBVHBuilderMemorySize(max_leaf_count, thread_count);
+    memory_size += sizeof(u32) * (scene_settings->primitives + max_bvh_depth * (WIDE_BVH_WIDTH - 1) + 2) * (thread_count + 1) * 2; // Trace stack sizes (with packet masks)
+    memory_size += sizeof(RayPacket) * (thread_count + 1);
+    memory_size += (sizeof(Wavefront) + (sizeof(WavefrontPath) + sizeof(WavefrontShadowRay) + sizeof(u32) * 2) * WAVEFRONT_SIZE +
+                    sizeof(u32) * (scene_settings->materials + 1)) * (thread_count + 1);
+    memory_size += (sizeof(Trace) + sizeof(TileQueue)) * thread_count;
 
     memory_size += max_vertex_count * (sizeof(vec3) + sizeof(vec4) + 1);
     memory_size += max_normal_count * sizeof(vec3);
@@ -288,13 +311,21 @@ void _initApp(Defaults *defaults, void* window_content_memory) {
 
     if (app->on.sceneReady) app->on.sceneReady(scene);
 
-    initBVHBuilder(builder, scene, memory);
+    initBVHBuilder(builder, max_leaf_count, thread_count, thread_count > 1 ? platform->runParallelJob : null, memory);
+    if (scene_settings->mesh_bvh_strategies) {
+        for (u32 m = 0; m < scene->settings.meshes; m++)
+            moveMeshToMemory(scene->meshes + m, getMeshTriangleReferenceCapacity(scene->meshes + m, scene_settings->mesh_bvh_strategies[m]), memory);
+        updateMeshBVHs(scene, builder, scene_settings->mesh_bvh_strategies);
+    }
 
     uploadScene(scene);
+    updateEmissiveQuads(scene);
+    updateMaterialRanks(scene);
     updateSceneBVH(scene, builder);
     uploadMeshBVHs(scene);
 
     initTrace(&viewport->trace, &app->scene, &app->memory);
+    initTiles(&viewport->tiles, &app->scene, thread_count, &app->memory);
 
     if (viewport_settings->hud_line_count)
         viewport_settings->hud_lines = (HUDLine*)allocateAppMemory(viewport_settings->hud_line_count * sizeof(HUDLine));
@@ -308,7 +339,7 @@ void _initApp(Defaults *defaults, void* window_content_memory) {
 }
 
 #ifdef __linux__
-//linux code goes here
+#include "./platforms/linux.h"
 #elif _WIN32
 #include "./platforms/win32.h"
 #endif
\ No newline at end of file
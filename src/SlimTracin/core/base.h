@@ -58,6 +58,32 @@
     #define unlikely(x) x
 #endif
 
+#if defined(COMPILER_MSVC)
+    #include <intrin.h>
+    #define atomicFetchAdd(address, value) ((u32)_InterlockedExchangeAdd((volatile long*)(address), (long)(value)))
+#elif defined(COMPILER_CLANG_OR_GCC)
+    #define atomicFetchAdd(address, value) __atomic_fetch_add((address), (value), __ATOMIC_RELAXED)
+#endif
+
+// SIMD kernels use AVX or SSE when compiling for the CPU (and scalar code otherwise).
+// Wide BVH nodes are slab-tested 8 children at a time with AVX, 4 at a time with SSE:
+#if !defined(__CUDA_ARCH__) && defined(__AVX__)
+    #include <immintrin.h>
+    #define SIMD_AVX 1
+    #define SIMD_SSE 1
+    #define WIDE_BVH_WIDTH 8
+#elif !defined(__CUDA_ARCH__) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+    #include <emmintrin.h>
+    #define SIMD_SSE 1
+    #define WIDE_BVH_WIDTH 4
+#else
+    #define WIDE_BVH_WIDTH 4
+#endif
+
+// Defining WIDE_BVH_QUANTIZED stores the child bounds of wide BVH nodes as 8-bit offsets (halving the size of a node),
+// trading some decoding work and looser bounds for less memory traffic on scenes that don't fit in the caches.
+// It is a compile-time option only, and is off by default as it measured slower on all of the examples.
+
 #ifdef COMPILER_CLANG
     #define ENABLE_FP_CONTRACT \
         _Pragma("clang diagnostic push") \
@@ -92,14 +118,47 @@
 
 typedef unsigned char      u8;
 typedef unsigned short     u16;
-typedef unsigned long      u32;
+typedef unsigned int       u32;
 typedef unsigned long long u64;
 typedef signed   short     i16;
-typedef signed   long      i32;
+typedef signed   int       i32;
 
 typedef float  f32;
 typedef double f64;
 
+// Indices of the lowest and highest set bits of a (non-zero) mask:
+INLINE u32 getLowestSetBit(u32 mask) {
+#if defined(__CUDA_ARCH__)
+    return (u32)__ffs(mask) - 1;
+#elif defined(COMPILER_CLANG_OR_GCC)
+    return (u32)__builtin_ctz(mask);
+#elif defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (u32)index;
+#else
+    u32 index = 0;
+    while (!(mask & 1)) { mask >>= 1; index++; }
+    return index;
+#endif
+}
+
+INLINE u32 getHighestSetBit(u32 mask) {
+#if defined(__CUDA_ARCH__)
+    return 31 - (u32)__clz(mask);
+#elif defined(COMPILER_CLANG_OR_GCC)
+    return 31 - (u32)__builtin_clz(mask);
+#elif defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return (u32)index;
+#else
+    u32 index = 31;
+    while (!(mask & 0x80000000u)) { mask <<= 1; index--; }
+    return index;
+#endif
+}
+
 typedef void* (*CallbackWithInt)(u64 size);
 typedef void (*CallbackWithBool)(bool on);
 typedef void (*CallbackWithCharPtr)(char* str);
@@ -122,6 +181,21 @@ typedef void (*CallbackWithCharPtr)(char* str);
 #define MAX_WIDTH 3840
 #define MAX_HEIGHT 2160
 
+#define MAX_THREAD_COUNT 64
+#define RENDER_TILE_SIZE 32
+#define RAY_PACKET_WIDTH 4
+#define RAY_PACKET_HEIGHT 4
+#define RAY_PACKET_SIZE (RAY_PACKET_WIDTH * RAY_PACKET_HEIGHT)
+#define MAX_PRETRACED_LIGHTS 32
+#define WAVEFRONT_SIZE (RENDER_TILE_SIZE * RENDER_TILE_SIZE)
+
+// The GPU traverses the binary BVHs, stacking up at most one node per level of depth. The stacks of a block's threads
+// are kept in its shared memory, sized by the heights of the BVHs (so blocks get fewer threads when the BVHs are taller):
+#define GPU_MAX_THREADS_PER_BLOCK 256
+#define GPU_MIN_THREADS_PER_BLOCK 32
+#define GPU_MAX_STACKS_MEMORY_SIZE (48 * 1024)
+#define MAX_OPTIMIZED_MESH_BVH_HEIGHT 32
+
 #define BOX__ALL_SIDES (Top | Bottom | Left | Right | Front | Back)
 #define BOX__VERTEX_COUNT 8
 #define BOX__EDGE_COUNT 12
@@ -158,16 +232,52 @@ typedef void (*CallbackWithCharPtr)(char* str);
 #define ALBEDO_MAP 1
 #define NORMAL_MAP 2
 
+#define TEXTURE_MAX_ANISOTROPY 8
+
 #define TRACE_OFFSET 0.0001f
 
 #define MAX_HIT_DEPTH 4
 #define MAX_DISTANCE INFINITY
 #define MAX_TRIANGLES_PER_MESH_BVH_NODE 4
+#define TRIANGLE_PACKET_WIDTH 4
 #define MAX_OBJS_PER_SCENE_BVH_NODE 2
 #define MAX_PRIMITIVES_PER_LEAF ( \
             MAX_TRIANGLES_PER_MESH_BVH_NODE > MAX_OBJS_PER_SCENE_BVH_NODE ? \
             MAX_TRIANGLES_PER_MESH_BVH_NODE : MAX_OBJS_PER_SCENE_BVH_NODE   \
 )
+#define BVH_BUILD_BIN_COUNT 16
+#define BVH_TRAVERSAL_COST 1
+#define BVH_BOTTOM_UP_SEARCH_RADIUS 14
+#define MAX_BVH_BUILD_BIN_COUNT 32
+#define BVH_BUILD_TASKS_PER_THREAD 8
+#define BVH_BUILD_MIN_TASK_SIZE 256
+
+// A refit BVH gets rebuilt once its SAH cost grows past this factor of the cost it had when it was last built:
+#define BVH_REFIT_MAX_COST_GROWTH 1.3f
+
+// Spatial splits may reference a triangle from several leaves of its mesh's BVH, for at most this many extra references
+// (as a fraction of the mesh's triangle count). They are only tried where the children of an object split overlap
+// by more than the given fraction of the surface area of the mesh:
+#define BVH_SPATIAL_SPLIT_BUDGET 0.25f
+#define BVH_SPATIAL_SPLIT_MIN_OVERLAP 0.00001f
+
+// Optimizing a BVH takes passes over it that reinsert each of its nodes where they add the least surface area.
+// A pass may not lower its SAH cost, so it stops after this many passes in a row that fail to lower it by the given fraction:
+#define BVH_REINSERTION_MIN_GAIN 0.0005f
+#define BVH_REINSERTION_MAX_FAILED_PASSES 8
+#define BVH_REINSERTION_MAX_PASSES 256
+
+// Mesh files that start with this magic number ("MESH" as a little-endian u32) are mapped into memory and used in place,
+// with each of their sections starting at a multiple of the given alignment (a cache line):
+#define MESH_FILE_MAGIC 0x4853454D
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_ALIGNMENT 64
+
+// Texture files that start with this magic number ("\0\0TX" as a little-endian u32) are mapped into memory, with the texels
+// of their mips used in place (so only paged in once sampled). Older texture files start with their width, which is never 0:
+#define TEXTURE_FILE_MAGIC 0x58540000
+#define TEXTURE_FILE_VERSION 1
+#define TEXTURE_FILE_ALIGNMENT 64
 
 #define IOR_AIR 1.0003f
 #define IOR_GLASS 1.52f
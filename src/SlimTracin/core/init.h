@@ -6,6 +6,19 @@
 #include "../math/mat4.h"
 #include "../math/quat.h"
 #include "../scene/primitive.h"
+#include "../scene/texture.h"
+
+// The most triangle references that a mesh's BVH gets to have when it's built with spatial splits:
+INLINE u32 getMaxTriangleReferenceCount(u32 triangle_count) {
+    return triangle_count + (u32)((f32)triangle_count * BVH_SPATIAL_SPLIT_BUDGET);
+}
+
+// The room for triangle references that a mesh needs for its BVH to be rebuilt with the given strategy.
+// Only spatial splits add references (while a BVH that was baked with them keeps its references until rebuilt):
+INLINE u32 getMeshTriangleReferenceCapacity(Mesh *mesh, enum BVHBuildStrategy strategy) {
+    u32 capacity = strategy == BVHBuildStrategy_SpatialSAH ? getMaxTriangleReferenceCount(mesh->triangle_count) : mesh->triangle_count;
+    return mesh->triangle_reference_count > capacity ? mesh->triangle_reference_count : capacity;
+}
 
 #ifdef __CUDACC__
 
@@ -18,13 +31,15 @@ __device__   FloatPixel d_pixels[MAX_WIDTH * MAX_HEIGHT];
 
 Light *d_lights;
 AreaLight  *d_area_lights;
+EmissiveQuad *d_emissive_quads;
 Material   *d_materials;
 Primitive  *d_primitives;
 Texture    *d_textures;
 TextureMip *d_texture_mips;
-TexelQuad  *d_texel_quads;
+u8         *d_texel_data;
 Mesh       *d_meshes;
 Triangle   *d_triangles;
+TriangleShading *d_triangle_shading;
 u32        *d_scene_bvh_leaf_ids;
 u32        *d_mesh_bvh_leaf_ids;
 BVHNode    *d_scene_bvh_nodes;
@@ -38,12 +53,14 @@ void allocateDeviceScene(Scene *scene) {
     if (scene->settings.lights) gpuErrchk(cudaMalloc(&d_lights, sizeof(Light) * scene->settings.lights))
     if (scene->settings.area_lights)  gpuErrchk(cudaMalloc(&d_area_lights,  sizeof(AreaLight)  * scene->settings.area_lights))
     if (scene->settings.primitives)   gpuErrchk(cudaMalloc(&d_primitives,   sizeof(Primitive)  * scene->settings.primitives))
+    if (scene->settings.primitives)   gpuErrchk(cudaMalloc(&d_emissive_quads, sizeof(EmissiveQuad) * scene->settings.primitives))
     if (scene->settings.meshes) {
         for (u32 i = 0; i < scene->settings.meshes; i++)
-            total_triangles += scene->meshes[i].triangle_count;
+            total_triangles += scene->meshes[i].triangle_reference_capacity;
 
         gpuErrchk(cudaMalloc(&d_meshes,    sizeof(Mesh)     * scene->settings.meshes))
         gpuErrchk(cudaMalloc(&d_triangles, sizeof(Triangle) * total_triangles))
+        gpuErrchk(cudaMalloc(&d_triangle_shading, sizeof(TriangleShading) * total_triangles))
         gpuErrchk(cudaMalloc(&d_mesh_bvh_leaf_ids,    sizeof(u32) * total_triangles))
         gpuErrchk(cudaMalloc(&d_mesh_bvh_node_counts, sizeof(u32) * scene->settings.meshes))
         gpuErrchk(cudaMalloc(&d_mesh_triangle_counts, sizeof(u32) * scene->settings.meshes))
@@ -51,15 +68,15 @@ void allocateDeviceScene(Scene *scene) {
 
     if (scene->settings.textures) {
         u32 total_mip_count = 0;
-        u32 total_texel_quads_count = 0;
+        u32 total_texel_data_size = 0;
         Texture *texture = scene->textures;
         for (u32 i = 0; i < scene->settings.textures; i++, texture++) {
             total_mip_count += texture->mip_count;
             TextureMip *mip = texture->mips;
             for (u32 m = 0; m < texture->mip_count; m++, mip++)
-                total_texel_quads_count += mip->width * mip->height;
+                total_texel_data_size += getTextureMipDataSize(texture->format, mip->width, mip->height, texture->tiled);
         }
-        gpuErrchk(cudaMalloc(&d_texel_quads, sizeof(TexelQuad) * total_texel_quads_count))
+        gpuErrchk(cudaMalloc(&d_texel_data, total_texel_data_size))
         gpuErrchk(cudaMalloc(&d_textures,           sizeof(Texture)  * scene->settings.textures))
         gpuErrchk(cudaMalloc(&d_texture_mips,       sizeof(TextureMip) * total_mip_count))
 
@@ -77,6 +94,9 @@ void uploadPrimitives(Scene *scene) {
 void uploadMaterials(Scene *scene) {
     uploadN( scene->materials, d_materials,scene->settings.materials)
 }
+void uploadEmissiveQuads(Scene *scene) {
+    if (scene->emissive_quad_count) uploadN(scene->emissive_quads, d_emissive_quads, scene->emissive_quad_count)
+}
 void uploadLights(Scene *scene) {
     if (scene->settings.lights) uploadN( scene->lights, d_lights, scene->settings.lights)
     if (scene->settings.area_lights)  uploadN( scene->area_lights,  d_area_lights,  scene->settings.area_lights)
@@ -87,18 +107,18 @@ void uploadScene(Scene *scene) {
     uploadPrimitives(scene);
     uploadMaterials(scene);
     uploadN( scene->textures,  d_textures,scene->settings.textures)
-    u32 texel_quads_offset = 0;
+    u32 texel_data_offset = 0;
     u32 mip_index_offset = 0;
-    u32 dim;
+    u32 size;
     Texture *texture = scene->textures;
     for (u32 i = 0; i < scene->settings.textures; i++, texture++) {
         uploadNto( texture->mips,  d_texture_mips, texture->mip_count, mip_index_offset)
         mip_index_offset += texture->mip_count;
         TextureMip *mip = texture->mips;
         for (u32 m = 0; m < texture->mip_count; m++, mip++) {
-            dim = mip->width * mip->height;
-            uploadNto( mip->texel_quads, d_texel_quads, dim, texel_quads_offset)
-            texel_quads_offset += dim;
+            size = getTextureMipDataSize(texture->format, mip->width, mip->height, texture->tiled);
+            uploadNto( mip->texel_data, d_texel_data, size, texel_data_offset)
+            texel_data_offset += size;
         }
     }
 }
@@ -115,10 +135,11 @@ void uploadMeshBVHs(Scene *scene) {
     u32 triangles_offset = 0;
     for (u32 i = 0; i < scene->settings.meshes; i++, mesh++) {
         uploadNto(mesh->bvh.nodes, d_mesh_bvh_nodes, mesh->bvh.node_count, nodes_offset)
-        uploadNto(mesh->triangles, d_triangles,      mesh->triangle_count, triangles_offset)
-        uploadNto(mesh->bvh.leaf_ids, d_mesh_bvh_leaf_ids,      mesh->triangle_count, triangles_offset)
+        uploadNto(mesh->triangles, d_triangles,      mesh->triangle_reference_count, triangles_offset)
+        uploadNto(mesh->triangle_shading, d_triangle_shading, mesh->triangle_reference_count, triangles_offset)
+        uploadNto(mesh->bvh.leaf_ids, d_mesh_bvh_leaf_ids,      mesh->triangle_reference_count, triangles_offset)
         nodes_offset        += mesh->bvh.node_count;
-        triangles_offset    += mesh->triangle_count;
+        triangles_offset    += mesh->triangle_reference_count;
     }
 
     uploadN(scene->mesh_bvh_node_counts, d_mesh_bvh_node_counts, scene->settings.meshes)
@@ -129,6 +150,7 @@ void uploadMeshBVHs(Scene *scene) {
 #define USE_GPU_BY_DEFAULT false
 
     void uploadLights(Scene *scene) {}
+    void uploadEmissiveQuads(Scene *scene) {}
     void uploadPrimitives(Scene *scene) {}
     void uploadMaterials(Scene *scene) {}
     void uploadScene(Scene *scene) {}
@@ -404,6 +426,11 @@ void setDefaultViewportSettings(ViewportSettings *settings) {
     settings->show_SSB = false;
     settings->show_selection = true;
     settings->use_GPU  = USE_GPU_BY_DEFAULT;
+    settings->use_threads = true;
+    settings->use_SSB = false;
+    settings->use_packets = false;
+    settings->use_wavefront = false;
+    settings->sort_hits = true;
     settings->render_mode = RenderMode_Beauty;
     settings->antialias = true;
     settings->use_cube_NDC = false;
@@ -453,7 +480,10 @@ void setDefaultSceneSettings(SceneSettings *settings) {
     settings->lights = 0;
     settings->area_lights = 0;
     settings->meshes = 0;
+    settings->textures = 0;
     settings->mesh_files = null;
+    settings->texture_files = null;
+    settings->mesh_bvh_strategies = null;
     settings->file.char_ptr = null;
     settings->file.length = 0;
 }
@@ -492,6 +522,61 @@ void initMaterial(Material *material) {
     for (u8 i = 0; i < 16; i++) material->texture_ids[i] = 0;
 }
 
+INLINE u32 getMaterialTextureId(Material *material, Scene *scene) {
+    return material->use && material->texture_count ? material->texture_ids[0] : scene->settings.textures;
+}
+
+// Rank the materials by the texture they sample first (untextured ones last) and then by their id,
+// so that the wavefront renderer can shade the hits of materials that share textures back to back.
+// This needs to be called again whenever the textures that materials use change:
+void updateMaterialRanks(Scene *scene) {
+    u32 material_count = scene->settings.materials, texture_id, other_texture_id, rank;
+    for (u32 m = 0; m < material_count; m++) {
+        texture_id = getMaterialTextureId(scene->materials + m, scene);
+        rank = 0;
+        for (u32 other = 0; other < material_count; other++) {
+            other_texture_id = getMaterialTextureId(scene->materials + other, scene);
+            if (other_texture_id < texture_id || (other_texture_id == texture_id && other < m))
+                rank++;
+        }
+        scene->material_ranks[m] = rank;
+    }
+}
+
+void updateEmissiveQuads(Scene *scene) {
+    // Cache the world-space geometry of every quad with an emissive material, so shading only visits those:
+    EmissiveQuad *emissive_quad = scene->emissive_quads;
+    Primitive *primitive = scene->primitives;
+    vec3 U, V;
+
+    scene->emissive_quad_count = 0;
+    for (u32 i = 0; i < scene->settings.primitives; i++, primitive++) {
+        if (primitive->type != PrimitiveType_Quad || !(scene->materials[primitive->material_id].is & EMISSIVE))
+            continue;
+
+        U = V = getVec3Of(0);
+        U.x = primitive->scale.x < 0 ? -primitive->scale.x : primitive->scale.x;
+        V.z = primitive->scale.z < 0 ? -primitive->scale.z : primitive->scale.z;
+        emissive_quad->area = 4 * U.x * V.z;
+        U = mulVec3Quat(U, primitive->rotation);
+        V = mulVec3Quat(V, primitive->rotation);
+
+        emissive_quad->vertices[0] = subVec3(subVec3(primitive->position, U), V);
+        emissive_quad->vertices[1] = subVec3(addVec3(primitive->position, U), V);
+        emissive_quad->vertices[2] = addVec3(addVec3(primitive->position, U), V);
+        emissive_quad->vertices[3] = addVec3(subVec3(primitive->position, U), V);
+        emissive_quad->position = primitive->position;
+        emissive_quad->normal = mulVec3Quat(Vec3(0, 1, 0), primitive->rotation);
+        emissive_quad->primitive_id = i;
+        emissive_quad->material_id = primitive->material_id;
+
+        emissive_quad++;
+        scene->emissive_quad_count++;
+    }
+
+    uploadEmissiveQuads(scene);
+}
+
 void initBVHNode(BVHNode *node) {
     node->aabb.min.x = node->aabb.min.y = node->aabb.min.z = 0;
     node->aabb.max.x = node->aabb.max.y = node->aabb.max.z = 0;
@@ -511,26 +596,76 @@ u32 getBVHMemorySize(u32 leaf_count) {
     return leaf_count * (sizeof(u32) + sizeof(BVHNode) * 2);
 }
 
+void initWideBVH(WideBVH *wide_bvh, u32 leaf_count, Memory *memory) {
+    wide_bvh->node_count = wide_bvh->height = 0;
+    wide_bvh->nodes = (WideBVHNode*)allocateMemory(memory, sizeof(WideBVHNode) * (leaf_count ? leaf_count : 1));
+}
+
+u32 getWideBVHMemorySize(u32 leaf_count) {
+    return sizeof(WideBVHNode) * (leaf_count ? leaf_count : 1);
+}
+
+// Stack sizes are kept in full 32 bits, as deep mesh BVHs (and wide ones especially) can stack up more than 255 nodes:
+u32 getTraceMeshStackSize(Scene *scene) {
+    u32 max_depth = 0;
+    for (u32 m = 0; m < scene->settings.meshes; m++)
+        if (scene->meshes[m].bvh.height > max_depth)
+            max_depth = scene->meshes[m].bvh.height;
+
+    // A wide node can leave all but its nearest child on the stack:
+    for (u32 m = 0; m < scene->settings.meshes; m++)
+        if (scene->meshes[m].wide_bvh.height * (WIDE_BVH_WIDTH - 1) > max_depth)
+            max_depth = scene->meshes[m].wide_bvh.height * (WIDE_BVH_WIDTH - 1);
+
+    return max_depth + 2;
+}
+
+// Mesh stacks need to be re-allocated whenever mesh BVHs get rebuilt (as they may come out taller):
+void initTraceMeshStack(Trace *trace, Scene *scene, Memory *memory) {
+    trace->mesh_stack_size = scene->settings.meshes ? getTraceMeshStackSize(scene) : 0;
+    trace->mesh_stack = trace->mesh_stack_size ? (u32*)allocateMemory(memory, sizeof(u32) * trace->mesh_stack_size) : null;
+    trace->packet->mesh_stack_masks = trace->mesh_stack_size ? (u32*)allocateMemory(memory, sizeof(u32) * trace->mesh_stack_size) : null;
+}
+
 void initTrace(Trace *trace, Scene *scene, Memory *memory) {
 //    trace->quad_light_hits = scene->settings.area_lights ?
 //            allocateMemory(memory, sizeof(RayHit) * scene->settings.area_lights) : null;
 
-    trace->mesh_stack_size = 0;
-    trace->mesh_stack = null;
-    if (scene->settings.meshes) {
-        trace->closest_mesh_hit.object_type = PrimitiveType_Mesh;
-
-        u32 max_depth = 0;
-        for (u32 m = 0; m < scene->settings.meshes; m++)
-            if (scene->meshes[m].bvh.height > max_depth)
-                max_depth = scene->meshes[m].bvh.height;
-        trace->mesh_stack_size = (u8)(max_depth + 2);
-        trace->mesh_stack = (u32*)allocateMemory(memory, sizeof(u32) * trace->mesh_stack_size);
-    }
+    trace->closest_mesh_hit.object_type = PrimitiveType_Mesh;
 
-    trace->scene_stack_size = (u8)scene->settings.primitives;
+    // Traversing the scene's BVH never stacks up more nodes than there are primitives (instances) in the scene:
+    trace->scene_stack_size = scene->settings.primitives;
     trace->scene_stack = (u32*)allocateMemory(memory, sizeof(u32) * trace->scene_stack_size);
+
+    // Packet traversals keep the ray mask of each node they push alongside the node ids on the stacks:
+    trace->packet = (RayPacket*)allocateMemory(memory, sizeof(RayPacket));
+    trace->packet->scene_stack_masks = (u32*)allocateMemory(memory, sizeof(u32) * trace->scene_stack_size);
+    initTraceMeshStack(trace, scene, memory);
+    trace->pretraced_lights = trace->shadowed_lights = 0;
+
+    // The queues of the wavefront renderer hold up to a tile's worth of paths at a time:
+    Wavefront *wavefront = trace->wavefront = (Wavefront*)allocateMemory(memory, sizeof(Wavefront));
+    wavefront->paths         = (WavefrontPath*     )allocateMemory(memory, sizeof(WavefrontPath)      * WAVEFRONT_SIZE);
+    wavefront->shadow_rays   = (WavefrontShadowRay*)allocateMemory(memory, sizeof(WavefrontShadowRay) * WAVEFRONT_SIZE);
+    wavefront->ray_queue     = (u32*)allocateMemory(memory, sizeof(u32) * WAVEFRONT_SIZE);
+    wavefront->shading_queue = (u32*)allocateMemory(memory, sizeof(u32) * WAVEFRONT_SIZE);
+    wavefront->material_offsets = (u32*)allocateMemory(memory, sizeof(u32) * (scene->settings.materials + 1));
+
     trace->depth = 2;
+    trace->soft_shadows = true;
+    trace->stats.primary_rays = trace->stats.secondary_rays = trace->stats.shadow_rays = 0;
+    trace->stats.primitive_tests = trace->stats.primary_primitive_tests = 0;
+    trace->stats.shaded_hits = trace->stats.shading_switches = 0;
+    trace->shaded_material_id = (u32)-1;
+}
+
+void initTiles(Tiles *tiles, Scene *scene, u32 thread_count, Memory *memory) {
+    tiles->count = tiles->columns = tiles->rows = 0;
+    tiles->thread_count = thread_count;
+    tiles->queues = (TileQueue*)allocateMemory(memory, sizeof(TileQueue) * thread_count);
+    tiles->traces = (Trace*    )allocateMemory(memory, sizeof(Trace)     * thread_count);
+    for (u32 i = 0; i < thread_count; i++)
+        initTrace(tiles->traces + i, scene, memory);
 }
 
 INLINE void prePrepRay(Ray *ray) {
@@ -556,4 +691,7 @@ void setViewportProjectionPlane(Viewport *viewport) {
 
     projection_plane->right = scaleVec3(*camera->transform.right_direction, 2);
     projection_plane->down  = scaleVec3(*camera->transform.up_direction, -2);
+
+    // Pixels are 2 units wide on a projection plane that is (height * focal length) units away:
+    projection_plane->cone_angle = 1.0f / (dimensions->f_height * camera->focal_length);
 }
\ No newline at end of file
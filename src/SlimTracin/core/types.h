@@ -61,18 +61,66 @@ typedef struct TexelQuad {
     TexelQuadComponent R, G, B;
 } TexelQuad;
 
+typedef struct TexelRGBA {
+    u8 R, G, B, A;
+} TexelRGBA;
+
+// A 4x4 block of texels, as 2 (RGB 565) end-point colors and a 2-bit palette index per texel (BC1):
+typedef struct TexelBlock {
+    u16 color0, color1;
+    u32 indices;
+} TexelBlock;
+
+// Texel quads hold all 4 corners of each bilinear fetch (12 bytes per texel), RGBA8 texels are bordered so that a fetch
+// never needs to wrap or clamp (4 bytes per texel) and BC1 blocks are decoded as they're sampled (half a byte per texel).
+// Texel quads and RGBA8 texels can also be laid out in 4x4 tiles (BC1 blocks already are), keeping vertical neighbours
+// close in memory:
+typedef enum TextureFormat {
+    TextureFormat_TexelQuads,
+    TextureFormat_RGBA8,
+    TextureFormat_BC1
+} TextureFormat;
+
+// Bilinear filtering samples the single mip closest to the footprint of a ray cone, trilinear filtering blends the 2 mips
+// around it, and anisotropic filtering blends several trilinear taps along the major axis of the footprint (sampling
+// mips that match its minor axis instead):
+typedef enum TextureFilter {
+    TextureFilter_Bilinear,
+    TextureFilter_Trilinear,
+    TextureFilter_Anisotropic
+} TextureFilter;
+
 typedef struct TextureMip {
     u16 width, height;
-    TexelQuad *texel_quads;
+    union {
+        TexelQuad *texel_quads;
+        TexelRGBA *texels;
+        TexelBlock *texel_blocks;
+        u8 *texel_data;
+    };
 } TextureMip;
 
 typedef struct Texture {
     u16 width, height;
-    u8 mip_count;
-    bool wrap, mipmap;
+    u8 mip_count, format, filter;
+    bool wrap, mipmap, tiled;
     TextureMip *mips;
 } Texture;
 
+typedef struct TextureFileMip {
+    u16 width, height;
+    u32 size;
+    u64 offset; // In bytes from the start of the file
+} TextureFileMip;
+
+typedef struct TextureFileHeader { // Followed by a TextureFileMip for each mip
+    u32 magic, version;
+    u16 width, height;
+    u8 mip_count, format;
+    bool wrap, mipmap, tiled;
+    u64 file_size;
+} TextureFileHeader;
+
 typedef enum BoxSide {
     NoSide = 0,
     Top    = 1,
@@ -184,21 +232,58 @@ typedef struct Ray {
 
 typedef struct RayHit {
     vec3 position, normal;
-    vec2 uv, dUV;
+    vec2 uv, uv_axis;
     f32 distance, distance_squared, cone_angle, cone_width, NdotV, area, uv_area;
     u32 material_id, object_id, object_type;
     bool from_behind;
 } RayHit;
 
+typedef struct TraceStats {
+    u64 primary_rays, secondary_rays, shadow_rays, primitive_tests, primary_primitive_tests, shaded_hits, shading_switches;
+} TraceStats;
+
+// The interval bounds of a packet of rays that all share the same octant.
+// Near/far origins are the corners of the origins' bounds that give the lowest entry and highest exit distances:
+typedef struct RayPacketBounds {
+    vec3 near_origin, far_origin, direction_reciprocal_min, direction_reciprocal_max;
+    u8_3 octant;
+} RayPacketBounds;
+
+typedef struct RayPacket {
+    Ray rays[RAY_PACKET_SIZE], local_space_rays[RAY_PACKET_SIZE];
+    RayHit hits[RAY_PACKET_SIZE], mesh_hits[RAY_PACKET_SIZE];
+    RayPacketBounds bounds, local_space_bounds;
+    u32 *scene_stack_masks,
+        *mesh_stack_masks;
+} RayPacket;
+
 typedef struct Trace {
+    TraceStats stats;
     SphereHit sphere_hit;
     RayHit closest_hit, closest_mesh_hit, current_hit, *quad_light_hits;
     Ray local_space_ray;
+    RayPacket *packet;
+    struct Wavefront *wavefront;
     u32 *scene_stack,
-        *mesh_stack;
-    u8 depth, mesh_stack_size, scene_stack_size;
+        *mesh_stack,
+        pretraced_lights, shadowed_lights, shaded_material_id,
+        mesh_stack_size, scene_stack_size;
+    u8 depth;
+    bool soft_shadows;
 } Trace;
 
+// Tiles:
+// ======
+typedef struct TileQueue {
+    u32 next, end, padding[14]; // One cache line per queue, to avoid false sharing between threads
+} TileQueue;
+
+typedef struct Tiles {
+    TileQueue *queues;
+    Trace *traces;
+    u32 thread_count, count, columns, rows;
+} Tiles;
+
 // BVH:
 // ====
 typedef struct BVHNode {
@@ -212,6 +297,25 @@ typedef struct BVH {
     BVHNode *nodes;
 } BVH;
 
+typedef struct WideBVHNode {
+#ifdef WIDE_BVH_QUANTIZED
+    // Child bounds are stored in power-of-two steps (per axis) from the origin, rounded outwards,
+    // which fits a whole 4-wide node in a single cache line:
+    vec3 origin;
+    u8 exponents[3], padding; // Biased exponents (as in the bits of an f32) of the steps
+    u8 bounds[6][WIDE_BVH_WIDTH]; // Min x/y/z then max x/y/z, one lane per child
+#else
+    f32 bounds[6][WIDE_BVH_WIDTH]; // Min x/y/z then max x/y/z, one lane per child
+#endif
+    u32 child_ids[WIDE_BVH_WIDTH]; // Wide node id of an inner child, or the first leaf id (triangle packet id for meshes) of a leaf child
+    u16 child_counts[WIDE_BVH_WIDTH]; // 0 for inner children, the leaf's primitive count otherwise
+} WideBVHNode;
+
+typedef struct WideBVH {
+    u32 node_count, height;
+    WideBVHNode *nodes;
+} WideBVH;
+
 typedef struct NavigationSpeedSettings {
     f32 turn, zoom, dolly, pan, orbit, orient;
 } NavigationSpeedSettings;
@@ -251,7 +355,7 @@ typedef struct ViewportSettings {
     HUDLine *hud_lines;
     enum ColorID hud_default_color;
     enum RenderMode render_mode;
-    bool show_hud, show_wire_frame, antialias, use_cube_NDC, flip_z, show_BVH, show_SSB, show_selection, background_fill, use_GPU;
+    bool show_hud, show_wire_frame, antialias, use_cube_NDC, flip_z, show_BVH, show_SSB, show_selection, background_fill, use_GPU, use_threads, use_SSB, use_packets, use_wavefront, sort_hits;
 } ViewportSettings;
 
 typedef struct Viewport {
@@ -262,6 +366,8 @@ typedef struct Viewport {
     Camera *camera;
     PixelGrid *frame_buffer;
     Trace trace;
+    Tiles tiles;
+    TraceStats stats;
     Box default_box;
     vec2i position;
     mat4 projection_matrix;
@@ -269,18 +375,39 @@ typedef struct Viewport {
 
 // Mesh:
 // =====
-typedef struct Triangle {
+typedef struct Triangle { // Just what a ray test reads, padded to a cache line
     mat3 world_to_tangent;
     vec3 position, normal;
+    u32 padding;
+} Triangle;
+typedef struct TriangleShading { // Only read for the closest hit
     vec3 vertex_normals[3];
     vec2 uvs[3];
     f32 area_of_parallelogram, area_of_uv;
-} Triangle;
+} TriangleShading;
+typedef struct TriangleRecord { // How triangles are laid out in mesh files of the older (read rather than mapped) layout
+    mat3 world_to_tangent;
+    vec3 position, normal;
+    vec3 vertex_normals[3];
+    vec2 uvs[3];
+    f32 area_of_parallelogram, area_of_uv;
+} TriangleRecord;
+typedef struct TrianglePacket { // Consecutive triangles of a mesh BVH leaf, one per lane
+    f32 position[3][TRIANGLE_PACKET_WIDTH],
+        normal[3][TRIANGLE_PACKET_WIDTH],
+        world_to_tangent[9][TRIANGLE_PACKET_WIDTH];
+    u32 first_triangle_id, triangle_count;
+} TrianglePacket;
 typedef struct EdgeVertexIndices { u32 from, to; } EdgeVertexIndices;
 typedef union TriangleVertexIndices { u32 ids[3]; struct { u32 v1, v2, v3; }; } TriangleVertexIndices;
 typedef struct Mesh {
     AABB aabb;
     u32 triangle_count, vertex_count, edge_count, normals_count, uvs_count;
+
+    // Triangles are laid out in the order of the leaves of the mesh's BVH that reference them (once each,
+    // unless the BVH was built with spatial splits), with 'bvh.leaf_ids' mapping them back to their vertex indices.
+    // The capacity is how many references its arrays have room for (so how many a rebuilt BVH can have):
+    u32 triangle_reference_count, triangle_reference_capacity;
     vec3 *vertex_positions, *vertex_normals;
     vec2 *vertex_uvs;
     TriangleVertexIndices *vertex_position_indices;
@@ -288,9 +415,46 @@ typedef struct Mesh {
     TriangleVertexIndices *vertex_uvs_indices;
     EdgeVertexIndices     *edge_vertex_indices;
     Triangle *triangles;
+    TriangleShading *triangle_shading;
+    TrianglePacket *triangle_packets;
     BVH bvh;
+    WideBVH wide_bvh;
+    bool is_mapped; // Used in place from its mapped file
 } Mesh;
 
+typedef enum MeshSection {
+    MeshSection_Triangles,
+    MeshSection_TriangleShading,
+    MeshSection_TrianglePackets,
+    MeshSection_BVHNodes,
+    MeshSection_BVHLeafIds,
+    MeshSection_WideBVHNodes,
+    MeshSection_VertexPositions,
+    MeshSection_VertexPositionIndices,
+    MeshSection_EdgeVertexIndices,
+    MeshSection_VertexUVs,
+    MeshSection_VertexUVsIndices,
+    MeshSection_VertexNormals,
+    MeshSection_VertexNormalIndices,
+    MeshSection_Count
+} MeshSection;
+
+typedef struct MeshFileHeader {
+    u32 magic, version;
+    AABB aabb;
+    u32 vertex_count, triangle_count, triangle_reference_count, triangle_packet_count;
+    u32 edge_count, uvs_count, normals_count;
+    u32 bvh_node_count, bvh_height;
+
+    // The wide BVH is only used as is when its nodes are laid out as they are in this build (they vary with the
+    // SIMD width and quantization), and is rebuilt from the BVH otherwise:
+    u32 wide_bvh_node_count, wide_bvh_height, wide_bvh_width, wide_bvh_node_size;
+
+    // Byte offsets from the start of the file (0 for sections that the mesh does not have):
+    u64 section_offsets[MeshSection_Count];
+    u64 file_size;
+} MeshFileHeader;
+
 // Lights:
 // ======
 typedef struct AmbientLight{
@@ -308,6 +472,12 @@ typedef struct AreaLight {
     f32 A, u_length, v_length;
 } AreaLight;
 
+typedef struct EmissiveQuad {
+    vec3 vertices[4], position, normal;
+    f32 area;
+    u32 primitive_id, material_id;
+} EmissiveQuad;
+
 // Materials:
 // =========
 enum BRDF {
@@ -328,10 +498,37 @@ typedef struct Material {
 typedef struct Shaded {
     Primitive *primitive;
     Material *material;
-    vec3 albedo, position, normal, viewing_direction, viewing_origin, reflected_direction, light_direction, emissive_quad_vertices[4];
+    vec3 albedo, position, normal, viewing_direction, viewing_origin, reflected_direction, light_direction;
     vec2 uv;
 } Shaded;
 
+// Wavefront:
+// ==========
+// The state of the path of a pixel's ray through the scene, carried across the stages of the wavefront renderer:
+typedef struct WavefrontPath {
+    Ray ray;
+    RayHit hit;
+    Shaded shaded;
+    vec3 color, current_color, throughput, primary_direction;
+    f32 max_distance, primary_distance, z, NdotRd, ior;
+    u16 x, y;
+    u8 depth;
+    bool hit_found, lights_shaded, is_ref;
+} WavefrontPath;
+
+typedef struct WavefrontShadowRay {
+    Ray ray;
+    vec3 light_direction;
+    f32 distance, distance_squared, NdotL, light_intensity;
+    u32 path_id;
+} WavefrontShadowRay;
+
+typedef struct Wavefront {
+    WavefrontPath *paths;
+    WavefrontShadowRay *shadow_rays;
+    u32 *ray_queue, *shading_queue, *material_offsets;
+} Wavefront;
+
 typedef struct Selection {
     quat object_rotation;
     vec3 transformation_plane_origin,
@@ -348,23 +545,40 @@ typedef struct Selection {
     bool changed, transformed;
 } Selection;
 
+enum BVHBuildStrategy {
+    BVHBuildStrategy_SweepSAH,
+    BVHBuildStrategy_BinnedSAH,
+    BVHBuildStrategy_BottomUp,
+
+    // Binned SAH that also considers splitting a mesh's BVH nodes by planes that cut through triangles (referencing them
+    // from both sides). The scene's BVH only gets binned object splits:
+    BVHBuildStrategy_SpatialSAH
+};
+
 typedef struct SceneSettings {
     u32 cameras, primitives, meshes, materials, lights, area_lights, textures;
     String file, *mesh_files, *texture_files;
+
+    // When set, the BVHs of meshes get rebuilt once loaded, each with its own strategy (instead of the ones they were baked with):
+    enum BVHBuildStrategy *mesh_bvh_strategies;
 } SceneSettings;
 
 typedef struct Scene {
     SceneSettings settings;
     Selection *selection;
     BVH bvh;
+    WideBVH wide_bvh;
 
     Texture *textures;
     Camera *cameras;
     AmbientLight ambient_light;
     Light *lights;
     AreaLight *area_lights;
+    EmissiveQuad *emissive_quads;
+    u32 emissive_quad_count;
 
     Material *materials;
+    u32 *material_ranks;
     Primitive *primitives;
     Mesh *meshes;
     u32 *mesh_bvh_node_counts,
@@ -391,6 +605,10 @@ typedef struct AppCallbacks {
 typedef void* (*CallbackForFileOpen)(const char* file_path);
 typedef bool  (*CallbackForFileRW)(void *out, unsigned long, void *handle);
 typedef void  (*CallbackForFileClose)(void *handle);
+typedef void* (*CallbackForFileMap)(const char* file_path, u64 *size);
+typedef void  (*CallbackForFileUnmap)(void *address, u64 size);
+typedef void  (*CallbackForJob)(void *data, u32 thread_index);
+typedef void  (*CallbackForParallelJob)(CallbackForJob job, void *data, u32 thread_count);
 
 typedef struct Platform {
     GetTicks             getTicks;
@@ -403,7 +621,11 @@ typedef struct Platform {
     CallbackForFileOpen  openFileForWriting;
     CallbackForFileRW    readFromFile;
     CallbackForFileRW    writeToFile;
+    CallbackForFileMap   mapFile;
+    CallbackForFileUnmap unmapFile;
+    CallbackForParallelJob runParallelJob;
     u64 ticks_per_second;
+    u32 thread_count;
 } Platform;
 
 typedef struct Settings {
@@ -0,0 +1,476 @@
+#pragma once
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../core/time.h"
+#include "../viewport/navigation.h"
+#include "../render/raytracer.h"
+
+// Headless platform layer: there is no window or input, the scene is rendered offline for a
+// given number of frames and the final frame is written out as an image (PPM or PFM).
+// In benchmark mode the camera orbits its target along a fixed path, and the timings and
+// ray counts are reported as a single line of JSON.
+
+u32 Linux_missing_file_count;
+
+void Linux_setWindowTitle(char* str) {}
+void Linux_setCursorVisibility(bool on) {}
+void Linux_setWindowCapture(bool on) {}
+u64 Linux_getTicks() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000ULL + (u64)now.tv_nsec;
+}
+void* Linux_getMemory(u64 size) {
+    void *memory = mmap(null, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return memory == MAP_FAILED ? null : memory;
+}
+
+void Linux_closeFile(void *handle) { if (handle) close((int)(size_t)handle); }
+void* Linux_openFile(const char* path, int flags) {
+    int fd = open(path, flags, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open file \"%s\"\n", path);
+        return null;
+    }
+    return (void*)(size_t)fd;
+}
+void* Linux_openFileForReading(const char* path) {
+    void *handle = Linux_openFile(path, O_RDONLY);
+    if (!handle) Linux_missing_file_count++;
+    return handle;
+}
+void* Linux_openFileForWriting(const char* path) {
+    return Linux_openFile(path, O_WRONLY | O_CREAT | O_TRUNC);
+}
+bool Linux_readFromFile(void *out, unsigned long size, void *handle) {
+    u8 *bytes = (u8*)out;
+    ssize_t bytes_read;
+    while (handle && size) {
+        bytes_read = read((int)(size_t)handle, bytes, size);
+        if (bytes_read <= 0) break;
+        bytes += bytes_read;
+        size  -= (unsigned long)bytes_read;
+    }
+    // Whatever could not be read is zeroed, so a missing file loads as an empty resource:
+    if (size) memset(bytes, 0, size);
+    return size == 0;
+}
+bool Linux_writeToFile(void *out, unsigned long size, void *handle) {
+    u8 *bytes = (u8*)out;
+    ssize_t bytes_written;
+    while (handle && size) {
+        bytes_written = write((int)(size_t)handle, bytes, size);
+        if (bytes_written <= 0) break;
+        bytes += bytes_written;
+        size  -= (unsigned long)bytes_written;
+    }
+    return size == 0;
+}
+// Files are mapped copy-on-write: their pages are shared with every other process that maps them until written to.
+// Failing to map a file is not reported, as callers then fall back to reading it:
+void* Linux_mapFile(const char* path, u64 *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return null;
+
+    void *address = null;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        address = mmap(null, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) address = null;
+        else *size = (u64)file_stat.st_size;
+    }
+    close(fd);
+    return address;
+}
+void Linux_unmapFile(void *address, u64 size) { if (address) munmap(address, (size_t)size); }
+
+pthread_t       Linux_worker_threads[MAX_THREAD_COUNT];
+pthread_mutex_t Linux_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  Linux_workers_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t  Linux_workers_done  = PTHREAD_COND_INITIALIZER;
+CallbackForJob Linux_job;
+void *Linux_job_data;
+u32 Linux_job_generation;
+u32 Linux_job_thread_count;
+u32 Linux_workers_remaining;
+u32 Linux_thread_count;
+
+void* Linux_workerThread(void *parameter) {
+    u32 thread_index = (u32)(size_t)parameter;
+    u32 generation = 0;
+    while (true) {
+        pthread_mutex_lock(&Linux_workers_mutex);
+        while (generation == Linux_job_generation)
+            pthread_cond_wait(&Linux_workers_start, &Linux_workers_mutex);
+        generation = Linux_job_generation;
+        pthread_mutex_unlock(&Linux_workers_mutex);
+
+        if (thread_index >= Linux_job_thread_count) continue;
+
+        Linux_job(Linux_job_data, thread_index);
+
+        pthread_mutex_lock(&Linux_workers_mutex);
+        if (!--Linux_workers_remaining)
+            pthread_cond_signal(&Linux_workers_done);
+        pthread_mutex_unlock(&Linux_workers_mutex);
+    }
+    return null;
+}
+
+void Linux_runParallelJob(CallbackForJob job, void *data, u32 thread_count) {
+    if (thread_count > Linux_thread_count) thread_count = Linux_thread_count;
+    if (thread_count > 1) {
+        pthread_mutex_lock(&Linux_workers_mutex);
+        Linux_job = job;
+        Linux_job_data = data;
+        Linux_job_thread_count = thread_count;
+        Linux_workers_remaining = thread_count - 1;
+        Linux_job_generation++;
+        pthread_cond_broadcast(&Linux_workers_start);
+        pthread_mutex_unlock(&Linux_workers_mutex);
+    }
+
+    job(data, 0);
+
+    if (thread_count > 1) {
+        pthread_mutex_lock(&Linux_workers_mutex);
+        while (Linux_workers_remaining)
+            pthread_cond_wait(&Linux_workers_done, &Linux_workers_mutex);
+        pthread_mutex_unlock(&Linux_workers_mutex);
+    }
+}
+
+void Linux_initThreads(u32 thread_count) {
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    Linux_thread_count = thread_count ? thread_count : (cpu_count > 0 ? (u32)cpu_count : 1);
+    if (Linux_thread_count > MAX_THREAD_COUNT) Linux_thread_count = MAX_THREAD_COUNT;
+
+    for (u32 i = 1; i < Linux_thread_count; i++)
+        if (pthread_create(Linux_worker_threads + i, null, Linux_workerThread, (void*)(size_t)i)) {
+            Linux_thread_count = i;
+            break;
+        }
+}
+
+bool Linux_writePPM(PixelGrid *frame_buffer, const char* file_path) {
+    FILE *file = fopen(file_path, "wb");
+    if (!file) return false;
+
+    u16 width  = frame_buffer->dimensions.width  - (frame_buffer->QCAA ? 1 : 0);
+    u16 height = frame_buffer->dimensions.height - (frame_buffer->QCAA ? 1 : 0);
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+    Pixel *pixel = frame_buffer->pixels;
+    for (u32 i = 0; i < (u32)width * height; i++, pixel++) {
+        fputc(pixel->color.R, file);
+        fputc(pixel->color.G, file);
+        fputc(pixel->color.B, file);
+    }
+    fclose(file);
+    return true;
+}
+
+bool Linux_writePFM(PixelGrid *frame_buffer, const char* file_path) {
+    FILE *file = fopen(file_path, "wb");
+    if (!file) return false;
+
+    u16 stride = frame_buffer->dimensions.width;
+    u16 width  = frame_buffer->dimensions.width  - (frame_buffer->QCAA ? 1 : 0);
+    u16 height = frame_buffer->dimensions.height - (frame_buffer->QCAA ? 1 : 0);
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+    // Pixel colors are kept squared in the [0, 255] range, PFM wants linear floats stored bottom-up.
+    // With QCAA, each pixel averages the 4 samples at its corners (as drawViewportToWindowContent does):
+    FloatPixel *TL_pixel, *TR_pixel, *BL_pixel, *BR_pixel;
+    vec3 color;
+    f32 rgb[3];
+    for (i32 y = height - 1; y >= 0; y--) {
+        TL_pixel = frame_buffer->float_pixels + stride * y;
+        TR_pixel = TL_pixel + 1;
+        BL_pixel = TL_pixel + stride;
+        BR_pixel = BL_pixel + 1;
+        for (u16 x = 0; x < width; x++, TL_pixel++, TR_pixel++, BL_pixel++, BR_pixel++) {
+            if (frame_buffer->QCAA) {
+                if (TL_pixel->depth == INFINITY &&
+                    TR_pixel->depth == INFINITY &&
+                    BL_pixel->depth == INFINITY &&
+                    BR_pixel->depth == INFINITY)
+                    color = getVec3Of(0);
+                else
+                    color = scaleVec3(scaleAddVec3(TL_pixel->color, TL_pixel->opacity, scaleAddVec3(TR_pixel->color, TR_pixel->opacity, scaleAddVec3(BL_pixel->color, BL_pixel->opacity, scaleVec3(BR_pixel->color, BR_pixel->opacity)))), 0.25f);
+            } else
+                color = TL_pixel->depth == INFINITY ? getVec3Of(0) : scaleVec3(TL_pixel->color, TL_pixel->opacity);
+
+            rgb[0] = sqrtf(color.r) * COLOR_COMPONENT_TO_FLOAT;
+            rgb[1] = sqrtf(color.g) * COLOR_COMPONENT_TO_FLOAT;
+            rgb[2] = sqrtf(color.b) * COLOR_COMPONENT_TO_FLOAT;
+            fwrite(rgb, sizeof(f32), 3, file);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+void Linux_printUsage(char *program) {
+    fprintf(stderr, "Usage: %s [-w width] [-h height] [-f frames] [-t threads] [-o output.ppm|output.pfm] [-s] [-p] [-q [-u]] [-b [-n | -x]]\n", program);
+}
+
+int Linux_compareTicks(const void *a, const void *b) {
+    u64 ticks_a = *(const u64*)a;
+    u64 ticks_b = *(const u64*)b;
+    return ticks_a < ticks_b ? -1 : (ticks_a > ticks_b ? 1 : 0);
+}
+
+void Linux_printBenchmark(char *program, u32 width, u32 height, u32 frames, u64 *frame_ticks, u64 load_ticks, u64 bvh_build_ticks, TraceStats stats) {
+    Viewport *viewport = &app->viewport;
+    u64 rays = stats.primary_rays + stats.secondary_rays + stats.shadow_rays;
+
+    u64 render_ticks = 0;
+    for (u32 i = 0; i < frames; i++) render_ticks += frame_ticks[i];
+    qsort(frame_ticks, frames, sizeof(u64), Linux_compareTicks);
+
+    f64 ms = app->time.ticks.per_tick.milliseconds;
+    char *scene_name = strrchr(program, '/');
+    scene_name = scene_name ? scene_name + 1 : program;
+
+    printf("{\"scene\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, \"threads\": %d, ",
+           scene_name, width, height, frames, viewport->settings.use_threads ? viewport->tiles.thread_count : 1);
+    printf("\"primary_rays\": \"%s\", ", viewport->settings.use_SSB ? "SSB" : (viewport->settings.use_packets ? "BVH_packets" : "BVH"));
+    printf("\"pipeline\": \"%s\", ", viewport->settings.use_wavefront ? (viewport->settings.sort_hits ? "wavefront" : "wavefront_unsorted") : "megakernel");
+    printf("\"load_ms\": %.3f, \"bvh_build_ms\": %.3f, ", (f64)load_ticks * ms, (f64)bvh_build_ticks * ms);
+    printf("\"frame_ms\": {\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+           (f64)render_ticks * ms / frames,
+           (f64)frame_ticks[0] * ms,
+           (f64)frame_ticks[(u32)(0.50f * (f32)(frames - 1) + 0.5f)] * ms,
+           (f64)frame_ticks[(u32)(0.90f * (f32)(frames - 1) + 0.5f)] * ms,
+           (f64)frame_ticks[(u32)(0.99f * (f32)(frames - 1) + 0.5f)] * ms,
+           (f64)frame_ticks[frames - 1] * ms);
+    printf("\"rays\": {\"primary\": %llu, \"secondary\": %llu, \"shadow\": %llu}, ",
+           stats.primary_rays, stats.secondary_rays, stats.shadow_rays);
+    printf("\"shading_coherence\": %.3f, ", getShadingCoherence(&stats));
+    printf("\"primitives_per_primary_ray\": %.3f, \"rays_per_second\": %.0f}\n",
+           stats.primary_rays ? (f64)stats.primary_primitive_tests / (f64)stats.primary_rays : 0,
+           render_ticks ? (f64)rays / ((f64)render_ticks * app->time.ticks.per_tick.seconds) : 0);
+}
+
+int main(int argc, char **argv) {
+    u32 width = 0, height = 0, frames = 1, threads = 0;
+    char *output_file_path = null;
+    bool benchmark = false;
+    bool use_SSB = false;
+    bool use_packets = false;
+    bool use_wavefront = false;
+    bool sort_hits = true;
+    enum BVHBuildStrategy mesh_bvh_strategy = BVHBuildStrategy_SweepSAH;
+    bool mesh_bvh_strategy_is_set = false;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] == 'b' && !argv[i][2]) {
+            benchmark = true;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 's' && !argv[i][2]) {
+            use_SSB = true;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 'p' && !argv[i][2]) {
+            use_packets = true;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 'q' && !argv[i][2]) {
+            use_wavefront = true;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 'u' && !argv[i][2]) {
+            sort_hits = false;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 'n' && !argv[i][2]) {
+            mesh_bvh_strategy = BVHBuildStrategy_BinnedSAH;
+            mesh_bvh_strategy_is_set = true;
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1] == 'x' && !argv[i][2]) {
+            mesh_bvh_strategy = BVHBuildStrategy_SpatialSAH;
+            mesh_bvh_strategy_is_set = true;
+            continue;
+        }
+        if (i + 1 < argc && argv[i][0] == '-' && argv[i][1] && !argv[i][2]) {
+            switch (argv[i][1]) {
+                case 'w': width  = (u32)atoi(argv[++i]); continue;
+                case 'h': height = (u32)atoi(argv[++i]); continue;
+                case 'f': frames = (u32)atoi(argv[++i]); continue;
+                case 't': threads = (u32)atoi(argv[++i]); continue;
+                case 'o': output_file_path = argv[++i]; continue;
+                default: break;
+            }
+        }
+        Linux_printUsage(argv[0]);
+        return -1;
+    }
+
+    app = (App*)Linux_getMemory(sizeof(App));
+    if (!app)
+        return -1;
+
+    void* window_content_memory = Linux_getMemory(RENDER_SIZE);
+    if (!window_content_memory)
+        return -1;
+
+    Linux_initThreads(threads);
+
+    app->controls.key_map.space = ' ';
+    app->controls.key_map.shift = 16;
+    app->controls.key_map.ctrl  = 17;
+    app->controls.key_map.alt   = 18;
+    app->controls.key_map.tab   = 9;
+
+    app->platform.ticks_per_second    = 1000000000ULL;
+    app->platform.getTicks            = Linux_getTicks;
+    app->platform.getMemory           = Linux_getMemory;
+    app->platform.setWindowTitle      = Linux_setWindowTitle;
+    app->platform.setWindowCapture    = Linux_setWindowCapture;
+    app->platform.setCursorVisibility = Linux_setCursorVisibility;
+    app->platform.closeFile           = Linux_closeFile;
+    app->platform.openFileForReading  = Linux_openFileForReading;
+    app->platform.openFileForWriting  = Linux_openFileForWriting;
+    app->platform.readFromFile        = Linux_readFromFile;
+    app->platform.writeToFile         = Linux_writeToFile;
+    app->platform.mapFile             = Linux_mapFile;
+    app->platform.unmapFile           = Linux_unmapFile;
+    app->platform.runParallelJob      = Linux_runParallelJob;
+    app->platform.thread_count        = Linux_thread_count;
+
+    Defaults defaults;
+    u64 load_ticks = Linux_getTicks();
+    _initApp(&defaults, window_content_memory);
+    load_ticks = Linux_getTicks() - load_ticks;
+    if (Linux_missing_file_count) {
+        fprintf(stderr, "Scene could not be loaded: %d file(s) are missing\n", Linux_missing_file_count);
+        return 2;
+    }
+    if (!app->is_running) {
+        fprintf(stderr, "Scene could not be loaded: out of memory\n");
+        return -1;
+    }
+
+    if (!frames) frames = 1;
+    if (!width)  width  = defaults.width;
+    if (!height) height = defaults.height;
+    if (width  > MAX_WIDTH)  width  = MAX_WIDTH;
+    if (height > MAX_HEIGHT) height = MAX_HEIGHT;
+
+    Scene *scene = &app->scene;
+    Viewport *viewport = &app->viewport;
+    Timer *timer = &app->time.timers.render;
+    viewport->settings.use_SSB = use_SSB;
+    viewport->settings.use_packets = use_packets;
+    viewport->settings.use_wavefront = use_wavefront;
+    viewport->settings.sort_hits = sort_hits;
+
+    u64 bvh_build_ticks = 0;
+    if (benchmark) {
+        // Meshes get rebuilt as the scene has them rebuilt once loaded, unless a strategy is given for all of them.
+        // The app's memory has no room for that, so the meshes are moved to (and rebuilt with) memory of their own:
+        enum BVHBuildStrategy *strategies = mesh_bvh_strategy_is_set ? null : scene->settings.mesh_bvh_strategies;
+        u32 max_leaf_count = scene->settings.primitives;
+        u64 memory_size = 0;
+        for (u32 m = 0; m < scene->settings.meshes; m++) {
+            enum BVHBuildStrategy strategy = strategies ? strategies[m] : mesh_bvh_strategy;
+            memory_size += getMeshBVHMemorySize(getMeshTriangleReferenceCapacity(scene->meshes + m, strategy));
+            if (getMeshBVHLeafCount(scene->meshes + m, strategy) > max_leaf_count)
+                max_leaf_count = getMeshBVHLeafCount(scene->meshes + m, strategy);
+        }
+        // The app's builder only has workers where its own BVHs are large enough, so this one gets all of the threads:
+        u32 thread_count = Linux_thread_count;
+        u32 trace_count = viewport->tiles.thread_count + 1;
+
+        // The rebuilt BVHs may come out taller than the ones the traces had their mesh stacks sized for, so the traces
+        // get new ones once the BVHs are built, in the memory that the builder is then done with (or as much as expected):
+        u64 builder_memory_size = getBVHBuilderMemorySize(max_leaf_count, thread_count);
+        u64 stacks_memory_size = sizeof(u32) * (getBVHHeightEstimate(max_leaf_count) * (WIDE_BVH_WIDTH - 1) + 2) * trace_count * 2;
+        memory_size += builder_memory_size > stacks_memory_size ? builder_memory_size : stacks_memory_size;
+
+        u8 *memory_address = (u8*)Linux_getMemory(memory_size);
+        if (!memory_address)
+            return -1;
+
+        Memory memory, stacks_memory;
+        BVHBuilder builder;
+        initMemory(&memory, memory_address, memory_size);
+        for (u32 m = 0; m < scene->settings.meshes; m++)
+            moveMeshToMemory(scene->meshes + m, getMeshTriangleReferenceCapacity(scene->meshes + m, strategies ? strategies[m] : mesh_bvh_strategy), &memory);
+        stacks_memory = memory;
+        initBVHBuilder(&builder, max_leaf_count, thread_count, thread_count > 1 ? Linux_runParallelJob : null, &memory);
+        builder.strategy = mesh_bvh_strategy;
+
+        bvh_build_ticks = Linux_getTicks();
+        updateMeshBVHs(scene, &builder, strategies);
+        updateSceneBVH(scene, &app->bvh_builder);
+        bvh_build_ticks = Linux_getTicks() - bvh_build_ticks;
+
+        memory = stacks_memory;
+        if (sizeof(u32) * getTraceMeshStackSize(scene) * trace_count * 2 > memory.capacity - memory.occupied) {
+            fprintf(stderr, "Rebuilt mesh BVHs are too tall to be traversed\n");
+            return -1;
+        }
+        initTraceMeshStack(&viewport->trace, scene, &memory);
+        for (u32 i = 0; i < viewport->tiles.thread_count; i++)
+            initTraceMeshStack(viewport->tiles.traces + i, scene, &memory);
+    }
+
+    updateDimensions(&app->window_content.dimensions, (u16)width, (u16)height, app->window_content.QCAA);
+    updateSceneSSB(scene, viewport);
+    if (app->on.windowResize) app->on.windowResize((u16)width, (u16)height);
+
+    TraceStats stats = {0};
+    u64 render_ticks = 0;
+    u64 *frame_ticks = (u64*)malloc(sizeof(u64) * frames);
+    for (u32 frame = 0; frame < frames; frame++) {
+        if (benchmark) {
+            orbitCamera(viewport->camera, TAU / (f32)frames, 0);
+            updateSceneSSB(scene, viewport);
+        }
+        beginFrameTimer(timer);
+        beginDrawing(viewport);
+        renderScene(scene, viewport);
+        endFrameTimer(timer);
+        render_ticks += frame_ticks[frame] = timer->ticks_diff;
+
+        stats.primary_rays            += viewport->stats.primary_rays;
+        stats.secondary_rays          += viewport->stats.secondary_rays;
+        stats.shadow_rays             += viewport->stats.shadow_rays;
+        stats.primitive_tests         += viewport->stats.primitive_tests;
+        stats.primary_primitive_tests += viewport->stats.primary_primitive_tests;
+        stats.shaded_hits             += viewport->stats.shaded_hits;
+        stats.shading_switches        += viewport->stats.shading_switches;
+    }
+    drawViewportToWindowContent(viewport);
+
+    if (benchmark)
+        Linux_printBenchmark(argv[0], width, height, frames, frame_ticks, load_ticks, bvh_build_ticks, stats);
+    else
+        printf("%dx%d, %d frame(s) on %d thread(s): %.3f ms/frame\n", width, height, frames,
+               viewport->settings.use_threads ? viewport->tiles.thread_count : 1,
+               (f64)render_ticks * app->time.ticks.per_tick.milliseconds / frames);
+    free(frame_ticks);
+
+    if (output_file_path) {
+        u32 length = getStringLength(output_file_path);
+        bool is_pfm = length > 4 && !strcmp(output_file_path + length - 4, ".pfm");
+        if (!(is_pfm ? Linux_writePFM : Linux_writePPM)(&app->window_content, output_file_path)) {
+            fprintf(stderr, "Unable to write \"%s\"\n", output_file_path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
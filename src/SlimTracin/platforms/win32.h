@@ -137,6 +137,70 @@ bool Win32_writeToFile(LPVOID out, DWORD size, HANDLE handle) {
     return result != FALSE;
 }
 
+// Files are mapped copy-on-write: their pages are shared with every other process that maps them until written to.
+// Failing to map a file is not reported, as callers then fall back to reading it:
+void* Win32_mapFile(const char* path, u64 *size) {
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, null, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, null);
+    if (file == INVALID_HANDLE_VALUE) return null;
+
+    void *address = null;
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart) {
+        HANDLE mapping = CreateFileMapping(file, null, PAGE_WRITECOPY, 0, 0, null);
+        if (mapping) {
+            address = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            if (address) *size = (u64)file_size.QuadPart;
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    return address;
+}
+void Win32_unmapFile(void *address, u64 size) { if (address) UnmapViewOfFile(address); }
+
+HANDLE Win32_worker_start_events[MAX_THREAD_COUNT];
+HANDLE Win32_workers_done_event;
+volatile LONG Win32_workers_remaining;
+CallbackForJob Win32_job;
+void *Win32_job_data;
+u32 Win32_thread_count;
+
+DWORD WINAPI Win32_workerThread(LPVOID parameter) {
+    u32 thread_index = (u32)(size_t)parameter;
+    while (true) {
+        WaitForSingleObject(Win32_worker_start_events[thread_index], INFINITE);
+        Win32_job(Win32_job_data, thread_index);
+        if (!InterlockedDecrement(&Win32_workers_remaining))
+            SetEvent(Win32_workers_done_event);
+    }
+}
+
+void Win32_runParallelJob(CallbackForJob job, void *data, u32 thread_count) {
+    if (thread_count > Win32_thread_count) thread_count = Win32_thread_count;
+    Win32_job = job;
+    Win32_job_data = data;
+    Win32_workers_remaining = thread_count - 1;
+    for (u32 i = 1; i < thread_count; i++) SetEvent(Win32_worker_start_events[i]);
+
+    job(data, 0);
+
+    if (thread_count > 1) WaitForSingleObject(Win32_workers_done_event, INFINITE);
+}
+
+void Win32_initThreads() {
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    Win32_thread_count = (u32)system_info.dwNumberOfProcessors;
+    if (Win32_thread_count > MAX_THREAD_COUNT) Win32_thread_count = MAX_THREAD_COUNT;
+    if (Win32_thread_count < 1) Win32_thread_count = 1;
+
+    Win32_workers_done_event = CreateEventA(null, FALSE, FALSE, null);
+    for (u32 i = 1; i < Win32_thread_count; i++) {
+        Win32_worker_start_events[i] = CreateEventA(null, FALSE, FALSE, null);
+        CreateThread(null, 0, Win32_workerThread, (LPVOID)(size_t)i, 0, null);
+    }
+}
+
 LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
     switch (message) {
         case WM_DESTROY:
@@ -238,6 +302,12 @@ int APIENTRY WinMain(HINSTANCE hInstance,
     app->platform.openFileForWriting  = Win32_openFileForWriting;
     app->platform.readFromFile        = Win32_readFromFile;
     app->platform.writeToFile         = Win32_writeToFile;
+    app->platform.mapFile             = Win32_mapFile;
+    app->platform.unmapFile           = Win32_unmapFile;
+    app->platform.runParallelJob      = Win32_runParallelJob;
+
+    Win32_initThreads();
+    app->platform.thread_count = Win32_thread_count;
 
     Defaults defaults;
     _initApp(&defaults, window_content_memory);
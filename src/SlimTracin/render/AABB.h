@@ -22,6 +22,307 @@ INLINE bool hitAABB(AABB *aabb, Ray *ray, f32 closest_distance, f32 *distance) {
     return min_t.x <= max_t.x;
 }
 
+#ifdef WIDE_BVH_QUANTIZED
+INLINE f32 getWideBVHNodeStep(u8 exponent) {
+    union { u32 bits; f32 value; } step;
+    step.bits = (u32)exponent << 23;
+    return step.value;
+}
+#endif
+
+// The bounds of all the children of a wide node, as rows of planes (min x/y/z then max x/y/z) with one lane per child.
+// Quantized bounds get decoded into the given buffer, while full-precision ones are used in place:
+INLINE f32* getWideBVHNodeBounds(WideBVHNode *node, f32 *decoded) {
+#ifdef WIDE_BVH_QUANTIZED
+    f32 origin, step;
+    for (u8 axis = 0; axis < 3; axis++) {
+        origin = node->origin.components[axis];
+        step = getWideBVHNodeStep(node->exponents[axis]);
+        for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+            decoded[ axis      * WIDE_BVH_WIDTH + lane] = origin + (f32)node->bounds[axis    ][lane] * step;
+            decoded[(axis + 3) * WIDE_BVH_WIDTH + lane] = origin + (f32)node->bounds[axis + 3][lane] * step;
+        }
+    }
+    return decoded;
+#else
+    (void)decoded;
+    return node->bounds[0];
+#endif
+}
+
+// Slab-test all the children of a wide node at once, returning a bit-mask of the ones that were hit:
+INLINE u32 hitWideBVHNodeBounds(f32 *bounds, Ray *ray, f32 closest_distance, f32 *distances) {
+    f32 *near_x = bounds + WIDE_BVH_WIDTH * (    ray->octant.x), *far_x = bounds + WIDE_BVH_WIDTH * (3 - ray->octant.x);
+    f32 *near_y = bounds + WIDE_BVH_WIDTH * (1 + ray->octant.y), *far_y = bounds + WIDE_BVH_WIDTH * (4 - ray->octant.y);
+    f32 *near_z = bounds + WIDE_BVH_WIDTH * (2 + ray->octant.z), *far_z = bounds + WIDE_BVH_WIDTH * (5 - ray->octant.z);
+#if defined(SIMD_AVX)
+    __m256 rcp_x = _mm256_set1_ps(ray->direction_reciprocal.x), origin_x = _mm256_set1_ps(ray->scaled_origin.x);
+    __m256 rcp_y = _mm256_set1_ps(ray->direction_reciprocal.y), origin_y = _mm256_set1_ps(ray->scaled_origin.y);
+    __m256 rcp_z = _mm256_set1_ps(ray->direction_reciprocal.z), origin_z = _mm256_set1_ps(ray->scaled_origin.z);
+    __m256 min_t = _mm256_max_ps(
+            _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(near_x), rcp_x), origin_x),
+                          _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(near_y), rcp_y), origin_y)),
+            _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(near_z), rcp_z), origin_z), _mm256_setzero_ps()));
+    __m256 max_t = _mm256_min_ps(
+            _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(far_x), rcp_x), origin_x),
+                          _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(far_y), rcp_y), origin_y)),
+            _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(far_z), rcp_z), origin_z), _mm256_set1_ps(closest_distance)));
+    _mm256_storeu_ps(distances, min_t);
+
+    return (u32)_mm256_movemask_ps(_mm256_cmp_ps(min_t, max_t, _CMP_LE_OQ));
+#elif defined(SIMD_SSE)
+    __m128 rcp_x = _mm_set1_ps(ray->direction_reciprocal.x), origin_x = _mm_set1_ps(ray->scaled_origin.x);
+    __m128 rcp_y = _mm_set1_ps(ray->direction_reciprocal.y), origin_y = _mm_set1_ps(ray->scaled_origin.y);
+    __m128 rcp_z = _mm_set1_ps(ray->direction_reciprocal.z), origin_z = _mm_set1_ps(ray->scaled_origin.z);
+    __m128 min_t = _mm_max_ps(
+            _mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(near_x), rcp_x), origin_x),
+                       _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(near_y), rcp_y), origin_y)),
+            _mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(near_z), rcp_z), origin_z), _mm_setzero_ps()));
+    __m128 max_t = _mm_min_ps(
+            _mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(far_x), rcp_x), origin_x),
+                       _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(far_y), rcp_y), origin_y)),
+            _mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(far_z), rcp_z), origin_z), _mm_set1_ps(closest_distance)));
+    _mm_storeu_ps(distances, min_t);
+
+    return (u32)_mm_movemask_ps(_mm_cmple_ps(min_t, max_t));
+#else
+    u32 hits = 0;
+    f32 min_t, max_t, t;
+    for (u8 i = 0; i < WIDE_BVH_WIDTH; i++) {
+        min_t = near_x[i] * ray->direction_reciprocal.x + ray->scaled_origin.x;
+        t     = near_y[i] * ray->direction_reciprocal.y + ray->scaled_origin.y; min_t = min_t > t ? min_t : t;
+        t     = near_z[i] * ray->direction_reciprocal.z + ray->scaled_origin.z; min_t = min_t > t ? min_t : t;
+        min_t = min_t > 0 ? min_t : 0;
+
+        max_t = far_x[i] * ray->direction_reciprocal.x + ray->scaled_origin.x;
+        t     = far_y[i] * ray->direction_reciprocal.y + ray->scaled_origin.y; max_t = max_t < t ? max_t : t;
+        t     = far_z[i] * ray->direction_reciprocal.z + ray->scaled_origin.z; max_t = max_t < t ? max_t : t;
+        max_t = max_t < closest_distance ? max_t : closest_distance;
+
+        distances[i] = min_t;
+        if (min_t <= max_t) hits |= 1 << i;
+    }
+
+    return hits;
+#endif
+}
+
+INLINE u32 hitWideBVHNode(WideBVHNode *node, Ray *ray, f32 closest_distance, f32 *distances) {
+    f32 decoded[6 * WIDE_BVH_WIDTH];
+    return hitWideBVHNodeBounds(getWideBVHNodeBounds(node, decoded), ray, closest_distance, distances);
+}
+
+INLINE u32 sortWideBVHNodeHits(u32 hits, f32 *distances, u8 *order) {
+    u32 hit_count = 0, i;
+    for (u8 lane = 0; hits; lane++, hits >>= 1) {
+        if (!(hits & 1)) continue;
+
+        for (i = hit_count++; i && distances[order[i - 1]] > distances[lane]; i--) order[i] = order[i - 1];
+        order[i] = lane;
+    }
+
+    return hit_count;
+}
+
+// Bound a packet of rays by intervals of their origins and direction reciprocals.
+// Returns false when the rays diverge (don't share an octant), in which case they need to be traced one by one:
+INLINE bool setRayPacketBounds(RayPacketBounds *bounds, Ray *rays, u32 ray_mask) {
+    vec3 origin_min, origin_max, rcp_min, rcp_max;
+    u8_3 octant;
+    Ray *ray;
+    bool first = true;
+    for (u32 rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+        ray = rays + getLowestSetBit(rays_left);
+        if (ray->direction_reciprocal.x == INFINITY || ray->direction_reciprocal.x == -INFINITY ||
+            ray->direction_reciprocal.y == INFINITY || ray->direction_reciprocal.y == -INFINITY ||
+            ray->direction_reciprocal.z == INFINITY || ray->direction_reciprocal.z == -INFINITY)
+            return false;
+
+        if (first) {
+            first = false;
+            octant = ray->octant;
+            origin_min = origin_max = ray->origin;
+            rcp_min = rcp_max = ray->direction_reciprocal;
+            continue;
+        }
+        if (ray->octant.x != octant.x ||
+            ray->octant.y != octant.y ||
+            ray->octant.z != octant.z)
+            return false;
+
+        origin_min = minVec3(origin_min, ray->origin);
+        origin_max = maxVec3(origin_max, ray->origin);
+        rcp_min = minVec3(rcp_min, ray->direction_reciprocal);
+        rcp_max = maxVec3(rcp_max, ray->direction_reciprocal);
+    }
+    if (first)
+        return false;
+
+    bounds->octant = octant;
+    bounds->direction_reciprocal_min = rcp_min;
+    bounds->direction_reciprocal_max = rcp_max;
+    bounds->near_origin.x = octant.x ? origin_min.x : origin_max.x;
+    bounds->near_origin.y = octant.y ? origin_min.y : origin_max.y;
+    bounds->near_origin.z = octant.z ? origin_min.z : origin_max.z;
+    bounds->far_origin.x  = octant.x ? origin_max.x : origin_min.x;
+    bounds->far_origin.y  = octant.y ? origin_max.y : origin_min.y;
+    bounds->far_origin.z  = octant.z ? origin_max.z : origin_min.z;
+
+    return true;
+}
+
+#if defined(SIMD_AVX)
+INLINE __m256 getSlabEntryLowerBound(f32 *planes, f32 origin, f32 rcp_min, f32 rcp_max) {
+    __m256 t = _mm256_sub_ps(_mm256_loadu_ps(planes), _mm256_set1_ps(origin));
+    return _mm256_min_ps(_mm256_mul_ps(t, _mm256_set1_ps(rcp_min)), _mm256_mul_ps(t, _mm256_set1_ps(rcp_max)));
+}
+INLINE __m256 getSlabExitUpperBound(f32 *planes, f32 origin, f32 rcp_min, f32 rcp_max) {
+    __m256 t = _mm256_sub_ps(_mm256_loadu_ps(planes), _mm256_set1_ps(origin));
+    return _mm256_max_ps(_mm256_mul_ps(t, _mm256_set1_ps(rcp_min)), _mm256_mul_ps(t, _mm256_set1_ps(rcp_max)));
+}
+#elif defined(SIMD_SSE)
+INLINE __m128 getSlabEntryLowerBound(f32 *planes, f32 origin, f32 rcp_min, f32 rcp_max) {
+    __m128 t = _mm_sub_ps(_mm_loadu_ps(planes), _mm_set1_ps(origin));
+    return _mm_min_ps(_mm_mul_ps(t, _mm_set1_ps(rcp_min)), _mm_mul_ps(t, _mm_set1_ps(rcp_max)));
+}
+INLINE __m128 getSlabExitUpperBound(f32 *planes, f32 origin, f32 rcp_min, f32 rcp_max) {
+    __m128 t = _mm_sub_ps(_mm_loadu_ps(planes), _mm_set1_ps(origin));
+    return _mm_max_ps(_mm_mul_ps(t, _mm_set1_ps(rcp_min)), _mm_mul_ps(t, _mm_set1_ps(rcp_max)));
+}
+#endif
+
+// Interval-arithmetic slab test of all the children of a wide node against the bounds of a whole packet of rays.
+// A child that is missed here is missed by every ray of the packet (the test is padded a bit to stay conservative):
+INLINE u32 hitWideBVHNodeWithRayPacketBounds(f32 *node_bounds, RayPacketBounds *bounds, f32 max_distance) {
+    f32 *near_x = node_bounds + WIDE_BVH_WIDTH * (    bounds->octant.x), *far_x = node_bounds + WIDE_BVH_WIDTH * (3 - bounds->octant.x);
+    f32 *near_y = node_bounds + WIDE_BVH_WIDTH * (1 + bounds->octant.y), *far_y = node_bounds + WIDE_BVH_WIDTH * (4 - bounds->octant.y);
+    f32 *near_z = node_bounds + WIDE_BVH_WIDTH * (2 + bounds->octant.z), *far_z = node_bounds + WIDE_BVH_WIDTH * (5 - bounds->octant.z);
+    vec3 *rcp_min = &bounds->direction_reciprocal_min;
+    vec3 *rcp_max = &bounds->direction_reciprocal_max;
+    vec3 *near_origin = &bounds->near_origin;
+    vec3 *far_origin = &bounds->far_origin;
+#if defined(SIMD_AVX)
+    __m256 min_t = _mm256_max_ps(
+            _mm256_max_ps(getSlabEntryLowerBound(near_x, near_origin->x, rcp_min->x, rcp_max->x),
+                          getSlabEntryLowerBound(near_y, near_origin->y, rcp_min->y, rcp_max->y)),
+            _mm256_max_ps(getSlabEntryLowerBound(near_z, near_origin->z, rcp_min->z, rcp_max->z), _mm256_setzero_ps()));
+    __m256 max_t = _mm256_min_ps(
+            _mm256_min_ps(getSlabExitUpperBound(far_x, far_origin->x, rcp_min->x, rcp_max->x),
+                          getSlabExitUpperBound(far_y, far_origin->y, rcp_min->y, rcp_max->y)),
+            _mm256_min_ps(getSlabExitUpperBound(far_z, far_origin->z, rcp_min->z, rcp_max->z), _mm256_set1_ps(max_distance)));
+    max_t = _mm256_add_ps(max_t, _mm256_add_ps(_mm256_mul_ps(max_t, _mm256_set1_ps(0.0001f)), _mm256_set1_ps(0.0001f)));
+
+    return (u32)_mm256_movemask_ps(_mm256_cmp_ps(min_t, max_t, _CMP_LE_OQ));
+#elif defined(SIMD_SSE)
+    __m128 min_t = _mm_max_ps(
+            _mm_max_ps(getSlabEntryLowerBound(near_x, near_origin->x, rcp_min->x, rcp_max->x),
+                       getSlabEntryLowerBound(near_y, near_origin->y, rcp_min->y, rcp_max->y)),
+            _mm_max_ps(getSlabEntryLowerBound(near_z, near_origin->z, rcp_min->z, rcp_max->z), _mm_setzero_ps()));
+    __m128 max_t = _mm_min_ps(
+            _mm_min_ps(getSlabExitUpperBound(far_x, far_origin->x, rcp_min->x, rcp_max->x),
+                       getSlabExitUpperBound(far_y, far_origin->y, rcp_min->y, rcp_max->y)),
+            _mm_min_ps(getSlabExitUpperBound(far_z, far_origin->z, rcp_min->z, rcp_max->z), _mm_set1_ps(max_distance)));
+    max_t = _mm_add_ps(max_t, _mm_add_ps(_mm_mul_ps(max_t, _mm_set1_ps(0.0001f)), _mm_set1_ps(0.0001f)));
+
+    return (u32)_mm_movemask_ps(_mm_cmple_ps(min_t, max_t));
+#else
+    u32 hits = 0;
+    f32 min_t, max_t, t, lo, hi;
+    f32 *near[3] = {near_x, near_y, near_z};
+    f32 *far[3] = {far_x, far_y, far_z};
+    for (u8 i = 0; i < WIDE_BVH_WIDTH; i++) {
+        min_t = 0;
+        max_t = max_distance;
+        for (u8 c = 0; c < 3; c++) {
+            t = near[c][i] - (&near_origin->x)[c]; lo = t * (&rcp_min->x)[c]; hi = t * (&rcp_max->x)[c];
+            t = lo < hi ? lo : hi; min_t = min_t > t ? min_t : t;
+
+            t = far[c][i] - (&far_origin->x)[c]; lo = t * (&rcp_min->x)[c]; hi = t * (&rcp_max->x)[c];
+            t = lo > hi ? lo : hi; max_t = max_t < t ? max_t : t;
+        }
+        max_t += max_t * 0.0001f + 0.0001f;
+        if (min_t <= max_t) hits |= 1 << i;
+    }
+
+    return hits;
+#endif
+}
+
+// Slab-test the children of a wide node against the rays of a packet that reached it, after culling the children that the
+// packet as a whole misses. Gathers the mask of rays to take into each child, along with each child's nearest entry distance.
+// Rays are tested exhaustively only for nodes with leaf children. Inner children just take the range of rays between the first
+// and the last ones that hit them (the rays in between are then tested further down, which for a coherent packet is cheaper):
+INLINE u32 hitWideBVHNodeWithRayPacket(WideBVHNode *node, RayPacketBounds *bounds, Ray *rays, RayHit *hits, u32 ray_mask,
+                                       u32 *lane_ray_masks, f32 *lane_distances) {
+    f32 max_distance = 0, distances[WIDE_BVH_WIDTH], decoded[6 * WIDE_BVH_WIDTH];
+    f32 *node_bounds = getWideBVHNodeBounds(node, decoded);
+    u32 r, rays_left, lane, lane_hits, node_hits, remaining, leaf_lanes = 0, first_rays[WIDE_BVH_WIDTH];
+    for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+        r = getLowestSetBit(rays_left);
+        if (hits[r].distance > max_distance)
+            max_distance = hits[r].distance;
+    }
+
+    u32 packet_hits = hitWideBVHNodeWithRayPacketBounds(node_bounds, bounds, max_distance);
+    if (!packet_hits)
+        return 0;
+
+    for (lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+        lane_ray_masks[lane] = 0;
+        lane_distances[lane] = INFINITY;
+        if (node->child_counts[lane]) leaf_lanes |= 1u << lane;
+    }
+
+    node_hits = 0;
+    if (packet_hits & leaf_lanes) {
+        for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+            r = getLowestSetBit(rays_left);
+            lane_hits = hitWideBVHNodeBounds(node_bounds, rays + r, hits[r].distance, distances) & packet_hits;
+            node_hits |= lane_hits;
+            for (lane = 0; lane_hits; lane++, lane_hits >>= 1) {
+                if (!(lane_hits & 1)) continue;
+
+                lane_ray_masks[lane] |= 1u << r;
+                if (distances[lane] < lane_distances[lane])
+                    lane_distances[lane] = distances[lane];
+            }
+        }
+
+        return node_hits;
+    }
+
+    // Find the first ray that hits each child, then the last one:
+    remaining = packet_hits;
+    for (rays_left = ray_mask; rays_left && remaining; rays_left &= rays_left - 1) {
+        r = getLowestSetBit(rays_left);
+        lane_hits = hitWideBVHNodeBounds(node_bounds, rays + r, hits[r].distance, distances) & remaining;
+        remaining &= ~lane_hits;
+        node_hits |= lane_hits;
+        for (lane = 0; lane_hits; lane++, lane_hits >>= 1) {
+            if (!(lane_hits & 1)) continue;
+
+            first_rays[lane] = r;
+            lane_distances[lane] = distances[lane];
+        }
+    }
+
+    remaining = node_hits;
+    for (rays_left = ray_mask; rays_left && remaining; rays_left &= ~(1u << r)) {
+        r = getHighestSetBit(rays_left);
+        lane_hits = hitWideBVHNodeBounds(node_bounds, rays + r, hits[r].distance, distances) & remaining;
+        remaining &= ~lane_hits;
+        for (lane = 0; lane_hits; lane++, lane_hits >>= 1) {
+            if (!(lane_hits & 1)) continue;
+
+            lane_ray_masks[lane] = ray_mask & ((2u << r) - 1) & ~((1u << first_rays[lane]) - 1);
+            if (distances[lane] < lane_distances[lane])
+                lane_distances[lane] = distances[lane];
+        }
+    }
+
+    return node_hits;
+}
+
 INLINE AABB mergeAABBs(AABB lhs, AABB rhs) {
     AABB merged;
 
@@ -36,6 +337,24 @@ INLINE AABB mergeAABBs(AABB lhs, AABB rhs) {
     return merged;
 }
 
+INLINE AABB intersectAABBs(AABB lhs, AABB rhs) {
+    AABB intersection;
+
+    intersection.min.x = lhs.min.x > rhs.min.x ? lhs.min.x : rhs.min.x;
+    intersection.min.y = lhs.min.y > rhs.min.y ? lhs.min.y : rhs.min.y;
+    intersection.min.z = lhs.min.z > rhs.min.z ? lhs.min.z : rhs.min.z;
+
+    intersection.max.x = lhs.max.x < rhs.max.x ? lhs.max.x : rhs.max.x;
+    intersection.max.y = lhs.max.y < rhs.max.y ? lhs.max.y : rhs.max.y;
+    intersection.max.z = lhs.max.z < rhs.max.z ? lhs.max.z : rhs.max.z;
+
+    return intersection;
+}
+
+INLINE bool isEmptyAABB(AABB aabb) {
+    return aabb.min.x > aabb.max.x || aabb.min.y > aabb.max.y || aabb.min.z > aabb.max.z;
+}
+
 INLINE f32 getSurfaceAreaOfAABB(AABB aabb) {
     vec3 extents = subVec3(aabb.max, aabb.min);
     return extents.x*extents.y + extents.y*extents.z + extents.z*extents.x;
@@ -1,35 +1,26 @@
 ﻿#pragma once
 
-#include <stdlib.h>
-#include <string.h>
-
-#include "globals.h"
-#include "aabb.h"
+#include "../../core/types.h"
+#include "../../core/base.h"
+#include "../../math/vec3.h"
+#include "../../render/AABB.h"
 
 typedef struct {
     BVHNode node;
     u32 depth, parent_id;
     bool is_first_child, is_collapsed;
-} BottomUpBvhBuilderNode;
+} BottomUpBVHBuilderNode;
 
 typedef struct {
-    AABB overall_aabb;
-    u32 primitive_count,
-        max_primitives_per_leaf;
-    u32 *ids;
-    u64 *z_curve_distances;
-    Obj *objects;
-    vec3d *centroids;
-    BottomUpBvhBuilderNode *nodes;
-} BottomUpBvhBuilder;
-
-#define isLeaf(  builder_node) ((builder_node)->node.primitive_count != 0)
-#define isParent(builder_node) ((builder_node)->node.primitive_count == 0)
-
-#define TRAVERSAL_COST 1
-#define SEARCH_RADIUS 14
-
-inline u64 spreadOut64Bits(u64 a) {
+    BottomUpBVHBuilderNode *nodes;
+    u64 *z_curve_distances, *sorted_z_curve_distances;
+    u32 *ids, *sorted_ids, leaf_count;
+} BottomUpBVHBuilder;
+
+INLINE bool isBottomUpBVHLeaf(  BottomUpBVHBuilderNode *builder_node) { return builder_node->node.child_count != 0; }
+INLINE bool isBottomUpBVHParent(BottomUpBVHBuilderNode *builder_node) { return builder_node->node.child_count == 0; }
+
+INLINE u64 spreadOut64Bits(u64 a) {
     u64 x = a & 0x1fffff;
     x = (x | x << 32) & 0x1f00000000ffff;
     x = (x | x << 16) & 0x1f0000ff0000ff;
@@ -39,7 +30,7 @@ inline u64 spreadOut64Bits(u64 a) {
     return x;
 }
 
-inline u64 getZCurveDistanceOf(vec3d position) {
+INLINE u64 getZCurveDistanceOf(vec3 position) {
     return (
         spreadOut64Bits((u64)position.x) << 0 |
         spreadOut64Bits((u64)position.y) << 1 |
@@ -47,33 +38,60 @@ inline u64 getZCurveDistanceOf(vec3d position) {
     );
 }
 
-u64 *z_curve_distances = 0;
+u64 getBottomUpBVHBuilderMemorySize(u32 leaf_count) {
+    u64 memory_size = sizeof(BottomUpBVHBuilderNode) * 4;
+    memory_size += sizeof(u32) * (2 + 2 * MAX_PRIMITIVES_PER_LEAF);
+    memory_size += sizeof(u64) * 2;
+    memory_size *= leaf_count;
 
-void initBottomUpBvhBuilder(BottomUpBvhBuilder *builder, u32 max_primitive_count) {
-    u32 max_node_count = max_primitive_count * 4;
-    builder->objects   = Allocate(Obj,   max_primitive_count);
-    builder->centroids = Allocate(vec3d, max_primitive_count);
-    builder->nodes     = Allocate(BottomUpBvhBuilderNode, max_node_count * 3);
-    builder->ids       = Allocate(u32,   max_primitive_count + max_node_count * MAX_PRIMITIVES_PER_LEAF);
-    builder->z_curve_distances = Allocate(u64, max_primitive_count);
-    builder->max_primitives_per_leaf = MAX_PRIMITIVES_PER_LEAF;
+    return memory_size;
 }
 
-void freeBottomUpBvhBuilder(BottomUpBvhBuilder *builder) {
-    if (builder->ids)       free(builder->ids);
-    if (builder->nodes)     free(builder->nodes);
-    if (builder->objects)   free(builder->objects);
-    if (builder->centroids) free(builder->centroids);
-    if (builder->z_curve_distances) free(builder->z_curve_distances);
+void initBottomUpBVHBuilder(BottomUpBVHBuilder *builder, u32 leaf_count, Memory *memory) {
+    // The nodes are laid out as the output nodes (2N - 1), followed by the current and next iteration's nodes (N each).
+    // The ids hold the sorted primitive ids (N), followed by the sub-ranges of primitive ids of each (collapsed)leaf node:
+    builder->leaf_count = leaf_count;
+    builder->nodes      = (BottomUpBVHBuilderNode*)allocateMemory(memory, sizeof(BottomUpBVHBuilderNode) * 4 * leaf_count);
+    builder->ids        = (u32*)allocateMemory(memory, sizeof(u32) * (1 + 2 * MAX_PRIMITIVES_PER_LEAF) * leaf_count);
+    builder->sorted_ids = (u32*)allocateMemory(memory, sizeof(u32) * leaf_count);
+    builder->z_curve_distances        = (u64*)allocateMemory(memory, sizeof(u64) * leaf_count);
+    builder->sorted_z_curve_distances = (u64*)allocateMemory(memory, sizeof(u64) * leaf_count);
 }
 
-int sortCmpZCurveDistances(const void *lhs, const void *rhs) {
-    u64 l = z_curve_distances[*((u32*)(lhs))];
-    u64 r = z_curve_distances[*((u32*)(rhs))];
-    return l < r ? -1 : (l > r ? 1 : 0);
+void sortByZCurveDistances(BottomUpBVHBuilder *builder, u32 N) {
+    // Least-significant-digit radix sort of the ids by their z-curve distances, 8 bits at a time.
+    // Passes for digits that are the same for all the distances are skipped (as for the unused top bits):
+    u64 *keys = builder->z_curve_distances, *sorted_keys = builder->sorted_z_curve_distances, *tmp_keys;
+    u32 *ids  = builder->ids, *sorted_ids = builder->sorted_ids, *tmp_ids;
+    u32 counts[256], offset, digit;
+
+    for (u32 shift = 0; shift < 64; shift += 8) {
+        for (u32 i = 0; i < 256; i++) counts[i] = 0;
+        for (u32 i = 0; i < N; i++) counts[(keys[i] >> shift) & 0xFF]++;
+        if (counts[keys[0] >> shift & 0xFF] == N) continue;
+
+        offset = 0;
+        for (u32 i = 0; i < 256; i++) {
+            digit = counts[i];
+            counts[i] = offset;
+            offset += digit;
+        }
+        for (u32 i = 0; i < N; i++) {
+            digit = (keys[i] >> shift) & 0xFF;
+            sorted_keys[counts[digit]] = keys[i];
+            sorted_ids[ counts[digit]] = ids[i];
+            counts[digit]++;
+        }
+
+        tmp_keys = keys; keys = sorted_keys; sorted_keys = tmp_keys;
+        tmp_ids  = ids;  ids  = sorted_ids;  sorted_ids  = tmp_ids;
+    }
+
+    if (ids != builder->ids)
+        for (u32 i = 0; i < N; i++) builder->ids[i] = ids[i];
 }
 
-void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
+void buildBVHBottomUp(BVH *bvh, BottomUpBVHBuilder *builder, BVHNode *leaf_nodes, u32 N, u16 max_leaf_size) {
     // The build process goes through several distinct steps (all happening here in sequence):
     // =======================================================================================
     // 1) Generate an array of primitive indices, sorted based on their relative Z-curve distances:
@@ -89,14 +107,7 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
     // 4) Collapse leaf nodes up-to their parents (leaving holes in the array) so that they represent multiple primitives
     // 5) Write the final node tree into the BVH itself, while packing the sparse array resulted from the leaf-collapse.
 
-    // For each of the 3 axis, compute the multiplication factors needed to place the centroids into a 0->1 range
-    // within the bounds of the overall aabb, and then mapping those up to the range of the z-order (of a single axis):
-    f64 fx = (f64)(1 << 21) / ((f64)builder->overall_aabb.max.x - (f64)builder->overall_aabb.min.x);
-    f64 fy = (f64)(1 << 21) / ((f64)builder->overall_aabb.max.y - (f64)builder->overall_aabb.min.y);
-    f64 fz = (f64)(1 << 21) / ((f64)builder->overall_aabb.max.z - (f64)builder->overall_aabb.min.z);
-
-    u32 i, j, begin, end, max_primitives_per_leaf = builder->max_primitives_per_leaf;
-    u32 N = builder->primitive_count;
+    u32 i, j, begin, end, max_primitives_per_leaf = max_leaf_size;
     u32 node_count = 2 * N - 1;
 
     // The first N entries are reserved for another purpose in a final step.
@@ -105,23 +116,37 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
 
     // 1) Generate an array of primitive indices, sorted based on their relative Z-curve distances:
     {
-        vec3d centroid;
-        u32 *primitive_indices = builder->ids;
-        z_curve_distances = builder->z_curve_distances;
+        // Centroids are kept doubled (min + max) so the overall bounds are of the doubled centroids as well:
+        AABB centroid_bounds;
+        centroid_bounds.min = getVec3Of(INFINITY);
+        centroid_bounds.max = getVec3Of(-INFINITY);
+        vec3 centroid;
+        for (i = 0; i < N; i++) {
+            centroid = addVec3(leaf_nodes[i].aabb.min, leaf_nodes[i].aabb.max);
+            centroid_bounds.min = minVec3(centroid_bounds.min, centroid);
+            centroid_bounds.max = maxVec3(centroid_bounds.max, centroid);
+        }
+
+        // For each of the 3 axis, compute the multiplication factors needed to place the centroids into a 0->1 range
+        // within the bounds of the overall aabb, and then mapping those up to the range of the z-order (of a single axis):
+        vec3 extent = subVec3(centroid_bounds.max, centroid_bounds.min);
+        vec3 factor;
+        factor.x = extent.x > 0 ? (f32)((1 << 21) - 1) / extent.x : 0;
+        factor.y = extent.y > 0 ? (f32)((1 << 21) - 1) / extent.y : 0;
+        factor.z = extent.z > 0 ? (f32)((1 << 21) - 1) / extent.z : 0;
 
         // For each primitive, compute a Z-curve relative distance (on a 1D Z-curve) from the position of it's centroid,
         // and initialize an array of ids for the primitives (0 -> N-1), then sort it based on their Z-curve distances:
         for (i = 0; i < N; i++) {
             // Convert the centroid into the space of the overall aabb's bounds, and then into the space of the z-curve:
-            centroid.x = (builder->centroids[i].x - builder->overall_aabb.min.x) * fx;
-            centroid.y = (builder->centroids[i].y - builder->overall_aabb.min.y) * fy;
-            centroid.z = (builder->centroids[i].z - builder->overall_aabb.min.z) * fz;
+            centroid = addVec3(leaf_nodes[i].aabb.min, leaf_nodes[i].aabb.max);
+            centroid = mulVec3(subVec3(centroid, centroid_bounds.min), factor);
 
-            z_curve_distances[i] = getZCurveDistanceOf(centroid);
-            primitive_indices[i] = i;
+            builder->z_curve_distances[i] = getZCurveDistanceOf(centroid);
+            builder->ids[i] = i;
         }
 
-        qsort(primitive_indices, N, sizeof(u32), sortCmpZCurveDistances);
+        sortByZCurveDistances(builder, N);
     }
 
     // 2) Initialize an array of bvh (leaf)nodes for each primitive, ordered based on the sorted array of indices.
@@ -131,15 +156,15 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
         // contain the actual id of the primitive they represent (as opposed to an index into an indirection array).
         // This also then frees the builder->ids array data to be reused for other purposes.
 
-        BottomUpBvhBuilderNode *node = builder->nodes + node_count;
+        BottomUpBVHBuilderNode *node = builder->nodes + node_count;
         for (i = 0; i < N; i++, node++) {
             j = builder->ids[i];
-            *node = builder->nodes[j];
-
+            node->node.aabb = leaf_nodes[j].aabb;
             node->node.first_child_id = j;
-            node->node.primitive_count = 1;
+            node->node.child_count = 1;
             node->depth = 1;
             node->parent_id = 0;
+            node->is_collapsed = false;
         }
     }
 
@@ -154,17 +179,17 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
         u32 right_node_id, left_node_id;
         AABB merged_aabb;
 
-        BottomUpBvhBuilderNode *out_nodes     = builder->nodes;
-        BottomUpBvhBuilderNode *current_nodes = builder->nodes + node_count;
-        BottomUpBvhBuilderNode *next_nodes    = builder->nodes + node_count + node_count;
-        BottomUpBvhBuilderNode *tmp_nodes, *left_node, *right_node, *parent_node;
+        BottomUpBVHBuilderNode *out_nodes     = builder->nodes;
+        BottomUpBVHBuilderNode *current_nodes = builder->nodes + node_count;
+        BottomUpBVHBuilderNode *next_nodes    = builder->nodes + node_count + N;
+        BottomUpBVHBuilderNode *tmp_nodes, *left_node, *right_node, *parent_node;
 
         while (current_nodes_count > 1) {
 
             // a: Scan through the remaining nodes, looking for optimal neighboring pairs to create parents for:
             for (i = 0; i < current_nodes_count; ++i) {
-                begin = i > SEARCH_RADIUS ? i - SEARCH_RADIUS : 0;
-                end   = i + SEARCH_RADIUS + 1 < current_nodes_count ? i + SEARCH_RADIUS + 1 : current_nodes_count;
+                begin = i > BVH_BOTTOM_UP_SEARCH_RADIUS ? i - BVH_BOTTOM_UP_SEARCH_RADIUS : 0;
+                end   = i + BVH_BOTTOM_UP_SEARCH_RADIUS + 1 < current_nodes_count ? i + BVH_BOTTOM_UP_SEARCH_RADIUS + 1 : current_nodes_count;
 
                 best_candidate_index  = begin == i ? end : begin;
                 best_candidate_values = INFINITY;
@@ -212,11 +237,11 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
                     // Only when their parent node itself get placed into the output array does this gets decided upon.
                     // So if any of the "child" nodes being placed now is also a parent, it means it's child-nodes had
                     // already been placed, so their `parent_id` field can now be set to the (now-known)parent-node index:
-                    if (isParent(left_node)) {
+                    if (isBottomUpBVHParent(left_node)) {
                         out_nodes[left_node->node.first_child_id + 0].parent_id = left_node_id;
                         out_nodes[left_node->node.first_child_id + 1].parent_id = left_node_id;
                     }
-                    if (isParent(right_node)) {
+                    if (isBottomUpBVHParent(right_node)) {
                         out_nodes[right_node->node.first_child_id + 0].parent_id = right_node_id;
                         out_nodes[right_node->node.first_child_id + 1].parent_id = right_node_id;
                     }
@@ -225,7 +250,8 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
                     parent_node = next_nodes + next_nodes_count++;
                     parent_node->depth = left_node->depth > right_node->depth ? left_node->depth : right_node->depth;
                     parent_node->depth++;
-                    parent_node->node.primitive_count = 0;
+                    parent_node->is_collapsed = false;
+                    parent_node->node.child_count = 0;
                     parent_node->node.first_child_id = insertion_index;
                     parent_node->node.aabb = mergeAABBs(left_node->node.aabb, right_node->node.aabb);
                 } else // Put the current node in the nodes of the next iteration:
@@ -241,7 +267,8 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
 
         // Finalize the root node in the output nodes array:
         out_nodes[0] = current_nodes[0];
-        if (isParent(out_nodes)) {
+        out_nodes->is_first_child = false;
+        if (isBottomUpBVHParent(out_nodes)) {
             out_nodes[out_nodes->node.first_child_id + 0].parent_id = 0;
             out_nodes[out_nodes->node.first_child_id + 1].parent_id = 0;
         }
@@ -254,35 +281,35 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
         // Each leaf node would now thus need to get it's own sub-array(sub-range) space to hold it's primitive indices.
         // For that, prime each node's sub-range with the index of just the one primitive it currently references:
         u32 *primitive_id = node_primitive_ids;
-        BottomUpBvhBuilderNode *out_node = builder->nodes;
+        BottomUpBVHBuilderNode *out_node = builder->nodes;
         for (i = 0; i < node_count; i++, out_node++, primitive_id += max_primitives_per_leaf)
-            if (isLeaf(out_node))
+            if (isBottomUpBVHLeaf(out_node))
                 *primitive_id = out_node->node.first_child_id;
 
         u32 Nl, Nr, Np, right_node_id, left_node_id, *parent_primitive_ids;
-        BottomUpBvhBuilderNode *left_node, *right_node, *parent_node;
+        BottomUpBVHBuilderNode *left_node, *right_node, *parent_node;
         f32 collapsed_cost, uncollapsed_cost, SAl, SAr, SAp;
         bool collapse_leaf_nodes = true;
         while (collapse_leaf_nodes) {
             collapse_leaf_nodes = false;
 
             for (i = 0, parent_node = builder->nodes; i < node_count; i++, parent_node++) {
-                if (!isParent(parent_node))
+                if (!isBottomUpBVHParent(parent_node))
                     continue;
 
                 left_node_id = parent_node->node.first_child_id;
                 left_node = builder->nodes + left_node_id;
-                if (!isLeaf(left_node)) continue;
+                if (!isBottomUpBVHLeaf(left_node)) continue;
 
                 right_node_id = left_node_id + 1;
                 right_node = builder->nodes + right_node_id;
-                if (!isLeaf(right_node)) continue;
+                if (!isBottomUpBVHLeaf(right_node)) continue;
 
                 // Default the 2 child-nodes to being un-collapsed so that in the next step they won't be skipped:
                 left_node->is_collapsed = right_node->is_collapsed = false;
 
-                Nl = left_node->node.primitive_count;
-                Nr = right_node->node.primitive_count;
+                Nl = left_node->node.child_count;
+                Nr = right_node->node.child_count;
                 Np = Nr + Nl;
                 if (Np > max_primitives_per_leaf)  // Don't collapse too much
                     continue;
@@ -292,9 +319,9 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
                 SAl = getSurfaceAreaOfAABB(left_node->node.aabb);
                 SAr = getSurfaceAreaOfAABB(right_node->node.aabb);
                 uncollapsed_cost = (f32)Nl * SAl + (f32)Nr * SAr;
-                collapsed_cost = ((f32)Np - (f32)TRAVERSAL_COST) * SAp;
+                collapsed_cost = ((f32)Np - (f32)BVH_TRAVERSAL_COST) * SAp;
                 if (collapsed_cost <= uncollapsed_cost) { // Worth collapsing - do it:
-                    parent_node->node.primitive_count = Np;
+                    parent_node->node.child_count = (u16)Np;
                     parent_node->depth = 1;
 
                     // Copy over the primitive ids of the children to their parent:
@@ -320,195 +347,46 @@ void buildBvhBottomUp(BVH *bvh, BottomUpBvhBuilder *builder) {
     // 5) Write the final node tree into the BVH itself, while packing the sparse array resulted from the leaf-collapse.
     {
         // The first N entries will now be used to hold the final primitive indices of the (final)leaf nodes.
-        u32 *out_primitive_id = builder->ids;
-        u32 primitive_id_insertion_index = 0;
+        // Parents always precede their children in the sparse array, so depths (from the root) are set going forward:
+        u32 *out_leaf_id = bvh->leaf_ids;
+        u32 leaf_id_insertion_index = 0;
         u32 insertion_index = 0;
         u32 *primitive_id;
-        BottomUpBvhBuilderNode *node = builder->nodes;
-        bvh->depth = 1;
+        BottomUpBVHBuilderNode *node = builder->nodes;
+        bvh->height = 1;
         bvh->node_count = 0;
+        builder->nodes->node.depth = 0;
 
         for (i = 0; i < node_count; i++, node++) {
-            if (isLeaf(node)) {
+            if (isBottomUpBVHLeaf(node)) {
                 if (node->is_collapsed)
                     continue;
 
                 // Copy primitive ids over to the final (dense)array of primitive indices:
                 primitive_id = node_primitive_ids + (max_primitives_per_leaf * i);
-                for (j = 0; j < node->node.primitive_count; j++)
-                    *(out_primitive_id++) = *(primitive_id++);
-
-                node->node.first_child_id = primitive_id_insertion_index;
-                primitive_id_insertion_index += node->node.primitive_count;
-            } else { // isParent(node):
-                if (node->depth > bvh->depth)
-                    bvh->depth = node->depth;
+                for (j = 0; j < node->node.child_count; j++)
+                    *(out_leaf_id++) = leaf_nodes[*(primitive_id++)].first_child_id;
 
+                node->node.first_child_id = leaf_id_insertion_index;
+                leaf_id_insertion_index += node->node.child_count;
+            } else { // isBottomUpBVHParent(node):
                 // Set 'parent_id' on this node's children to it's new-placement index:
                 builder->nodes[node->node.first_child_id + 0].parent_id = insertion_index;
                 builder->nodes[node->node.first_child_id + 1].parent_id = insertion_index;
             }
 
-            // If this node is it's parent's left child, set it's parent's 'first_child_id' to it's new-placement index:
-            if (i && node->is_first_child)
-                bvh->nodes[node->parent_id].first_child_id = insertion_index;
+            if (i) {
+                node->node.depth = bvh->nodes[node->parent_id].depth + 1;
+                if (node->node.depth > bvh->height)
+                    bvh->height = node->node.depth;
+
+                // If this node is it's parent's left child, set it's parent's 'first_child_id' to it's new-placement index:
+                if (node->is_first_child)
+                    bvh->nodes[node->parent_id].first_child_id = insertion_index;
+            }
 
             bvh->nodes[insertion_index++] = node->node;
             bvh->node_count++;
         }
     }
 }
-
-void reinsert(BottomUpBvhBuilderNode *nodes, u32 in_id, u32 out_id) {
-    BottomUpBvhBuilderNode *in_node  = nodes + in_id;
-    BottomUpBvhBuilderNode *out_node = nodes + out_id;
-
-    u32 sibling_node_id = in_node->is_first_child ? in_id + 1 : in_id - 1;
-    if (isParent(out_node)) {
-        nodes[out_node->node.first_child_id + 0].parent_id = sibling_node_id;
-        nodes[out_node->node.first_child_id + 1].parent_id = sibling_node_id;
-    }
-
-    BottomUpBvhBuilderNode *sibling_node = nodes + sibling_node_id;
-    BottomUpBvhBuilderNode *parent_node  = nodes + in_node->parent_id;
-    if (isParent(sibling_node)) {
-        nodes[sibling_node->node.first_child_id + 0].parent_id = in_node->parent_id;
-        nodes[sibling_node->node.first_child_id + 1].parent_id = in_node->parent_id;
-    }
-    *parent_node  = *sibling_node;
-    *sibling_node = *out_node;
-
-    // Re-insert it into the destination
-    out_node->node.aabb = mergeAABBs(out_node->node.aabb, in_node->node.aabb);
-    out_node->node.first_child_id = in_id < sibling_node_id ? in_id : sibling_node_id;
-    out_node->node.primitive_count= 0;
-
-    in_node->parent_id = sibling_node->parent_id = out_id;
-}
-
-void updateMeshBvhBottomUp(Mesh *mesh, MeshAccelerationStructure *mesh_acceleration_structure, BottomUpBvhBuilder *builder) {
-    builder->overall_aabb.min = getVec3Of(0);
-    builder->overall_aabb.max = getVec3Of(0);
-
-    BottomUpBvhBuilderNode *node = builder->nodes;
-    vec3d *centroid = builder->centroids;
-
-    TriangleVertexIndices *indices = mesh->triangle_vertex_indices;
-    vec3 *v1, *v2, *v3, min, max;
-    f32 diff;
-
-    for (u32 t = 0; t < mesh->triangle_count; t++, node++, indices++, centroid++) {
-        v1 = mesh->vertex_positions + indices->ids[0];
-        v2 = mesh->vertex_positions + indices->ids[1];
-        v3 = mesh->vertex_positions + indices->ids[2];
-        centroid->x = (v1->x + v2->x + v3->x) / 3.0;
-        centroid->y = (v1->y + v2->y + v3->y) / 3.0;
-        centroid->z = (v1->z + v2->z + v3->z) / 3.0;
-
-        min = minVec3(minVec3(*v1, *v2), *v3);
-        max = maxVec3(maxVec3(*v1, *v2), *v3);
-
-        diff = max.x - min.x;
-        if (diff < 0) diff = -diff;
-        if (diff < EPS) {
-            min.x -= EPS;
-            max.x += EPS;
-        }
-
-        diff = max.y - min.y;
-        if (diff < 0) diff = -diff;
-        if (diff < EPS) {
-            min.y -= EPS;
-            max.y += EPS;
-        }
-
-        diff = max.z - min.z;
-        if (diff < 0) diff = -diff;
-        if (diff < EPS) {
-            min.z -= EPS;
-            max.z += EPS;
-        }
-
-        node->node.aabb.min = min;
-        node->node.aabb.max = max;
-
-        builder->overall_aabb = mergeAABBs(builder->overall_aabb, node->node.aabb);
-    }
-
-    Triangle *triangle = mesh_acceleration_structure->triangles;
-    BVH *bvh = &mesh_acceleration_structure->bvh;
-    u32 N = mesh->triangle_count;
-    if (N <= MAX_TRIANGLES_PER_MESH_BVH_NODE) {
-        for (u32 i = 0; i < N; i++) *(triangle++) = mesh->triangles[i];
-
-        bvh->nodes->aabb = builder->overall_aabb;
-        bvh->nodes->primitive_count = N;
-        bvh->nodes->first_child_id = 0;
-        bvh->depth = 1;
-    } else {
-        builder->primitive_count = N;
-        builder->max_primitives_per_leaf = MAX_TRIANGLES_PER_MESH_BVH_NODE;
-        buildBvhBottomUp(bvh, builder);
-
-        for (u32 i = 0; i < N; i++) *(triangle++) = mesh->triangles[builder->ids[i]];
-    }
-}
-
-void updateSceneBvhBottomUp(Scene *scene, AccelerationStructures *acceleration_structures, BottomUpBvhBuilder *builder) {
-    builder->overall_aabb.min = getVec3Of(0);
-    builder->overall_aabb.max = getVec3Of(0);
-
-    BottomUpBvhBuilderNode *builder_node = builder->nodes;
-    vec3d *centroid = builder->centroids;
-    Obj *object = builder->objects;
-
-    Mesh *mesh = scene->meshes;
-    MeshAccelerationStructure *mesh_as = acceleration_structures->meshes;
-    for (u32 mesh_id = 0; mesh_id < scene->counts.meshes; mesh_id++, mesh++, mesh_as++, builder_node++, object++, centroid++) {
-        object->id = mesh_id;
-        object->type = MeshType;
-
-        builder_node->node.aabb = mesh_as->bvh.nodes->aabb;
-
-        transformAABB(&builder_node->node.aabb, &mesh->primitive);
-        builder->overall_aabb = mergeAABBs(builder->overall_aabb, builder_node->node.aabb);
-
-        centroid->x = (builder_node->node.aabb.max.x - builder_node->node.aabb.min.x) / 2.0;
-        centroid->y = (builder_node->node.aabb.max.y - builder_node->node.aabb.min.y) / 2.0;
-        centroid->z = (builder_node->node.aabb.max.z - builder_node->node.aabb.min.z) / 2.0;
-    }
-
-    Primitive *geometry = scene->primitives;
-    for (u32 sphere_id = 0; sphere_id < scene->counts.primitives; sphere_id++, geometry++, builder_node++, object++, centroid++) {
-        object->id = sphere_id;
-        object->type = GeoTypeSphere;
-
-        builder_node->node.aabb.min = getVec3Of(-1);
-        builder_node->node.aabb.max = getVec3Of(+1);
-
-        transformAABB(&builder_node->node.aabb, geometry);
-        builder->overall_aabb = mergeAABBs(builder->overall_aabb, builder_node->node.aabb);
-
-        centroid->x = (f64)geometry->position.x;
-        centroid->y = (f64)geometry->position.y;
-        centroid->z = (f64)geometry->position.z;
-    }
-
-    object = acceleration_structures->scene.objects;
-    BVH *bvh = &acceleration_structures->scene.bvh;
-    u32 N = scene->counts.meshes + scene->counts.primitives;
-    if (N <= MAX_OBJS_PER_SCENE_BVH_NODE) {
-        bvh->nodes->aabb = builder->overall_aabb;
-        bvh->nodes->primitive_count = N;
-        bvh->nodes->first_child_id = 0;
-        bvh->depth = 1;
-
-        for (u32 i = 0; i < N; i++) *(object++) = builder->objects[i];
-    } else {
-        builder->primitive_count = N;
-        builder->max_primitives_per_leaf = MAX_OBJS_PER_SCENE_BVH_NODE;
-        buildBvhBottomUp(bvh, builder);
-
-        for (u32 i = 0; i < N; i++) *(object++) = builder->objects[builder->ids[i]];
-    }
-}
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include "../../render/AABB.h"
 #include "../../math/mat3.h"
 #include "../../math/vec3.h"
+#include "./builder_bottom_up.h"
+#include "./wide_bvh.h"
 
 
 typedef struct {
@@ -19,50 +21,170 @@ typedef struct {
 } PartitionAxis;
 
 typedef struct {
-    u32 start, end, node_id;
+    u32 start, end, node_id, depth;
 } BuildIteration;
 
 typedef struct {
+    BuildIteration iteration;
+    u32 height, first_node_id, node_count;
+} BVHBuildTask;
+
+typedef struct {
+    AABB aabb;
+    u32 count;
+} BuildBin;
+
+typedef struct {
+    AABB aabb;
+    u32 entry_count, exit_count;
+} SpatialBuildBin;
+
+typedef struct {
+    AABB left_aabb, right_aabb;
+    f32 cost, min, scale;
+    u32 bin;
+    u8 axis;
+} BinnedSplit;
+
+typedef struct {
+    f32 cost, position;
+    u8 axis;
+} SpatialSplit;
+
+typedef struct {
+    f32 cost;
+    u32 node_id, depth;
+} BVHNodeCandidate;
+
+typedef struct BVHBuilder {
     BuildIteration *build_iterations;
     BVHNode *leaf_nodes;
     u32 *leaf_ids;
     i32 *sort_stack;
     PartitionAxis partition_axis[3];
+
+    // The (doubled) centroids of the leaves that binned builds split by, an array per axis in step with the leaf ids
+    // (set once per build and swapped along with them), so that they don't get recomputed from the leaves at every level:
+    f32 *centroids[3];
+    BuildBin bins[3][MAX_BVH_BUILD_BIN_COUNT];
+    SpatialBuildBin spatial_bins[MAX_BVH_BUILD_BIN_COUNT];
+    AABB right_bin_aabbs[MAX_BVH_BUILD_BIN_COUNT];
+    u32 right_bin_counts[MAX_BVH_BUILD_BIN_COUNT];
+    BottomUpBVHBuilder bottom_up;
+    enum BVHBuildStrategy strategy;
+    u8 bin_count;
+
+    // The scene's BVH is refit for as long as its SAH cost stays within 'max_refit_cost_growth' of 'scene_bvh_cost',
+    // the cost it had when it was last built:
+    f32 scene_bvh_cost, max_refit_cost_growth;
+
+    // While a mesh's BVH is built with spatial splits, leaves get appended for triangles that are referenced again
+    // (from the other side of a split), for as long as the duplication budget lasts:
+    Mesh *mesh;
+    u32 leaf_node_count, duplication_budget;
+
+    // Scratch memory for optimizing a BVH once it's built (only allocated where meshes get baked), for 2 nodes per leaf:
+    BVHNodeCandidate *node_candidates;
+    BVHNode *optimized_nodes;
+    u32 *parent_ids, *node_ids;
+
+    // Subtrees of up to 'worker_leaf_count' leaves are deferred to tasks that run concurrently,
+    // each worker building with its own scratch memory into a range of nodes that is set aside for the task:
+    struct BVHBuilder *workers;
+    BVHBuildTask *tasks;
+    CallbackForParallelJob runParallelJob;
+    u32 worker_count, worker_leaf_count, task_count, max_task_count, next_task;
 } BVHBuilder;
 
-u32 getBVHBuilderMemorySize(Scene *scene, u32 max_leaf_count) {
-    u32 memory_size = sizeof(u32) + sizeof(i32) + 2 * (sizeof(AABB) + sizeof(f32));
+typedef struct BVHBuildJob {
+    BVHBuilder *builder;
+    BVH *bvh;
+    Scene *scene;
+    enum BVHBuildStrategy *strategies;
+    u16 max_leaf_size;
+} BVHBuildJob;
+
+u32 getBVHBuilderWorkerLeafCount(u32 max_leaf_count, u32 thread_count) {
+    if (thread_count < 2) return 0;
+
+    u32 worker_leaf_count = max_leaf_count / (thread_count * BVH_BUILD_TASKS_PER_THREAD);
+    return worker_leaf_count < BVH_BUILD_MIN_TASK_SIZE ? 0 : worker_leaf_count;
+}
+
+u64 getBVHBuilderScratchMemorySize(u32 leaf_count) {
+    u64 memory_size = sizeof(u32) + sizeof(i32) + sizeof(f32) + 2 * (sizeof(AABB) + sizeof(f32));
     memory_size *= 3;
     memory_size += sizeof(BuildIteration) + sizeof(BVHNode) + sizeof(u32);
-    memory_size *= max_leaf_count;
+    memory_size *= leaf_count;
 
     return memory_size;
 }
 
-void initBVHBuilder(BVHBuilder *builder, Scene *scene, Memory *memory) {
-    u32 max_triangle_count = 0;
-    if (scene->settings.meshes)
-        for (u32 m = 0; m < scene->settings.meshes; m++)
-            if (scene->meshes[m].triangle_count > max_triangle_count)
-                max_triangle_count = scene->meshes[m].triangle_count;
+u64 getBVHBuilderMemorySize(u32 max_leaf_count, u32 thread_count) {
+    u64 memory_size = getBVHBuilderScratchMemorySize(max_leaf_count);
+    memory_size += getBottomUpBVHBuilderMemorySize(max_leaf_count);
+
+    u32 worker_leaf_count = getBVHBuilderWorkerLeafCount(max_leaf_count, thread_count);
+    if (worker_leaf_count) {
+        memory_size += getBVHBuilderScratchMemorySize(worker_leaf_count) * thread_count;
+        memory_size += sizeof(BVHBuilder) * thread_count;
+        memory_size += sizeof(BVHBuildTask) * thread_count * BVH_BUILD_TASKS_PER_THREAD * 4;
+    }
 
-    u32 leaf_node_count = scene->settings.primitives > max_triangle_count ? scene->settings.primitives : max_triangle_count;
+    return memory_size;
+}
 
-    builder->build_iterations = (BuildIteration*)allocateMemory(memory, sizeof(BuildIteration) * leaf_node_count);
-    builder->leaf_nodes       = (BVHNode*       )allocateMemory(memory, sizeof(BVHNode)        * leaf_node_count);
-    builder->leaf_ids         = (u32*           )allocateMemory(memory, sizeof(u32)            * leaf_node_count);
-    builder->sort_stack       = (i32*           )allocateMemory(memory, sizeof(i32)            * leaf_node_count);
+void initBVHBuilderScratch(BVHBuilder *builder, u32 leaf_count, Memory *memory) {
+    builder->strategy = BVHBuildStrategy_SweepSAH;
+    builder->bin_count = BVH_BUILD_BIN_COUNT;
+    builder->scene_bvh_cost = 0;
+    builder->max_refit_cost_growth = BVH_REFIT_MAX_COST_GROWTH;
+    builder->mesh = null;
+    builder->leaf_node_count = builder->duplication_budget = 0;
+    builder->node_candidates = null;
+    builder->optimized_nodes = null;
+    builder->parent_ids = builder->node_ids = null;
+    builder->workers = null;
+    builder->tasks = null;
+    builder->bottom_up.leaf_count = 0;
+    builder->runParallelJob = null;
+    builder->worker_count = builder->worker_leaf_count = 0;
+    builder->task_count = builder->max_task_count = builder->next_task = 0;
+
+    builder->build_iterations = (BuildIteration*)allocateMemory(memory, sizeof(BuildIteration) * leaf_count);
+    builder->leaf_nodes       = (BVHNode*       )allocateMemory(memory, sizeof(BVHNode)        * leaf_count);
+    builder->leaf_ids         = (u32*           )allocateMemory(memory, sizeof(u32)            * leaf_count);
+    builder->sort_stack       = (i32*           )allocateMemory(memory, sizeof(i32)            * leaf_count);
 
     PartitionAxis *pa = builder->partition_axis;
     for (u8 i = 0; i < 3; i++, pa++) {
-        pa->sorted_leaf_ids     = (u32* )allocateMemory(memory, sizeof(u32)  * leaf_node_count);
-        pa->left.aabbs          = (AABB*)allocateMemory(memory, sizeof(AABB) * leaf_node_count);
-        pa->right.aabbs         = (AABB*)allocateMemory(memory, sizeof(AABB) * leaf_node_count);
-        pa->left.surface_areas  = (f32* )allocateMemory(memory, sizeof(f32)  * leaf_node_count);
-        pa->right.surface_areas = (f32* )allocateMemory(memory, sizeof(f32)  * leaf_node_count);
+        builder->centroids[i]   = (f32* )allocateMemory(memory, sizeof(f32)  * leaf_count);
+        pa->sorted_leaf_ids     = (u32* )allocateMemory(memory, sizeof(u32)  * leaf_count);
+        pa->left.aabbs          = (AABB*)allocateMemory(memory, sizeof(AABB) * leaf_count);
+        pa->right.aabbs         = (AABB*)allocateMemory(memory, sizeof(AABB) * leaf_count);
+        pa->left.surface_areas  = (f32* )allocateMemory(memory, sizeof(f32)  * leaf_count);
+        pa->right.surface_areas = (f32* )allocateMemory(memory, sizeof(f32)  * leaf_count);
     }
 }
 
+// The builder gets scratch memory for up to 'max_leaf_count' leaves (that of the scene's BVH, or of the largest mesh BVH
+// that gets built), and more for each of its workers when given a way to run them:
+void initBVHBuilder(BVHBuilder *builder, u32 max_leaf_count, u32 thread_count, CallbackForParallelJob runParallelJob, Memory *memory) {
+    initBVHBuilderScratch(builder, max_leaf_count, memory);
+    initBottomUpBVHBuilder(&builder->bottom_up, max_leaf_count, memory);
+
+    u32 worker_leaf_count = runParallelJob ? getBVHBuilderWorkerLeafCount(max_leaf_count, thread_count) : 0;
+    if (!worker_leaf_count) return;
+
+    builder->runParallelJob = runParallelJob;
+    builder->worker_count = thread_count;
+    builder->worker_leaf_count = worker_leaf_count;
+    builder->max_task_count = thread_count * BVH_BUILD_TASKS_PER_THREAD * 4;
+    builder->tasks   = (BVHBuildTask*)allocateMemory(memory, sizeof(BVHBuildTask) * builder->max_task_count);
+    builder->workers = (BVHBuilder*  )allocateMemory(memory, sizeof(BVHBuilder)   * thread_count);
+    for (u32 i = 0; i < thread_count; i++) initBVHBuilderScratch(builder->workers + i, worker_leaf_count, memory);
+}
+
 i32 partitionNodesByAxis(BVHNode *nodes, u8 axis, i32 start, i32 end, u32 *leaf_ids) {
     i32 pIndex = start;
     i32 pivot = (i32)leaf_ids[end];
@@ -201,135 +323,656 @@ u32 splitBVHNode(BVHNode *bvh_nodes, u32 *bvh_node_count, BVHBuilder *builder, B
     return start + left_count;
 }
 
-void buildBVH(BVH *bvh, BVHBuilder *builder, u32 N, u16 max_leaf_size) {
-    bvh->node_count = 1;
-    initBVHNode(bvh->nodes);
+// Set the centroids of the leaves in a range of the leaf ids:
+void setBuildCentroids(BVHBuilder *builder, u32 start, u32 end) {
+    f32 *x = builder->centroids[0];
+    f32 *y = builder->centroids[1];
+    f32 *z = builder->centroids[2];
+    AABB *aabb;
+    for (u32 i = start; i < end; i++) {
+        aabb = &builder->leaf_nodes[builder->leaf_ids[i]].aabb;
+        x[i] = aabb->min.x + aabb->max.x;
+        y[i] = aabb->min.y + aabb->max.y;
+        z[i] = aabb->min.z + aabb->max.z;
+    }
+}
+
+INLINE void swapBuildLeaves(BVHBuilder *builder, u32 a, u32 b) {
+    u32 id = builder->leaf_ids[a];
+    builder->leaf_ids[a] = builder->leaf_ids[b];
+    builder->leaf_ids[b] = id;
+
+    f32 centroid;
+    for (u8 axis = 0; axis < 3; axis++) {
+        centroid = builder->centroids[axis][a];
+        builder->centroids[axis][a] = builder->centroids[axis][b];
+        builder->centroids[axis][b] = centroid;
+    }
+}
+
+INLINE u32 getBuildBinIndex(f32 position, f32 min, f32 scale, u32 bin_count) {
+    u32 bin_index = (u32)((position - min) * scale);
+    return bin_index < bin_count ? bin_index : bin_count - 1;
+}
+
+INLINE u32 getBuildBinCount(BVHBuilder *builder) {
+    u32 bin_count = builder->bin_count;
+    if (bin_count < 2) bin_count = 2;
+    if (bin_count > MAX_BVH_BUILD_BIN_COUNT) bin_count = MAX_BVH_BUILD_BIN_COUNT;
+    return bin_count;
+}
+
+// Find the cheapest boundary between bins of leaf centroids (its cost is infinite if all the centroids coincide).
+// The leaves are binned along all 3 axes in a single pass over them, as going over the leaves is what the build spends
+// most of its time on:
+BinnedSplit findBinnedSplit(BVHBuilder *builder, u32 start, u32 N) {
+    BVHNode *leaf_nodes = builder->leaf_nodes;
+    u32 *leaf_ids = builder->leaf_ids + start;
+    f32 *centroids[3], max[3], min[3], centroid;
+    for (u8 axis = 0; axis < 3; axis++) {
+        centroids[axis] = builder->centroids[axis] + start;
+        min[axis] = INFINITY;
+        max[axis] = -INFINITY;
+        for (u32 i = 0; i < N; i++) {
+            centroid = centroids[axis][i];
+            if (centroid < min[axis]) min[axis] = centroid;
+            if (centroid > max[axis]) max[axis] = centroid;
+        }
+    }
 
-    if (N <= max_leaf_size) {
-        bvh->nodes->aabb.min = getVec3Of(INFINITY);
-        bvh->nodes->aabb.max = getVec3Of(-INFINITY);
-        BVHNode *builder_node = builder->leaf_nodes;
-        for (u32 i = 0; i < N; i++, builder_node++) {
-            bvh->leaf_ids[i] = builder_node->first_child_id;
-            bvh->nodes->aabb = mergeAABBs(bvh->nodes->aabb, builder_node->aabb);
+    u32 bin_count = getBuildBinCount(builder);
+    AABB *right_aabbs = builder->right_bin_aabbs;
+    AABB empty, L, R, *leaf_aabb;
+    f32 scale[3], extent, cost;
+    u32 left_count;
+    bool is_binned[3];
+    BuildBin *bin;
+
+    empty.min = getVec3Of(INFINITY);
+    empty.max = getVec3Of(-INFINITY);
+    for (u8 axis = 0; axis < 3; axis++) {
+        extent = max[axis] - min[axis];
+        is_binned[axis] = extent > 0;
+        scale[axis] = is_binned[axis] ? (f32)bin_count / extent : 0;
+        for (u32 b = 0; b < bin_count; b++) {
+            builder->bins[axis][b].aabb = empty;
+            builder->bins[axis][b].count = 0;
+        }
+    }
+    for (u32 i = 0; i < N; i++) {
+        leaf_aabb = &leaf_nodes[leaf_ids[i]].aabb;
+        for (u8 axis = 0; axis < 3; axis++) {
+            if (!is_binned[axis]) continue;
+
+            bin = builder->bins[axis] + getBuildBinIndex(centroids[axis][i], min[axis], scale[axis], bin_count);
+            bin->aabb = mergeAABBs(bin->aabb, *leaf_aabb);
+            bin->count++;
         }
-        bvh->nodes->depth = 0;
-        bvh->nodes->child_count = (u16)N;
-        bvh->nodes->first_child_id = 0;
-        bvh->height = 1;
+    }
 
-        return;
+    BinnedSplit split;
+    split.cost = INFINITY;
+    split.min = split.scale = 0;
+    split.bin = 0;
+    split.axis = 0;
+
+    for (u8 axis = 0; axis < 3; axis++) {
+        if (!is_binned[axis]) continue;
+
+        // Sweep the bins from the right, then from the left evaluating the SAH at every bin boundary:
+        bin = builder->bins[axis];
+        R = empty;
+        for (u32 b = bin_count - 1; b > 0; b--) right_aabbs[b] = R = mergeAABBs(R, bin[b].aabb);
+
+        L = empty;
+        left_count = 0;
+        for (u32 b = 0; b < bin_count - 1; b++) {
+            L = mergeAABBs(L, bin[b].aabb);
+            left_count += bin[b].count;
+            if (left_count == 0 || left_count == N) continue;
+
+            cost = getSurfaceAreaOfAABB(L) * (f32)left_count + getSurfaceAreaOfAABB(right_aabbs[b + 1]) * (f32)(N - left_count);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = b + 1;
+                split.min = min[axis];
+                split.scale = scale[axis];
+                split.left_aabb = L;
+                split.right_aabb = right_aabbs[b + 1];
+            }
+        }
     }
 
-    u32 middle = splitBVHNode(bvh->nodes, &bvh->node_count, builder, bvh->nodes, 0, N);
-    BuildIteration *stack = builder->build_iterations;
-    u32 *leaf_id;
+    return split;
+}
 
-    stack[0].start = 0;
-    stack[0].end = middle;
-    stack[0].node_id = 1;
+// Partition leaf ids to either side of a binned split, returning how many ended up on the left:
+u32 partitionByBinnedSplit(BVHBuilder *builder, u32 start, u32 N, BinnedSplit *split) {
+    BVHNode *leaf_nodes = builder->leaf_nodes;
+    u32 *leaf_ids = builder->leaf_ids + start;
+    u32 left_count;
+
+    if (split->cost == INFINITY) {
+        // All centroids coincide, so no bin boundary separates them - split down the middle instead:
+        left_count = N / 2;
+        split->left_aabb.min = split->right_aabb.min = getVec3Of(INFINITY);
+        split->left_aabb.max = split->right_aabb.max = getVec3Of(-INFINITY);
+        for (u32 i = 0; i < left_count; i++) split->left_aabb  = mergeAABBs(split->left_aabb,  leaf_nodes[leaf_ids[i]].aabb);
+        for (u32 i = left_count; i < N; i++) split->right_aabb = mergeAABBs(split->right_aabb, leaf_nodes[leaf_ids[i]].aabb);
+
+        return left_count;
+    }
+
+    u32 bin_count = getBuildBinCount(builder);
+    f32 *centroids = builder->centroids[split->axis];
+    u32 left_index = start, right_index = start + N;
+    while (left_index < right_index) {
+        if (getBuildBinIndex(centroids[left_index], split->min, split->scale, bin_count) < split->bin)
+            left_index++;
+        else
+            swapBuildLeaves(builder, left_index, --right_index);
+    }
+
+    return left_index - start;
+}
+
+u32 splitBVHNodeBinned(BVHNode *bvh_nodes, u32 *bvh_node_count, BVHBuilder *builder, BVHNode *node, u32 start, u32 end) {
+    u32 N = end - start;
+
+    node->first_child_id = *bvh_node_count;
+    BVHNode *left_node  = bvh_nodes + (*bvh_node_count)++;
+    BVHNode *right_node = bvh_nodes + (*bvh_node_count)++;
 
-    stack[1].start = middle;
-    stack[1].end = N;
-    stack[1].node_id = 2;
+    initBVHNode(left_node);
+    initBVHNode(right_node);
+
+    BinnedSplit split = findBinnedSplit(builder, start, N);
+    u32 left_count = partitionByBinnedSplit(builder, start, N, &split);
+    left_node->aabb  = split.left_aabb;
+    right_node->aabb = split.right_aabb;
 
-    i32 depth = 1;
-    u32 leaf_count = 0;
+    return start + left_count;
+}
+
+INLINE u32 splitBVHNodeByStrategy(BVHNode *bvh_nodes, u32 *bvh_node_count, BVHBuilder *builder, BVHNode *node, u32 start, u32 end) {
+    return builder->strategy != BVHBuildStrategy_SweepSAH ?
+        splitBVHNodeBinned(bvh_nodes, bvh_node_count, builder, node, start, end) :
+        splitBVHNode(      bvh_nodes, bvh_node_count, builder, node, start, end);
+}
+
+u32 buildBVHNodes(BVH *bvh, u32 *node_count, BVHBuilder *builder, BuildIteration root, u16 max_leaf_size, u32 max_task_count) {
+    BuildIteration *stack = builder->build_iterations;
     BuildIteration left, right;
     BVHNode *node;
+    u32 *leaf_id, N, middle, depth, height = root.depth;
+    i32 top = 0;
 
-    bvh->height = 1;
+    stack[0] = root;
 
-    while (depth >= 0) {
-        left = stack[depth];
+    while (top >= 0) {
+        left = stack[top];
         node = bvh->nodes + left.node_id;
+        depth = left.depth;
         N = left.end - left.start;
         if (N <= max_leaf_size) {
             node->depth = (u16)depth;
             node->child_count = (u16)N;
-            node->first_child_id = leaf_count;
+            node->first_child_id = left.start;
             leaf_id = builder->leaf_ids + left.start;
             for (u32 i = 0; i < N; i++, leaf_id++)
-                bvh->leaf_ids[leaf_count + i] = builder->leaf_nodes[*leaf_id].first_child_id;
-            leaf_count += N;
-            depth--;
+                bvh->leaf_ids[left.start + i] = builder->leaf_nodes[*leaf_id].first_child_id;
+            top--;
+        } else if (N <= builder->worker_leaf_count && builder->task_count < max_task_count) {
+            BVHBuildTask *task = builder->tasks + builder->task_count++;
+            task->iteration = left;
+            top--;
         } else {
-            middle = splitBVHNode(bvh->nodes, &bvh->node_count, builder, node, left.start, left.end);
-            bvh->nodes[bvh->node_count - 1].depth = bvh->nodes[bvh->node_count - 2].depth = (u16)depth;
+            middle = splitBVHNodeByStrategy(bvh->nodes, node_count, builder, node, left.start, left.end);
+            bvh->nodes[*node_count - 1].depth = bvh->nodes[*node_count - 2].depth = (u16)(depth + 1);
             right.end = left.end;
             right.start = left.end = middle;
             left.node_id  = node->first_child_id;
             right.node_id = node->first_child_id + 1;
-            stack[  depth] = left;
-            stack[++depth] = right;
-            if (depth > (i32)bvh->height) bvh->height = (u32)depth;
+            left.depth = right.depth = depth + 1;
+
+            // Go down the left child first, so that nodes end up laid out depth-first with siblings next to each other:
+            stack[  top] = right;
+            stack[++top] = left;
+            if (depth + 1 > height) height = depth + 1;
         }
     }
 
-    bvh->nodes->aabb = mergeAABBs(bvh->nodes[1].aabb, bvh->nodes[2].aabb);
+    return height;
 }
 
-void updateMeshBVH(Mesh *mesh, BVHBuilder *builder) {
-    BVHNode *leaf_node = builder->leaf_nodes;
-    TriangleVertexIndices *indices = mesh->vertex_position_indices;
-    vec3 *v1, *v2, *v3;
+void buildBVHSubtrees(void *data, u32 thread_index) {
+    BVHBuildJob *job = (BVHBuildJob*)data;
+    BVHBuilder *builder = job->builder;
+
+    // The worker keeps its own scratch memory but partitions the shared leaf ids (each task owns a disjoint range):
+    BVHBuilder worker = builder->workers[thread_index];
+    worker.leaf_nodes = builder->leaf_nodes;
+    worker.leaf_ids   = builder->leaf_ids;
+    for (u8 axis = 0; axis < 3; axis++) worker.centroids[axis] = builder->centroids[axis];
+    worker.strategy   = builder->strategy;
+    worker.bin_count  = builder->bin_count;
+
+    BVHBuildTask *task;
+    u32 node_count;
+    for (u32 t = atomicFetchAdd(&builder->next_task, 1); t < builder->task_count; t = atomicFetchAdd(&builder->next_task, 1)) {
+        task = builder->tasks + t;
+        node_count = task->first_node_id;
+        task->height = buildBVHNodes(job->bvh, &node_count, &worker, task->iteration, job->max_leaf_size, 0);
+        task->node_count = node_count - task->first_node_id;
+    }
+}
+
+void buildBVH(BVH *bvh, BVHBuilder *builder, u32 N, u16 max_leaf_size) {
+    bvh->node_count = 1;
+    initBVHNode(bvh->nodes);
+    bvh->nodes->aabb.min = getVec3Of(INFINITY);
+    bvh->nodes->aabb.max = getVec3Of(-INFINITY);
+    for (u32 i = 0; i < N; i++) bvh->nodes->aabb = mergeAABBs(bvh->nodes->aabb, builder->leaf_nodes[builder->leaf_ids[i]].aabb);
+
+    // The bottom-up builder builds the whole tree at once, so where its scratch memory is too small (as on the workers)
+    // the top-down builder is used instead, with binning:
+    if (builder->strategy == BVHBuildStrategy_BottomUp && N > max_leaf_size && N <= builder->bottom_up.leaf_count) {
+        buildBVHBottomUp(bvh, &builder->bottom_up, builder->leaf_nodes, N, max_leaf_size);
+        return;
+    }
+    if (builder->strategy != BVHBuildStrategy_SweepSAH) setBuildCentroids(builder, 0, N);
+
+    BuildIteration root;
+    root.start = 0;
+    root.end = N;
+    root.node_id = 0;
+    root.depth = 0;
+
+    bool parallel = builder->runParallelJob && N > builder->worker_leaf_count;
+    builder->task_count = builder->next_task = 0;
+    bvh->height = buildBVHNodes(bvh, &bvh->node_count, builder, root, max_leaf_size, parallel ? builder->max_task_count : 0);
+
+    if (builder->task_count) {
+        // Each task gets a range of nodes that its subtree can't outgrow (a subtree of N leaves has fewer than 2N nodes
+        // below its root). These all fit in the BVH, as the nodes that they replace would have had leaves of their own:
+        BVHBuildTask *task = builder->tasks;
+        for (u32 t = 0; t < builder->task_count; t++, task++) {
+            task->first_node_id = bvh->node_count;
+            bvh->node_count += 2 * (task->iteration.end - task->iteration.start) - 2;
+        }
+
+        BVHBuildJob job;
+        job.builder = builder;
+        job.bvh = bvh;
+        job.scene = null;
+        job.strategies = null;
+        job.max_leaf_size = max_leaf_size;
+        builder->runParallelJob(buildBVHSubtrees, &job, builder->worker_count);
+
+        // Close the gaps that the subtrees left at the ends of their ranges, in the order of the tasks. That way nodes
+        // end up in the same order however the tasks were spread across the workers:
+        BVHNode node;
+        u32 node_count = builder->tasks->first_node_id, shift;
+        task = builder->tasks;
+        for (u32 t = 0; t < builder->task_count; t++, task++) {
+            shift = task->first_node_id - node_count;
+            bvh->nodes[task->iteration.node_id].first_child_id -= shift;
+            for (u32 i = 0; i < task->node_count; i++) {
+                node = bvh->nodes[task->first_node_id + i];
+                if (!node.child_count) node.first_child_id -= shift;
+                bvh->nodes[node_count + i] = node;
+            }
+            node_count += task->node_count;
+            if (task->height > bvh->height) bvh->height = task->height;
+        }
+        bvh->node_count = node_count;
+    }
+
+    if (bvh->height < 1) bvh->height = 1;
+}
+
+// Flat bounds (of axis-aligned triangles) get padded a little, so that rays can't slip past them:
+INLINE void padFlatAABB(AABB *aabb) {
     f32 diff;
+    for (u8 axis = 0; axis < 3; axis++) {
+        diff = (&aabb->max.x)[axis] - (&aabb->min.x)[axis];
+        if (diff < 0) diff = -diff;
+        if (diff < EPS) {
+            (&aabb->min.x)[axis] -= EPS;
+            (&aabb->max.x)[axis] += EPS;
+        }
+    }
+}
 
-    for (u32 i = 0; i < mesh->triangle_count; i++, leaf_node++, indices++) {
-        v1 = mesh->vertex_positions + indices->ids[0];
-        v2 = mesh->vertex_positions + indices->ids[1];
-        v3 = mesh->vertex_positions + indices->ids[2];
+// The bounds of the part of a mesh's triangle that lies between two planes perpendicular to the given axis:
+AABB getTriangleAABBInSlab(Mesh *mesh, u32 triangle_id, u8 axis, f32 min, f32 max) {
+    TriangleVertexIndices *indices = mesh->vertex_position_indices + triangle_id;
+    vec3 *from, *to, point;
+    f32 a, b, planes[2] = {min, max};
+
+    AABB aabb;
+    aabb.min = getVec3Of(INFINITY);
+    aabb.max = getVec3Of(-INFINITY);
+
+    for (u8 v = 0; v < 3; v++) {
+        from = mesh->vertex_positions + indices->ids[v];
+        to   = mesh->vertex_positions + indices->ids[v == 2 ? 0 : v + 1];
+        a = (&from->x)[axis];
+        b = (&to->x)[axis];
+        if (min <= a && a <= max) {
+            aabb.min = minVec3(aabb.min, *from);
+            aabb.max = maxVec3(aabb.max, *from);
+        }
 
-        leaf_node->aabb.min.x = v2->x < v3->x ? v2->x : v3->x;
-        leaf_node->aabb.min.y = v2->y < v3->y ? v2->y : v3->y;
-        leaf_node->aabb.min.z = v2->z < v3->z ? v2->z : v3->z;
+        // Where the edge crosses either of the planes:
+        for (u8 p = 0; p < 2; p++)
+            if ((a < planes[p] && planes[p] < b) || (b < planes[p] && planes[p] < a)) {
+                point = lerpVec3(*from, *to, (planes[p] - a) / (b - a));
+                (&point.x)[axis] = planes[p];
+                aabb.min = minVec3(aabb.min, point);
+                aabb.max = maxVec3(aabb.max, point);
+            }
+    }
 
-        leaf_node->aabb.max.x = v2->x > v3->x ? v2->x : v3->x;
-        leaf_node->aabb.max.y = v2->y > v3->y ? v2->y : v3->y;
-        leaf_node->aabb.max.z = v2->z > v3->z ? v2->z : v3->z;
+    return aabb;
+}
 
-        leaf_node->aabb.min.x = leaf_node->aabb.min.x < v1->x ? leaf_node->aabb.min.x : v1->x;
-        leaf_node->aabb.min.y = leaf_node->aabb.min.y < v1->y ? leaf_node->aabb.min.y : v1->y;
-        leaf_node->aabb.min.z = leaf_node->aabb.min.z < v1->z ? leaf_node->aabb.min.z : v1->z;
+// The bounds of a leaf, clipped to the part of its triangle within a slab (empty when none of it is):
+AABB clipLeafToSlab(Mesh *mesh, BVHNode *leaf_node, u8 axis, f32 min, f32 max) {
+    AABB aabb = intersectAABBs(leaf_node->aabb, getTriangleAABBInSlab(mesh, leaf_node->first_child_id, axis, min, max));
+    if (isEmptyAABB(aabb)) {
+        aabb.min = getVec3Of(INFINITY);
+        aabb.max = getVec3Of(-INFINITY);
+    } else
+        padFlatAABB(&aabb);
 
-        leaf_node->aabb.max.x = leaf_node->aabb.max.x > v1->x ? leaf_node->aabb.max.x : v1->x;
-        leaf_node->aabb.max.y = leaf_node->aabb.max.y > v1->y ? leaf_node->aabb.max.y : v1->y;
-        leaf_node->aabb.max.z = leaf_node->aabb.max.z > v1->z ? leaf_node->aabb.max.z : v1->z;
+    return aabb;
+}
 
-        diff = leaf_node->aabb.max.x - leaf_node->aabb.min.x;
-        if (diff < 0) diff = -diff;
-        if (diff < EPS) {
-            leaf_node->aabb.min.x -= EPS;
-            leaf_node->aabb.max.x += EPS;
+INLINE f32 getSplitSideCost(AABB aabb, u32 leaf_count) {
+    return leaf_count ? getSurfaceAreaOfAABB(aabb) * (f32)leaf_count : 0;
+}
+
+// Find the cheapest boundary between equally sized bins of the node's bounds, with every leaf chopped into the bins that
+// its triangle spans, and counted on the left of the bin that it enters and on the right of the bin that it exits:
+SpatialSplit findSpatialSplit(BVHBuilder *builder, AABB *node_aabb, u32 *leaf_ids, u32 N) {
+    u32 bin_count = getBuildBinCount(builder);
+    SpatialBuildBin *bins = builder->spatial_bins;
+    AABB *right_aabbs = builder->right_bin_aabbs;
+    u32 *right_counts = builder->right_bin_counts;
+    BVHNode *leaf_node;
+    AABB empty, L, R;
+    f32 min, extent, scale, bin_size, cost;
+    u32 first, last, left_count, right_count;
+
+    empty.min = getVec3Of(INFINITY);
+    empty.max = getVec3Of(-INFINITY);
+
+    SpatialSplit split;
+    split.cost = INFINITY;
+    split.position = 0;
+    split.axis = 0;
+
+    for (u8 axis = 0; axis < 3; axis++) {
+        min = (&node_aabb->min.x)[axis];
+        extent = (&node_aabb->max.x)[axis] - min;
+        if (extent <= 0) continue;
+
+        scale = (f32)bin_count / extent;
+        bin_size = extent / (f32)bin_count;
+        for (u32 b = 0; b < bin_count; b++) {
+            bins[b].aabb = empty;
+            bins[b].entry_count = bins[b].exit_count = 0;
+        }
+        for (u32 i = 0; i < N; i++) {
+            leaf_node = builder->leaf_nodes + leaf_ids[i];
+            first = getBuildBinIndex((&leaf_node->aabb.min.x)[axis], min, scale, bin_count);
+            last  = getBuildBinIndex((&leaf_node->aabb.max.x)[axis], min, scale, bin_count);
+            bins[first].entry_count++;
+            bins[last].exit_count++;
+            if (first == last)
+                bins[first].aabb = mergeAABBs(bins[first].aabb, leaf_node->aabb);
+            else
+                for (u32 b = first; b <= last; b++)
+                    bins[b].aabb = mergeAABBs(bins[b].aabb, clipLeafToSlab(builder->mesh, leaf_node, axis,
+                                                                           b == first ? -INFINITY : min + bin_size * (f32)b,
+                                                                           b == last  ?  INFINITY : min + bin_size * (f32)(b + 1)));
         }
 
-        diff = leaf_node->aabb.max.y - leaf_node->aabb.min.y;
-        if (diff < 0) diff = -diff;
-        if (diff < EPS) {
-            leaf_node->aabb.min.y -= EPS;
-            leaf_node->aabb.max.y += EPS;
+        R = empty;
+        right_count = 0;
+        for (u32 b = bin_count - 1; b > 0; b--) {
+            right_aabbs[b] = R = mergeAABBs(R, bins[b].aabb);
+            right_counts[b] = right_count += bins[b].exit_count;
         }
 
-        diff = leaf_node->aabb.max.z - leaf_node->aabb.min.z;
-        if (diff < 0) diff = -diff;
-        if (diff < EPS) {
-            leaf_node->aabb.min.z -= EPS;
-            leaf_node->aabb.max.z += EPS;
+        L = empty;
+        left_count = 0;
+        for (u32 b = 0; b < bin_count - 1; b++) {
+            L = mergeAABBs(L, bins[b].aabb);
+            left_count += bins[b].entry_count;
+            if (left_count == 0 || right_counts[b + 1] == 0) continue;
+
+            cost = getSurfaceAreaOfAABB(L) * (f32)left_count + getSurfaceAreaOfAABB(right_aabbs[b + 1]) * (f32)right_counts[b + 1];
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.position = min + bin_size * (f32)(b + 1);
+            }
         }
+    }
 
-        leaf_node->first_child_id = builder->leaf_ids[i] = i;
+    return split;
+}
+
+// Partition leaf ids to either side of a spatial split, left ones first. Leaves that straddle it get duplicated into both
+// sides (clipped to either side), unless moving them whole into one of the sides is cheaper or the duplication budget is
+// spent. Duplicates are appended to the leaf ids (the range grows past 'N'). Returns how many leaves ended up on the left
+// (with the right ones counted into 'right_count'), or 0 where the split fails to separate the leaves:
+u32 partitionBySpatialSplit(BVHBuilder *builder, u32 *leaf_ids, u32 N, SpatialSplit *split,
+                            u32 *right_count, AABB *left_aabb, AABB *right_aabb) {
+    BVHNode *leaf_nodes = builder->leaf_nodes, *leaf_node, *duplicate;
+    i32 *sides = builder->sort_stack; // -1: Left, 1: Right, 2: Both, 0: Undecided (straddling)
+    u8 axis = split->axis;
+    f32 position = split->position, left_cost, right_cost, split_cost;
+    u32 left_count = 0, duplicates = 0;
+    AABB clipped_left, clipped_right;
+
+    *right_count = 0;
+    left_aabb->min = right_aabb->min = getVec3Of(INFINITY);
+    left_aabb->max = right_aabb->max = getVec3Of(-INFINITY);
+    for (u32 i = 0; i < N; i++) {
+        leaf_node = leaf_nodes + leaf_ids[i];
+        if ((&leaf_node->aabb.max.x)[axis] <= position) {
+            *left_aabb = mergeAABBs(*left_aabb, leaf_node->aabb);
+            left_count++;
+            sides[i] = -1;
+        } else if ((&leaf_node->aabb.min.x)[axis] >= position) {
+            *right_aabb = mergeAABBs(*right_aabb, leaf_node->aabb);
+            (*right_count)++;
+            sides[i] = 1;
+        } else
+            sides[i] = 0;
+    }
+
+    for (u32 i = 0; i < N; i++) {
+        if (sides[i]) continue;
+
+        leaf_node = leaf_nodes + leaf_ids[i];
+        clipped_left  = clipLeafToSlab(builder->mesh, leaf_node, axis, -INFINITY, position);
+        clipped_right = clipLeafToSlab(builder->mesh, leaf_node, axis, position, INFINITY);
+        left_cost  = getSplitSideCost(mergeAABBs(*left_aabb, leaf_node->aabb), left_count + 1) + getSplitSideCost(*right_aabb, *right_count);
+        right_cost = getSplitSideCost(*left_aabb, left_count) + getSplitSideCost(mergeAABBs(*right_aabb, leaf_node->aabb), *right_count + 1);
+        split_cost = getSplitSideCost(mergeAABBs(*left_aabb, clipped_left), left_count + 1) +
+                     getSplitSideCost(mergeAABBs(*right_aabb, clipped_right), *right_count + 1);
+
+        if (isEmptyAABB(clipped_left))
+            right_cost = -INFINITY;
+        else if (isEmptyAABB(clipped_right))
+            left_cost = -INFINITY;
+        else if (builder->duplication_budget > duplicates && split_cost < left_cost && split_cost < right_cost) {
+            *left_aabb  = mergeAABBs(*left_aabb,  clipped_left);
+            *right_aabb = mergeAABBs(*right_aabb, clipped_right);
+            left_count++;
+            (*right_count)++;
+            duplicates++;
+            sides[i] = 2;
+            continue;
+        }
+
+        if (left_cost <= right_cost) {
+            *left_aabb = mergeAABBs(*left_aabb, leaf_node->aabb);
+            left_count++;
+            sides[i] = -1;
+        } else {
+            *right_aabb = mergeAABBs(*right_aabb, leaf_node->aabb);
+            (*right_count)++;
+            sides[i] = 1;
+        }
+    }
+
+    if (left_count == 0 || *right_count == 0)
+        return 0;
+
+    u32 *left_ids  = builder->partition_axis[0].sorted_leaf_ids; left_count = 0;
+    u32 *right_ids = builder->partition_axis[1].sorted_leaf_ids; *right_count = 0;
+    for (u32 i = 0; i < N; i++) {
+        if (sides[i] == 2) {
+            leaf_node = leaf_nodes + leaf_ids[i];
+            duplicate = leaf_nodes + builder->leaf_node_count;
+            duplicate->first_child_id = leaf_node->first_child_id;
+            duplicate->aabb = clipLeafToSlab(builder->mesh, leaf_node, axis, position, INFINITY);
+            leaf_node->aabb = clipLeafToSlab(builder->mesh, leaf_node, axis, -INFINITY, position);
+            right_ids[(*right_count)++] = builder->leaf_node_count++;
+        }
+        if (sides[i] == 1)
+            right_ids[(*right_count)++] = leaf_ids[i];
+        else
+            left_ids[left_count++] = leaf_ids[i];
+    }
+    builder->duplication_budget -= duplicates;
+
+    for (u32 i = 0; i < left_count;   i++) leaf_ids[i] = left_ids[i];
+    for (u32 i = 0; i < *right_count; i++) leaf_ids[left_count + i] = right_ids[i];
+
+    return left_count;
+}
+
+// Build a mesh's BVH top-down with binned SAH splits that may also be spatial (where object splits overlap too much).
+// Children are built first to last (laid out depth-first like the other builders), so the first child of a node takes
+// the upper side of its split: That way the node being built always has its leaves at the end of the ones that are yet
+// to be built, where duplicates can be appended. Leaves are written out as they are reached, so triangles still end up
+// in leaf order.
+// Returns the number of triangle references:
+u32 buildMeshBVHWithSpatialSplits(Mesh *mesh, BVHBuilder *builder, u16 max_leaf_size) {
+    BVH *bvh = &mesh->bvh;
+    BuildIteration *stack = builder->build_iterations;
+    BuildIteration left, right;
+    BinnedSplit object_split;
+    SpatialSplit spatial_split;
+    AABB overlap, left_aabb, right_aabb;
+    BVHNode *node, *left_node, *right_node;
+    u32 *leaf_ids, N, left_count, right_count, depth, height = 0, reference_count = 0;
+    bool try_spatial_split;
+    i32 top = 0;
+
+    builder->mesh = mesh;
+    builder->leaf_node_count = mesh->triangle_count;
+    // Duplicates are limited to what the mesh has room for (it may have been given less than the full budget):
+    builder->duplication_budget = getMaxTriangleReferenceCount(mesh->triangle_count);
+    if (builder->duplication_budget > mesh->triangle_reference_capacity) builder->duplication_budget = mesh->triangle_reference_capacity;
+    builder->duplication_budget -= mesh->triangle_count;
+
+    bvh->node_count = 1;
+    initBVHNode(bvh->nodes);
+    bvh->nodes->aabb.min = getVec3Of(INFINITY);
+    bvh->nodes->aabb.max = getVec3Of(-INFINITY);
+    for (u32 i = 0; i < mesh->triangle_count; i++) bvh->nodes->aabb = mergeAABBs(bvh->nodes->aabb, builder->leaf_nodes[builder->leaf_ids[i]].aabb);
+    setBuildCentroids(builder, 0, mesh->triangle_count);
+    f32 min_overlap = getSurfaceAreaOfAABB(bvh->nodes->aabb) * BVH_SPATIAL_SPLIT_MIN_OVERLAP;
+
+    stack[0].start = 0;
+    stack[0].end = mesh->triangle_count;
+    stack[0].node_id = 0;
+    stack[0].depth = 0;
+
+    while (top >= 0) {
+        left = stack[top];
+        node = bvh->nodes + left.node_id;
+        depth = left.depth;
+        N = left.end - left.start;
+        leaf_ids = builder->leaf_ids + left.start;
+        if (N <= max_leaf_size) {
+            node->depth = (u16)depth;
+            node->child_count = (u16)N;
+            node->first_child_id = reference_count;
+            for (u32 i = 0; i < N; i++) bvh->leaf_ids[reference_count++] = builder->leaf_nodes[leaf_ids[i]].first_child_id;
+            top--;
+            continue;
+        }
+
+        object_split = findBinnedSplit(builder, left.start, N);
+        try_spatial_split = object_split.cost == INFINITY;
+        if (!try_spatial_split) {
+            overlap = intersectAABBs(object_split.left_aabb, object_split.right_aabb);
+            try_spatial_split = !isEmptyAABB(overlap) && getSurfaceAreaOfAABB(overlap) > min_overlap;
+        }
+
+        left_count = 0;
+        if (try_spatial_split) {
+            spatial_split = findSpatialSplit(builder, &node->aabb, leaf_ids, N);
+            if (spatial_split.cost < object_split.cost)
+                left_count = partitionBySpatialSplit(builder, leaf_ids, N, &spatial_split, &right_count, &left_aabb, &right_aabb);
+
+            // Leaves got reordered, clipped and duplicated, so their centroids are set again:
+            if (left_count) setBuildCentroids(builder, left.start, left.start + left_count + right_count);
+        }
+        if (!left_count) {
+            left_count = partitionByBinnedSplit(builder, left.start, N, &object_split);
+            right_count = N - left_count;
+            left_aabb  = object_split.left_aabb;
+            right_aabb = object_split.right_aabb;
+        }
+
+        node->first_child_id = bvh->node_count;
+        left_node  = bvh->nodes + bvh->node_count++;
+        right_node = bvh->nodes + bvh->node_count++;
+        initBVHNode(left_node);
+        initBVHNode(right_node);
+        left_node->aabb  = right_aabb;
+        right_node->aabb = left_aabb;
+        left_node->depth = right_node->depth = (u16)(depth + 1);
+
+        right.start = left.start;
+        right.end   = left.start + left_count;
+        right.node_id = node->first_child_id + 1;
+        left.start = right.end;
+        left.end   = right.end + right_count;
+        left.node_id = node->first_child_id;
+        left.depth = right.depth = depth + 1;
+
+        stack[  top] = right;
+        stack[++top] = left;
+        if (depth + 1 > height) height = depth + 1;
     }
 
-    buildBVH(&mesh->bvh, builder, mesh->triangle_count, MAX_TRIANGLES_PER_MESH_BVH_NODE);
+    bvh->height = height < 1 ? 1 : height;
+
+    return reference_count;
+}
 
-    for (u32 i = 0; i < mesh->triangle_count; i++) builder->leaf_ids[i] = mesh->bvh.leaf_ids[i];
+// Build a mesh's wide BVH from its binary one, and lay its triangles out in the order of the leaves that reference them:
+void finalizeMeshBVH(Mesh *mesh) {
+    buildWideBVH(&mesh->wide_bvh, &mesh->bvh);
 
+    TriangleVertexIndices *indices;
+    vec3 *v1, *v2, *v3;
     mat3 m3;
     Triangle *triangle = mesh->triangles;
-    u32 *triangle_id = builder->leaf_ids;
-    for (u32 i = 0; i < mesh->triangle_count; i++, triangle++, triangle_id++) {
-        mesh->bvh.leaf_ids[*triangle_id] = i;
-
+    TriangleShading *shading = mesh->triangle_shading;
+    u32 *triangle_id = mesh->bvh.leaf_ids;
+    for (u32 i = 0; i < mesh->triangle_reference_count; i++, triangle++, shading++, triangle_id++) {
         indices = mesh->vertex_position_indices + *triangle_id; // 7
 
         v1 = &mesh->vertex_positions[indices->ids[0]];
@@ -339,31 +982,139 @@ void updateMeshBVH(Mesh *mesh, BVHBuilder *builder) {
         m3.X = subVec3(*v3, *v1);
         m3.Y = subVec3(*v2, *v1);
         m3.Z = crossVec3(m3.X, m3.Y);
-        triangle->area_of_parallelogram = lengthVec3(m3.Z);
-        m3.Z = scaleVec3(m3.Z, 1.0f / triangle->area_of_parallelogram);
+        shading->area_of_parallelogram = lengthVec3(m3.Z);
+        m3.Z = scaleVec3(m3.Z, 1.0f / shading->area_of_parallelogram);
 
         indices = mesh->vertex_normal_indices + *triangle_id;
 
         triangle->world_to_tangent = invMat3(m3);
         triangle->normal = m3.Z;
         triangle->position = *v1;
+        triangle->padding = 0;
 
 //        triangle->minus_position_dot_normal = -1 * dotVec3(normVec3(triangle->position), triangle->normal);
-        triangle->vertex_normals[0] = mesh->vertex_normals[indices->ids[0]];
-        triangle->vertex_normals[1] = mesh->vertex_normals[indices->ids[1]];
-        triangle->vertex_normals[2] = mesh->vertex_normals[indices->ids[2]];
+        shading->vertex_normals[0] = mesh->vertex_normals[indices->ids[0]];
+        shading->vertex_normals[1] = mesh->vertex_normals[indices->ids[1]];
+        shading->vertex_normals[2] = mesh->vertex_normals[indices->ids[2]];
 
         if (mesh->uvs_count) {
             indices = mesh->vertex_uvs_indices + *triangle_id;
-            vec2 a = triangle->uvs[0] = mesh->vertex_uvs[indices->ids[0]];
-            vec2 b = triangle->uvs[1] = mesh->vertex_uvs[indices->ids[1]];
-            vec2 c = triangle->uvs[2] = mesh->vertex_uvs[indices->ids[2]];
-            triangle->area_of_uv = fabsf((b.x-a.x) * (c.y-a.y) - (c.x-a.x) * (b.y-a.y));
+            vec2 a = shading->uvs[0] = mesh->vertex_uvs[indices->ids[0]];
+            vec2 b = shading->uvs[1] = mesh->vertex_uvs[indices->ids[1]];
+            vec2 c = shading->uvs[2] = mesh->vertex_uvs[indices->ids[2]];
+            shading->area_of_uv = fabsf((b.x-a.x) * (c.y-a.y) - (c.x-a.x) * (b.y-a.y));
         }
     }
+
+    buildTrianglePackets(mesh);
 }
 
-void updateSceneBVH(Scene *scene, BVHBuilder *builder) {
+void updateMeshBVH(Mesh *mesh, BVHBuilder *builder) {
+    BVHNode *leaf_node = builder->leaf_nodes;
+    TriangleVertexIndices *indices = mesh->vertex_position_indices;
+    vec3 *v1, *v2, *v3;
+    if (!mesh->triangle_count) return;
+
+    for (u32 i = 0; i < mesh->triangle_count; i++, leaf_node++, indices++) {
+        v1 = mesh->vertex_positions + indices->ids[0];
+        v2 = mesh->vertex_positions + indices->ids[1];
+        v3 = mesh->vertex_positions + indices->ids[2];
+
+        leaf_node->aabb.min.x = v2->x < v3->x ? v2->x : v3->x;
+        leaf_node->aabb.min.y = v2->y < v3->y ? v2->y : v3->y;
+        leaf_node->aabb.min.z = v2->z < v3->z ? v2->z : v3->z;
+
+        leaf_node->aabb.max.x = v2->x > v3->x ? v2->x : v3->x;
+        leaf_node->aabb.max.y = v2->y > v3->y ? v2->y : v3->y;
+        leaf_node->aabb.max.z = v2->z > v3->z ? v2->z : v3->z;
+
+        leaf_node->aabb.min.x = leaf_node->aabb.min.x < v1->x ? leaf_node->aabb.min.x : v1->x;
+        leaf_node->aabb.min.y = leaf_node->aabb.min.y < v1->y ? leaf_node->aabb.min.y : v1->y;
+        leaf_node->aabb.min.z = leaf_node->aabb.min.z < v1->z ? leaf_node->aabb.min.z : v1->z;
+
+        leaf_node->aabb.max.x = leaf_node->aabb.max.x > v1->x ? leaf_node->aabb.max.x : v1->x;
+        leaf_node->aabb.max.y = leaf_node->aabb.max.y > v1->y ? leaf_node->aabb.max.y : v1->y;
+        leaf_node->aabb.max.z = leaf_node->aabb.max.z > v1->z ? leaf_node->aabb.max.z : v1->z;
+
+        padFlatAABB(&leaf_node->aabb);
+        leaf_node->first_child_id = builder->leaf_ids[i] = i;
+    }
+
+    if (builder->strategy == BVHBuildStrategy_SpatialSAH)
+        mesh->triangle_reference_count = buildMeshBVHWithSpatialSplits(mesh, builder, MAX_TRIANGLES_PER_MESH_BVH_NODE);
+    else {
+        buildBVH(&mesh->bvh, builder, mesh->triangle_count, MAX_TRIANGLES_PER_MESH_BVH_NODE);
+        mesh->triangle_reference_count = mesh->triangle_count;
+    }
+
+    finalizeMeshBVH(mesh);
+}
+
+// The most leaves that a mesh's BVH may need scratch memory for, counting duplicates from spatial splits:
+INLINE u32 getMeshBVHLeafCount(Mesh *mesh, enum BVHBuildStrategy strategy) {
+    return strategy == BVHBuildStrategy_SpatialSAH ? getMaxTriangleReferenceCount(mesh->triangle_count) : mesh->triangle_count;
+}
+
+// How tall a BVH is expected to get once rebuilt, for setting memory aside for traversing it before it's built.
+// SAH splits don't come out balanced, so this allows for twice the height of a balanced BVH (and then some):
+INLINE u32 getBVHHeightEstimate(u32 leaf_count) {
+    u32 height = 0;
+    for (u32 count = 1; count < leaf_count; count <<= 1) height++;
+    return 2 * height + 8;
+}
+
+INLINE enum BVHBuildStrategy getMeshBVHBuildStrategy(BVHBuilder *builder, enum BVHBuildStrategy *strategies, u32 mesh_id) {
+    return strategies ? strategies[mesh_id] : builder->strategy;
+}
+
+void buildMeshBVHs(void *data, u32 thread_index) {
+    BVHBuildJob *job = (BVHBuildJob*)data;
+    BVHBuilder *builder = job->builder;
+    BVHBuilder *worker = builder->workers + thread_index;
+    worker->bin_count = builder->bin_count;
+
+    Scene *scene = job->scene;
+    for (u32 m = atomicFetchAdd(&builder->next_task, 1); m < scene->settings.meshes; m = atomicFetchAdd(&builder->next_task, 1)) {
+        worker->strategy = getMeshBVHBuildStrategy(builder, job->strategies, m);
+        if (getMeshBVHLeafCount(scene->meshes + m, worker->strategy) <= builder->worker_leaf_count)
+            updateMeshBVH(scene->meshes + m, worker);
+    }
+}
+
+// Rebuild the BVHs of all the meshes of a scene, each with its own strategy (where given, or with the builder's otherwise):
+void updateMeshBVHs(Scene *scene, BVHBuilder *builder, enum BVHBuildStrategy *strategies) {
+    // Meshes that fit in a worker's scratch memory are built concurrently (a whole mesh per worker),
+    // then the larger ones are built one at a time with their subtrees spread across the workers:
+    bool parallel = builder->runParallelJob != null;
+    if (parallel) {
+        BVHBuildJob job;
+        job.builder = builder;
+        job.bvh = null;
+        job.scene = scene;
+        job.strategies = strategies;
+        job.max_leaf_size = MAX_TRIANGLES_PER_MESH_BVH_NODE;
+        builder->next_task = 0;
+        builder->runParallelJob(buildMeshBVHs, &job, builder->worker_count);
+    }
+
+    enum BVHBuildStrategy strategy = builder->strategy;
+    for (u32 m = 0; m < scene->settings.meshes; m++) {
+        builder->strategy = getMeshBVHBuildStrategy(builder, strategies, m);
+        if (!parallel || getMeshBVHLeafCount(scene->meshes + m, builder->strategy) > builder->worker_leaf_count)
+            updateMeshBVH(scene->meshes + m, builder);
+        builder->strategy = strategy;
+    }
+
+    for (u32 m = 0; m < scene->settings.meshes; m++) {
+        scene->mesh_bvh_node_counts[m] = scene->meshes[m].bvh.node_count;
+        scene->mesh_triangle_counts[m] = scene->meshes[m].triangle_reference_count;
+    }
+}
+
+// The scene's BVH is the top level of a two-level hierarchy: Its leaves are primitives, and mesh primitives are instances
+// of meshes whose own BVHs (the bottom level) are built once, in object space, and shared by all of their instances.
+// An instance only contributes its world-space bounds (its mesh's bounds, transformed) to the scene's BVH:
+void setSceneBVHLeafNodes(Scene *scene, BVHBuilder *builder) {
     BVHNode *leaf_node = builder->leaf_nodes;
     Primitive *primitive  = scene->primitives;
 
@@ -375,7 +1126,312 @@ void updateSceneBVH(Scene *scene, BVHBuilder *builder) {
         transformAABB(&leaf_node->aabb, primitive);
         leaf_node->first_child_id = builder->leaf_ids[i] = i;
     }
+}
+
+INLINE f32 getBVHNodeCost(BVHNode *node) {
+    return getSurfaceAreaOfAABB(node->aabb) * (node->child_count ? (f32)node->child_count : (f32)BVH_TRAVERSAL_COST);
+}
+
+// The SAH cost of a BVH, relative to the surface area of its root (so that it doesn't grow with the scene's extent):
+f32 getBVHCost(BVH *bvh) {
+    f32 cost = 0;
+    for (u32 n = 0; n < bvh->node_count; n++) cost += getBVHNodeCost(bvh->nodes + n);
+    f32 root_surface_area = getSurfaceAreaOfAABB(bvh->nodes->aabb);
+    return root_surface_area > 0 ? cost / root_surface_area : 0;
+}
+
+// Update the bounds of a BVH to where its leaves are now, keeping its topology as it is, and return its new SAH cost.
+// Both builders lay nodes out with parents before their children, so a single backwards pass refits all of them:
+f32 refitBVH(BVH *bvh, BVHNode *leaf_nodes) {
+    BVHNode *node;
+    u32 *leaf_id;
+    f32 cost = 0;
+    for (u32 n = bvh->node_count; n-- > 0;) {
+        node = bvh->nodes + n;
+        if (node->child_count) {
+            leaf_id = bvh->leaf_ids + node->first_child_id;
+            node->aabb = leaf_nodes[*leaf_id].aabb;
+            for (u32 i = 1; i < node->child_count; i++)
+                node->aabb = mergeAABBs(node->aabb, leaf_nodes[leaf_id[i]].aabb);
+        } else
+            node->aabb = mergeAABBs(bvh->nodes[node->first_child_id].aabb,
+                                    bvh->nodes[node->first_child_id + 1].aabb);
+        cost += getBVHNodeCost(node);
+    }
+
+    f32 root_surface_area = getSurfaceAreaOfAABB(bvh->nodes->aabb);
+    return root_surface_area > 0 ? cost / root_surface_area : 0;
+}
 
+void buildSceneBVH(Scene *scene, BVHBuilder *builder) {
     buildBVH(&scene->bvh, builder, scene->settings.primitives, MAX_OBJS_PER_SCENE_BVH_NODE);
+    buildWideBVH(&scene->wide_bvh, &scene->bvh);
     uploadSceneBVH(scene);
-}
\ No newline at end of file
+    builder->scene_bvh_cost = getBVHCost(&scene->bvh);
+}
+
+void updateSceneBVH(Scene *scene, BVHBuilder *builder) {
+    setSceneBVHLeafNodes(scene, builder);
+    buildSceneBVH(scene, builder);
+}
+
+// Update the bounds of the scene's BVH to where its primitives are now, keeping its topology as it is,
+// and return its new SAH cost:
+f32 refitSceneBVH(Scene *scene, BVHBuilder *builder) {
+    setSceneBVHLeafNodes(scene, builder);
+    f32 cost = refitBVH(&scene->bvh, builder->leaf_nodes);
+    refitWideBVH(&scene->wide_bvh, scene->bvh.leaf_ids, builder->leaf_nodes);
+    uploadSceneBVH(scene);
+    return cost;
+}
+
+// Refit the scene's BVH, rebuilding it instead once refitting has degraded it too much. Returns whether it was rebuilt:
+bool refitOrRebuildSceneBVH(Scene *scene, BVHBuilder *builder) {
+    if (refitSceneBVH(scene, builder) <= builder->scene_bvh_cost * builder->max_refit_cost_growth)
+        return false;
+
+    buildSceneBVH(scene, builder);
+    return true;
+}
+INLINE void pushBVHNodeCandidate(BVHNodeCandidate *heap, u32 *count, BVHNodeCandidate candidate) {
+    u32 i = (*count)++, parent;
+    while (i) {
+        parent = (i - 1) >> 1;
+        if (heap[parent].cost <= candidate.cost) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = candidate;
+}
+
+INLINE BVHNodeCandidate popBVHNodeCandidate(BVHNodeCandidate *heap, u32 *count) {
+    BVHNodeCandidate top = heap[0];
+    BVHNodeCandidate last = heap[--(*count)];
+    u32 i = 0, child;
+    while (true) {
+        child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && heap[child + 1].cost < heap[child].cost) child++;
+        if (last.cost <= heap[child].cost) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+// While a BVH is being optimized, the depth of each node holds its height instead (that of its subtree).
+// Update the bounds and heights of a node and all of its ancestors, after its subtree has changed:
+INLINE void refitBVHNodeAndAncestors(BVH *bvh, u32 *parent_ids, u32 node_id) {
+    BVHNode *node, *left, *right;
+    while (true) {
+        node = bvh->nodes + node_id;
+        left = bvh->nodes + node->first_child_id;
+        right = left + 1;
+        node->aabb = mergeAABBs(left->aabb, right->aabb);
+        node->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+        if (!node_id) break;
+        node_id = parent_ids[node_id];
+    }
+}
+
+// How much a node's bounds waste relative to its children's (those of a leaf, by their surface area alone):
+INLINE f32 getBVHNodeInefficiency(BVH *bvh, BVHNode *node) {
+    f32 area = getSurfaceAreaOfAABB(node->aabb);
+    if (node->child_count) return area;
+
+    f32 left_area  = getSurfaceAreaOfAABB(bvh->nodes[node->first_child_id    ].aabb);
+    f32 right_area = getSurfaceAreaOfAABB(bvh->nodes[node->first_child_id + 1].aabb);
+    f32 min_area = left_area < right_area ? left_area : right_area;
+    f32 denominator = (left_area + right_area) * min_area;
+    return denominator > 0 ? 2 * area * area * area / denominator : area;
+}
+
+// Put a subtree into a BVH wherever it adds the least surface area to the nodes above it (found by branch and bound),
+// pairing it up with the node that is there in the given (free) pair of sibling slots.
+// Positions that would make the BVH taller than 'max_height' are skipped:
+void insertBVHSubtree(BVH *bvh, BVHBuilder *builder, BVHNode subtree, u32 pair_id, u32 max_height) {
+    BVHNode *nodes = bvh->nodes;
+    u32 *parent_ids = builder->parent_ids;
+    BVHNodeCandidate *heap = builder->node_candidates;
+    BVHNodeCandidate candidate, child;
+    BVHNode *target;
+    u32 heap_size = 1, target_id = 0, target_height;
+    f32 subtree_area = getSurfaceAreaOfAABB(subtree.aabb);
+    f32 best_cost = INFINITY, cost;
+    heap->cost = 0;
+    heap->node_id = heap->depth = 0;
+    while (heap_size) {
+        candidate = popBVHNodeCandidate(heap, &heap_size);
+        if (candidate.cost + subtree_area >= best_cost) break;
+
+        target = nodes + candidate.node_id;
+        cost = candidate.cost + getSurfaceAreaOfAABB(mergeAABBs(target->aabb, subtree.aabb));
+        target_height = target->depth > subtree.depth ? target->depth : subtree.depth;
+        if (cost < best_cost && candidate.depth + 1 + target_height <= max_height) {
+            best_cost = cost;
+            target_id = candidate.node_id;
+        }
+
+        // Going further down adds the growth of this node's bounds to the cost of every position below it:
+        child.cost = cost - getSurfaceAreaOfAABB(target->aabb);
+        child.depth = candidate.depth + 1;
+        if (!target->child_count && child.cost + subtree_area < best_cost && child.depth + 1 + subtree.depth <= max_height) {
+            child.node_id = target->first_child_id;
+            pushBVHNodeCandidate(heap, &heap_size, child);
+            child.node_id++;
+            pushBVHNodeCandidate(heap, &heap_size, child);
+        }
+    }
+
+    nodes[pair_id] = nodes[target_id];
+    nodes[pair_id + 1] = subtree;
+    if (!nodes[pair_id].child_count)
+        parent_ids[nodes[pair_id].first_child_id] = parent_ids[nodes[pair_id].first_child_id + 1] = pair_id;
+    if (!subtree.child_count)
+        parent_ids[subtree.first_child_id] = parent_ids[subtree.first_child_id + 1] = pair_id + 1;
+    parent_ids[pair_id] = parent_ids[pair_id + 1] = target_id;
+
+    nodes[target_id].first_child_id = pair_id;
+    nodes[target_id].child_count = 0;
+    refitBVHNodeAndAncestors(bvh, parent_ids, target_id);
+}
+
+// Take a node out of a BVH (its sibling taking the place of their parent) and put its children back in one at a time,
+// the larger first (a leaf gets put back in as it is). The pairs of sibling slots that this frees are where they go:
+void reinsertBVHNode(BVH *bvh, BVHBuilder *builder, u32 node_id, u32 max_height) {
+    BVHNode *nodes = bvh->nodes;
+    u32 *parent_ids = builder->parent_ids;
+    u32 parent_id = parent_ids[node_id];
+    u32 pair_id = nodes[parent_id].first_child_id;
+    u32 sibling_id = node_id == pair_id ? pair_id + 1 : pair_id;
+
+    BVHNode node = nodes[node_id];
+    nodes[parent_id] = nodes[sibling_id];
+    if (!nodes[parent_id].child_count)
+        parent_ids[nodes[parent_id].first_child_id] = parent_ids[nodes[parent_id].first_child_id + 1] = parent_id;
+    if (parent_id)
+        refitBVHNodeAndAncestors(bvh, parent_ids, parent_ids[parent_id]);
+
+    if (node.child_count) {
+        insertBVHSubtree(bvh, builder, node, pair_id, max_height);
+        return;
+    }
+
+    BVHNode left  = nodes[node.first_child_id];
+    BVHNode right = nodes[node.first_child_id + 1];
+    bool left_is_larger = getSurfaceAreaOfAABB(left.aabb) >= getSurfaceAreaOfAABB(right.aabb);
+    insertBVHSubtree(bvh, builder, left_is_larger ? left : right, pair_id, max_height);
+    insertBVHSubtree(bvh, builder, left_is_larger ? right : left, node.first_child_id, max_height);
+}
+
+// Lay a BVH's nodes back out depth-first (with siblings next to each other) and its leaf ids in the order of its leaves,
+// setting the depths of the nodes (and the height of the BVH) the way that the builders do:
+void layOutBVHDepthFirst(BVH *bvh, BVHBuilder *builder) {
+    BuildIteration *stack = builder->build_iterations;
+    BuildIteration left, right;
+    BVHNode *node, *nodes = builder->optimized_nodes;
+    u32 *leaf_ids = builder->leaf_ids;
+    u32 node_count = 1, leaf_id_count = 0, depth, height = 0;
+    i32 top = 0;
+
+    // Each iteration starts at a node's current id and puts it at its new id:
+    stack[0].start = stack[0].node_id = stack[0].depth = 0;
+    while (top >= 0) {
+        left = stack[top];
+        depth = left.depth;
+        node = nodes + left.node_id;
+        *node = bvh->nodes[left.start];
+        node->depth = (u16)depth;
+        if (node->child_count) {
+            for (u32 i = 0; i < node->child_count; i++) leaf_ids[leaf_id_count + i] = bvh->leaf_ids[node->first_child_id + i];
+            node->first_child_id = leaf_id_count;
+            leaf_id_count += node->child_count;
+            if (depth > height) height = depth;
+            top--;
+        } else {
+            right.start = node->first_child_id + 1;
+            left.start = node->first_child_id;
+            left.depth = right.depth = depth + 1;
+            left.node_id = node->first_child_id = node_count;
+            right.node_id = node_count + 1;
+            node_count += 2;
+
+            stack[  top] = right;
+            stack[++top] = left;
+        }
+    }
+
+    for (u32 i = 0; i < node_count; i++) bvh->nodes[i] = nodes[i];
+    for (u32 i = 0; i < leaf_id_count; i++) bvh->leaf_ids[i] = leaf_ids[i];
+    bvh->height = height < 1 ? 1 : height;
+}
+
+// Improve a built BVH by reinserting its most wasteful nodes, pass after pass, then lay it back out depth-first.
+// This is meant for baking meshes offline, where it's worth seconds of work for every bit of traversal that it saves.
+// Returns the BVH's new SAH cost:
+f32 optimizeBVH(BVH *bvh, BVHBuilder *builder, u32 max_passes, u32 max_height) {
+    f32 cost = getBVHCost(bvh);
+    if (bvh->node_count < 5) return cost;
+
+    // The builders lay nodes out with parents before their children, so heights can be set by a single backwards pass:
+    BVHNode *node, *left, *right;
+    u32 *parent_ids = builder->parent_ids;
+    parent_ids[0] = 0;
+    for (u32 n = bvh->node_count; n-- > 0;) {
+        node = bvh->nodes + n;
+        if (node->child_count)
+            node->depth = 0;
+        else {
+            parent_ids[node->first_child_id] = parent_ids[node->first_child_id + 1] = n;
+            left = bvh->nodes + node->first_child_id;
+            right = left + 1;
+            node->depth = 1 + (left->depth > right->depth ? left->depth : right->depth);
+        }
+    }
+
+    // Each pass reinserts every node, the most wasteful ones first. A pass can make things worse though,
+    // so the best nodes so far are kept aside (the leaves don't change):
+    BVHNode *best_nodes = builder->optimized_nodes;
+    BVHNodeCandidate *heap = builder->node_candidates;
+    BVHNodeCandidate candidate;
+    u32 *node_ids = builder->node_ids;
+    u32 heap_size, node_count, failed_passes = 0;
+    f32 new_cost;
+    for (u32 n = 0; n < bvh->node_count; n++) best_nodes[n] = bvh->nodes[n];
+    candidate.depth = 0;
+    for (u32 pass = 0; pass < max_passes && failed_passes < BVH_REINSERTION_MAX_FAILED_PASSES; pass++) {
+        heap_size = 0;
+        for (u32 n = 1; n < bvh->node_count; n++) {
+            candidate.cost = getBVHNodeInefficiency(bvh, bvh->nodes + n);
+            candidate.node_id = n;
+            pushBVHNodeCandidate(heap, &heap_size, candidate);
+        }
+        for (u32 i = node_count = heap_size; i-- > 0;) node_ids[i] = popBVHNodeCandidate(heap, &heap_size).node_id;
+
+        // Reinsertions move nodes around, but every node id remains in use (a node that was picked may have been replaced):
+        for (u32 i = 0; i < node_count; i++) reinsertBVHNode(bvh, builder, node_ids[i], max_height);
+
+        new_cost = getBVHCost(bvh);
+        if (new_cost < cost) {
+            failed_passes = cost - new_cost < cost * BVH_REINSERTION_MIN_GAIN ? failed_passes + 1 : 0;
+            cost = new_cost;
+            for (u32 n = 0; n < bvh->node_count; n++) best_nodes[n] = bvh->nodes[n];
+        } else
+            failed_passes++;
+    }
+
+    for (u32 n = 0; n < bvh->node_count; n++) bvh->nodes[n] = best_nodes[n];
+    layOutBVHDepthFirst(bvh, builder);
+
+    return cost;
+}
+
+// Optimize a mesh's BVH, keeping it from getting taller than a set height (unless it already is), as the traversal stacks
+// grow with the heights of BVHs (and on the GPU, fewer threads then fit in a block):
+f32 optimizeMeshBVH(Mesh *mesh, BVHBuilder *builder, u32 max_passes) {
+    u32 max_height = mesh->bvh.height > MAX_OPTIMIZED_MESH_BVH_HEIGHT ? mesh->bvh.height : MAX_OPTIMIZED_MESH_BVH_HEIGHT;
+    f32 cost = optimizeBVH(&mesh->bvh, builder, max_passes, max_height);
+    finalizeMeshBVH(mesh);
+    return cost;
+}
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "../../core/types.h"
+#include "../AABB.h"
+
+INLINE void setWideBVHNodeChild(WideBVHNode *wide_node, u8 lane, u32 child_id, u16 child_count) {
+    wide_node->child_ids[lane] = child_id;
+    wide_node->child_counts[lane] = child_count;
+}
+
+INLINE void clearWideBVHNodeChild(WideBVHNode *wide_node, u8 lane, AABB *aabb) {
+    // An inverted box is missed by every ray, so unused lanes never need to be masked out:
+    aabb->min = getVec3Of(+INFINITY);
+    aabb->max = getVec3Of(-INFINITY);
+    setWideBVHNodeChild(wide_node, lane, 0, 0);
+}
+
+// Set the bounds of all the children of a wide node at once (quantized bounds are relative to the union of them all):
+void setWideBVHNodeBounds(WideBVHNode *wide_node, AABB *aabbs) {
+#ifdef WIDE_BVH_QUANTIZED
+    vec3 max = getVec3Of(-INFINITY);
+    wide_node->origin = getVec3Of(+INFINITY);
+    wide_node->padding = 0;
+    for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+        if (aabbs[lane].min.x > aabbs[lane].max.x) continue;
+
+        wide_node->origin = minVec3(wide_node->origin, aabbs[lane].min);
+        max = maxVec3(max, aabbs[lane].max);
+    }
+    if (wide_node->origin.x > max.x)
+        wide_node->origin = max = getVec3Of(0);
+
+    f32 origin, step, min_plane, max_plane;
+    i32 exponent;
+    u32 lo, hi;
+    for (u8 axis = 0; axis < 3; axis++) {
+        // Use the smallest power of two that spans the whole extent in 255 steps:
+        origin = wide_node->origin.components[axis];
+        frexpf((max.components[axis] - origin) / 255.0f, &exponent);
+        exponent += 127;
+        wide_node->exponents[axis] = (u8)(exponent < 1 ? 1 : (exponent > 254 ? 254 : exponent));
+        step = getWideBVHNodeStep(wide_node->exponents[axis]);
+
+        for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+            min_plane = aabbs[lane].min.components[axis];
+            max_plane = aabbs[lane].max.components[axis];
+            if (min_plane > max_plane) {
+                lo = 255;
+                hi = 0;
+            } else {
+                // Round outwards, making sure the decoded planes enclose the child:
+                lo = (u32)floorf((min_plane - origin) / step);
+                hi = (u32)ceilf( (max_plane - origin) / step);
+                if (lo > 255) lo = 255;
+                if (hi > 255) hi = 255;
+                while (lo &&       origin + (f32)lo * step > min_plane) lo--;
+                while (hi < 255 && origin + (f32)hi * step < max_plane) hi++;
+            }
+            wide_node->bounds[axis    ][lane] = (u8)lo;
+            wide_node->bounds[axis + 3][lane] = (u8)hi;
+        }
+    }
+#else
+    for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+        wide_node->bounds[0][lane] = aabbs[lane].min.x;
+        wide_node->bounds[1][lane] = aabbs[lane].min.y;
+        wide_node->bounds[2][lane] = aabbs[lane].min.z;
+        wide_node->bounds[3][lane] = aabbs[lane].max.x;
+        wide_node->bounds[4][lane] = aabbs[lane].max.y;
+        wide_node->bounds[5][lane] = aabbs[lane].max.z;
+    }
+#endif
+}
+
+// The union of the bounds of all the children of a wide node (unused lanes hold inverted boxes, which leave it as it is):
+INLINE AABB getWideBVHNodeAABB(WideBVHNode *wide_node) {
+    f32 decoded[6 * WIDE_BVH_WIDTH];
+    f32 *bounds = getWideBVHNodeBounds(wide_node, decoded);
+    AABB aabb;
+    aabb.min = getVec3Of(+INFINITY);
+    aabb.max = getVec3Of(-INFINITY);
+    for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+        aabb.min = minVec3(aabb.min, Vec3(bounds[lane], bounds[WIDE_BVH_WIDTH + lane], bounds[2 * WIDE_BVH_WIDTH + lane]));
+        aabb.max = maxVec3(aabb.max, Vec3(bounds[3 * WIDE_BVH_WIDTH + lane], bounds[4 * WIDE_BVH_WIDTH + lane], bounds[5 * WIDE_BVH_WIDTH + lane]));
+    }
+    return aabb;
+}
+
+void buildWideBVH(WideBVH *wide_bvh, BVH *bvh) {
+    if (!wide_bvh->nodes)
+        return;
+
+    WideBVHNode *wide_node = wide_bvh->nodes, *child;
+    BVHNode *node, *root = bvh->nodes;
+    AABB aabbs[WIDE_BVH_WIDTH];
+    u32 children[WIDE_BVH_WIDTH];
+    u32 child_count, expanded, last, depth, first_inner_child, pending = 0;
+    f32 area, largest_area;
+
+    wide_bvh->node_count = 1;
+    wide_bvh->height = 1;
+    if (root->child_count) {
+        aabbs[0] = root->aabb;
+        setWideBVHNodeChild(wide_node, 0, root->first_child_id, root->child_count);
+        for (u8 lane = 1; lane < WIDE_BVH_WIDTH; lane++) clearWideBVHNodeChild(wide_node, lane, aabbs + lane);
+        setWideBVHNodeBounds(wide_node, aabbs);
+        return;
+    }
+
+    // Wide nodes are laid out depth-first, with the inner children of each node next to each other.
+    // Until a wide node gets collapsed, its first child id holds the id of the binary inner node it stands for,
+    // its second child id links it to the next node pending collapse (if any) and its first child count holds its depth:
+    wide_node->child_ids[0] = 0;
+    wide_node->child_counts[0] = 0;
+    while (true) {
+        node = bvh->nodes + wide_node->child_ids[0];
+        depth = wide_node->child_counts[0];
+        children[0] = node->first_child_id;
+        children[1] = node->first_child_id + 1;
+        child_count = 2;
+
+        // Keep opening up the inner child with the largest surface area until the wide node is full:
+        while (child_count < WIDE_BVH_WIDTH) {
+            expanded = WIDE_BVH_WIDTH;
+            largest_area = -1;
+            for (u32 c = 0; c < child_count; c++) {
+                node = bvh->nodes + children[c];
+                if (node->child_count) continue;
+
+                area = getSurfaceAreaOfAABB(node->aabb);
+                if (area > largest_area) {
+                    largest_area = area;
+                    expanded = c;
+                }
+            }
+            if (expanded == WIDE_BVH_WIDTH)
+                break;
+
+            last = bvh->nodes[children[expanded]].first_child_id;
+            children[expanded] = last;
+            children[child_count++] = last + 1;
+        }
+
+        first_inner_child = wide_bvh->node_count;
+        for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+            if (lane >= child_count) {
+                clearWideBVHNodeChild(wide_node, lane, aabbs + lane);
+                continue;
+            }
+
+            node = bvh->nodes + children[lane];
+            aabbs[lane] = node->aabb;
+            if (node->child_count) {
+                setWideBVHNodeChild(wide_node, lane, node->first_child_id, node->child_count);
+            } else {
+                child = wide_bvh->nodes + wide_bvh->node_count;
+                child->child_ids[0] = children[lane];
+                child->child_counts[0] = (u16)(depth + 1);
+                if (depth + 2 > wide_bvh->height)
+                    wide_bvh->height = depth + 2;
+
+                setWideBVHNodeChild(wide_node, lane, wide_bvh->node_count++, 0);
+            }
+        }
+        setWideBVHNodeBounds(wide_node, aabbs);
+
+        // Push the inner children last to first, so that the first one gets collapsed next:
+        for (u32 c = wide_bvh->node_count; c-- > first_inner_child;) {
+            wide_bvh->nodes[c].child_ids[1] = pending;
+            pending = c;
+        }
+        if (!pending)
+            break;
+
+        wide_node = wide_bvh->nodes + pending;
+        pending = wide_node->child_ids[1];
+    }
+}
+
+// Refit a wide BVH whose leaf children are runs of leaf ids (into the given leaf nodes), keeping its topology as it is.
+// Wide nodes are laid out with every child after its parent, so going backwards refits every child before its parent:
+void refitWideBVH(WideBVH *wide_bvh, u32 *leaf_ids, BVHNode *leaf_nodes) {
+    WideBVHNode *wide_node;
+    AABB aabbs[WIDE_BVH_WIDTH];
+    u32 *leaf_id;
+    for (u32 w = wide_bvh->node_count; w-- > 0;) {
+        wide_node = wide_bvh->nodes + w;
+        for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+            if (wide_node->child_counts[lane]) {
+                leaf_id = leaf_ids + wide_node->child_ids[lane];
+                aabbs[lane] = leaf_nodes[*leaf_id].aabb;
+                for (u32 i = 1; i < wide_node->child_counts[lane]; i++)
+                    aabbs[lane] = mergeAABBs(aabbs[lane], leaf_nodes[leaf_id[i]].aabb);
+            } else if (wide_node->child_ids[lane])
+                aabbs[lane] = getWideBVHNodeAABB(wide_bvh->nodes + wide_node->child_ids[lane]);
+            else
+                clearWideBVHNodeChild(wide_node, lane, aabbs + lane);
+        }
+        setWideBVHNodeBounds(wide_node, aabbs);
+    }
+}
+
+void buildTrianglePackets(Mesh *mesh) {
+    if (!mesh->triangle_packets || !mesh->wide_bvh.node_count)
+        return;
+
+    // Re-point the leaf children of the mesh's wide BVH from runs of triangles to runs of SoA packets of them:
+    TrianglePacket *packet = mesh->triangle_packets;
+    WideBVHNode *node = mesh->wide_bvh.nodes;
+    Triangle *triangle;
+    u32 packet_id = 0, triangle_id, remaining;
+    for (u32 n = 0; n < mesh->wide_bvh.node_count; n++, node++) {
+        for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++) {
+            if (!node->child_counts[lane])
+                continue;
+
+            triangle_id = node->child_ids[lane];
+            node->child_ids[lane] = packet_id;
+            for (remaining = node->child_counts[lane]; remaining; remaining -= packet->triangle_count, packet++, packet_id++) {
+                packet->first_triangle_id = triangle_id;
+                packet->triangle_count = remaining < TRIANGLE_PACKET_WIDTH ? remaining : TRIANGLE_PACKET_WIDTH;
+                for (u8 i = 0; i < TRIANGLE_PACKET_WIDTH; i++) {
+                    if (i < packet->triangle_count) {
+                        triangle = mesh->triangles + triangle_id++;
+                        packet->position[0][i] = triangle->position.x;
+                        packet->position[1][i] = triangle->position.y;
+                        packet->position[2][i] = triangle->position.z;
+                        packet->normal[0][i] = triangle->normal.x;
+                        packet->normal[1][i] = triangle->normal.y;
+                        packet->normal[2][i] = triangle->normal.z;
+                        packet->world_to_tangent[0][i] = triangle->world_to_tangent.X.x;
+                        packet->world_to_tangent[1][i] = triangle->world_to_tangent.X.y;
+                        packet->world_to_tangent[2][i] = triangle->world_to_tangent.X.z;
+                        packet->world_to_tangent[3][i] = triangle->world_to_tangent.Y.x;
+                        packet->world_to_tangent[4][i] = triangle->world_to_tangent.Y.y;
+                        packet->world_to_tangent[5][i] = triangle->world_to_tangent.Y.z;
+                        packet->world_to_tangent[6][i] = triangle->world_to_tangent.Z.x;
+                        packet->world_to_tangent[7][i] = triangle->world_to_tangent.Z.y;
+                        packet->world_to_tangent[8][i] = triangle->world_to_tangent.Z.z;
+                    } else {
+                        // A zero normal makes the ray parallel to the (unused) lane's plane, so it's never hit:
+                        for (u8 c = 0; c < 3; c++) packet->position[c][i] = packet->normal[c][i] = 0;
+                        for (u8 c = 0; c < 9; c++) packet->world_to_tangent[c][i] = 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+INLINE u32 getTrianglePacketCount(Mesh *mesh) {
+    if (!mesh->triangle_packets || !mesh->wide_bvh.nodes)
+        return 0;
+
+    u32 packet_count = 0;
+    WideBVHNode *node = mesh->wide_bvh.nodes;
+    for (u32 n = 0; n < mesh->wide_bvh.node_count; n++, node++)
+        for (u8 lane = 0; lane < WIDE_BVH_WIDTH; lane++)
+            packet_count += (node->child_counts[lane] + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH;
+
+    return packet_count;
+}
@@ -12,6 +12,7 @@
 #include "./shaders/closest_hit/debug.h"
 #include "./shaders/closest_hit/surface.h"
 #include "./shaders/closest_hit/lights.h"
+#include "./wavefront.h"
 #include "./SSB.h"
 #include "../viewport/viewport.h"
 
@@ -51,7 +52,7 @@ void drawBVH(Scene *scene, Viewport *viewport) {
     enum ColorID color;
     u32 *primitive_id;
 
-    for (u8 node_id = 0; node_id < scene->bvh.node_count; node_id++, node++) {
+    for (u32 node_id = 0; node_id < scene->bvh.node_count; node_id++, node++) {
         if (node->child_count) {
             primitive_id = scene->bvh.leaf_ids + node->first_child_id;
             for (u32 i = 0; i < node->child_count; i++, primitive_id++) {
@@ -78,15 +79,13 @@ void drawBVH(Scene *scene, Viewport *viewport) {
     }
 }
 
-INLINE void rayTrace(Ray *ray, Trace *trace, Scene *scene, enum RenderMode mode, FloatPixel *pixel, u16 x, u16 y, vec3 camera_position, quat camera_rotation) {
+INLINE void shadePrimaryHit(Ray *ray, Trace *trace, Scene *scene, enum RenderMode mode, bool hit_found, FloatPixel *pixel, vec3 camera_position, quat camera_rotation) {
     RayHit *hit = &trace->closest_hit;
     vec3 Ro = ray->origin;
     vec3 Rd = ray->direction;
     vec3 color = getVec3Of(0);
 
     bool lights_shaded = false;
-//    bool hit_found = traceRay(ray, trace, scene);
-    bool hit_found = hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids, scene->settings.primitives, false, true, x, y);
     f32 closest_distance = hit_found ? hit->distance : INFINITY;
     f32 z = INFINITY;
     if (hit_found) {
@@ -100,9 +99,9 @@ INLINE void rayTrace(Ray *ray, Trace *trace, Scene *scene, enum RenderMode mode,
                     if (M->texture_count > 1 && M->use & NORMAL_MAP) {
                         vec2 uv = Vec2(hit->uv.u * M->uv_repeat.u, hit->uv.v * M->uv_repeat.v);
                         hit->uv_area /= M->uv_repeat.u / M->uv_repeat.v;
-                        vec2 dUV;
-                        dUV.u = dUV.x = dUVbyRayCone(hit->NdotV, hit->cone_width, hit->area, hit->uv_area);
-                        quat rotation = getNormalRotation(sampleNormal(scene->textures + M->texture_ids[1], uv, dUV));
+                        vec2 major_axis;
+                        vec2 dUV = dUVbyRayConeFootprint(hit, M->uv_repeat, &major_axis);
+                        quat rotation = getNormalRotation(sampleNormal(scene->textures + M->texture_ids[1], uv, dUV, major_axis));
                         hit->normal = mulVec3Quat(hit->normal, rotation);
                     }
 
@@ -121,58 +120,186 @@ INLINE void rayTrace(Ray *ray, Trace *trace, Scene *scene, enum RenderMode mode,
         }
     }
 
-    if (hit_found) {
-        if (mode == RenderMode_Beauty) {
-            color.x = toneMappedBaked(color.x);
-            color.y = toneMappedBaked(color.y);
-            color.z = toneMappedBaked(color.z);
-        }
-        color = scaleVec3(color, FLOAT_TO_COLOR_COMPONENT);
-        color = mulVec3(color, color);
-        setPixel(pixel, color, 1, z);
-    }
+    if (hit_found) shadePixel(pixel, color, z, mode);
 }
 
-void renderSceneOnCPU(Scene *scene, Viewport *viewport) {
-    PixelGrid *frame_buffer = viewport->frame_buffer;
-    FloatPixel* pixel = frame_buffer->float_pixels;
-    Dimensions *dim = &frame_buffer->dimensions;
+INLINE void rayTrace(Ray *ray, Trace *trace, Scene *scene, enum RenderMode mode, bool use_SSB, FloatPixel *pixel, u16 x, u16 y, vec3 camera_position, quat camera_rotation) {
+    bool hit_found = tracePrimaryRay(ray, trace, scene, use_SSB, x, y);
+    shadePrimaryHit(ray, trace, scene, mode, hit_found, pixel, camera_position, camera_rotation);
+}
+
+// Render a rectangular region of the frame in blocks of pixels. When packets are enabled, the primary rays (and the shadow rays
+// from their hits) of each full block are traced as packets. Blocks that are partial, or whose rays diverge, get traced one ray at a time:
+void renderRegion(Scene *scene, Viewport *viewport, Trace *trace, u16 x_start, u16 y_start, u16 x_end, u16 y_end) {
+    Dimensions *dim = &viewport->frame_buffer->dimensions;
 
     quat camera_rotation = viewport->camera->transform.rotation_inverted;
     vec3 camera_position = viewport->camera->transform.position;
-    vec3 start = viewport->projection_plane.start;
     vec3 right = viewport->projection_plane.right;
     vec3 down  = viewport->projection_plane.down;
-    vec3 current = start;
+    f32 cone_angle = viewport->projection_plane.cone_angle;
+
+    enum RenderMode mode = viewport->settings.render_mode;
+    bool use_SSB = viewport->settings.use_SSB;
+    bool use_packets = viewport->settings.use_packets && !use_SSB && trace->packet;
+
+    RayPacket *packet = trace->packet;
+    RayHit primary_hits[RAY_PACKET_SIZE];
+    u32 pretraced_lights[RAY_PACKET_SIZE], shadowed_lights[RAY_PACKET_SIZE], hit_mask, r;
+    vec3 starts[RAY_PACKET_HEIGHT], currents[RAY_PACKET_HEIGHT];
+    vec3 start = scaleAddVec3(down, y_start, scaleAddVec3(right, x_start, viewport->projection_plane.start));
+    FloatPixel *pixel;
 
     Ray ray;
-    ray.origin = camera_position;
+    for (u16 block_y = y_start; block_y < y_end; block_y += RAY_PACKET_HEIGHT) {
+        u16 block_height = y_end - block_y < RAY_PACKET_HEIGHT ? y_end - block_y : RAY_PACKET_HEIGHT;
+        for (u16 row = 0; row < block_height; row++) {
+            currents[row] = starts[row] = start;
+            start = addVec3(start, down);
+        }
 
-    const u16 w = dim->width;
-    const u16 h = dim->height;
-    enum RenderMode mode = viewport->settings.render_mode;
-    Trace *trace = &viewport->trace;
+        for (u16 block_x = x_start; block_x < x_end; block_x += RAY_PACKET_WIDTH) {
+            u16 block_width = x_end - block_x < RAY_PACKET_WIDTH ? x_end - block_x : RAY_PACKET_WIDTH;
+            bool as_packet = use_packets && block_width == RAY_PACKET_WIDTH && block_height == RAY_PACKET_HEIGHT;
+            if (as_packet) {
+                // Step the projection-plane vectors exactly as the ray-by-ray path does, to get bit-identical ray directions:
+                r = 0;
+                for (u16 row = 0; row < RAY_PACKET_HEIGHT; row++) {
+                    vec3 current = currents[row];
+                    for (u16 column = 0; column < RAY_PACKET_WIDTH; column++, r++) {
+                        Ray *packet_ray = packet->rays + r;
+                        packet_ray->origin = camera_position;
+                        packet_ray->direction = normVec3(current);
+                        packet_ray->direction_reciprocal = oneOverVec3(packet_ray->direction);
+                        prePrepRay(packet_ray);
+                        packet->hits[r].cone_angle = cone_angle;
+                        packet->hits[r].cone_width = 0;
+                        current = addVec3(current, right);
+                    }
+                }
+                as_packet = tracePrimaryRayPacket(packet, trace, scene, &hit_mask);
+            }
 
-    for (u16 y = 0; y < h; y++) {
-        for (u16 x = 0; x < w; x++, pixel++) {
-            ray.origin = camera_position;
-            ray.direction = normVec3(current);
-            ray.direction_reciprocal = oneOverVec3(ray.direction);
-            trace->closest_hit.distance = trace->closest_hit.distance_squared = INFINITY;
-            trace->closest_hit.cone_angle = viewport->projection_plane.cone_angle;
-            trace->closest_hit.cone_width = 0;
+            if (as_packet) {
+                for (r = 0; r < RAY_PACKET_SIZE; r++) primary_hits[r] = packet->hits[r];
+                if (mode == RenderMode_Beauty && scene->lights && hit_mask)
+                    traceShadowRayPackets(packet, trace, scene, primary_hits, hit_mask, pretraced_lights, shadowed_lights);
+                else
+                    for (r = 0; r < RAY_PACKET_SIZE; r++) pretraced_lights[r] = shadowed_lights[r] = 0;
+
+                r = 0;
+                for (u16 row = 0; row < RAY_PACKET_HEIGHT; row++) {
+                    pixel = viewport->frame_buffer->float_pixels + dim->width * (block_y + row) + block_x;
+                    for (u16 column = 0; column < RAY_PACKET_WIDTH; column++, r++, pixel++) {
+                        ray.origin = camera_position;
+                        ray.direction = normVec3(currents[row]);
+                        trace->closest_hit = primary_hits[r];
+                        trace->pretraced_lights = pretraced_lights[r];
+                        trace->shadowed_lights = shadowed_lights[r];
+
+                        shadePrimaryHit(&ray, trace, scene, mode, (hit_mask >> r) & 1, pixel, camera_position, camera_rotation);
+
+                        trace->pretraced_lights = 0;
+                        currents[row] = addVec3(currents[row], right);
+                    }
+                }
+                continue;
+            }
+
+            for (u16 row = 0; row < block_height; row++) {
+                u16 y = block_y + row;
+                pixel = viewport->frame_buffer->float_pixels + dim->width * y + block_x;
+                for (u16 x = block_x; x < block_x + block_width; x++, pixel++) {
+                    ray.origin = camera_position;
+                    ray.direction = normVec3(currents[row]);
+                    ray.direction_reciprocal = oneOverVec3(ray.direction);
+                    trace->closest_hit.distance = trace->closest_hit.distance_squared = INFINITY;
+                    trace->closest_hit.cone_angle = cone_angle;
+                    trace->closest_hit.cone_width = 0;
 
-            rayTrace(&ray, trace, scene, mode, pixel, x, y, camera_position, camera_rotation);
+                    rayTrace(&ray, trace, scene, mode, use_SSB, pixel, x, y, camera_position, camera_rotation);
 
-            current = addVec3(current, right);
+                    currents[row] = addVec3(currents[row], right);
+                }
+            }
         }
-        current = start = addVec3(start, down);
     }
 }
 
+INLINE bool useWavefront(Viewport *viewport) {
+    return viewport->settings.use_wavefront && viewport->settings.render_mode == RenderMode_Beauty;
+}
+
+void renderSceneOnCPU(Scene *scene, Viewport *viewport) {
+    Dimensions *dim = &viewport->frame_buffer->dimensions;
+    if (useWavefront(viewport))
+        renderRegionAsWavefront(scene, viewport, &viewport->trace, 0, 0, dim->width, dim->height);
+    else
+        renderRegion(scene, viewport, &viewport->trace, 0, 0, dim->width, dim->height);
+}
+
+typedef struct TileRenderJob {
+    Scene *scene;
+    Viewport *viewport;
+} TileRenderJob;
+
+void renderTile(Scene *scene, Viewport *viewport, Trace *trace, u32 tile_index) {
+    Tiles *tiles = &viewport->tiles;
+    Dimensions *dim = &viewport->frame_buffer->dimensions;
+
+    const u16 x_start = (u16)((tile_index % tiles->columns) * RENDER_TILE_SIZE);
+    const u16 y_start = (u16)((tile_index / tiles->columns) * RENDER_TILE_SIZE);
+    const u16 x_end = x_start + RENDER_TILE_SIZE < dim->width  ? x_start + RENDER_TILE_SIZE : dim->width;
+    const u16 y_end = y_start + RENDER_TILE_SIZE < dim->height ? y_start + RENDER_TILE_SIZE : dim->height;
+    if (useWavefront(viewport))
+        renderRegionAsWavefront(scene, viewport, trace, x_start, y_start, x_end, y_end);
+    else
+        renderRegion(scene, viewport, trace, x_start, y_start, x_end, y_end);
+}
+
+void renderTiles(void *data, u32 thread_index) {
+    TileRenderJob *job = (TileRenderJob*)data;
+    Tiles *tiles = &job->viewport->tiles;
+    Trace *trace = tiles->traces + thread_index;
+    trace->depth = job->viewport->trace.depth;
+    trace->soft_shadows = job->viewport->trace.soft_shadows;
+
+    // Drain this thread's own queue first, then steal whatever is left in the queues of the other threads:
+    TileQueue *queue;
+    u32 tile_index;
+    for (u32 i = 0; i < tiles->thread_count; i++) {
+        queue = tiles->queues + (thread_index + i) % tiles->thread_count;
+        while ((tile_index = atomicFetchAdd(&queue->next, 1)) < queue->end)
+            renderTile(job->scene, job->viewport, trace, tile_index);
+    }
+}
+
+void renderSceneOnCPUInTiles(Scene *scene, Viewport *viewport) {
+    Tiles *tiles = &viewport->tiles;
+    Dimensions *dim = &viewport->frame_buffer->dimensions;
+    tiles->columns = (dim->width  + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    tiles->rows    = (dim->height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    tiles->count   = tiles->columns * tiles->rows;
+
+    // Each thread starts off with a contiguous band of tiles of its own:
+    TileQueue *queue = tiles->queues;
+    for (u32 i = 0; i < tiles->thread_count; i++, queue++) {
+        queue->next = tiles->count * i / tiles->thread_count;
+        queue->end  = tiles->count * (i + 1) / tiles->thread_count;
+    }
+
+    TileRenderJob job;
+    job.scene = scene;
+    job.viewport = viewport;
+    if (tiles->thread_count > 1)
+        app->platform.runParallelJob(renderTiles, &job, tiles->thread_count);
+    else
+        renderTiles(&job, 0);
+}
+
 #ifdef __CUDACC__
 
-__global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode, vec3 camera_position, quat camera_rotation, Trace trace,
+__global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode, bool use_SSB, vec3 camera_position, quat camera_rotation, Trace trace,
                          u16 width,
                          u32 pixel_count,
 
@@ -182,12 +309,14 @@ __global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode,
                          BVHNode    *mesh_bvh_nodes,
                          Mesh       *meshes,
                          Triangle   *mesh_triangles,
+                         TriangleShading *mesh_triangle_shading,
                          Light *lights,
                          AreaLight  *area_lights,
+                         EmissiveQuad *emissive_quads,
                          Material   *materials,
                          Texture *textures,
                          TextureMip *texture_mips,
-                         TexelQuad *texel_quads,
+                         u8 *texel_data,
                          Primitive  *primitives,
 
                          u32       *mesh_bvh_leaf_ids,
@@ -212,6 +341,7 @@ __global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode,
 
     scene.lights = lights;
     scene.area_lights  = area_lights;
+    scene.emissive_quads = emissive_quads;
     scene.materials    = materials;
     scene.textures     = textures;
     scene.primitives   = primitives;
@@ -219,9 +349,9 @@ __global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode,
     scene.bvh.nodes    = scene_bvh_nodes;
     scene.bvh.leaf_ids = scene_bvh_leaf_ids;
 
-    u32 scene_stack[6], mesh_stack[5];
-    trace.mesh_stack  = mesh_stack;
-    trace.scene_stack = scene_stack;
+    extern __shared__ u32 d_trace_stacks[];
+    trace.scene_stack = d_trace_stacks + threadIdx.x * (trace.scene_stack_size + trace.mesh_stack_size);
+    trace.mesh_stack  = trace.scene_stack + trace.scene_stack_size;
 
     Mesh *mesh = meshes;
     u32 nodes_offset = 0;
@@ -229,21 +359,22 @@ __global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode,
     for (u32 m = 0; m < scene.settings.meshes; m++, mesh++) {
         mesh->bvh.node_count = mesh_bvh_node_counts[m];
         mesh->triangles      = mesh_triangles + triangles_offset;
+        mesh->triangle_shading = mesh_triangle_shading + triangles_offset;
         mesh->bvh.leaf_ids   = mesh_bvh_leaf_ids + triangles_offset;
         mesh->bvh.nodes      = mesh_bvh_nodes + nodes_offset;
 
         nodes_offset        += mesh->bvh.node_count;
-        triangles_offset    += mesh->triangle_count;
+        triangles_offset    += mesh->triangle_reference_count;
     }
 
     TextureMip *mip = texture_mips;
-    TexelQuad *quads = texel_quads;
+    u8 *data = texel_data;
     Texture *texture = textures;
     for (u32 t = 0; t < scene.settings.textures; t++, texture++) {
         texture->mips = mip;
         for (u32 m = 0; m < texture->mip_count; m++, mip++) {
-            mip->texel_quads = quads;
-            quads += mip->width * mip->height;
+            mip->texel_data = data;
+            data += getTextureMipDataSize(texture->format, mip->width, mip->height, texture->tiled);
         }
     }
 
@@ -252,13 +383,27 @@ __global__ void d_render(ProjectionPlane projection_plane, enum RenderMode mode,
     trace.closest_hit.cone_angle = projection_plane.cone_angle;
     trace.closest_hit.cone_width = 0;
 
-    rayTrace(&ray, &trace, &scene, mode, pixel, x, y, camera_position, camera_rotation);
+    rayTrace(&ray, &trace, &scene, mode, use_SSB, pixel, x, y, camera_position, camera_rotation);
 }
 
 void renderSceneOnGPU(Scene *scene, Viewport *viewport) {
     Dimensions *dim = &viewport->frame_buffer->dimensions;
     u32 pixel_count = dim->width_times_height;
-    u32 threads = 256;
+
+    // Size the traversal stacks by the heights of the BVHs (a traversal stacks up at most one inner node per level below
+    // the root), and fit as many threads in a block as their stacks allow for:
+    Trace trace = viewport->trace;
+    trace.scene_stack_size = scene->bvh.height;
+    trace.mesh_stack_size = 0;
+    for (u32 m = 0; m < scene->settings.meshes; m++)
+        if (scene->meshes[m].bvh.height > trace.mesh_stack_size)
+            trace.mesh_stack_size = scene->meshes[m].bvh.height;
+
+    u32 stacks_size = sizeof(u32) * (trace.scene_stack_size + trace.mesh_stack_size);
+    u32 threads = GPU_MAX_THREADS_PER_BLOCK;
+    while (threads > GPU_MIN_THREADS_PER_BLOCK && threads * stacks_size > GPU_MAX_STACKS_MEMORY_SIZE)
+        threads >>= 1;
+
     u32 blocks  = pixel_count / threads;
     if (pixel_count < threads) {
         threads = pixel_count;
@@ -266,12 +411,13 @@ void renderSceneOnGPU(Scene *scene, Viewport *viewport) {
     } else if (pixel_count % threads)
         blocks++;
 
-    d_render<<<blocks, threads>>>(
+    d_render<<<blocks, threads, threads * stacks_size>>>(
             viewport->projection_plane,
             viewport->settings.render_mode,
+            viewport->settings.use_SSB,
             viewport->camera->transform.position,
             viewport->camera->transform.rotation_inverted,
-            viewport->trace,
+            trace,
 
             dim->width,
             pixel_count,
@@ -282,12 +428,14 @@ void renderSceneOnGPU(Scene *scene, Viewport *viewport) {
             d_mesh_bvh_nodes,
             d_meshes,
             d_triangles,
+            d_triangle_shading,
             d_lights,
             d_area_lights,
+            d_emissive_quads,
             d_materials,
             d_textures,
             d_texture_mips,
-            d_texel_quads,
+            d_texel_data,
             d_primitives,
 
             d_mesh_bvh_leaf_ids,
@@ -299,11 +447,43 @@ void renderSceneOnGPU(Scene *scene, Viewport *viewport) {
 }
 #endif
 
+void resetTraceStats(Viewport *viewport) {
+    TraceStats empty = {0};
+    viewport->trace.stats = empty;
+    for (u32 i = 0; i < viewport->tiles.thread_count; i++)
+        viewport->tiles.traces[i].stats = empty;
+}
+
+TraceStats getTraceStats(Viewport *viewport) {
+    TraceStats stats = viewport->trace.stats;
+    TraceStats *thread_stats;
+    for (u32 i = 0; i < viewport->tiles.thread_count; i++) {
+        thread_stats = &viewport->tiles.traces[i].stats;
+        stats.primary_rays            += thread_stats->primary_rays;
+        stats.secondary_rays          += thread_stats->secondary_rays;
+        stats.shadow_rays             += thread_stats->shadow_rays;
+        stats.primitive_tests         += thread_stats->primitive_tests;
+        stats.primary_primitive_tests += thread_stats->primary_primitive_tests;
+        stats.shaded_hits             += thread_stats->shaded_hits;
+        stats.shading_switches        += thread_stats->shading_switches;
+    }
+
+    return stats;
+}
+
+// The fraction of shaded hits that were shaded right after a hit of the same material:
+INLINE f32 getShadingCoherence(TraceStats *stats) {
+    return stats->shaded_hits ? 1.0f - (f32)stats->shading_switches / (f32)stats->shaded_hits : 1.0f;
+}
+
 void renderScene(Scene *scene, Viewport *viewport) {
+    resetTraceStats(viewport);
 #ifdef __CUDACC__
     if (viewport->settings.use_GPU) renderSceneOnGPU(scene, viewport);
-    else                            renderSceneOnCPU(scene, viewport);
-#else
-        renderSceneOnCPU(scene, viewport);
+    else
 #endif
+    if (viewport->settings.use_threads) renderSceneOnCPUInTiles(scene, viewport);
+    else                                renderSceneOnCPU(scene, viewport);
+
+    viewport->stats = getTraceStats(viewport);
 }
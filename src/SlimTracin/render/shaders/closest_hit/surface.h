@@ -8,8 +8,10 @@
 
 INLINE vec3 shadeFromLights(Shaded *shaded, Ray *ray, Trace *trace, Scene *scene, vec3 color) {
     RayHit *hit = &trace->closest_hit;
+    RayHit closest_hit = *hit;
     Light *light = scene->lights;
     f32 light_intensity, NdotL;
+    bool in_shadow;
     for (u32 i = 0; i < scene->settings.lights; i++, light++) {
         hit->position = light->position_or_direction;
         shaded->light_direction = subVec3(hit->position, shaded->position);
@@ -25,54 +27,61 @@ INLINE vec3 shadeFromLights(Shaded *shaded, Ray *ray, Trace *trace, Scene *scene
 
         ray->origin    = shaded->position;
         ray->direction = shaded->light_direction;
-        if (inShadow(ray, trace, scene))
+        if (i < MAX_PRETRACED_LIGHTS && trace->pretraced_lights & (1u << i))
+            in_shadow = (trace->shadowed_lights >> i) & 1;
+        else
+            in_shadow = inShadow(ray, trace, scene);
+        if (in_shadow)
             continue;
 
         color = mulAddVec3(shadePointOnSurface(shaded, NdotL), scaleVec3(light->color, light_intensity), color);
     }
 
+    // Shadow rays that were traced as packets only apply to the primary hit, not to any bounce off of it:
+    trace->pretraced_lights = 0;
+    *hit = closest_hit;
+
     return color;
 }
 
 INLINE bool shadeFromEmissiveQuads(Shaded *shaded, Ray *ray, Trace *trace, Scene *scene, vec3 *color) {
     RayHit *hit = &trace->current_hit;
-    Primitive *quad = scene->primitives;
+    EmissiveQuad *emissive_quad = scene->emissive_quads;
+    Primitive *quad;
     Material *emissive_material;
     vec3 emissive_quad_normal;
     vec3 *Rd = &trace->local_space_ray.direction;
     vec3 *Ro = &trace->local_space_ray.origin;
+    RayHit closest_hit = trace->closest_hit;
     bool found = false;
 
-    for (u32 i = 0; i < scene->settings.primitives; i++, quad++) {
-        emissive_material = scene->materials + quad->material_id;
-        if (quad->type != PrimitiveType_Quad || !(emissive_material->is & EMISSIVE))
-            continue;
+    for (u32 i = 0; i < scene->emissive_quad_count; i++, emissive_quad++) {
+        quad = scene->primitives + emissive_quad->primitive_id;
+        emissive_material = scene->materials + emissive_quad->material_id;
 
         convertPositionAndDirectionToObjectSpace(shaded->viewing_origin, shaded->viewing_direction, quad, Ro, Rd);
         if (hitQuad(hit, Ro, Rd, quad->flags)) {
             hit->position = convertPositionToWorldSpace(hit->position, quad);
             hit->distance_squared = squaredLengthVec3(subVec3(hit->position, shaded->viewing_origin));
-            if (hit->distance_squared < trace->closest_hit.distance_squared) {
-                hit->object_id = i;
+            if (hit->distance_squared < closest_hit.distance_squared) {
+                hit->object_id = emissive_quad->primitive_id;
                 hit->object_type = PrimitiveType_Quad;
                 hit->material_id = quad->material_id;
-                trace->closest_hit = *hit;
+                closest_hit = *hit;
                 found = true;
             }
         }
 
-        emissive_quad_normal.x = emissive_quad_normal.z = 0;
-        emissive_quad_normal.y = 1;
-        emissive_quad_normal = mulVec3Quat(emissive_quad_normal, quad->rotation);
-        shaded->light_direction = ray->direction = subVec3(quad->position, shaded->position);
+        emissive_quad_normal = emissive_quad->normal;
+        shaded->light_direction = ray->direction = subVec3(emissive_quad->position, shaded->position);
         if (dotVec3(emissive_quad_normal, shaded->light_direction) >= 0)
             continue;
 
-        f32 emission_intensity = dotVec3(shaded->normal, getAreaLightVector(quad, shaded->position, shaded->emissive_quad_vertices));
+        f32 emission_intensity = dotVec3(shaded->normal, getAreaLightVector(emissive_quad, shaded->position));
         if (emission_intensity > 0) {
             bool skip = true;
             for (u8 j = 0; j < 4; j++) {
-                if (dotVec3(shaded->normal, subVec3(shaded->emissive_quad_vertices[j], shaded->position)) >= 0) {
+                if (dotVec3(shaded->normal, subVec3(emissive_quad->vertices[j], shaded->position)) >= 0) {
                     skip = false;
                     break;
                 }
@@ -80,23 +89,28 @@ INLINE bool shadeFromEmissiveQuads(Shaded *shaded, Ray *ray, Trace *trace, Scene
             if (skip)
                 continue;
 
+            trace->stats.shadow_rays++;
             f32 shaded_light = 1;
-            Primitive *shadowing_primitive = scene->primitives;
-            for (u32 s = 0; s < scene->settings.primitives; s++, shadowing_primitive++) {
-                if (quad == shaded->primitive ||
-                    quad == shadowing_primitive ||
-                    dotVec3(emissive_quad_normal, subVec3(shadowing_primitive->position, quad->position)) <= 0)
-                    continue;
-
-                convertPositionAndDirectionToObjectSpace(shaded->position, shaded->light_direction, shadowing_primitive, Ro, Rd);
-                *Ro = scaleAddVec3(*Rd, TRACE_OFFSET, *Ro);
-
-                f32 d = 1;
-                if (shadowing_primitive->type == PrimitiveType_Sphere) {
-                    if (hitSphere(hit, Ro, Rd, shadowing_primitive->flags))
-                        d -= (1.0f - sqrtf(hit->distance_squared)) / (hit->distance * emission_intensity * 3);
-                } else if (shadowing_primitive->type == PrimitiveType_Quad) {
-                    if (hitQuad(hit, Ro, Rd, shadowing_primitive->flags)) {
+            f32 light_distance = lengthVec3(shaded->light_direction);
+            ray->origin = shaded->position;
+            ray->direction = scaleVec3(shaded->light_direction, 1.0f / light_distance);
+            trace->closest_hit.distance = light_distance - TRACE_OFFSET;
+            trace->closest_hit.distance_squared = trace->closest_hit.distance * trace->closest_hit.distance;
+            if (traceScene(ray, trace, scene, !trace->soft_shadows, true)) {
+                shaded_light = 0;
+
+                // Soften the shadow by how close the light ray passes to the edge of the closest occluder:
+                Primitive *shadowing_primitive = scene->primitives + trace->closest_hit.object_id;
+                if (trace->soft_shadows && (shadowing_primitive->type == PrimitiveType_Sphere ||
+                                            shadowing_primitive->type == PrimitiveType_Quad)) {
+                    convertPositionAndDirectionToObjectSpace(shaded->position, shaded->light_direction, shadowing_primitive, Ro, Rd);
+                    *Ro = scaleAddVec3(*Rd, TRACE_OFFSET, *Ro);
+
+                    f32 d = 1;
+                    if (shadowing_primitive->type == PrimitiveType_Sphere) {
+                        if (hitSphere(hit, Ro, Rd, shadowing_primitive->flags))
+                            d -= (1.0f - sqrtf(hit->distance_squared)) / (hit->distance * emission_intensity * 3);
+                    } else if (hitQuad(hit, Ro, Rd, shadowing_primitive->flags)) {
                         hit->position.y = 0;
                         hit->position.x = hit->position.x < 0 ? -hit->position.x : hit->position.x;
                         hit->position.z = hit->position.z < 0 ? -hit->position.z : hit->position.z;
@@ -108,9 +122,8 @@ INLINE bool shadeFromEmissiveQuads(Shaded *shaded, Ray *ray, Trace *trace, Scene
                         }
                         d -= (1.0f - hit->position.z) / (hit->distance * emission_intensity);
                     }
-                }
-                if (d < shaded_light)
                     shaded_light = d;
+                }
             }
             if (shaded_light > 0) {
                 f32 NdotL = DotVec3(shaded->normal, shaded->light_direction);
@@ -123,13 +136,14 @@ INLINE bool shadeFromEmissiveQuads(Shaded *shaded, Ray *ray, Trace *trace, Scene
     }
 
     if (found)
-        trace->closest_hit.distance = sqrtf(trace->closest_hit.distance_squared);
+        closest_hit.distance = sqrtf(closest_hit.distance_squared);
+    trace->closest_hit = closest_hit;
 
     return found;
 }
 
-INLINE vec3 sampleNormal(Texture *texture, vec2 uv, vec2 dUV) {
-    vec3 normal = sampleTexture(texture, uv, dUV).v3;
+INLINE vec3 sampleNormal(Texture *texture, vec2 uv, vec2 dUV, vec2 major_axis) {
+    vec3 normal = sampleTexture(texture, uv, dUV, major_axis).v3;
     f32 y = normal.z;
     normal.z = normal.y;
     normal.y = y;
@@ -143,40 +157,56 @@ INLINE quat getNormalRotation(vec3 normal) {
     q.amount = normal.y * 0.25f;
     return normQuat(q);
 }
+INLINE void setShadedMaterial(Shaded *shaded, RayHit *hit, Scene *scene) {
+    Material *M = shaded->material = scene->materials + hit->material_id;
+    shaded->primitive = scene->primitives + hit->object_id;
+    shaded->albedo = M->albedo;
+    if (M->use && M->texture_count) {
+        vec2 dUV, major_axis;
+        shaded->uv = Vec2(hit->uv.u * M->uv_repeat.u, hit->uv.v * M->uv_repeat.v);
+        hit->uv_area /= M->uv_repeat.u / M->uv_repeat.v;
+        dUV = dUVbyRayConeFootprint(hit, M->uv_repeat, &major_axis);
+        if (M->use & ALBEDO_MAP) shaded->albedo = sampleTexture(scene->textures + M->texture_ids[0], shaded->uv, dUV, major_axis).v3;
+        if (M->use & NORMAL_MAP && M->texture_count > 1) {
+            quat rotation = getNormalRotation(sampleNormal(scene->textures + M->texture_ids[1], shaded->uv, dUV, major_axis));
+            hit->normal = mulVec3Quat(hit->normal, rotation);
+        }
+    }
+}
+INLINE vec3 getBounceDirection(Shaded *shaded, f32 ior, f32 NdotRd) {
+    if (shaded->material->is & REFLECTIVE)
+        return shaded->reflected_direction;
+
+    vec3 direction = refract(shaded->viewing_direction, shaded->normal, ior, NdotRd);
+    if (direction.x == 0 &&
+        direction.y == 0 &&
+        direction.z == 0)
+        direction = shaded->reflected_direction;
+
+    return direction;
+}
+// Shading coherence is measured by how often consecutively shaded hits switch from one material to another:
+INLINE void countShadedHit(Trace *trace, u32 material_id) {
+    trace->stats.shaded_hits++;
+    if (material_id != trace->shaded_material_id) {
+        trace->shaded_material_id = material_id;
+        trace->stats.shading_switches++;
+    }
+}
 INLINE vec3 shadeSurface(Ray *ray, Trace *trace, Scene *scene, bool *lights_shaded) {
     RayHit *hit = &trace->closest_hit;
     vec3 color = getVec3Of(0);
+    countShadedHit(trace, hit->material_id);
     Material *M = scene->materials  + hit->material_id;
     if (M->is & EMISSIVE) return hit->from_behind ? color : M->emission;
 
-    vec2 dUV;
     Shaded shaded;
     shaded.viewing_origin    = ray->origin;
     shaded.viewing_direction = ray->direction;
-    shaded.primitive = scene->primitives + hit->object_id;
-    shaded.material = M;
-    shaded.albedo = shaded.material->albedo;
-    if (M->use && M->texture_count) {
-        shaded.uv = Vec2(hit->uv.u * M->uv_repeat.u, hit->uv.v * M->uv_repeat.v);
-        hit->uv_area /= M->uv_repeat.u / M->uv_repeat.v;
-        dUV.u = dUV.v = dUVbyRayCone(hit->NdotV, hit->cone_width, hit->area, hit->uv_area);
-        if (M->use & ALBEDO_MAP) shaded.albedo = sampleTexture(scene->textures + M->texture_ids[0], shaded.uv, dUV).v3;
-        if (M->use & NORMAL_MAP && M->texture_count > 1) {
-            quat rotation = getNormalRotation(sampleNormal(scene->textures + M->texture_ids[1], shaded.uv, dUV));
-            hit->normal = mulVec3Quat(hit->normal, rotation);
-        }
-    }
+    setShadedMaterial(&shaded, hit, scene);
 
     f32 NdotRd, ior, max_distance = hit->distance;
 
-    bool scene_has_emissive_quads = false;
-    for (u32 i = 0; i < scene->settings.primitives; i++)
-        if (scene->primitives[i].type == PrimitiveType_Quad &&
-            scene->materials[scene->primitives[i].material_id].is & EMISSIVE) {
-            scene_has_emissive_quads = true;
-            break;
-        }
-
     vec3 current_color, throughput = getVec3Of(1);
     u32 depth = trace->depth;
     while (depth) {
@@ -194,7 +224,7 @@ INLINE vec3 shadeSurface(Ray *ray, Trace *trace, Scene *scene, bool *lights_shad
         if (scene->lights)
             current_color = shadeFromLights(&shaded, ray, trace, scene, current_color);
 
-        if (scene_has_emissive_quads) {
+        if (scene->emissive_quad_count) {
             if (shadeFromEmissiveQuads(&shaded, ray, trace, scene, &current_color))
                 max_distance = hit->distance;
         }
@@ -211,30 +241,11 @@ INLINE vec3 shadeSurface(Ray *ray, Trace *trace, Scene *scene, bool *lights_shad
             *lights_shaded = true;
 
         if (is_ref && --depth) {
-            if (M->is & REFLECTIVE) {
-                ray->direction = shaded.reflected_direction;
-            } else {
-                ray->direction = refract(shaded.viewing_direction, shaded.normal, ior, NdotRd);
-                if (ray->direction.x == 0 &&
-                    ray->direction.y == 0 &&
-                    ray->direction.z == 0)
-                    ray->direction = shaded.reflected_direction;
-            }
+            ray->direction = getBounceDirection(&shaded, ior, NdotRd);
             if (traceRay(ray, trace, scene)) {
-                shaded.primitive = scene->primitives + hit->object_id;
-                shaded.material = M = scene->materials + hit->material_id;
-                shaded.albedo = M->albedo;
-                if (M->use && M->texture_count) {
-                    shaded.uv = Vec2(hit->uv.u * M->uv_repeat.u, hit->uv.v * M->uv_repeat.v);
-                    hit->uv_area /= M->uv_repeat.u / M->uv_repeat.v;
-                    dUV.u = dUV.x = dUVbyRayCone(hit->NdotV, hit->cone_width, hit->area, hit->uv_area);
-                    if (M->use & ALBEDO_MAP) shaded.albedo = sampleTexture(scene->textures + M->texture_ids[0], shaded.uv, dUV).v3;
-                    if (M->use & NORMAL_MAP && M->texture_count > 1) {
-                        quat rotation = getNormalRotation(sampleNormal(scene->textures + M->texture_ids[1], shaded.uv, dUV));
-                        hit->normal = mulVec3Quat(hit->normal, rotation);
-                    }
-                }
-
+                countShadedHit(trace, hit->material_id);
+                setShadedMaterial(&shaded, hit, scene);
+                M = shaded.material;
                 if (hit->object_type == PrimitiveType_Quad && M->is & EMISSIVE) {
                     color = hit->from_behind ? getVec3Of(0) : M->emission;
                     break;
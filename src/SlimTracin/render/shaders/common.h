@@ -93,6 +93,16 @@ INLINE f32 toneMappedBaked(f32 LinearColor) {
     f32 x2_times_sholder_strength = x * x * 6.2f;
     return (x2_times_sholder_strength + x*0.5f)/(x2_times_sholder_strength + x*1.7f + 0.06f);
 }
+INLINE void shadePixel(FloatPixel *pixel, vec3 color, f32 z, enum RenderMode mode) {
+    if (mode == RenderMode_Beauty) {
+        color.x = toneMappedBaked(color.x);
+        color.y = toneMappedBaked(color.y);
+        color.z = toneMappedBaked(color.z);
+    }
+    color = scaleVec3(color, FLOAT_TO_COLOR_COMPONENT);
+    color = mulVec3(color, color);
+    setPixel(pixel, color, 1, z);
+}
 
 INLINE f32 invDotVec3(vec3 a, vec3 b) {
     return clampValue(-dotVec3(a, b));
@@ -194,22 +204,11 @@ INLINE bool hitPlane(vec3 plane_origin, vec3 plane_normal, vec3 *ray_origin, vec
     return true;
 }
 
-INLINE vec3 getAreaLightVector(Primitive *primitive, vec3 P, vec3 *v) {
-    if (primitive->scale.x == 0 ||
-        primitive->scale.z == 0)
+INLINE vec3 getAreaLightVector(EmissiveQuad *quad, vec3 P) {
+    if (quad->area == 0)
         return getVec3Of(0);
 
-    vec3 U = getVec3Of(0);
-    vec3 V = getVec3Of(0);
-    U.x = primitive->scale.x; if (U.x < 0) U.x = -U.x;
-    V.z = primitive->scale.z; if (V.z < 0) V.z = -V.z;
-    U = mulVec3Quat(U, primitive->rotation);
-    V = mulVec3Quat(V, primitive->rotation);
-
-    v[0] = subVec3(subVec3(primitive->position, U), V);
-    v[1] = subVec3(addVec3(primitive->position, U), V);
-    v[2] = addVec3(addVec3(primitive->position, U), V);
-    v[3] = addVec3(subVec3(primitive->position, U), V);
+    vec3 *v = quad->vertices;
     vec3 u1n = normVec3(subVec3(v[0], P));
     vec3 u2n = normVec3(subVec3(v[1], P));
     vec3 u3n = normVec3(subVec3(v[2], P));
@@ -336,4 +335,19 @@ INLINE vec3 shadePointOnSurface(Shaded *shaded, f32 NdotL) {
 INLINE f32 dUVbyRayCone(f32 NdotV, f32 cone_width, f32 area, f32 uv_area) {
     f32 projected_cone_width = cone_width / fabsf(NdotV);
     return sqrtf((projected_cone_width * projected_cone_width) * (uv_area / area));
+}
+
+// The projected width of a ray cone spans the major axis of its footprint. When the UV direction of that axis is known,
+// the footprint is returned as its (unprojected) width across it, along with the major axis itself:
+INLINE vec2 dUVbyRayConeFootprint(RayHit *hit, vec2 uv_repeat, vec2 *major_axis) {
+    f32 width = dUVbyRayCone(hit->NdotV, hit->cone_width, hit->area, hit->uv_area);
+    vec2 axis = mulVec2(hit->uv_axis, uv_repeat);
+    f32 axis_length = lengthVec2(axis);
+    if (axis_length > 0) {
+        *major_axis = scaleVec2(axis, width / axis_length);
+        width *= fabsf(hit->NdotV);
+    } else
+        *major_axis = getVec2Of(0);
+
+    return getVec2Of(width);
 }
\ No newline at end of file
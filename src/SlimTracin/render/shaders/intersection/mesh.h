@@ -23,8 +23,6 @@ INLINE bool hitTriangles(Ray *ray, RayHit *hit, RayHit *closest_hit, Triangle *t
             closest_hit->from_behind = hit->from_behind;
             closest_hit->distance = hit->distance;
             closest_hit->position = hit->position;
-            closest_hit->area = triangle->area_of_parallelogram;
-            closest_hit->uv_area = triangle->area_of_uv;
 
             found_triangle = true;
 
@@ -35,7 +33,162 @@ INLINE bool hitTriangles(Ray *ray, RayHit *hit, RayHit *closest_hit, Triangle *t
 
     return found_triangle;
 }
+// Same plane-then-tangent-space test as hitTriangles, for all the triangles of a packet at once:
+INLINE bool hitTrianglePacket(Ray *ray, RayHit *closest_hit, TrianglePacket *packet, bool any_hit) {
+    f32 distances[TRIANGLE_PACKET_WIDTH], u[TRIANGLE_PACKET_WIDTH], v[TRIANGLE_PACKET_WIDTH], NdotV[TRIANGLE_PACKET_WIDTH];
+    u32 hits, from_behind;
+#ifdef SIMD_SSE
+    __m128 sign = _mm_set1_ps(-0.0f), zero = _mm_setzero_ps();
+    __m128 Ox = _mm_set1_ps(ray->origin.x),    Oy = _mm_set1_ps(ray->origin.y),    Oz = _mm_set1_ps(ray->origin.z);
+    __m128 Dx = _mm_set1_ps(ray->direction.x), Dy = _mm_set1_ps(ray->direction.y), Dz = _mm_set1_ps(ray->direction.z);
+    __m128 Nx = _mm_loadu_ps(packet->normal[0]), Ny = _mm_loadu_ps(packet->normal[1]), Nz = _mm_loadu_ps(packet->normal[2]);
+    __m128 Px = _mm_loadu_ps(packet->position[0]), Py = _mm_loadu_ps(packet->position[1]), Pz = _mm_loadu_ps(packet->position[2]);
+
+    __m128 NdotD = _mm_xor_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Dx, Nx), _mm_mul_ps(Dy, Ny)), _mm_mul_ps(Dz, Nz)), sign);
+    __m128 RPx = _mm_sub_ps(Px, Ox), RPy = _mm_sub_ps(Py, Oy), RPz = _mm_sub_ps(Pz, Oz);
+    __m128 RPdotN = _mm_add_ps(_mm_add_ps(_mm_mul_ps(RPx, Nx), _mm_mul_ps(RPy, Ny)), _mm_mul_ps(RPz, Nz));
+    __m128 behind = _mm_cmpgt_ps(RPdotN, zero);
+    __m128 valid = _mm_and_ps(_mm_cmpneq_ps(NdotD, zero), _mm_xor_ps(_mm_cmpgt_ps(NdotD, zero), behind));
+    __m128 t = _mm_andnot_ps(sign, _mm_div_ps(RPdotN, NdotD));
+    valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_set1_ps(closest_hit->distance)));
+
+    __m128 Hx = _mm_sub_ps(_mm_add_ps(Ox, _mm_mul_ps(Dx, t)), Px);
+    __m128 Hy = _mm_sub_ps(_mm_add_ps(Oy, _mm_mul_ps(Dy, t)), Py);
+    __m128 Hz = _mm_sub_ps(_mm_add_ps(Oz, _mm_mul_ps(Dz, t)), Pz);
+    __m128 U = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Hx, _mm_loadu_ps(packet->world_to_tangent[0])),
+                                     _mm_mul_ps(Hy, _mm_loadu_ps(packet->world_to_tangent[3]))),
+                                     _mm_mul_ps(Hz, _mm_loadu_ps(packet->world_to_tangent[6])));
+    __m128 V = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Hx, _mm_loadu_ps(packet->world_to_tangent[1])),
+                                     _mm_mul_ps(Hy, _mm_loadu_ps(packet->world_to_tangent[4]))),
+                                     _mm_mul_ps(Hz, _mm_loadu_ps(packet->world_to_tangent[7])));
+    valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(U, zero), _mm_cmpge_ps(V, zero)));
+    valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(U, V), _mm_set1_ps(1)));
+
+    hits = (u32)_mm_movemask_ps(valid);
+    if (!hits)
+        return false;
+
+    from_behind = (u32)_mm_movemask_ps(behind);
+    _mm_storeu_ps(distances, t);
+    _mm_storeu_ps(NdotV, NdotD);
+    _mm_storeu_ps(u, U);
+    _mm_storeu_ps(v, V);
+#else
+    vec3 N, RP, H;
+    f32 RPdotN;
+    hits = from_behind = 0;
+    for (u8 i = 0; i < TRIANGLE_PACKET_WIDTH; i++) {
+        N = Vec3(packet->normal[0][i], packet->normal[1][i], packet->normal[2][i]);
+        NdotV[i] = -dotVec3(ray->direction, N);
+        if (NdotV[i] == 0)
+            continue;
+
+        RP = subVec3(Vec3(packet->position[0][i], packet->position[1][i], packet->position[2][i]), ray->origin);
+        RPdotN = dotVec3(RP, N);
+        if (RPdotN > 0) from_behind |= 1 << i;
+        if ((RPdotN > 0) == (NdotV[i] > 0))
+            continue;
+
+        distances[i] = fabsf(RPdotN / NdotV[i]);
+        if (distances[i] >= closest_hit->distance)
+            continue;
+
+        H = subVec3(addVec3(ray->origin, scaleVec3(ray->direction, distances[i])), Vec3(packet->position[0][i], packet->position[1][i], packet->position[2][i]));
+        u[i] = H.x * packet->world_to_tangent[0][i] + H.y * packet->world_to_tangent[3][i] + H.z * packet->world_to_tangent[6][i];
+        v[i] = H.x * packet->world_to_tangent[1][i] + H.y * packet->world_to_tangent[4][i] + H.z * packet->world_to_tangent[7][i];
+        if (u[i] < 0 || v[i] < 0 || (u[i] + v[i]) > 1)
+            continue;
+
+        hits |= 1 << i;
+    }
+    if (!hits)
+        return false;
+#endif
+    u8 nearest = TRIANGLE_PACKET_WIDTH;
+    for (u8 i = 0; i < TRIANGLE_PACKET_WIDTH; i++) {
+        if (!(hits & (1 << i)) || (nearest != TRIANGLE_PACKET_WIDTH && distances[i] >= distances[nearest]))
+            continue;
+
+        nearest = i;
+        if (any_hit)
+            break;
+    }
+
+    closest_hit->NdotV = NdotV[nearest];
+    closest_hit->normal = Vec3(packet->normal[0][nearest], packet->normal[1][nearest], packet->normal[2][nearest]);
+    closest_hit->uv.x = u[nearest];
+    closest_hit->uv.y = v[nearest];
+    closest_hit->object_id = packet->first_triangle_id + nearest;
+    closest_hit->from_behind = (from_behind >> nearest) & 1;
+    closest_hit->distance = distances[nearest];
+    closest_hit->position = addVec3(ray->origin, scaleVec3(ray->direction, distances[nearest]));
+
+    return true;
+}
+
+INLINE bool traceMeshWide(Trace *trace, Mesh *mesh, bool any_hit) {
+    Ray *ray = &trace->local_space_ray;
+    RayHit *closest_hit = &trace->closest_mesh_hit;
+    TrianglePacket *packet;
+    u32 *stack = trace->mesh_stack;
+    u32 stack_size = 0, hit_count, next_node_id;
+    f32 distances[WIDE_BVH_WIDTH];
+    u8 order[WIDE_BVH_WIDTH], lane;
+    bool found = false;
+
+    WideBVHNode *node = mesh->wide_bvh.nodes;
+    while (true) {
+        hit_count = sortWideBVHNodeHits(hitWideBVHNode(node, ray, closest_hit->distance, distances), distances, order);
+
+        // Leaves get tested nearest first, then inner children are pushed farthest first so that the nearest one is visited next:
+        for (u32 i = 0; i < hit_count; i++) {
+            lane = order[i];
+            if (!node->child_counts[lane])
+                continue;
+
+            packet = mesh->triangle_packets + node->child_ids[lane];
+            for (u32 remaining = node->child_counts[lane]; remaining; remaining -= packet->triangle_count, packet++) {
+                if (hitTrianglePacket(ray, closest_hit, packet, any_hit)) {
+                    found = true;
+                    if (any_hit)
+                        return true;
+                }
+            }
+        }
+
+        next_node_id = 0;
+        for (u32 i = hit_count; i-- > 0;) {
+            lane = order[i];
+            if (node->child_counts[lane] || distances[lane] > closest_hit->distance)
+                continue;
+
+            if (next_node_id) {
+                stack[stack_size++] = next_node_id;
+                if (stack_size == trace->mesh_stack_size)
+                    return found;
+            }
+            next_node_id = node->child_ids[lane];
+        }
+
+        if (next_node_id) {
+            node = mesh->wide_bvh.nodes + next_node_id;
+        } else {
+            if (stack_size == 0) break;
+            node = mesh->wide_bvh.nodes + stack[--stack_size];
+        }
+    }
+
+    return found;
+}
+
 INLINE bool traceMesh(Trace *trace, Mesh *mesh, bool any_hit) {
+#ifndef __CUDA_ARCH__
+    if (mesh->wide_bvh.node_count)
+        return traceMeshWide(trace, mesh, any_hit);
+#endif
+    if (!mesh->bvh.node_count) // An empty mesh (its file failed to load)
+        return false;
+
     Ray *ray = &trace->local_space_ray;
     RayHit *closest_hit = &trace->closest_mesh_hit;
     RayHit *hit = &trace->current_hit;
@@ -48,7 +201,7 @@ INLINE bool traceMesh(Trace *trace, Mesh *mesh, bool any_hit) {
         return false;
 
     if (unlikely(mesh->bvh.nodes->child_count))
-        return hitTriangles(ray, hit, closest_hit, mesh->triangles, mesh->triangle_count, any_hit);
+        return hitTriangles(ray, hit, closest_hit, mesh->triangles, mesh->triangle_reference_count, any_hit);
 
     BVHNode *left_node = mesh->bvh.nodes + mesh->bvh.nodes->first_child_id;
     BVHNode *right_node, *tmp_node;
@@ -96,7 +249,7 @@ INLINE bool traceMesh(Trace *trace, Mesh *mesh, bool any_hit) {
                 }
                 stack[stack_size++] = right_node->first_child_id;
                 if (stack_size == trace->mesh_stack_size)
-                    return false;
+                    return found;
             }
             left_node = mesh->bvh.nodes + left_node->first_child_id;
         } else if (right_node) {
@@ -108,4 +261,75 @@ INLINE bool traceMesh(Trace *trace, Mesh *mesh, bool any_hit) {
     }
 
     return found;
-}
\ No newline at end of file
+}
+// Trace a packet of (object-space) rays through a mesh's wide BVH together, visiting every node once for all the rays
+// that reach it. Returns a mask of the rays that found a closer hit (each in its own entry of the packet's mesh hits):
+INLINE u32 traceMeshWithRayPacket(RayPacket *packet, Trace *trace, Mesh *mesh, u32 ray_mask, bool any_hit) {
+    Ray *rays = packet->local_space_rays;
+    RayHit *hits = packet->mesh_hits;
+    TrianglePacket *triangle_packet;
+    u32 *stack = trace->mesh_stack;
+    u32 *stack_masks = packet->mesh_stack_masks;
+    u32 stack_size = 0, hit_count, next_node_id, next_ray_mask, found = 0, r, rays_left, remaining;
+    u32 lane_ray_masks[WIDE_BVH_WIDTH];
+    f32 distances[WIDE_BVH_WIDTH];
+    u8 order[WIDE_BVH_WIDTH], lane;
+
+    WideBVHNode *node = mesh->wide_bvh.nodes;
+    while (true) {
+        hit_count = sortWideBVHNodeHits(hitWideBVHNodeWithRayPacket(node, &packet->local_space_bounds, rays, hits, ray_mask,
+                                                                    lane_ray_masks, distances), distances, order);
+
+        for (u32 i = 0; i < hit_count; i++) {
+            lane = order[i];
+            if (!node->child_counts[lane])
+                continue;
+
+            triangle_packet = mesh->triangle_packets + node->child_ids[lane];
+            for (remaining = node->child_counts[lane]; remaining; remaining -= triangle_packet->triangle_count, triangle_packet++) {
+                for (rays_left = lane_ray_masks[lane]; rays_left; rays_left &= rays_left - 1) {
+                    r = getLowestSetBit(rays_left);
+                    if (hitTrianglePacket(rays + r, hits + r, triangle_packet, any_hit))
+                        found |= 1u << r;
+                }
+                if (any_hit)
+                    lane_ray_masks[lane] &= ~found;
+            }
+        }
+
+        // Rays that are already occluded don't need to go any further:
+        if (any_hit) {
+            ray_mask &= ~found;
+            for (lane = 0; lane < WIDE_BVH_WIDTH; lane++) lane_ray_masks[lane] &= ray_mask;
+        }
+
+        next_node_id = next_ray_mask = 0;
+        for (u32 i = hit_count; i-- > 0;) {
+            lane = order[i];
+            if (node->child_counts[lane] || !lane_ray_masks[lane])
+                continue;
+
+            if (next_node_id) {
+                stack_masks[stack_size] = next_ray_mask;
+                stack[stack_size++] = next_node_id;
+                if (stack_size == trace->mesh_stack_size)
+                    return found;
+            }
+            next_node_id = node->child_ids[lane];
+            next_ray_mask = lane_ray_masks[lane];
+        }
+
+        if (next_node_id) {
+            node = mesh->wide_bvh.nodes + next_node_id;
+            ray_mask = next_ray_mask;
+        } else {
+            do {
+                if (stack_size == 0) return found;
+                stack_size--;
+                ray_mask = stack_masks[stack_size];
+                if (any_hit) ray_mask &= ~found;
+            } while (!ray_mask);
+            node = mesh->wide_bvh.nodes + stack[stack_size];
+        }
+    }
+}
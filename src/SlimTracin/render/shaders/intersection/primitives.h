@@ -6,10 +6,76 @@
 #include "./box.h"
 #include "./mesh.h"
 
+INLINE bool hitPrimitiveShape(RayHit *hit, vec3 *Ro, vec3 *Rd, Primitive *primitive) {
+    switch (primitive->type) {
+        case PrimitiveType_Quad       : return hitQuad(       hit, Ro, Rd, primitive->flags);
+        case PrimitiveType_Box        : return hitBox(        hit, Ro, Rd, primitive->flags);
+        case PrimitiveType_Sphere     : return hitSphere(     hit, Ro, Rd, primitive->flags);
+        case PrimitiveType_Tetrahedron: return hitTetrahedron(hit, Ro, Rd, primitive->flags);
+        default: return false;
+    }
+}
+
+// The major axis of a ray cone's footprint on a surface is along the ray direction projected onto it, and the UV axis
+// is that direction in UV space (left unnormalized, and zero where it isn't derived: on spheres and tetrahedra):
+INLINE void finalizeClosestHit(RayHit *closest_hit, Scene *scene, Primitive *primitive, u32 primitive_id, f32 cone_angle, vec3 direction) {
+    vec3 Rd = convertDirectionToObjectSpace(direction, primitive);
+    vec3 N = closest_hit->normal;
+    closest_hit->uv_axis = getVec2Of(0);
+    if (closest_hit->object_type == PrimitiveType_Quad) {
+        closest_hit->uv_axis.u = Rd.x;
+        closest_hit->uv_axis.v = Rd.z;
+    } else if (closest_hit->object_type == PrimitiveType_Box) {
+        BoxSide side = N.x ? (N.x > 0 ? Right : Left) : (N.y ? (N.y > 0 ? Top : Bottom) : (N.z > 0 ? Front : Back));
+        closest_hit->uv_axis = subVec2(getUVonUnitCube(scaleAddVec3(N, -dotVec3(N, Rd), Rd), side), getVec2Of(0.5f));
+    } else if (closest_hit->object_type == PrimitiveType_Mesh) {
+        Mesh *mesh = scene->meshes + primitive->id;
+        TriangleShading *triangle = mesh->triangle_shading + closest_hit->object_id;
+        closest_hit->area = triangle->area_of_parallelogram;
+        closest_hit->uv_area = triangle->area_of_uv;
+
+        Triangle *tangent_space = mesh->triangles + closest_hit->object_id;
+        vec3 axis = scaleAddVec3(tangent_space->normal, -dotVec3(tangent_space->normal, Rd), Rd);
+        axis = mulVec3Mat3(axis, tangent_space->world_to_tangent);
+        if (mesh->uvs_count) {
+            closest_hit->uv_axis = scaleVec2(subVec2(triangle->uvs[2], triangle->uvs[0]), axis.x);
+            closest_hit->uv_axis = scaleAddVec2(subVec2(triangle->uvs[1], triangle->uvs[0]), axis.y, closest_hit->uv_axis);
+        } else {
+            closest_hit->uv_axis.u = axis.x;
+            closest_hit->uv_axis.v = axis.y;
+        }
+        if (mesh->normals_count | mesh->uvs_count) {
+            f32 u = closest_hit->uv.u;
+            f32 v = closest_hit->uv.v;
+            f32 w = 1 - u - v;
+            if (mesh->uvs_count) {
+                closest_hit->uv.x = fast_mul_add(triangle->uvs[2].x, u, fast_mul_add(triangle->uvs[1].u, v, triangle->uvs[0].u * w));
+                closest_hit->uv.y = fast_mul_add(triangle->uvs[2].y, u, fast_mul_add(triangle->uvs[1].v, v, triangle->uvs[0].v * w));
+            }
+            if (mesh->normals_count) {
+                closest_hit->normal.x = fast_mul_add(triangle->vertex_normals[2].x, u, fast_mul_add(triangle->vertex_normals[1].x, v, triangle->vertex_normals[0].x * w));
+                closest_hit->normal.y = fast_mul_add(triangle->vertex_normals[2].y, u, fast_mul_add(triangle->vertex_normals[1].y, v, triangle->vertex_normals[0].y * w));
+                closest_hit->normal.z = fast_mul_add(triangle->vertex_normals[2].z, u, fast_mul_add(triangle->vertex_normals[1].z, v, triangle->vertex_normals[0].z * w));
+                closest_hit->normal = normVec3(closest_hit->normal);
+            }
+        }
+    }
+    // A surface's area scales by the volume of the scale over how much the scale stretches along the normal (and the
+    // footprint of a ray cone is measured against the world-space normal):
+    vec3 scale = primitive->scale;
+    closest_hit->area *= scale.x * scale.y * scale.z * lengthVec3(mulVec3(closest_hit->normal, oneOverVec3(scale)));
+    closest_hit->object_id = primitive_id;
+    closest_hit->normal = normVec3(convertDirectionToWorldSpace(closest_hit->normal, primitive));
+    closest_hit->NdotV = -dotVec3(closest_hit->normal, direction);
+    closest_hit->distance = sqrtf(closest_hit->distance_squared);
+    closest_hit->cone_width = 2.0f * cone_angle * closest_hit->distance;
+}
+
 INLINE bool hitPrimitives(Ray *ray, Trace *trace, Scene *scene,
                           u32 *primitive_ids,
                           u32 primitive_count,
                           bool any_hit,
+                          bool shadow_ray,
                           bool check_visibility,
                           u16 x,
                           u16 y
@@ -26,7 +92,7 @@ INLINE bool hitPrimitives(Ray *ray, Trace *trace, Scene *scene,
     u32 hit_primitive_id, *primitive_id = primitive_ids;
     for (u32 i = 0; i < primitive_count; i++, primitive_id++) {
         primitive = scene->primitives + *primitive_id;
-        if (any_hit && !(primitive->flags & IS_SHADOWING))
+        if (shadow_ray && !(primitive->flags & IS_SHADOWING))
             continue;
         if (check_visibility) {
             if (!(primitive->flags & IS_VISIBLE))
@@ -39,14 +105,15 @@ INLINE bool hitPrimitives(Ray *ray, Trace *trace, Scene *scene,
                 continue;
         }
 
+        trace->stats.primitive_tests++;
         convertPositionAndDirectionToObjectSpace(ray->origin, ray->direction, primitive, Ro, Rd);
         *Ro = scaleAddVec3(*Rd, TRACE_OFFSET, *Ro);
 
         switch (primitive->type) {
-            case PrimitiveType_Quad       : current_found = hitQuad(       hit, Ro, Rd, primitive->flags); break;
-            case PrimitiveType_Box        : current_found = hitBox(        hit, Ro, Rd, primitive->flags); break;
-            case PrimitiveType_Sphere     : current_found = hitSphere(     hit, Ro, Rd, primitive->flags); break;
-            case PrimitiveType_Tetrahedron: current_found = hitTetrahedron(hit, Ro, Rd, primitive->flags); break;
+            case PrimitiveType_Quad       :
+            case PrimitiveType_Box        :
+            case PrimitiveType_Sphere     :
+            case PrimitiveType_Tetrahedron: current_found = hitPrimitiveShape(hit, Ro, Rd, primitive); break;
             case PrimitiveType_Mesh:
                 trace->local_space_ray.direction_reciprocal = oneOverVec3(*Rd);
                 trace->closest_mesh_hit.distance = closest_hit->distance == INFINITY ? INFINITY :
@@ -65,6 +132,7 @@ INLINE bool hitPrimitives(Ray *ray, Trace *trace, Scene *scene,
             hit->distance_squared = squaredLengthVec3(subVec3(hit->position, ray->origin));
             if (hit->distance_squared < closest_hit->distance_squared) {
                 *closest_hit = *hit;
+                closest_hit->cone_angle = cone_angle;
                 hit_primitive_id = *primitive_id;
                 hit_primitive = primitive;
 
@@ -79,34 +147,105 @@ INLINE bool hitPrimitives(Ray *ray, Trace *trace, Scene *scene,
         }
     }
 
-    if (found) {
-        Mesh *mesh = null;
-        if (closest_hit->object_type == PrimitiveType_Mesh) {
-            mesh = scene->meshes + hit_primitive->id;
-            Triangle *triangle = mesh->triangles + closest_hit->object_id;
-            if (mesh->normals_count | mesh->uvs_count) {
-                f32 u = closest_hit->uv.u;
-                f32 v = closest_hit->uv.v;
-                f32 w = 1 - u - v;
-                if (mesh->uvs_count) {
-                    closest_hit->uv.x = fast_mul_add(triangle->uvs[2].x, u, fast_mul_add(triangle->uvs[1].u, v, triangle->uvs[0].u * w));
-                    closest_hit->uv.y = fast_mul_add(triangle->uvs[2].y, u, fast_mul_add(triangle->uvs[1].v, v, triangle->uvs[0].v * w));
+    if (found)
+        finalizeClosestHit(closest_hit, scene, hit_primitive, hit_primitive_id, cone_angle, ray->direction);
+
+    return found;
+}
+
+// Test the rays of a packet that reached a scene BVH leaf against its primitives. Meshes are traced with the whole packet
+// at once (in their object space), other primitives ray by ray. Returns a mask of the rays that found a closer hit:
+INLINE u32 hitPrimitivesWithRayPacket(RayPacket *packet, Trace *trace, Scene *scene,
+                                      u32 *primitive_ids,
+                                      u32 primitive_count,
+                                      u32 ray_mask,
+                                      bool any_hit
+) {
+    RayHit *hit, *closest_hit;
+    Ray *ray, *local_space_ray;
+    Primitive *primitive;
+    Mesh *mesh;
+    u32 r, rays_left, found = 0, mesh_found, *primitive_id = primitive_ids;
+    for (u32 i = 0; i < primitive_count && ray_mask; i++, primitive_id++) {
+        primitive = scene->primitives + *primitive_id;
+        if (any_hit && !(primitive->flags & IS_SHADOWING))
+            continue;
+
+        mesh = primitive->type == PrimitiveType_Mesh ? scene->meshes + primitive->id : null;
+        if (mesh && mesh->wide_bvh.node_count && mesh->triangle_packets) {
+            for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+                r = getLowestSetBit(rays_left);
+                ray = packet->rays + r;
+                local_space_ray = packet->local_space_rays + r;
+                closest_hit = packet->hits + r;
+                convertPositionAndDirectionToObjectSpace(ray->origin, ray->direction, primitive, &local_space_ray->origin, &local_space_ray->direction);
+                local_space_ray->origin = scaleAddVec3(local_space_ray->direction, TRACE_OFFSET, local_space_ray->origin);
+                local_space_ray->direction_reciprocal = oneOverVec3(local_space_ray->direction);
+                prePrepRay(local_space_ray);
+                packet->mesh_hits[r].distance = closest_hit->distance == INFINITY ? INFINITY :
+                        lengthVec3(subVec3(convertPositionToObjectSpace(closest_hit->position, primitive), local_space_ray->origin));
+            }
+
+            if (setRayPacketBounds(&packet->local_space_bounds, packet->local_space_rays, ray_mask)) {
+                for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) trace->stats.primitive_tests++;
+                mesh_found = traceMeshWithRayPacket(packet, trace, mesh, ray_mask, any_hit);
+                for (rays_left = mesh_found; rays_left; rays_left &= rays_left - 1) {
+                    r = getLowestSetBit(rays_left);
+                    hit = packet->mesh_hits + r;
+                    closest_hit = packet->hits + r;
+                    hit->position = convertPositionToWorldSpace(hit->position, primitive);
+                    hit->distance_squared = squaredLengthVec3(subVec3(hit->position, packet->rays[r].origin));
+                    if (hit->distance_squared < closest_hit->distance_squared) {
+                        hit->cone_angle = closest_hit->cone_angle;
+                        *closest_hit = *hit;
+                        closest_hit->object_type = primitive->type;
+                        closest_hit->material_id = primitive->material_id;
+                        finalizeClosestHit(closest_hit, scene, primitive, *primitive_id, closest_hit->cone_angle, packet->rays[r].direction);
+                        found |= 1u << r;
+                    }
                 }
-                if (mesh->normals_count) {
-                    closest_hit->normal.x = fast_mul_add(triangle->vertex_normals[2].x, u, fast_mul_add(triangle->vertex_normals[1].x, v, triangle->vertex_normals[0].x * w));
-                    closest_hit->normal.y = fast_mul_add(triangle->vertex_normals[2].y, u, fast_mul_add(triangle->vertex_normals[1].y, v, triangle->vertex_normals[0].y * w));
-                    closest_hit->normal.z = fast_mul_add(triangle->vertex_normals[2].z, u, fast_mul_add(triangle->vertex_normals[1].z, v, triangle->vertex_normals[0].z * w));
-                    closest_hit->normal = normVec3(closest_hit->normal);
+                if (any_hit) ray_mask &= ~found;
+                continue;
+            }
+        }
+
+        if (mesh) {
+            // Fall back to tracing the rays one by one (through the same path that single rays take):
+            for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+                r = getLowestSetBit(rays_left);
+                trace->closest_hit = packet->hits[r];
+                if (hitPrimitives(packet->rays + r, trace, scene, primitive_id, 1, any_hit, any_hit, false, 0, 0)) {
+                    packet->hits[r] = trace->closest_hit;
+                    found |= 1u << r;
+                }
+            }
+        } else {
+            hit = &trace->current_hit;
+            local_space_ray = &trace->local_space_ray;
+            for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+                r = getLowestSetBit(rays_left);
+                ray = packet->rays + r;
+                closest_hit = packet->hits + r;
+                trace->stats.primitive_tests++;
+                convertPositionAndDirectionToObjectSpace(ray->origin, ray->direction, primitive, &local_space_ray->origin, &local_space_ray->direction);
+                local_space_ray->origin = scaleAddVec3(local_space_ray->direction, TRACE_OFFSET, local_space_ray->origin);
+                if (!hitPrimitiveShape(hit, &local_space_ray->origin, &local_space_ray->direction, primitive))
+                    continue;
+
+                hit->position = convertPositionToWorldSpace(hit->position, primitive);
+                hit->distance_squared = squaredLengthVec3(subVec3(hit->position, ray->origin));
+                if (hit->distance_squared < closest_hit->distance_squared) {
+                    hit->cone_angle = closest_hit->cone_angle;
+                    *closest_hit = *hit;
+                    closest_hit->object_type = primitive->type;
+                    closest_hit->material_id = primitive->material_id;
+                    finalizeClosestHit(closest_hit, scene, primitive, *primitive_id, closest_hit->cone_angle, ray->direction);
+                    found |= 1u << r;
                 }
             }
         }
-        closest_hit->object_id = hit_primitive_id;
-        closest_hit->normal = normVec3(convertDirectionToWorldSpace(closest_hit->normal, hit_primitive));
-        closest_hit->distance = sqrtf(closest_hit->distance_squared);
-        closest_hit->cone_width = 2.0f * cone_angle * closest_hit->distance;
-        vec3 rotated_scale = mulVec3Quat(hit_primitive->scale, hit_primitive->rotation);
-        closest_hit->area *= dotVec3(oneMinusVec3(closest_hit->normal), rotated_scale);
+        if (any_hit) ray_mask &= ~found;
     }
 
     return found;
-}
\ No newline at end of file
+}
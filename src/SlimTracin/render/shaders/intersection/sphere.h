@@ -92,7 +92,8 @@ INLINE bool hitSphere(RayHit *hit, vec3 *Ro, vec3 *Rd, u8 flags) {
     hit->from_behind = !has_outer_hit;
     hit->normal = hit->position;
     hit->NdotV = -dotVec3(hit->normal, *Rd);
-    hit->area = hit->uv_area = UNIT_SPHERE_AREA_OVER_SIX;
+    hit->area = UNIT_SPHERE_AREA_OVER_SIX; // Each of the 6 cube-mapped faces spans the whole UV range
+    hit->uv_area = 1;
 
     return true;
 }
\ No newline at end of file
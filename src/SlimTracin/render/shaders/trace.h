@@ -5,10 +5,57 @@
 #include "../AABB.h"
 #include "./intersection/primitives.h"
 
-INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit) {
+INLINE bool traceSceneWide(Ray *ray, Trace *trace, Scene *scene, bool any_hit, bool shadow_ray) {
+    u32 *stack = trace->scene_stack;
+    u32 stack_size = 0, hit_count, next_node_id;
+    f32 distances[WIDE_BVH_WIDTH];
+    u8 order[WIDE_BVH_WIDTH], lane;
+    bool found = false;
+
+    WideBVHNode *node = scene->wide_bvh.nodes;
+    while (true) {
+        hit_count = sortWideBVHNodeHits(hitWideBVHNode(node, ray, trace->closest_hit.distance, distances), distances, order);
+
+        for (u32 i = 0; i < hit_count; i++) {
+            lane = order[i];
+            if (node->child_counts[lane] &&
+                hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids + node->child_ids[lane], node->child_counts[lane], any_hit, shadow_ray, false, 0, 0)) {
+                found = true;
+                if (any_hit)
+                    return true;
+            }
+        }
+
+        next_node_id = 0;
+        for (u32 i = hit_count; i-- > 0;) {
+            lane = order[i];
+            if (node->child_counts[lane] || distances[lane] > trace->closest_hit.distance)
+                continue;
+
+            if (next_node_id) stack[stack_size++] = next_node_id;
+            next_node_id = node->child_ids[lane];
+        }
+
+        if (next_node_id) {
+            node = scene->wide_bvh.nodes + next_node_id;
+        } else {
+            if (stack_size == 0) break;
+            node = scene->wide_bvh.nodes + stack[--stack_size];
+        }
+    }
+
+    return found;
+}
+
+INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit, bool shadow_ray) {
     ray->direction_reciprocal = oneOverVec3(ray->direction);
     prePrepRay(ray);
 
+#ifndef __CUDA_ARCH__
+    if (scene->wide_bvh.node_count)
+        return traceSceneWide(ray, trace, scene, any_hit, shadow_ray);
+#endif
+
     bool hit_left, hit_right, found = false;
     f32 left_distance, right_distance;
 
@@ -16,7 +63,7 @@ INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit) {
         return false;
 
     if (unlikely(scene->bvh.nodes->child_count))
-        return hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids, scene->settings.primitives, any_hit, false, 0, 0);
+        return hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids, scene->settings.primitives, any_hit, shadow_ray, false, 0, 0);
 
     BVHNode *left_node = scene->bvh.nodes + scene->bvh.nodes->first_child_id;
     BVHNode *right_node, *tmp_node;
@@ -31,7 +78,7 @@ INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit) {
 
         if (hit_left) {
             if (unlikely(left_node->child_count)) {
-                if (hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids + left_node->first_child_id, left_node->child_count, any_hit, false, 0, 0)) {
+                if (hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids + left_node->first_child_id, left_node->child_count, any_hit, shadow_ray, false, 0, 0)) {
                     found = true;
                     if (any_hit)
                         break;
@@ -44,7 +91,7 @@ INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit) {
 
         if (hit_right) {
             if (unlikely(right_node->child_count)) {
-                if (hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids + right_node->first_child_id, right_node->child_count, any_hit, false, 0, 0)) {
+                if (hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids + right_node->first_child_id, right_node->child_count, any_hit, shadow_ray, false, 0, 0)) {
                     found = true;
                     if (any_hit)
                         break;
@@ -62,6 +109,8 @@ INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit) {
                     right_node = tmp_node;
                 }
                 stack[stack_size++] = right_node->first_child_id;
+                if (stack_size == trace->scene_stack_size)
+                    return found;
             }
             left_node = scene->bvh.nodes + left_node->first_child_id;
         } else if (right_node) {
@@ -75,18 +124,163 @@ INLINE bool traceScene(Ray *ray, Trace *trace, Scene *scene, bool any_hit) {
     return found;
 }
 
-INLINE bool tracePrimaryRay(Ray *ray, Trace *trace, Scene *scene, u16 x, u16 y) {
-    ray->direction_reciprocal = oneOverVec3(ray->direction);
+// Trace a coherent packet of rays through the scene's wide BVH together (the packet's bounds need to be set already).
+// Returns a mask of the rays that hit something, with their closest (or any) hits in the packet's hits:
+INLINE u32 traceSceneWithRayPacket(RayPacket *packet, Trace *trace, Scene *scene, u32 ray_mask, bool any_hit) {
+    u32 *stack = trace->scene_stack;
+    u32 *stack_masks = packet->scene_stack_masks;
+    u32 stack_size = 0, hit_count, next_node_id, next_ray_mask, found = 0;
+    u32 lane_ray_masks[WIDE_BVH_WIDTH];
+    f32 distances[WIDE_BVH_WIDTH];
+    u8 order[WIDE_BVH_WIDTH], lane;
+
+    WideBVHNode *node = scene->wide_bvh.nodes;
+    while (true) {
+        hit_count = sortWideBVHNodeHits(hitWideBVHNodeWithRayPacket(node, &packet->bounds, packet->rays, packet->hits, ray_mask,
+                                                                    lane_ray_masks, distances), distances, order);
+
+        for (u32 i = 0; i < hit_count; i++) {
+            lane = order[i];
+            if (node->child_counts[lane])
+                found |= hitPrimitivesWithRayPacket(packet, trace, scene, scene->bvh.leaf_ids + node->child_ids[lane], node->child_counts[lane],
+                                                    any_hit ? lane_ray_masks[lane] & ~found : lane_ray_masks[lane], any_hit);
+        }
+
+        if (any_hit) {
+            ray_mask &= ~found;
+            for (lane = 0; lane < WIDE_BVH_WIDTH; lane++) lane_ray_masks[lane] &= ray_mask;
+        }
+
+        next_node_id = next_ray_mask = 0;
+        for (u32 i = hit_count; i-- > 0;) {
+            lane = order[i];
+            if (node->child_counts[lane] || !lane_ray_masks[lane])
+                continue;
+
+            if (next_node_id) {
+                stack_masks[stack_size] = next_ray_mask;
+                stack[stack_size++] = next_node_id;
+            }
+            next_node_id = node->child_ids[lane];
+            next_ray_mask = lane_ray_masks[lane];
+        }
+
+        if (next_node_id) {
+            node = scene->wide_bvh.nodes + next_node_id;
+            ray_mask = next_ray_mask;
+        } else {
+            do {
+                if (stack_size == 0) return found;
+                stack_size--;
+                ray_mask = stack_masks[stack_size];
+                if (any_hit) ray_mask &= ~found;
+            } while (!ray_mask);
+            node = scene->wide_bvh.nodes + stack[stack_size];
+        }
+    }
+}
+
+INLINE bool tracePrimaryRay(Ray *ray, Trace *trace, Scene *scene, bool use_SSB, u16 x, u16 y) {
+    trace->stats.primary_rays++;
     trace->closest_hit.distance = trace->closest_hit.distance_squared = MAX_DISTANCE;
+    u64 primitive_tests = trace->stats.primitive_tests;
+
+    // Either go through the scene's BVH, or test every visible primitive whose screen-space bounds contain the pixel:
+    bool found;
+    if (use_SSB) {
+        ray->direction_reciprocal = oneOverVec3(ray->direction);
+        found = hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids, scene->settings.primitives, false, false, true, x, y);
+    } else
+        found = traceScene(ray, trace, scene, false, false);
 
-    return hitPrimitives(ray, trace, scene, scene->bvh.leaf_ids, scene->settings.primitives, false, true, x, y);
+    trace->stats.primary_primitive_tests += trace->stats.primitive_tests - primitive_tests;
+
+    return found;
 }
 
 INLINE bool inShadow(Ray *ray, Trace *trace, Scene *scene) {
-    return traceScene(ray, trace, scene, true);
+    trace->stats.shadow_rays++;
+    return traceScene(ray, trace, scene, true, true);
 }
 
 INLINE bool traceRay(Ray *ray, Trace *trace, Scene *scene) {
+    trace->stats.secondary_rays++;
     trace->closest_hit.distance = trace->closest_hit.distance_squared = INFINITY;
-    return traceScene(ray, trace, scene, false);
-}
\ No newline at end of file
+    return traceScene(ray, trace, scene, false, false);
+}
+
+// Trace the primary rays of a block of pixels as one packet, when they are coherent enough.
+// Returns false when they are not (so that the caller traces them one by one instead):
+INLINE bool tracePrimaryRayPacket(RayPacket *packet, Trace *trace, Scene *scene, u32 *hit_mask) {
+    u32 ray_mask = (u32)-1 >> (32 - RAY_PACKET_SIZE);
+    if (!scene->wide_bvh.node_count || !setRayPacketBounds(&packet->bounds, packet->rays, ray_mask))
+        return false;
+
+    RayHit *hit = packet->hits;
+    for (u32 r = 0; r < RAY_PACKET_SIZE; r++, hit++)
+        hit->distance = hit->distance_squared = MAX_DISTANCE;
+
+    trace->stats.primary_rays += RAY_PACKET_SIZE;
+    u64 primitive_tests = trace->stats.primitive_tests;
+    *hit_mask = traceSceneWithRayPacket(packet, trace, scene, ray_mask, false);
+    trace->stats.primary_primitive_tests += trace->stats.primitive_tests - primitive_tests;
+
+    return true;
+}
+
+// Trace the shadow rays from the primary hits of a packet towards each light as packets of their own.
+// Lights whose shadow rays can't be traced as a packet are left out of the pretraced mask, to be traced one by one while shading:
+INLINE void traceShadowRayPackets(RayPacket *packet, Trace *trace, Scene *scene, RayHit *primary_hits, u32 hit_mask,
+                                  u32 *pretraced_lights, u32 *shadowed_lights) {
+    Light *light = scene->lights;
+    RayHit *hit, *shadow_hit;
+    Ray *ray;
+    vec3 normal, light_direction;
+    u32 r, rays_left, ray_mask, shadowed;
+    u32 light_count = scene->settings.lights < MAX_PRETRACED_LIGHTS ? scene->settings.lights : MAX_PRETRACED_LIGHTS;
+    for (r = 0; r < RAY_PACKET_SIZE; r++) pretraced_lights[r] = shadowed_lights[r] = 0;
+
+    // Emissive surfaces don't get shaded by lights:
+    for (rays_left = hit_mask; rays_left; rays_left &= rays_left - 1) {
+        r = getLowestSetBit(rays_left);
+        if (scene->materials[primary_hits[r].material_id].is & EMISSIVE)
+            hit_mask &= ~(1u << r);
+    }
+
+    for (u32 i = 0; i < light_count; i++, light++) {
+        ray_mask = 0;
+        for (rays_left = hit_mask; rays_left; rays_left &= rays_left - 1) {
+            r = getLowestSetBit(rays_left);
+
+            // Mirrors the shadow rays of shadeFromLights(), skipping the points that face away from the light:
+            hit = primary_hits + r;
+            shadow_hit = packet->hits + r;
+            shadow_hit->position = light->position_or_direction;
+            light_direction = subVec3(shadow_hit->position, hit->position);
+            shadow_hit->distance_squared = squaredLengthVec3(light_direction);
+            shadow_hit->distance = sqrtf(shadow_hit->distance_squared);
+            light_direction = scaleVec3(light_direction, 1.0f / shadow_hit->distance);
+            normal = hit->from_behind ? invertedVec3(hit->normal) : hit->normal;
+            if (dotVec3(normal, light_direction) <= 0)
+                continue;
+
+            ray = packet->rays + r;
+            ray->origin = hit->position;
+            ray->direction = light_direction;
+            ray->direction_reciprocal = oneOverVec3(ray->direction);
+            prePrepRay(ray);
+            ray_mask |= 1u << r;
+        }
+        if (!ray_mask || !setRayPacketBounds(&packet->bounds, packet->rays, ray_mask))
+            continue;
+
+        shadowed = traceSceneWithRayPacket(packet, trace, scene, ray_mask, true);
+        for (rays_left = ray_mask; rays_left; rays_left &= rays_left - 1) {
+            r = getLowestSetBit(rays_left);
+            trace->stats.shadow_rays++;
+            pretraced_lights[r] |= 1u << i;
+            if (shadowed & (1u << r)) shadowed_lights[r] |= 1u << i;
+        }
+    }
+}
+
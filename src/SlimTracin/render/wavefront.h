@@ -0,0 +1,288 @@
+#pragma once
+
+#include "../core/types.h"
+#include "../math/vec3.h"
+#include "../math/quat.h"
+#include "./shaders/common.h"
+#include "./shaders/trace.h"
+#include "./shaders/closest_hit/surface.h"
+#include "./shaders/closest_hit/lights.h"
+
+// The wavefront renderer breaks the shading of a tile down into stages that each run over a whole queue of paths:
+// Rays get generated, then traced, then their hits get sorted by material (and texture) and shaded, emitting queues of
+// shadow rays to be traced on their own, and then rays that bounce off of reflective/refractive surfaces get queued to go around again.
+// Every stage does exactly what the ray-by-ray shadeSurface() does for each path, so both produce the same image.
+
+INLINE u32 generatePrimaryRays(Wavefront *wavefront, Viewport *viewport, u16 x_start, u16 y_start, u16 x_end, u16 y_end) {
+    vec3 right = viewport->projection_plane.right;
+    vec3 down  = viewport->projection_plane.down;
+    vec3 start = scaleAddVec3(down, y_start, scaleAddVec3(right, x_start, viewport->projection_plane.start));
+    vec3 current;
+
+    WavefrontPath *path = wavefront->paths;
+    u32 path_id = 0;
+    for (u16 y = y_start; y < y_end; y++) {
+        current = start;
+        for (u16 x = x_start; x < x_end; x++, path++, path_id++) {
+            path->ray.origin = viewport->camera->transform.position;
+            path->ray.direction = normVec3(current);
+            path->ray.direction_reciprocal = oneOverVec3(path->ray.direction);
+            path->x = x;
+            path->y = y;
+            wavefront->ray_queue[path_id] = path_id;
+            current = addVec3(current, right);
+        }
+        start = addVec3(start, down);
+    }
+
+    return path_id;
+}
+
+INLINE u32 extendPrimaryPaths(Wavefront *wavefront, Trace *trace, Scene *scene, Viewport *viewport, u32 path_count) {
+    quat camera_rotation = viewport->camera->transform.rotation_inverted;
+    vec3 camera_position = viewport->camera->transform.position;
+    bool use_SSB = viewport->settings.use_SSB;
+    WavefrontPath *path = wavefront->paths;
+    u32 ray_count = 0;
+    for (u32 path_id = 0; path_id < path_count; path_id++, path++) {
+        trace->closest_hit.distance = trace->closest_hit.distance_squared = INFINITY;
+        trace->closest_hit.cone_angle = viewport->projection_plane.cone_angle;
+        trace->closest_hit.cone_width = 0;
+
+        path->color = getVec3Of(0);
+        path->lights_shaded = false;
+        path->depth = trace->depth;
+        path->primary_direction = path->ray.direction;
+        path->hit_found = tracePrimaryRay(&path->ray, trace, scene, use_SSB, path->x, path->y);
+        path->hit = trace->closest_hit;
+        if (path->hit_found) {
+            path->primary_distance = path->hit.distance;
+            path->z = mulVec3Quat(subVec3(path->hit.position, camera_position), camera_rotation).z;
+            wavefront->ray_queue[ray_count++] = path_id;
+        } else {
+            path->primary_distance = path->z = INFINITY;
+        }
+    }
+
+    return ray_count;
+}
+
+INLINE u32 extendBouncingPaths(Wavefront *wavefront, Trace *trace, Scene *scene, u32 ray_count) {
+    WavefrontPath *path;
+    u32 hit_count = 0;
+    for (u32 i = 0; i < ray_count; i++) {
+        path = wavefront->paths + wavefront->ray_queue[i];
+        trace->closest_hit = path->hit;
+        if (traceRay(&path->ray, trace, scene)) {
+            path->hit = trace->closest_hit;
+            wavefront->ray_queue[hit_count++] = wavefront->ray_queue[i];
+        }
+    }
+
+    return hit_count;
+}
+
+// Counting-sort the queued paths by the (precomputed) rank of the material of their hit, so that paths get shaded material by material.
+// Without sorting, paths get shaded in the order of their pixels:
+INLINE void sortPathsByMaterial(Wavefront *wavefront, Scene *scene, u32 ray_count, bool sort_hits) {
+    if (!sort_hits) {
+        for (u32 i = 0; i < ray_count; i++) wavefront->shading_queue[i] = wavefront->ray_queue[i];
+        return;
+    }
+
+    u32 *offsets = wavefront->material_offsets;
+    u32 *ranks = scene->material_ranks;
+    u32 material_count = scene->settings.materials, offset = 0, count;
+    for (u32 m = 0; m <= material_count; m++) offsets[m] = 0;
+    for (u32 i = 0; i < ray_count; i++) offsets[ranks[wavefront->paths[wavefront->ray_queue[i]].hit.material_id]]++;
+    for (u32 m = 0; m <= material_count; m++) {
+        count = offsets[m];
+        offsets[m] = offset;
+        offset += count;
+    }
+    for (u32 i = 0; i < ray_count; i++)
+        wavefront->shading_queue[offsets[ranks[wavefront->paths[wavefront->ray_queue[i]].hit.material_id]]++] = wavefront->ray_queue[i];
+}
+
+// Set up the shading of each queued hit, ending the paths that hit emissive surfaces. Returns how many are left to be shaded:
+INLINE u32 shadePathHits(Wavefront *wavefront, Trace *trace, Scene *scene, u32 ray_count, bool primary) {
+    WavefrontPath *path;
+    Shaded *shaded;
+    Material *M;
+    u32 shaded_count = 0;
+    for (u32 i = 0; i < ray_count; i++) {
+        path = wavefront->paths + wavefront->shading_queue[i];
+        shaded = &path->shaded;
+        M = scene->materials + path->hit.material_id;
+        countShadedHit(trace, path->hit.material_id);
+        if (primary) {
+            if (M->is & EMISSIVE) {
+                if (!path->hit.from_behind) path->color = M->emission;
+                continue;
+            }
+            path->throughput = getVec3Of(1);
+            path->max_distance = path->hit.distance;
+            shaded->viewing_origin    = path->ray.origin;
+            shaded->viewing_direction = path->ray.direction;
+            setShadedMaterial(shaded, &path->hit, scene);
+        } else {
+            setShadedMaterial(shaded, &path->hit, scene);
+            if (path->hit.object_type == PrimitiveType_Quad && M->is & EMISSIVE) {
+                path->color = path->hit.from_behind ? getVec3Of(0) : M->emission;
+                continue;
+            }
+            if (M->brdf != BRDF_CookTorrance) path->throughput = mulVec3(path->throughput, M->reflectivity);
+
+            shaded->viewing_origin    = path->ray.origin;
+            shaded->viewing_direction = path->ray.direction;
+        }
+
+        shaded->position = path->ray.origin = path->hit.position;
+        shaded->normal = path->hit.from_behind ? invertedVec3(path->hit.normal) : path->hit.normal;
+        path->ior = path->hit.from_behind ? M->n2_over_n1 : M->n1_over_n2;
+        path->is_ref = (M->is & REFLECTIVE) || (M->is & REFRACTIVE);
+        if (path->is_ref || M->brdf == BRDF_Phong) {
+            path->NdotRd = -invDotVec3(shaded->normal, shaded->viewing_direction);
+            shaded->reflected_direction = reflectWithDot(shaded->viewing_direction, shaded->normal, path->NdotRd);
+        }
+        path->current_color = path->is_ref ? getVec3Of(0) : scene->ambient_light.color;
+
+        wavefront->shading_queue[shaded_count++] = wavefront->shading_queue[i];
+    }
+
+    return shaded_count;
+}
+
+// Light by light, queue up the shadow rays of the shaded paths, trace them all, and then add the light to the unshadowed ones:
+INLINE void shadePathsFromLights(Wavefront *wavefront, Trace *trace, Scene *scene, u32 shaded_count) {
+    Light *light = scene->lights;
+    WavefrontShadowRay *shadow_ray;
+    WavefrontPath *path;
+    Shaded *shaded;
+    vec3 light_direction;
+    u32 shadow_ray_count;
+    for (u32 l = 0; l < scene->settings.lights; l++, light++) {
+        shadow_ray_count = 0;
+        shadow_ray = wavefront->shadow_rays;
+        for (u32 i = 0; i < shaded_count; i++) {
+            path = wavefront->paths + wavefront->shading_queue[i];
+            shaded = &path->shaded;
+            light_direction = subVec3(light->position_or_direction, shaded->position);
+            shadow_ray->distance_squared = squaredLengthVec3(light_direction);
+            shadow_ray->distance = sqrtf(shadow_ray->distance_squared);
+            shadow_ray->light_direction = scaleVec3(light_direction, 1.0f / shadow_ray->distance);
+            shadow_ray->NdotL = dotVec3(shaded->normal, shadow_ray->light_direction);
+            if (shadow_ray->NdotL <= 0)
+                continue;
+
+            shadow_ray->light_intensity = light->intensity / shadow_ray->distance_squared;
+            shadow_ray->ray.origin    = shaded->position;
+            shadow_ray->ray.direction = shadow_ray->light_direction;
+            shadow_ray->path_id = wavefront->shading_queue[i];
+            shadow_ray++;
+            shadow_ray_count++;
+        }
+
+        shadow_ray = wavefront->shadow_rays;
+        for (u32 i = 0; i < shadow_ray_count; i++, shadow_ray++) {
+            trace->closest_hit.position = light->position_or_direction;
+            trace->closest_hit.distance = shadow_ray->distance;
+            trace->closest_hit.distance_squared = shadow_ray->distance_squared;
+            if (inShadow(&shadow_ray->ray, trace, scene))
+                continue;
+
+            path = wavefront->paths + shadow_ray->path_id;
+            path->shaded.light_direction = shadow_ray->light_direction;
+            path->current_color = mulAddVec3(shadePointOnSurface(&path->shaded, shadow_ray->NdotL),
+                                             scaleVec3(light->color, shadow_ray->light_intensity),
+                                             path->current_color);
+        }
+    }
+}
+
+// Finish shading the current bounce of each shaded path, and queue up the rays of the ones that bounce on. Returns how many do:
+INLINE u32 finishPathBounces(Wavefront *wavefront, Trace *trace, Scene *scene, u32 shaded_count) {
+    WavefrontPath *path;
+    Shaded *shaded;
+    u32 ray_count = 0;
+    for (u32 i = 0; i < shaded_count; i++) {
+        path = wavefront->paths + wavefront->shading_queue[i];
+        shaded = &path->shaded;
+
+        if (scene->emissive_quad_count) {
+            trace->closest_hit = path->hit;
+            if (shadeFromEmissiveQuads(shaded, &path->ray, trace, scene, &path->current_color))
+                path->max_distance = trace->closest_hit.distance;
+            path->hit = trace->closest_hit;
+        }
+
+        path->color = mulAddVec3(path->current_color, path->throughput, path->color);
+
+        if (scene->lights && shadeLights(scene->lights,
+                                        scene->settings.lights,
+                                        shaded->viewing_origin,
+                                        shaded->viewing_direction,
+                                        path->max_distance,
+                                        &trace->sphere_hit,
+                                        &path->color))
+            path->lights_shaded = true;
+
+        if (path->is_ref && --path->depth) {
+            path->ray.origin = shaded->position;
+            path->ray.direction = getBounceDirection(shaded, path->ior, path->NdotRd);
+            wavefront->ray_queue[ray_count++] = wavefront->shading_queue[i];
+        }
+    }
+
+    return ray_count;
+}
+
+INLINE void writePathPixels(Wavefront *wavefront, Trace *trace, Scene *scene, Viewport *viewport, u32 path_count) {
+    vec3 camera_position = viewport->camera->transform.position;
+    FloatPixel *pixel;
+    WavefrontPath *path = wavefront->paths;
+    for (u32 path_id = 0; path_id < path_count; path_id++, path++) {
+        if (scene->lights && !path->lights_shaded &&
+            shadeLights(scene->lights, scene->settings.lights, camera_position, path->primary_direction,
+                        path->primary_distance, &trace->sphere_hit, &path->color)) {
+            path->hit_found = true;
+            path->z = trace->sphere_hit.closest_hit_distance;
+        }
+
+        if (path->hit_found) {
+            pixel = viewport->frame_buffer->float_pixels + viewport->frame_buffer->dimensions.width * path->y + path->x;
+            shadePixel(pixel, path->color, path->z, RenderMode_Beauty);
+        }
+    }
+}
+
+// Render a rectangular region of the frame (in Beauty mode) as a wavefront, a tile's worth of pixels at a time:
+void renderRegionAsWavefront(Scene *scene, Viewport *viewport, Trace *trace, u16 x_start, u16 y_start, u16 x_end, u16 y_end) {
+    Wavefront *wavefront = trace->wavefront;
+    u32 path_count, ray_count, shaded_count;
+    bool primary, sort_hits = viewport->settings.sort_hits;
+
+    for (u16 tile_y = y_start; tile_y < y_end; tile_y += RENDER_TILE_SIZE) {
+        u16 tile_y_end = y_end - tile_y < RENDER_TILE_SIZE ? y_end : tile_y + RENDER_TILE_SIZE;
+        for (u16 tile_x = x_start; tile_x < x_end; tile_x += RENDER_TILE_SIZE) {
+            u16 tile_x_end = x_end - tile_x < RENDER_TILE_SIZE ? x_end : tile_x + RENDER_TILE_SIZE;
+
+            path_count = generatePrimaryRays(wavefront, viewport, tile_x, tile_y, tile_x_end, tile_y_end);
+            ray_count = extendPrimaryPaths(wavefront, trace, scene, viewport, path_count);
+            primary = true;
+            while (ray_count) {
+                sortPathsByMaterial(wavefront, scene, ray_count, sort_hits);
+                shaded_count = shadePathHits(wavefront, trace, scene, ray_count, primary);
+                if (scene->lights)
+                    shadePathsFromLights(wavefront, trace, scene, shaded_count);
+
+                ray_count = finishPathBounces(wavefront, trace, scene, shaded_count);
+                if (ray_count)
+                    ray_count = extendBouncingPaths(wavefront, trace, scene, ray_count);
+                primary = false;
+            }
+
+            writePathPixels(wavefront, trace, scene, viewport, path_count);
+        }
+    }
+}
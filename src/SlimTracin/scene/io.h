@@ -2,79 +2,501 @@
 
 #include "../core/base.h"
 #include "../core/types.h"
+#include "../core/init.h"
+#include "./texture.h"
+#include "../render/acceleration_structures/wide_bvh.h"
+
+INLINE u64 alignFileOffset(u64 offset, u64 alignment) {
+    return (offset + (alignment - 1)) & ~(alignment - 1);
+}
+
+void writeZerosToFile(u64 size, Platform *platform, void *file) {
+    u8 zeros[256] = {0};
+    for (u64 chunk; size; size -= chunk) {
+        chunk = size < sizeof(zeros) ? size : sizeof(zeros);
+        platform->writeToFile(zeros, (unsigned long)chunk, file);
+    }
+}
+
+INLINE TextureFileMip* getTextureFileMips(TextureFileHeader *header) {
+    return (TextureFileMip*)(header + 1);
+}
+
+INLINE bool isTextureFile(TextureFileHeader *header, u64 file_size) {
+    return file_size >= sizeof(TextureFileHeader) && header->magic == TEXTURE_FILE_MAGIC;
+}
+
+// A texture file is only used when the texels of every one of its mips are (aligned) within the file, after its table
+// of mips. Mips are kept small enough for the size of their texels to never wrap around in 32 bits:
+bool isTextureFileHeaderValid(TextureFileHeader *header, u64 file_size) {
+    u64 mips_end = sizeof(TextureFileHeader) + sizeof(TextureFileMip) * header->mip_count;
+    if (!isTextureFile(header, file_size) ||
+        header->version != TEXTURE_FILE_VERSION ||
+        header->file_size > file_size ||
+        header->format > TextureFormat_BC1 ||
+        header->mip_count == 0 || header->mip_count > 16 ||
+        mips_end > header->file_size)
+        return false;
+
+    TextureFileMip *file_mip = getTextureFileMips(header);
+    for (u8 mip_index = 0; mip_index < header->mip_count; mip_index++, file_mip++) {
+        if (!file_mip->width || !file_mip->height ||
+            ((u64)file_mip->width + 4) * ((u64)file_mip->height + 4) * sizeof(TexelQuad) > 0xFFFFFFFF ||
+            file_mip->offset < mips_end ||
+            file_mip->offset % TEXTURE_FILE_ALIGNMENT ||
+            file_mip->offset > header->file_size ||
+            getTextureMipDataSize(header->format, file_mip->width, file_mip->height, header->tiled) > header->file_size - file_mip->offset)
+            return false;
+    }
+
+    return true;
+}
+
+void setTextureFromFileHeader(Texture *texture, TextureFileHeader *header) {
+    texture->width     = header->width;
+    texture->height    = header->height;
+    texture->mip_count = header->mip_count;
+    texture->format    = header->format;
+    texture->wrap      = header->wrap;
+    texture->mipmap    = header->mipmap;
+    texture->tiled     = header->tiled;
+    texture->filter    = TextureFilter_Bilinear;
+}
+
+// Textures with files that are corrupt (or from another version) are left without mips, so are never sampled:
+void initEmptyTexture(Texture *texture) {
+    texture->width = texture->height = 0;
+    texture->mip_count = 0;
+    texture->format = TextureFormat_TexelQuads;
+    texture->wrap = texture->mipmap = texture->tiled = false;
+    texture->filter = TextureFilter_Bilinear;
+    texture->mips = null;
+}
+
+// Map a texture file into memory and point the texels of its mips into it, returning false for files in the older layout.
+// The mapping is never unmapped, and as it's never written to its pages are shared with any other process that maps
+// the same file (so processes that render the same scene share a single copy of its textures):
+bool mapTextureFromFile(Texture *texture, char *file_path, Platform *platform, Memory *memory) {
+    u64 file_size = 0;
+    TextureFileHeader *header = platform->mapFile ? (TextureFileHeader*)platform->mapFile(file_path, &file_size) : null;
+    if (!header) return false;
+    if (!isTextureFileHeaderValid(header, file_size)) {
+        bool is_texture_file = isTextureFile(header, file_size);
+        platform->unmapFile(header, file_size);
+        if (is_texture_file) initEmptyTexture(texture);
+        return is_texture_file;
+    }
+
+    setTextureFromFileHeader(texture, header);
+    texture->mips = (TextureMip*)allocateMemory(memory, sizeof(TextureMip) * texture->mip_count);
+
+    TextureFileMip *file_mip = getTextureFileMips(header);
+    TextureMip *texture_mip = texture->mips;
+    for (u8 mip_index = 0; mip_index < texture->mip_count; mip_index++, texture_mip++, file_mip++) {
+        texture_mip->width  = file_mip->width;
+        texture_mip->height = file_mip->height;
+        texture_mip->texel_data = (u8*)header + file_mip->offset;
+    }
+
+    return true;
+}
+
+void saveTextureToFile(Texture *texture, char* file_path, Platform *platform) {
+    TextureFileHeader header;
+    u8 *byte = (u8*)&header;
+    for (u32 i = 0; i < sizeof(TextureFileHeader); i++) byte[i] = 0;
+    header.magic     = TEXTURE_FILE_MAGIC;
+    header.version   = TEXTURE_FILE_VERSION;
+    header.width     = texture->width;
+    header.height    = texture->height;
+    header.mip_count = texture->mip_count;
+    header.format    = texture->format;
+    header.wrap      = texture->wrap;
+    header.mipmap    = texture->mipmap;
+    header.tiled     = texture->tiled;
+
+    // Each mip starts on its own cache line, after the table of all of them:
+    TextureFileMip file_mips[16]; // Enough for mipmapping the largest (16-bit) dimensions
+    u64 offset = sizeof(TextureFileHeader) + sizeof(TextureFileMip) * texture->mip_count;
+    TextureMip *texture_mip = texture->mips;
+    for (u8 mip_index = 0; mip_index < texture->mip_count; mip_index++, texture_mip++) {
+        file_mips[mip_index].width  = texture_mip->width;
+        file_mips[mip_index].height = texture_mip->height;
+        file_mips[mip_index].size   = getTextureMipDataSize(texture->format, texture_mip->width, texture_mip->height, texture->tiled);
+        file_mips[mip_index].offset = offset = alignFileOffset(offset, TEXTURE_FILE_ALIGNMENT);
+        offset += file_mips[mip_index].size;
+    }
+    header.file_size = offset;
+
+    void *file = platform->openFileForWriting(file_path);
+    platform->writeToFile(&header, sizeof(TextureFileHeader), file);
+    platform->writeToFile(file_mips, sizeof(TextureFileMip) * texture->mip_count, file);
+
+    offset = sizeof(TextureFileHeader) + sizeof(TextureFileMip) * texture->mip_count;
+    texture_mip = texture->mips;
+    for (u8 mip_index = 0; mip_index < texture->mip_count; mip_index++, texture_mip++) {
+        writeZerosToFile(file_mips[mip_index].offset - offset, platform, file);
+        platform->writeToFile(texture_mip->texel_data, file_mips[mip_index].size, file);
+        offset = file_mips[mip_index].offset + file_mips[mip_index].size;
+    }
+
+    platform->closeFile(file);
+}
 
 u32 getTextureMemorySize(char* file_path, Platform *platform) {
+    // Mapped texture files only take memory for the array of their mips:
+    u64 file_size = 0;
+    TextureFileHeader *header = platform->mapFile ? (TextureFileHeader*)platform->mapFile(file_path, &file_size) : null;
+    if (header) {
+        bool is_texture_file = isTextureFile(header, file_size);
+        u32 memory_size = isTextureFileHeaderValid(header, file_size) ? sizeof(TextureMip) * header->mip_count : 0;
+        platform->unmapFile(header, file_size);
+        if (is_texture_file)
+            return memory_size;
+    }
+
     void *file = platform->openFileForReading(file_path);
 
     Texture texture;
     platform->readFromFile(&texture.width,  sizeof(u16),  file);
     platform->readFromFile(&texture.height, sizeof(u16),  file);
     platform->readFromFile(&texture.mipmap, sizeof(bool), file);
+    platform->readFromFile(&texture.wrap,   sizeof(bool), file);
+    platform->readFromFile(&texture.mip_count, sizeof(u8), file);
+    platform->readFromFile(&texture.format,    sizeof(u8), file);
+    platform->readFromFile(&texture.tiled,     sizeof(bool), file);
+    platform->closeFile(file);
 
     u16 mip_width  = texture.width;
     u16 mip_height = texture.height;
 
     u32 memory_size = 0;
-    texture.mip_count = 0;
-    do {
+    for (u8 mip_index = 0; mip_index < texture.mip_count; mip_index++) {
         memory_size += sizeof(TextureMip);
-        memory_size += (mip_width + 1) * (mip_height + 1) * sizeof(TexelQuad);
+        memory_size += getTextureMipDataSize(texture.format, mip_width, mip_height, texture.tiled);
 
         mip_width /= 2;
         mip_height /= 2;
-        texture.mip_count++;
-    } while (texture.mipmap && mip_width > 2 && mip_height > 2);
-
-    platform->closeFile(file);
+    }
 
     return memory_size;
 }
 
 void loadTextureFromFile(Texture *texture, char* file_path, Platform *platform, Memory *memory) {
+    if (mapTextureFromFile(texture, file_path, platform, memory))
+        return;
+
     void *file = platform->openFileForReading(file_path);
     platform->readFromFile(&texture->width,  sizeof(u16),  file);
     platform->readFromFile(&texture->height, sizeof(u16),  file);
     platform->readFromFile(&texture->mipmap, sizeof(bool), file);
     platform->readFromFile(&texture->wrap,   sizeof(bool), file);
     platform->readFromFile(&texture->mip_count, sizeof(u8), file);
+    platform->readFromFile(&texture->format,    sizeof(u8), file);
+    platform->readFromFile(&texture->tiled,     sizeof(bool), file);
+    texture->filter = TextureFilter_Bilinear;
 
     texture->mips = (TextureMip*)allocateMemory(memory, sizeof(TextureMip) * texture->mip_count);
 
-    u32 size, height, stride;
+    u32 size;
     TextureMip *texture_mip = texture->mips;
     for (u8 mip_index = 0; mip_index < texture->mip_count; mip_index++, texture_mip++) {
         platform->readFromFile(&texture_mip->width,  sizeof(u16), file);
         platform->readFromFile(&texture_mip->height, sizeof(u16), file);
 
-        height = texture_mip->height + 1;
-        stride = texture_mip->width  + 1;
-
-        size = sizeof(TexelQuad) * height * stride;
-        texture_mip->texel_quads = (TexelQuad*)allocateMemory(memory, size);
-        platform->readFromFile(texture_mip->texel_quads, size, file);
+        size = getTextureMipDataSize(texture->format, texture_mip->width, texture_mip->height, texture->tiled);
+        texture_mip->texel_data = (u8*)allocateMemory(memory, size);
+        platform->readFromFile(texture_mip->texel_data, size, file);
     }
 
     platform->closeFile(file);
 }
 
 
+#define TRIANGLE_RECORDS_PER_IO 256
+
+void readTrianglesFromFile(Mesh *mesh, Platform *platform, void *file) {
+    // Triangles are stored whole, but kept in memory as separate intersection and shading arrays:
+    TriangleRecord records[TRIANGLE_RECORDS_PER_IO], *record;
+    Triangle *triangle = mesh->triangles;
+    TriangleShading *shading = mesh->triangle_shading;
+    u32 count;
+    for (u32 start = 0; start < mesh->triangle_reference_count; start += count) {
+        count = mesh->triangle_reference_count - start;
+        if (count > TRIANGLE_RECORDS_PER_IO) count = TRIANGLE_RECORDS_PER_IO;
+        platform->readFromFile(records, sizeof(TriangleRecord) * count, file);
+
+        record = records;
+        for (u32 i = 0; i < count; i++, record++, triangle++, shading++) {
+            triangle->world_to_tangent = record->world_to_tangent;
+            triangle->position = record->position;
+            triangle->normal = record->normal;
+            triangle->padding = 0;
+            for (u8 v = 0; v < 3; v++) {
+                shading->vertex_normals[v] = record->vertex_normals[v];
+                shading->uvs[v] = record->uvs[v];
+            }
+            shading->area_of_parallelogram = record->area_of_parallelogram;
+            shading->area_of_uv = record->area_of_uv;
+        }
+    }
+}
+
+// The size of each section of a mesh file, as implied by the counts in its header:
+void getMeshFileSectionSizes(MeshFileHeader *header, u64 *section_sizes) {
+    u64 triangle_count = header->triangle_count;
+    u64 reference_count = header->triangle_reference_count;
+    section_sizes[MeshSection_Triangles]             = sizeof(Triangle)              * reference_count;
+    section_sizes[MeshSection_TriangleShading]       = sizeof(TriangleShading)       * reference_count;
+    section_sizes[MeshSection_TrianglePackets]       = sizeof(TrianglePacket)        * (u64)header->triangle_packet_count;
+    section_sizes[MeshSection_BVHNodes]              = sizeof(BVHNode)               * (u64)header->bvh_node_count;
+    section_sizes[MeshSection_BVHLeafIds]            = sizeof(u32)                   * reference_count;
+    section_sizes[MeshSection_WideBVHNodes]          = (u64)header->wide_bvh_node_size * (u64)header->wide_bvh_node_count;
+    section_sizes[MeshSection_VertexPositions]       = sizeof(vec3)                  * (u64)header->vertex_count;
+    section_sizes[MeshSection_VertexPositionIndices] = sizeof(TriangleVertexIndices) * triangle_count;
+    section_sizes[MeshSection_EdgeVertexIndices]     = sizeof(EdgeVertexIndices)     * (u64)header->edge_count;
+    section_sizes[MeshSection_VertexUVs]             = sizeof(vec2)                  * (u64)header->uvs_count;
+    section_sizes[MeshSection_VertexUVsIndices]      = sizeof(TriangleVertexIndices) * (header->uvs_count ? triangle_count : 0);
+    section_sizes[MeshSection_VertexNormals]         = sizeof(vec3)                  * (u64)header->normals_count;
+    section_sizes[MeshSection_VertexNormalIndices]   = sizeof(TriangleVertexIndices) * (header->normals_count ? triangle_count : 0);
+}
+
+// Lay out the file of a mesh, setting the size of each of its sections:
+void initMeshFileHeader(MeshFileHeader *header, Mesh *mesh, u64 *section_sizes) {
+    u8 *byte = (u8*)header;
+    for (u32 i = 0; i < sizeof(MeshFileHeader); i++) byte[i] = 0;
+
+    header->magic   = MESH_FILE_MAGIC;
+    header->version = MESH_FILE_VERSION;
+    header->aabb    = mesh->aabb;
+    header->vertex_count   = mesh->vertex_count;
+    header->triangle_count = mesh->triangle_count;
+    header->triangle_reference_count = mesh->triangle_reference_count;
+    header->triangle_packet_count    = getTrianglePacketCount(mesh);
+    header->edge_count     = mesh->edge_count;
+    header->uvs_count      = mesh->uvs_count;
+    header->normals_count  = mesh->normals_count;
+    header->bvh_node_count = mesh->bvh.node_count;
+    header->bvh_height     = mesh->bvh.height;
+    header->wide_bvh_node_count = mesh->wide_bvh.nodes ? mesh->wide_bvh.node_count : 0;
+    header->wide_bvh_height     = mesh->wide_bvh.nodes ? mesh->wide_bvh.height : 0;
+    header->wide_bvh_width      = WIDE_BVH_WIDTH;
+    header->wide_bvh_node_size  = sizeof(WideBVHNode);
+
+    getMeshFileSectionSizes(header, section_sizes);
+
+    u64 offset = sizeof(MeshFileHeader);
+    for (u8 section = 0; section < MeshSection_Count; section++) {
+        if (!section_sizes[section]) continue;
+
+        offset = alignFileOffset(offset, MESH_FILE_ALIGNMENT);
+        header->section_offsets[section] = offset;
+        offset += section_sizes[section];
+    }
+    header->file_size = offset;
+}
+
+// Mesh files are told apart from ones in the older layout (that are read into memory) by their magic number.
+// Those start with the bounds of the mesh instead, which are centered around the origin so never match it:
+INLINE bool isMeshFile(MeshFileHeader *header, u64 file_size) {
+    return file_size >= sizeof(MeshFileHeader) && header->magic == MESH_FILE_MAGIC;
+}
+
+// A mesh file is only used when every one of its sections is (aligned) within the file, at the size its counts imply.
+// Sizes are checked against what remains of the file past each offset, so that no sum of them can overflow:
+bool isMeshFileHeaderValid(MeshFileHeader *header, u64 file_size) {
+    if (!isMeshFile(header, file_size) ||
+        header->version != MESH_FILE_VERSION ||
+        header->file_size > file_size ||
+        header->triangle_count == 0 ||
+        header->bvh_node_count == 0 ||
+        header->triangle_reference_count < header->triangle_count ||
+        header->triangle_packet_count > header->triangle_reference_count)
+        return false;
+
+    u64 section_sizes[MeshSection_Count];
+    getMeshFileSectionSizes(header, section_sizes);
+    for (u8 section = 0; section < MeshSection_Count; section++) {
+        u64 offset = header->section_offsets[section];
+        if (!section_sizes[section]) {
+            if (offset) return false;
+            continue;
+        }
+        if (offset < sizeof(MeshFileHeader) ||
+            offset % MESH_FILE_ALIGNMENT ||
+            offset > header->file_size ||
+            section_sizes[section] > header->file_size - offset)
+            return false;
+    }
+
+    return true;
+}
+
+// The wide BVH of a mesh file is only used in place when its nodes are laid out as in this build:
+INLINE bool hasUsableWideBVH(MeshFileHeader *header) {
+    return header->wide_bvh_node_count &&
+           header->wide_bvh_width == WIDE_BVH_WIDTH &&
+           header->wide_bvh_node_size == sizeof(WideBVHNode);
+}
+
+INLINE void* getMeshFileSection(MeshFileHeader *header, MeshSection section) {
+    return header->section_offsets[section] ? (u8*)header + header->section_offsets[section] : null;
+}
+
+void setMeshFromFileHeader(Mesh *mesh, MeshFileHeader *header) {
+    mesh->aabb           = header->aabb;
+    mesh->vertex_count   = header->vertex_count;
+    mesh->triangle_count = header->triangle_count;
+    mesh->triangle_reference_count = header->triangle_reference_count;
+    mesh->edge_count     = header->edge_count;
+    mesh->uvs_count      = header->uvs_count;
+    mesh->normals_count  = header->normals_count;
+    mesh->bvh.node_count = header->bvh_node_count;
+    mesh->bvh.height     = header->bvh_height;
+    mesh->wide_bvh.node_count = header->wide_bvh_node_count;
+    mesh->wide_bvh.height     = header->wide_bvh_height;
+}
+
+// Memory for the triangles and BVHs of a mesh, with room for the given number of triangle references:
+u32 getMeshBVHMemorySize(u32 capacity) {
+    return capacity * (sizeof(Triangle) + sizeof(TriangleShading) + sizeof(TrianglePacket)) +
+           getBVHMemorySize(capacity) + getWideBVHMemorySize(capacity);
+}
+
+// Meshes with files that are corrupt (or from another version) are left empty, so are never hit:
+void initEmptyMesh(Mesh *mesh) {
+    mesh->aabb.min = mesh->aabb.max = getVec3Of(0);
+    mesh->triangle_count = mesh->vertex_count = mesh->edge_count = mesh->normals_count = mesh->uvs_count = 0;
+    mesh->triangle_reference_count = mesh->triangle_reference_capacity = 0;
+    mesh->vertex_positions = mesh->vertex_normals = null;
+    mesh->vertex_uvs = null;
+    mesh->vertex_position_indices = mesh->vertex_normal_indices = mesh->vertex_uvs_indices = null;
+    mesh->edge_vertex_indices = null;
+    mesh->triangles = null;
+    mesh->triangle_shading = null;
+    mesh->triangle_packets = null;
+    mesh->bvh.nodes = null;
+    mesh->bvh.leaf_ids = null;
+    mesh->bvh.node_count = mesh->bvh.height = 0;
+    mesh->wide_bvh.nodes = null;
+    mesh->wide_bvh.node_count = mesh->wide_bvh.height = 0;
+    mesh->is_mapped = false;
+}
+
+// Map a mesh file into memory and point the mesh's arrays into it, returning false for files in the older layout.
+// The mapping is never unmapped, and is private: Its pages are shared with other processes that map the same file.
+bool mapMeshFromFile(Mesh *mesh, char *file_path, Platform *platform, Memory *memory) {
+    u64 file_size = 0;
+    MeshFileHeader *header = platform->mapFile ? (MeshFileHeader*)platform->mapFile(file_path, &file_size) : null;
+    if (!header) return false;
+    if (!isMeshFileHeaderValid(header, file_size)) {
+        bool is_mesh_file = isMeshFile(header, file_size);
+        platform->unmapFile(header, file_size);
+        if (is_mesh_file) initEmptyMesh(mesh);
+        return is_mesh_file;
+    }
+
+    setMeshFromFileHeader(mesh, header);
+    mesh->is_mapped = true;
+    mesh->triangle_reference_capacity = mesh->triangle_reference_count;
+    mesh->triangles               = (Triangle*             )getMeshFileSection(header, MeshSection_Triangles);
+    mesh->triangle_shading        = (TriangleShading*      )getMeshFileSection(header, MeshSection_TriangleShading);
+    mesh->triangle_packets        = (TrianglePacket*       )getMeshFileSection(header, MeshSection_TrianglePackets);
+    mesh->bvh.nodes               = (BVHNode*              )getMeshFileSection(header, MeshSection_BVHNodes);
+    mesh->bvh.leaf_ids            = (u32*                  )getMeshFileSection(header, MeshSection_BVHLeafIds);
+    mesh->vertex_positions        = (vec3*                 )getMeshFileSection(header, MeshSection_VertexPositions);
+    mesh->vertex_position_indices = (TriangleVertexIndices*)getMeshFileSection(header, MeshSection_VertexPositionIndices);
+    mesh->edge_vertex_indices     = (EdgeVertexIndices*    )getMeshFileSection(header, MeshSection_EdgeVertexIndices);
+    mesh->vertex_uvs              = (vec2*                 )getMeshFileSection(header, MeshSection_VertexUVs);
+    mesh->vertex_uvs_indices      = (TriangleVertexIndices*)getMeshFileSection(header, MeshSection_VertexUVsIndices);
+    mesh->vertex_normals          = (vec3*                 )getMeshFileSection(header, MeshSection_VertexNormals);
+    mesh->vertex_normal_indices   = (TriangleVertexIndices*)getMeshFileSection(header, MeshSection_VertexNormalIndices);
+
+    if (hasUsableWideBVH(header))
+        mesh->wide_bvh.nodes = (WideBVHNode*)getMeshFileSection(header, MeshSection_WideBVHNodes);
+    else {
+        // Leaves get split into packets differently for other widths, so the packets of the file might not have room
+        // for the rebuilt ones (there are never more packets than triangle references though):
+        initWideBVH(&mesh->wide_bvh, mesh->triangle_reference_count, memory);
+        mesh->triangle_packets = (TrianglePacket*)allocateMemory(memory, sizeof(TrianglePacket) * mesh->triangle_reference_count);
+        buildWideBVH(&mesh->wide_bvh, &mesh->bvh);
+        buildTrianglePackets(mesh);
+    }
+
+    return true;
+}
+
+// Rebuilding the BVH of a mesh writes to its triangles and may need more room for them (with spatial splits),
+// so a mapped mesh (or one without the capacity) has to be moved into memory first:
+void moveMeshToMemory(Mesh *mesh, u32 capacity, Memory *memory) {
+    if (!mesh->is_mapped && mesh->triangle_reference_capacity >= capacity) return;
+
+    u32 packet_count = getTrianglePacketCount(mesh);
+    Triangle        *triangles        = mesh->triangles;
+    TriangleShading *triangle_shading = mesh->triangle_shading;
+    TrianglePacket  *triangle_packets = mesh->triangle_packets;
+    BVH bvh = mesh->bvh;
+    WideBVH wide_bvh = mesh->wide_bvh;
+
+    initBVH(&mesh->bvh, capacity, memory);
+    initWideBVH(&mesh->wide_bvh, capacity, memory);
+    mesh->triangles        = (Triangle*       )allocateMemory(memory, sizeof(Triangle)        * capacity);
+    mesh->triangle_shading = (TriangleShading*)allocateMemory(memory, sizeof(TriangleShading) * capacity);
+    mesh->triangle_packets = (TrianglePacket* )allocateMemory(memory, sizeof(TrianglePacket)  * capacity);
+
+    for (u32 i = 0; i < mesh->triangle_reference_count; i++) {
+        mesh->triangles[i] = triangles[i];
+        mesh->triangle_shading[i] = triangle_shading[i];
+        mesh->bvh.leaf_ids[i] = bvh.leaf_ids[i];
+    }
+    for (u32 i = 0; i < bvh.node_count; i++) mesh->bvh.nodes[i] = bvh.nodes[i];
+    for (u32 i = 0; i < wide_bvh.node_count; i++) mesh->wide_bvh.nodes[i] = wide_bvh.nodes[i];
+    for (u32 i = 0; i < packet_count; i++) mesh->triangle_packets[i] = triangle_packets[i];
+    mesh->bvh.node_count = bvh.node_count;
+    mesh->bvh.height = bvh.height;
+    mesh->wide_bvh.node_count = wide_bvh.node_count;
+    mesh->wide_bvh.height = wide_bvh.height;
+    mesh->triangle_reference_capacity = capacity;
+    mesh->is_mapped = false;
+}
+
 u32 getMeshMemorySize(Mesh *mesh, char *file_path, Platform *platform) {
+    // Mapped mesh files are used in place, so they only need memory for a wide BVH (and packets) that has to be rebuilt
+    // (memory for moving them into before their BVHs get rebuilt is set aside separately, only where they are):
+    u64 file_size = 0;
+    MeshFileHeader *header = platform->mapFile ? (MeshFileHeader*)platform->mapFile(file_path, &file_size) : null;
+    if (header) {
+        u32 memory_size = 0;
+        bool is_mesh_file = isMeshFile(header, file_size);
+        if (!isMeshFileHeaderValid(header, file_size))
+            initEmptyMesh(mesh);
+        else {
+            setMeshFromFileHeader(mesh, header);
+            if (!hasUsableWideBVH(header))
+                memory_size += getWideBVHMemorySize(mesh->triangle_reference_count) +
+                               sizeof(TrianglePacket) * mesh->triangle_reference_count;
+        }
+        platform->unmapFile(header, file_size);
+        if (is_mesh_file)
+            return memory_size;
+    }
+
     void *file = platform->openFileForReading(file_path);
 
     platform->readFromFile(&mesh->aabb,           sizeof(AABB), file);
     platform->readFromFile(&mesh->vertex_count,   sizeof(u32),  file);
     platform->readFromFile(&mesh->triangle_count, sizeof(u32),  file);
+    platform->readFromFile(&mesh->triangle_reference_count, sizeof(u32), file);
     platform->readFromFile(&mesh->edge_count,     sizeof(u32),  file);
     platform->readFromFile(&mesh->uvs_count,      sizeof(u32),  file);
     platform->readFromFile(&mesh->normals_count,  sizeof(u32),  file);
     platform->readFromFile(&mesh->bvh.node_count, sizeof(u32),  file);
     platform->readFromFile(&mesh->bvh.height,     sizeof(u32),  file);
 
-    u32 memory_size = 0;
+    u32 memory_size = getMeshBVHMemorySize(mesh->triangle_reference_count);
     memory_size += mesh->vertex_count   * sizeof(vec3);
     memory_size += mesh->triangle_count * sizeof(TriangleVertexIndices);
     memory_size += mesh->edge_count     * sizeof(EdgeVertexIndices);
-    memory_size += mesh->triangle_count * sizeof(Triangle);
 
     if (mesh->uvs_count) {
         memory_size += sizeof(vec2) * mesh->uvs_count;
@@ -87,27 +509,34 @@ u32 getMeshMemorySize(Mesh *mesh, char *file_path, Platform *platform) {
 
     platform->closeFile(file);
 
-    memory_size += getBVHMemorySize(mesh->triangle_count);
-
     return memory_size;
 }
 
 void loadMeshFromFile(Mesh *mesh, char *file_path, Platform *platform, Memory *memory) {
+    if (mapMeshFromFile(mesh, file_path, platform, memory))
+        return;
+
     void *file = platform->openFileForReading(file_path);
 
+    mesh->is_mapped               = false;
     mesh->vertex_normals          = null;
     mesh->vertex_normal_indices   = null;
     mesh->vertex_uvs              = null;
     mesh->vertex_uvs_indices      = null;
     mesh->triangles               = null;
+    mesh->triangle_shading        = null;
+    mesh->triangle_packets        = null;
     mesh->bvh.nodes               = null;
     mesh->bvh.leaf_ids            = null;
 
     platform->readFromFile(&mesh->aabb,           sizeof(AABB), file);
     platform->readFromFile(&mesh->vertex_count,   sizeof(u32),  file);
     platform->readFromFile(&mesh->triangle_count, sizeof(u32),  file);
+    platform->readFromFile(&mesh->triangle_reference_count, sizeof(u32), file);
 
-    initBVH(&mesh->bvh, mesh->triangle_count, memory);
+    u32 capacity = mesh->triangle_reference_capacity = mesh->triangle_reference_count;
+    initBVH(&mesh->bvh, capacity, memory);
+    initWideBVH(&mesh->wide_bvh, capacity, memory);
 
     platform->readFromFile(&mesh->edge_count,     sizeof(u32),  file);
     platform->readFromFile(&mesh->uvs_count,      sizeof(u32),  file);
@@ -118,7 +547,9 @@ void loadMeshFromFile(Mesh *mesh, char *file_path, Platform *platform, Memory *m
     mesh->vertex_positions        = (vec3*                 )allocateMemory(memory, sizeof(vec3)                  * mesh->vertex_count);
     mesh->vertex_position_indices = (TriangleVertexIndices*)allocateMemory(memory, sizeof(TriangleVertexIndices) * mesh->triangle_count);
     mesh->edge_vertex_indices     = (EdgeVertexIndices*    )allocateMemory(memory, sizeof(EdgeVertexIndices)     * mesh->edge_count);
-    mesh->triangles               = (Triangle*             )allocateMemory(memory, sizeof(Triangle)              * mesh->triangle_count);
+    mesh->triangles               = (Triangle*             )allocateMemory(memory, sizeof(Triangle)              * capacity);
+    mesh->triangle_shading        = (TriangleShading*      )allocateMemory(memory, sizeof(TriangleShading)       * capacity);
+    mesh->triangle_packets        = (TrianglePacket*       )allocateMemory(memory, sizeof(TrianglePacket)        * capacity);
 
     platform->readFromFile(mesh->vertex_positions,             sizeof(vec3)                  * mesh->vertex_count,   file);
     platform->readFromFile(mesh->vertex_position_indices,      sizeof(TriangleVertexIndices) * mesh->triangle_count, file);
@@ -136,40 +567,47 @@ void loadMeshFromFile(Mesh *mesh, char *file_path, Platform *platform, Memory *m
         platform->readFromFile(mesh->vertex_normal_indices,         sizeof(TriangleVertexIndices) * mesh->triangle_count, file);
     }
 
-    platform->readFromFile(mesh->triangles,                    sizeof(Triangle)              * mesh->triangle_count, file);
+    readTrianglesFromFile(mesh, platform, file);
     platform->readFromFile(mesh->bvh.nodes,                    sizeof(BVHNode)               * mesh->bvh.node_count, file);
-    platform->readFromFile(mesh->bvh.leaf_ids,                 sizeof(u32)                   * mesh->triangle_count, file);
+    platform->readFromFile(mesh->bvh.leaf_ids,                 sizeof(u32)                   * mesh->triangle_reference_count, file);
 
     platform->closeFile(file);
+
+    buildWideBVH(&mesh->wide_bvh, &mesh->bvh);
+    buildTrianglePackets(mesh);
 }
 
 void saveMeshToFile(Mesh *mesh, char* file_path, Platform *platform) {
+    MeshFileHeader header;
+    u64 section_sizes[MeshSection_Count];
+    initMeshFileHeader(&header, mesh, section_sizes);
+
+    void *section_data[MeshSection_Count];
+    section_data[MeshSection_Triangles]             = mesh->triangles;
+    section_data[MeshSection_TriangleShading]       = mesh->triangle_shading;
+    section_data[MeshSection_TrianglePackets]       = mesh->triangle_packets;
+    section_data[MeshSection_BVHNodes]              = mesh->bvh.nodes;
+    section_data[MeshSection_BVHLeafIds]            = mesh->bvh.leaf_ids;
+    section_data[MeshSection_WideBVHNodes]          = mesh->wide_bvh.nodes;
+    section_data[MeshSection_VertexPositions]       = mesh->vertex_positions;
+    section_data[MeshSection_VertexPositionIndices] = mesh->vertex_position_indices;
+    section_data[MeshSection_EdgeVertexIndices]     = mesh->edge_vertex_indices;
+    section_data[MeshSection_VertexUVs]             = mesh->vertex_uvs;
+    section_data[MeshSection_VertexUVsIndices]      = mesh->vertex_uvs_indices;
+    section_data[MeshSection_VertexNormals]         = mesh->vertex_normals;
+    section_data[MeshSection_VertexNormalIndices]   = mesh->vertex_normal_indices;
+
     void *file = platform->openFileForWriting(file_path);
+    platform->writeToFile(&header, sizeof(MeshFileHeader), file);
 
-    platform->writeToFile(&mesh->aabb,           sizeof(AABB), file);
-    platform->writeToFile(&mesh->vertex_count,   sizeof(u32),  file);
-    platform->writeToFile(&mesh->triangle_count, sizeof(u32),  file);
-    platform->writeToFile(&mesh->edge_count,     sizeof(u32),  file);
-    platform->writeToFile(&mesh->uvs_count,      sizeof(u32),  file);
-    platform->writeToFile(&mesh->normals_count,  sizeof(u32),  file);
-    platform->writeToFile(&mesh->bvh.node_count, sizeof(u32),  file);
-    platform->writeToFile(&mesh->bvh.height,     sizeof(u32),  file);
-
-    platform->writeToFile(mesh->vertex_positions,        sizeof(vec3)                  * mesh->vertex_count,   file);
-    platform->writeToFile(mesh->vertex_position_indices, sizeof(TriangleVertexIndices) * mesh->triangle_count, file);
-    platform->writeToFile(mesh->edge_vertex_indices,     sizeof(EdgeVertexIndices)     * mesh->edge_count,     file);
-    if (mesh->uvs_count) {
-        platform->writeToFile(mesh->vertex_uvs,          sizeof(vec2)                  * mesh->uvs_count,      file);
-        platform->writeToFile(mesh->vertex_uvs_indices,  sizeof(TriangleVertexIndices) * mesh->triangle_count, file);
-    }
-    if (mesh->normals_count) {
-        platform->writeToFile(mesh->vertex_normals,        sizeof(vec3)                  * mesh->normals_count,  file);
-        platform->writeToFile(mesh->vertex_normal_indices, sizeof(TriangleVertexIndices) * mesh->triangle_count, file);
-    }
+    u64 offset = sizeof(MeshFileHeader);
+    for (u8 section = 0; section < MeshSection_Count; section++) {
+        if (!header.section_offsets[section]) continue;
 
-    platform->writeToFile(mesh->triangles,               sizeof(Triangle)              * mesh->triangle_count, file);
-    platform->writeToFile(mesh->bvh.nodes,               sizeof(BVHNode)               * mesh->bvh.node_count, file);
-    platform->writeToFile(mesh->bvh.leaf_ids,            sizeof(u32)                   * mesh->triangle_count, file);
+        writeZerosToFile(header.section_offsets[section] - offset, platform, file);
+        platform->writeToFile(section_data[section], (unsigned long)section_sizes[section], file);
+        offset = header.section_offsets[section] + section_sizes[section];
+    }
 
     platform->closeFile(file);
 }
@@ -44,6 +44,11 @@ INLINE vec3 convertPositionToObjectSpace(vec3 position, Primitive *primitive) {
     return position;
 }
 
+INLINE vec3 convertDirectionToObjectSpace(vec3 direction, Primitive *primitive) {
+    if (primitive->flags & IS_ROTATED)              direction = mulVec3Quat(direction, conjugate(primitive->rotation));
+    if (primitive->flags & IS_SCALED_NON_UNIFORMLY) direction = mulVec3(direction, oneOverVec3(primitive->scale));
+    return direction;
+}
 INLINE vec3 convertDirectionToWorldSpace(vec3 direction, Primitive *primitive) {
     if (primitive->flags & IS_SCALED_NON_UNIFORMLY) direction = mulVec3(direction, oneOverVec3(primitive->scale));
     if (primitive->flags & IS_ROTATED)              direction = mulVec3Quat(direction,         primitive->rotation);
@@ -1,8 +1,28 @@
 #pragma once
 
 #include "../core/types.h"
+#include "../math/vec2.h"
+#include "../math/vec3.h"
+#include "../math/vec4.h"
 
-INLINE vec4 sampleTextureMip(TextureMip *mip, vec2 UV) {
+// Tiles are 4x4 texels, laid out row-major both within a tile and across tiles:
+INLINE u32 getTexelIndex(u32 x, u32 y, u32 stride, bool tiled) {
+    return tiled ? ((((y >> 2) * ((stride + 3) >> 2) + (x >> 2)) << 4) | ((y & 3) << 2) | (x & 3)) : y * stride + x;
+}
+
+INLINE u32 getTexelCount(u32 width, u32 height, bool tiled) {
+    return tiled ? ((width + 3) & ~3u) * ((height + 3) & ~3u) : width * height;
+}
+
+INLINE u32 getTextureMipDataSize(u8 format, u16 width, u16 height, bool tiled) {
+    switch (format) {
+        case TextureFormat_RGBA8: return sizeof(TexelRGBA)  * getTexelCount(width + 2, height + 2, tiled);
+        case TextureFormat_BC1  : return sizeof(TexelBlock) * ((width + 3) / 4) * ((height + 3) / 4);
+        default                 : return sizeof(TexelQuad)  * getTexelCount(width + 1, height + 1, tiled);
+    }
+}
+
+INLINE vec4 sampleTextureMip(TextureMip *mip, vec2 UV, bool tiled) {
     f32 u = UV.u;
     f32 v = UV.v;
     if (u > 1) u -= (f32)((u32)u);
@@ -21,7 +41,9 @@ INLINE vec4 sampleTextureMip(TextureMip *mip, vec2 UV) {
     const f32 bl = b * l * COLOR_COMPONENT_TO_FLOAT;
     const f32 br = b * r * COLOR_COMPONENT_TO_FLOAT;
 
-    const TexelQuad texel_quad = mip->texel_quads[y * (mip->width + 1) + x];
+    // Texel quads are sampled with scalar code: The corners of each component are already gathered together, which makes
+    // the 12 multiply-adds cheaper than regrouping the corners into vectors first (as measured with SSE2):
+    const TexelQuad texel_quad = mip->texel_quads[getTexelIndex(x, y, mip->width + 1, tiled)];
     return Vec4(
             fast_mul_add((f32)texel_quad.R.BR, br, fast_mul_add((f32)texel_quad.R.BL, bl, fast_mul_add((f32)texel_quad.R.TR, tr, (f32)texel_quad.R.TL * tl))),
             fast_mul_add((f32)texel_quad.G.BR, br, fast_mul_add((f32)texel_quad.G.BL, bl, fast_mul_add((f32)texel_quad.G.TR, tr, (f32)texel_quad.G.TL * tl))),
@@ -29,19 +51,241 @@ INLINE vec4 sampleTextureMip(TextureMip *mip, vec2 UV) {
             1.0f);
 }
 
-INLINE vec4 sampleTexture(Texture *texture, vec2 UV, vec2 dUV) {
-    u8 mip_level = 0;
-    if (texture->mipmap) {
-        const f32 pixel_width  = dUV.u * (f32)texture->width;
-        const f32 pixel_height = dUV.v * (f32)texture->height;
-        f32 pixel_size = (f32)(pixel_width + pixel_height) * 0.5f;
-        const u8 last_mip = texture->mip_count - 1;
+// The border of an RGBA8 mip already holds the wrapped (or clamped) texels, so the 2x2 footprint of a bilinear fetch
+// is always 2 adjacent texels on 2 adjacent rows (starting at the same padded coordinates a texel quad would be at):
+INLINE vec4 sampleTextureMipRGBA8(TextureMip *mip, vec2 UV, bool tiled) {
+    f32 u = UV.u;
+    f32 v = UV.v;
+    if (u > 1) u -= (f32)((u32)u);
+    if (v > 1) v -= (f32)((u32)v);
+
+    const f32 U = u * (f32)mip->width  + 0.5f;
+    const f32 V = v * (f32)mip->height + 0.5f;
+    const u32 x = (u32)U;
+    const u32 y = (u32)V;
+    const f32 r = U - (f32)x;
+    const f32 b = V - (f32)y;
+    const f32 l = 1 - r;
+    const f32 t = 1 - b;
+    const f32 tl = t * l * COLOR_COMPONENT_TO_FLOAT;
+    const f32 tr = t * r * COLOR_COMPONENT_TO_FLOAT;
+    const f32 bl = b * l * COLOR_COMPONENT_TO_FLOAT;
+    const f32 br = b * r * COLOR_COMPONENT_TO_FLOAT;
+
+    const u32 stride = mip->width + 2;
+    const TexelRGBA *top_left, *top_right, *bottom_left, *bottom_right;
+    if (tiled) {
+        // The right and bottom neighbours are in the next tile over when on the last column/row of a tile:
+        const u32 right_offset  = (x & 3) == 3 ? 13 : 1;
+        const u32 bottom_offset = (y & 3) == 3 ? (((stride + 3) >> 2) << 4) - 12 : 4;
+        top_left     = mip->texels + getTexelIndex(x, y, stride, true);
+        top_right    = top_left + right_offset;
+        bottom_left  = top_left + bottom_offset;
+        bottom_right = bottom_left + right_offset;
+    } else {
+        top_left     = mip->texels + y * stride + x;
+        top_right    = top_left + 1;
+        bottom_left  = top_left + stride;
+        bottom_right = bottom_left + 1;
+    }
+    vec4 color;
+#ifdef SIMD_SSE
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i top_pair    = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const i32*)top_left),
+                                                                     _mm_cvtsi32_si128(*(const i32*)top_right)), zero);
+    const __m128i bottom_pair = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const i32*)bottom_left),
+                                                                     _mm_cvtsi32_si128(*(const i32*)bottom_right)), zero);
+    __m128 sum =            _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(top_pair,    zero)), _mm_set1_ps(tl));
+    sum = _mm_add_ps(sum,   _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(top_pair,    zero)), _mm_set1_ps(tr)));
+    sum = _mm_add_ps(sum,   _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(bottom_pair, zero)), _mm_set1_ps(bl)));
+    sum = _mm_add_ps(sum,   _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(bottom_pair, zero)), _mm_set1_ps(br)));
+    _mm_storeu_ps(color.components, sum);
+#else
+    color.r = fast_mul_add((f32)bottom_right->R, br, fast_mul_add((f32)bottom_left->R, bl, fast_mul_add((f32)top_right->R, tr, (f32)top_left->R * tl)));
+    color.g = fast_mul_add((f32)bottom_right->G, br, fast_mul_add((f32)bottom_left->G, bl, fast_mul_add((f32)top_right->G, tr, (f32)top_left->G * tl)));
+    color.b = fast_mul_add((f32)bottom_right->B, br, fast_mul_add((f32)bottom_left->B, bl, fast_mul_add((f32)top_right->B, tr, (f32)top_left->B * tl)));
+#endif
+    color.a = 1.0f;
+    return color;
+}
+
+INLINE vec3 decodeTexelBlockColor(u16 color) {
+    return Vec3(
+        (f32)(color >> 11)        * (1.0f / 31.0f),
+        (f32)((color >> 5) & 63)  * (1.0f / 63.0f),
+        (f32)(color        & 31)  * (1.0f / 31.0f)
+    );
+}
 
-        while (pixel_size > 1 && mip_level < last_mip) {
-            pixel_size /= 2;
-            mip_level += 1;
-        }
+INLINE u32 getTexelBlockIndex(const TexelBlock *block, u32 x, u32 y) {
+    return (block->indices >> (((y & 3) << 3) | ((x & 3) << 1))) & 3;
+}
+
+#ifdef SIMD_SSE
+INLINE __m128 decodeTexelBlockColorSSE(u16 color) {
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_setr_epi32(color >> 11, (color >> 5) & 63, color & 31, 0)),
+                      _mm_setr_ps(1.0f / 31.0f, 1.0f / 63.0f, 1.0f / 31.0f, 0));
+}
+
+// The 4 palette colors of a block: Its 2 end-points and the 2 blends of them (or their average and black):
+INLINE void decodeTexelBlockPalette(const TexelBlock *block, __m128 *palette) {
+    palette[0] = decodeTexelBlockColorSSE(block->color0);
+    palette[1] = decodeTexelBlockColorSSE(block->color1);
+    if (block->color0 > block->color1) {
+        const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+        const __m128 delta = _mm_mul_ps(_mm_sub_ps(palette[1], palette[0]), third);
+        palette[2] = _mm_add_ps(palette[0], delta);
+        palette[3] = _mm_sub_ps(palette[1], delta);
+    } else {
+        palette[2] = _mm_mul_ps(_mm_add_ps(palette[0], palette[1]), _mm_set1_ps(0.5f));
+        palette[3] = _mm_setzero_ps();
     }
+}
+#endif
 
-    return sampleTextureMip(texture->mips + mip_level, UV);
-}
\ No newline at end of file
+// Every palette entry is a blend of the 2 end-points, so a texel's weight is split between them by its index:
+INLINE void accumulateTexelBlockWeights(const TexelBlock *block, u32 x, u32 y, f32 weight, f32 *weight0, f32 *weight1) {
+    const u32 index = getTexelBlockIndex(block, x, y);
+    if (index == 0) *weight0 += weight; else
+    if (index == 1) *weight1 += weight; else
+    if (block->color0 > block->color1) {
+        *weight0 += weight * (index == 2 ? (2.0f / 3.0f) : (1.0f / 3.0f));
+        *weight1 += weight * (index == 2 ? (1.0f / 3.0f) : (2.0f / 3.0f));
+    } else if (index == 2) {
+        *weight0 += weight * 0.5f;
+        *weight1 += weight * 0.5f;
+    }
+}
+
+INLINE vec3 blendTexelBlock(const TexelBlock *block, u32 x, u32 y, f32 weight, vec3 color) {
+    f32 weight0 = 0, weight1 = 0;
+    accumulateTexelBlockWeights(block, x, y, weight, &weight0, &weight1);
+    color = scaleAddVec3(decodeTexelBlockColor(block->color0), weight0, color);
+    color = scaleAddVec3(decodeTexelBlockColor(block->color1), weight1, color);
+    return color;
+}
+
+// BC1 blocks carry no border, so the 2x2 footprint is wrapped (or clamped) here. When it falls within a single block
+// (most of the time) the end-points get decoded just once (with SSE, the whole palette is decoded per distinct block):
+INLINE vec4 sampleTextureMipBC1(TextureMip *mip, vec2 UV, bool wrap) {
+    f32 u = UV.u;
+    f32 v = UV.v;
+    if (u > 1) u -= (f32)((u32)u);
+    if (v > 1) v -= (f32)((u32)v);
+
+    const f32 U = u * (f32)mip->width  + 0.5f;
+    const f32 V = v * (f32)mip->height + 0.5f;
+    const u32 x = (u32)U;
+    const u32 y = (u32)V;
+    const f32 r = U - (f32)x;
+    const f32 b = V - (f32)y;
+    const f32 l = 1 - r;
+    const f32 t = 1 - b;
+
+    const u32 last_x = mip->width  - 1;
+    const u32 last_y = mip->height - 1;
+    const u32 left   = x ? x - 1 : (wrap ? last_x : 0);
+    const u32 top    = y ? y - 1 : (wrap ? last_y : 0);
+    const u32 right  = x > last_x ? (wrap ? 0 : last_x) : x;
+    const u32 bottom = y > last_y ? (wrap ? 0 : last_y) : y;
+
+    const u32 stride = (mip->width + 3) >> 2;
+    const TexelBlock *top_left     = mip->texel_blocks + (top    >> 2) * stride + (left  >> 2);
+    const TexelBlock *top_right    = mip->texel_blocks + (top    >> 2) * stride + (right >> 2);
+    const TexelBlock *bottom_left  = mip->texel_blocks + (bottom >> 2) * stride + (left  >> 2);
+    const TexelBlock *bottom_right = mip->texel_blocks + (bottom >> 2) * stride + (right >> 2);
+#ifdef SIMD_SSE
+    __m128 palette[4];
+    decodeTexelBlockPalette(top_left, palette);
+    __m128 sum = _mm_mul_ps(palette[getTexelBlockIndex(top_left, left, top)], _mm_set1_ps(t * l));
+    if (top_right != top_left) decodeTexelBlockPalette(top_right, palette);
+    sum = _mm_add_ps(sum, _mm_mul_ps(palette[getTexelBlockIndex(top_right, right, top)], _mm_set1_ps(t * r)));
+    if (bottom_left != top_right) decodeTexelBlockPalette(bottom_left, palette);
+    sum = _mm_add_ps(sum, _mm_mul_ps(palette[getTexelBlockIndex(bottom_left, left, bottom)], _mm_set1_ps(b * l)));
+    if (bottom_right != bottom_left) decodeTexelBlockPalette(bottom_right, palette);
+    sum = _mm_add_ps(sum, _mm_mul_ps(palette[getTexelBlockIndex(bottom_right, right, bottom)], _mm_set1_ps(b * r)));
+
+    vec4 color;
+    _mm_storeu_ps(color.components, sum);
+    color.a = 1.0f;
+    return color;
+#else
+    vec3 color;
+    if (top_left == bottom_right) {
+        f32 weight0 = 0, weight1 = 0;
+        accumulateTexelBlockWeights(top_left, left,  top,    t * l, &weight0, &weight1);
+        accumulateTexelBlockWeights(top_left, right, top,    t * r, &weight0, &weight1);
+        accumulateTexelBlockWeights(top_left, left,  bottom, b * l, &weight0, &weight1);
+        accumulateTexelBlockWeights(top_left, right, bottom, b * r, &weight0, &weight1);
+        color = scaleVec3(decodeTexelBlockColor(top_left->color0), weight0);
+        color = scaleAddVec3(decodeTexelBlockColor(top_left->color1), weight1, color);
+    } else {
+        color = blendTexelBlock(top_left,     left,  top,    t * l, getVec3Of(0));
+        color = blendTexelBlock(top_right,    right, top,    t * r, color);
+        color = blendTexelBlock(bottom_left,  left,  bottom, b * l, color);
+        color = blendTexelBlock(bottom_right, right, bottom, b * r, color);
+    }
+    return Vec4(color.x, color.y, color.z, 1.0f);
+#endif
+}
+
+INLINE vec4 sampleTextureMipLevel(Texture *texture, u8 mip_level, vec2 UV) {
+    TextureMip *mip = texture->mips + mip_level;
+    switch (texture->format) {
+        case TextureFormat_RGBA8: return sampleTextureMipRGBA8(mip, UV, texture->tiled);
+        case TextureFormat_BC1  : return sampleTextureMipBC1(mip, UV, texture->wrap);
+        default                 : return sampleTextureMip(mip, UV, texture->tiled);
+    }
+}
+
+INLINE vec4 sampleTextureTrilinear(Texture *texture, f32 level, vec2 UV) {
+    const u8 mip_level = (u8)level;
+    const f32 blend = level - (f32)mip_level;
+    vec4 color = sampleTextureMipLevel(texture, mip_level, UV);
+    if (blend > 0) color = lerpVec4(color, sampleTextureMipLevel(texture, mip_level + 1, UV), blend);
+    return color;
+}
+
+INLINE f32 getTextureLevel(Texture *texture, f32 pixel_size) {
+    const f32 last_level = (f32)(texture->mip_count - 1);
+    const f32 level = pixel_size > 1 ? log2f(pixel_size) : 0;
+    return level < last_level ? level : last_level;
+}
+
+// Samples a footprint of dUV across (in UV space) that is stretched along the major axis when one is given.
+// Taps that step outside the texture get wrapped (or clamped) here, as the samplers only expect UVs >= 0:
+INLINE vec4 sampleTexture(Texture *texture, vec2 UV, vec2 dUV, vec2 major_axis) {
+    // Textures that failed to load have no mips, and read as a flat normal (or a pale blue albedo that stands out):
+    if (!texture->mip_count) return Vec4(0.5f, 0.5f, 1.0f, 1.0f);
+
+    const f32 width  = (f32)texture->width;
+    const f32 height = (f32)texture->height;
+    f32 pixel_size = (dUV.u * width + dUV.v * height) * 0.5f;
+    f32 major_size = sqrtf(major_axis.u * major_axis.u * width * width + major_axis.v * major_axis.v * height * height);
+    if (texture->filter != TextureFilter_Anisotropic || !(major_size > pixel_size)) {
+        if (major_size > pixel_size) pixel_size = major_size;
+        f32 level = getTextureLevel(texture, pixel_size);
+        return texture->filter == TextureFilter_Bilinear ?
+            sampleTextureMipLevel(texture, (u8)ceilf(level), UV) :
+            sampleTextureTrilinear(texture, level, UV);
+    }
+
+    const f32 anisotropy = pixel_size > 0 ? major_size / pixel_size : INFINITY;
+    const u32 tap_count = anisotropy < TEXTURE_MAX_ANISOTROPY ? (u32)ceilf(anisotropy) : TEXTURE_MAX_ANISOTROPY;
+    if (pixel_size < major_size / TEXTURE_MAX_ANISOTROPY) pixel_size = major_size / TEXTURE_MAX_ANISOTROPY;
+    const f32 level = getTextureLevel(texture, pixel_size);
+
+    const vec2 step = scaleVec2(major_axis, 1.0f / (f32)tap_count);
+    vec2 tap_UV = scaleAddVec2(major_axis, -0.5f, scaleAddVec2(step, 0.5f, UV));
+    vec2 wrapped_UV;
+    vec4 color = getVec4Of(0);
+    for (u32 tap = 0; tap < tap_count; tap++, tap_UV = addVec2(tap_UV, step)) {
+        if (texture->wrap) {
+            wrapped_UV.u = tap_UV.u - floorf(tap_UV.u);
+            wrapped_UV.v = tap_UV.v - floorf(tap_UV.v);
+        } else
+            wrapped_UV = clampVec2(tap_UV);
+        color = addVec4(color, sampleTextureTrilinear(texture, level, wrapped_UV));
+    }
+    return scaleVec4(color, 1.0f / (f32)tap_count);
+}
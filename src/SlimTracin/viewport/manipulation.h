@@ -68,6 +68,7 @@ void manipulateSelection(Scene *scene, Viewport *viewport, Controls *controls) {
                                        scene->bvh.leaf_ids,
                                        scene->settings.primitives,
                                        false,
+                                       false,
                                        true,
                                        (u16)mouse_pos.x,
                                        (u16)mouse_pos.y);
@@ -235,8 +236,9 @@ void manipulateSelection(Scene *scene, Viewport *viewport, Controls *controls) {
         if (selection->object_type == PrimitiveType_Light)
             uploadLights(scene);
         else {
-            updateSceneBVH(scene, &app->bvh_builder);
+            refitOrRebuildSceneBVH(scene, &app->bvh_builder);
             updateSceneSSB(scene, viewport);
+            updateEmissiveQuads(scene);
         }
     }
 }
@@ -0,0 +1,117 @@
+#ifdef COMPILER_CLANG
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#else
+#define _CRT_SECURE_NO_DEPRECATE
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define WEXITSTATUS(status) (status)
+#else
+#include <sys/wait.h>
+#endif
+
+#include "./SlimTracin/core/base.h"
+
+// Runs every example scene headlessly (through the platform layer's benchmark mode) at a set
+// of fixed resolutions, and merges the per-run JSON lines into a single JSON document.
+// Scenes whose mesh or texture files are missing are reported as skipped.
+
+#ifndef SLIMTRACIN_BENCH_BIN_DIR
+#define SLIMTRACIN_BENCH_BIN_DIR "."
+#endif
+
+#define SCENE_COUNT 9
+#define RESOLUTION_COUNT 2
+
+char *scene_names[SCENE_COUNT] = {
+    (char*)"01_Lights",
+    (char*)"02_Geometry",
+    (char*)"03_BlinnPhong",
+    (char*)"04_GlassMirror",
+    (char*)"05_PBR",
+    (char*)"06_AreaLights",
+    (char*)"07_Meshes",
+    (char*)"08_Modes",
+    (char*)"09_Textures"
+};
+u16 resolutions[RESOLUTION_COUNT][2] = {
+    {640, 360},
+    {1280, 720}
+};
+
+int main(int argc, char *argv[]) {
+    char *output_file_path = null;
+    char *bin_dir = (char*)SLIMTRACIN_BENCH_BIN_DIR;
+    u32 frames = 16;
+    u32 threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && argv[i][0] == '-' && argv[i][1] && !argv[i][2]) {
+            switch (argv[i][1]) {
+                case 'f': frames  = (u32)atoi(argv[++i]); continue;
+                case 't': threads = (u32)atoi(argv[++i]); continue;
+                case 'd': bin_dir = argv[++i]; continue;
+                case 'o': output_file_path = argv[++i]; continue;
+                default: break;
+            }
+        }
+        printf("Usage: %s [-f frames] [-t threads] [-d examples_directory] [-o output.json]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *output = output_file_path ? fopen(output_file_path, "w") : stdout;
+    if (!output) {
+        printf("Unable to open %s for writing\n", output_file_path);
+        return 1;
+    }
+
+    char command[1024];
+    char line[4096];
+    char skipped[SCENE_COUNT * 24];
+    bool first_result = true;
+    bool failed = false;
+    skipped[0] = 0;
+
+    fprintf(output, "{\"frames\": %d, \"results\": [\n", frames);
+    for (u32 s = 0; s < SCENE_COUNT; s++) {
+        bool scene_skipped = false;
+        for (u32 r = 0; r < RESOLUTION_COUNT && !scene_skipped; r++) {
+            sprintf(command, "\"%s/%s\" -b -w %d -h %d -f %d -t %d",
+                    bin_dir, scene_names[s], resolutions[r][0], resolutions[r][1], frames, threads);
+
+            FILE *run = popen(command, "r");
+            if (!run) {
+                failed = true;
+                continue;
+            }
+            bool has_result = false;
+            while (fgets(line, sizeof(line), run)) {
+                if (line[0] != '{') continue;
+                line[strcspn(line, "\r\n")] = 0;
+                fprintf(output, "%s  %s", first_result ? "" : ",\n", line);
+                first_result = false;
+                has_result = true;
+            }
+            int status = pclose(run);
+            if (WEXITSTATUS(status) == 2) {
+                scene_skipped = true;
+                sprintf(skipped + strlen(skipped), "%s\"%s\"", skipped[0] ? ", " : "", scene_names[s]);
+            } else if (status || !has_result) {
+                fprintf(stderr, "%s failed at %dx%d\n", scene_names[s], resolutions[r][0], resolutions[r][1]);
+                failed = true;
+            }
+        }
+    }
+    fprintf(output, "\n], \"skipped\": [%s]}\n", skipped);
+
+    if (output_file_path) fclose(output);
+
+    return failed ? 1 : 0;
+}
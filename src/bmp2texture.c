@@ -7,101 +7,13 @@
 #endif
 
 #include <stdio.h>
-#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "./SlimTracin/core/types.h"
 #include "./SlimTracin/math/vec4.h"
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
-//typedef struct BITMAPFILEHEADER
-//{
-//    WORD bfType;  //specifies the file type
-//    DWORD bfSize;  //specifies the size in bytes of the bitmap file
-//    WORD bfReserved1;  //reserved; must be 0
-//    WORD bfReserved2;  //reserved; must be 0
-//    DWORD bfOffBits;  //specifies the offset in bytes from the bitmapfileheader to the bitmap bits
-//} BITMAPFILEHEADER;
-//typedef struct BITMAPINFOHEADER
-//{
-//    DWORD biSize;  //specifies the number of bytes required by the struct
-//    LONG biWidth;  //specifies width in pixels
-//    LONG biHeight;  //specifies height in pixels
-//    WORD biPlanes;  //specifies the number of color planes, must be 1
-//    WORD biBitCount;  //specifies the number of bits per pixel
-//    DWORD biCompression;  //specifies the type of compression
-//    DWORD biSizeImage;  //size of image in bytes
-//    LONG biXPelsPerMeter;  //number of pixels per meter in x axis
-//    LONG biYPelsPerMeter;  //number of pixels per meter in y axis
-//    DWORD biClrUsed;  //number of colors used by the bitmap
-//    DWORD biClrImportant;  //number of colors that are important
-//}BITMAPINFOHEADER;
-
-unsigned char *LoadBitmapFile(char *filename, BITMAPINFOHEADER *bitmapInfoHeader)
-{
-    FILE *filePtr;  //our file pointer
-    BITMAPFILEHEADER bitmapFileHeader;  //our bitmap file header
-    unsigned char *bitmapImage;  //store image data
-    int imageIdx=0;  //image index counter
-    unsigned char tempRGB;  //our swap variable
-
-    //open file in read binary mode
-    filePtr = fopen(filename,"rb");
-    if (filePtr == NULL)
-        return NULL;
-
-    //read the bitmap file header
-    fread(&bitmapFileHeader, sizeof(BITMAPFILEHEADER),1,filePtr);
-
-    //verify that this is a .BMP file by checking bitmap id
-    if (bitmapFileHeader.bfType !=0x4D42)
-    {
-        fclose(filePtr);
-        return NULL;
-    }
-
-    //read the bitmap info header
-    fread(bitmapInfoHeader, sizeof(BITMAPINFOHEADER),1,filePtr);
-
-    //move file pointer to the beginning of bitmap data
-    fseek(filePtr, bitmapFileHeader.bfOffBits, SEEK_SET);
-
-    if (bitmapInfoHeader->biSizeImage == 0) {
-        bitmapInfoHeader->biSizeImage = bitmapInfoHeader->biBitCount * bitmapInfoHeader->biHeight * bitmapInfoHeader->biWidth;
-    }
-    //allocate enough memory for the bitmap image data
-    bitmapImage = (unsigned char*)malloc(bitmapInfoHeader->biSizeImage);
-
-    //verify memory allocation
-    if (!bitmapImage)
-    {
-        free(bitmapImage);
-        fclose(filePtr);
-        return NULL;
-    }
-
-    //read in the bitmap image data
-    fread(bitmapImage,bitmapInfoHeader->biSizeImage,1,filePtr);
-
-    //make sure bitmap image data was read
-    if (bitmapImage == NULL)
-    {
-        fclose(filePtr);
-        return NULL;
-    }
-
-    //swap the R and B values to get RGB (bitmap is BGR)
-    u8 step = bitmapInfoHeader->biBitCount == 32 ? 4 : 3;
-    for (imageIdx = 0;imageIdx < bitmapInfoHeader->biSizeImage;imageIdx+=step)
-    {
-        tempRGB = bitmapImage[imageIdx];
-        bitmapImage[imageIdx] = bitmapImage[imageIdx + 2];
-        bitmapImage[imageIdx + 2] = tempRGB;
-    }
-
-    //close file and return bitmap image data
-    fclose(filePtr);
-    return bitmapImage;
-}
+#include "./SlimTracin/scene/texture.h"
+#include "./SlimTracin/scene/io.h"
 
 typedef struct BitmapHeader {
     u16 file_type;  // Type of the file
@@ -130,24 +42,55 @@ typedef struct BitmapHeader {
     u32 colors_important; // Important color count
 } BitmapHeader;
 
-//void loadBitmapHeader(BitmapHeader *header, char* file_path, Platform *platform) {
-//    void *file = platform->openFileForReading(file_path);
-//    platform->readFromFile(header, sizeof(BitmapHeader), file);
-//    platform->closeFile(file);
-//}
-//
-//void loadBitmapFile(Bitmap *bitmap, char* file_path, u8 *file_data, Platform *platform, Memory *memory) {
-//    void *file = platform->openFileForReading(file_path);
-//    platform->readFromFile(file_data, sizeof(BitmapHeader), file);
-//    bitmap->header = *((BitmapHeader*)file_data);
-//    platform->readFromFile(file_data, bitmap->header.file_size - sizeof(BitmapHeader), file);
-//    platform->closeFile(file);
-//
-//    u32 pixel_data_size = bitmap->header.width * bitmap->header.height * 4;
-//    u8 *trg_pixel_data = bitmap->pixel_data = (u8*)allocateMemory(memory, pixel_data_size);
-//    u8 *src_pixel_data = file_data + (bitmap->header.data_offset - sizeof(BitmapHeader));
-//    for (u32 i = 0; i < pixel_data_size; i++) *trg_pixel_data = *src_pixel_data;
+// The headers are read field by field (they are packed on disk), and each row of pixels is padded to 4 bytes:
+u8 *loadBitmapFile(char *file_path, BitmapHeader *header) {
+    FILE *file = fopen(file_path, "rb");
+    if (!file) return NULL;
+
+    fread(&header->file_type,   sizeof(u16), 1, file);
+    fread(&header->file_size,   sizeof(u32), 1, file);
+    fread(&header->reserved1,   sizeof(u16), 1, file);
+    fread(&header->reserved2,   sizeof(u16), 1, file);
+    fread(&header->data_offset, sizeof(u32), 1, file);
+    fread(&header->struct_size, sizeof(u32), 1, file);
+    fread(&header->width,       sizeof(i32), 1, file);
+    fread(&header->height,      sizeof(i32), 1, file);
+    fread(&header->planes,      sizeof(u16), 1, file);
+    fread(&header->bit_depth,   sizeof(u16), 1, file);
+    fread(&header->compression, sizeof(u32), 1, file);
+    fread(&header->image_size,  sizeof(u32), 1, file);
+    if (header->file_type != 0x4D42 || (header->bit_depth != 24 && header->bit_depth != 32)) {
+        fclose(file);
+        return NULL;
+    }
+    if (header->height < 0) header->height = -header->height;
+
+    const u32 pixel_size = header->bit_depth / 8;
+    const u32 row_size = pixel_size * (u32)header->width;
+    const u32 padding = (4 - (row_size & 3)) & 3;
+    u8 *pixels = (u8*)malloc(row_size * (u32)header->height);
+    if (!pixels) {
+        fclose(file);
+        return NULL;
+    }
 
+    fseek(file, header->data_offset, SEEK_SET);
+    u8 *row = pixels, swap, padding_bytes[3];
+    for (i32 y = 0; y < header->height; y++, row += row_size) {
+        fread(row, row_size, 1, file);
+        if (padding) fread(padding_bytes, padding, 1, file);
+
+        // Swap the R and B values to get RGB (bitmap is BGR):
+        for (u32 x = 0; x < row_size; x += pixel_size) {
+            swap = row[x];
+            row[x] = row[x + 2];
+            row[x + 2] = swap;
+        }
+    }
+
+    fclose(file);
+    return pixels;
+}
 
 typedef union TexelQuadLoader {
     struct {vec4 TL, TR, BL, BR;};
@@ -204,8 +147,8 @@ void loadTextureMipLoader(TextureMipLoader *mip, bool wrap) {
             R = (x == last_x);
 
             TL->BR = TR->BL = BL->TR = BR->TL = *texel;
-            if (     L) TL->BL = BL->TL = *texel;
-            else if (R) TR->BR = BR->TR = *texel;
+            if (     L && !wrap) TL->BL = BL->TL = *texel;
+            else if (R && !wrap) TR->BR = BR->TR = *texel;
             if (wrap) {
                 if (     L) current_line[r].BR = next_line[r].TR = *texel;
                 else if (R) current_line[l].BL = next_line[l].TL = *texel;
@@ -321,12 +264,162 @@ void loadTextureLoader(TextureLoader *texture, u16 width, u16 height, bool wrap,
 }
 
 
-void loadTexture(Texture *texture, u16 width, u16 height, bool wrap, bool mipmap, u8 *texel_components, u8 bit_count) {
+u8 getTexelComponent(f32 value) {
+    return value >= FLOAT_TO_COLOR_COMPONENT ? 255 : (value <= 0 ? 0 : (u8)value);
+}
+
+void loadTexelQuads(TextureMip *mip, TextureMipLoader *loader_mip) {
+    TexelQuad *texel_quad = mip->texel_quads;
+    TexelQuadLoader *loader_texel_quad = loader_mip->texel_quads;
+    u32 texel_quads_count = (u32)(mip->width + 1) * (u32)(mip->height + 1);
+    for (u32 t = 0; t < texel_quads_count; t++, texel_quad++, loader_texel_quad++) {
+        texel_quad->R.TL = (u8)(loader_texel_quad->TL.r);
+        texel_quad->G.TL = (u8)(loader_texel_quad->TL.g);
+        texel_quad->B.TL = (u8)(loader_texel_quad->TL.b);
+
+        texel_quad->R.TR = (u8)(loader_texel_quad->TR.r);
+        texel_quad->G.TR = (u8)(loader_texel_quad->TR.g);
+        texel_quad->B.TR = (u8)(loader_texel_quad->TR.b);
+
+        texel_quad->R.BL = (u8)(loader_texel_quad->BL.r);
+        texel_quad->G.BL = (u8)(loader_texel_quad->BL.g);
+        texel_quad->B.BL = (u8)(loader_texel_quad->BL.b);
+
+        texel_quad->R.BR = (u8)(loader_texel_quad->BR.r);
+        texel_quad->G.BR = (u8)(loader_texel_quad->BR.g);
+        texel_quad->B.BR = (u8)(loader_texel_quad->BR.b);
+    }
+}
+
+void loadTexelsRGBA8(TextureMip *mip, TextureMipLoader *loader_mip, bool wrap) {
+    // The texels get a 1-texel border of their wrapped (or clamped) neighbours:
+    i32 width  = (i32)mip->width;
+    i32 height = (i32)mip->height;
+    i32 x, y, src_x, src_y;
+    vec4 *src;
+    TexelRGBA *texel = mip->texels;
+    for (y = -1; y <= height; y++) {
+        src_y = wrap ? (y + height) % height : (y < 0 ? 0 : (y == height ? height - 1 : y));
+        for (x = -1; x <= width; x++, texel++) {
+            src_x = wrap ? (x + width) % width : (x < 0 ? 0 : (x == width ? width - 1 : x));
+            src = loader_mip->texels + (src_y * width + src_x);
+            texel->R = (u8)(src->r);
+            texel->G = (u8)(src->g);
+            texel->B = (u8)(src->b);
+            texel->A = 255;
+        }
+    }
+}
+
+u16 encodeTexelBlockColor(vec3 color) {
+    const u32 R = ((u32)getTexelComponent(color.r) * 31 + 127) / 255;
+    const u32 G = ((u32)getTexelComponent(color.g) * 63 + 127) / 255;
+    const u32 B = ((u32)getTexelComponent(color.b) * 31 + 127) / 255;
+    return (u16)(R << 11 | G << 5 | B);
+}
+
+void encodeTexelBlock(TexelBlock *block, vec3 *colors) {
+    // The end-points are the extremes of the colors along their principal axis (found by power iteration):
+    vec3 mean = getVec3Of(0);
+    u8 i, j;
+    for (i = 0; i < 16; i++) mean = addVec3(mean, colors[i]);
+    mean = scaleVec3(mean, 1.0f / 16.0f);
+
+    f32 covariance[6] = {0, 0, 0, 0, 0, 0};
+    vec3 d;
+    for (i = 0; i < 16; i++) {
+        d = subVec3(colors[i], mean);
+        covariance[0] += d.x * d.x; covariance[1] += d.x * d.y; covariance[2] += d.x * d.z;
+        covariance[3] += d.y * d.y; covariance[4] += d.y * d.z; covariance[5] += d.z * d.z;
+    }
+    vec3 axis = Vec3(1, 1, 1), next;
+    f32 length;
+    for (j = 0; j < 8; j++) {
+        next.x = covariance[0] * axis.x + covariance[1] * axis.y + covariance[2] * axis.z;
+        next.y = covariance[1] * axis.x + covariance[3] * axis.y + covariance[4] * axis.z;
+        next.z = covariance[2] * axis.x + covariance[4] * axis.y + covariance[5] * axis.z;
+        length = sqrtf(dotVec3(next, next));
+        if (length < EPS) break;
+        axis = scaleVec3(next, 1.0f / length);
+    }
+
+    f32 t, min_t = INFINITY, max_t = -INFINITY;
+    for (i = 0; i < 16; i++) {
+        t = dotVec3(subVec3(colors[i], mean), axis);
+        if (t < min_t) min_t = t;
+        if (t > max_t) max_t = t;
+    }
+    block->color0 = encodeTexelBlockColor(scaleAddVec3(axis, max_t, mean));
+    block->color1 = encodeTexelBlockColor(scaleAddVec3(axis, min_t, mean));
+    block->indices = 0;
+    if (block->color0 == block->color1) return;
+    if (block->color0 < block->color1) {
+        u16 color = block->color0;
+        block->color0 = block->color1;
+        block->color1 = color;
+    }
+
+    // Each texel gets the palette entry (as the sampler decodes it) that is closest to it:
+    vec3 palette[4];
+    palette[0] = scaleVec3(decodeTexelBlockColor(block->color0), FLOAT_TO_COLOR_COMPONENT);
+    palette[1] = scaleVec3(decodeTexelBlockColor(block->color1), FLOAT_TO_COLOR_COMPONENT);
+    palette[2] = scaleAddVec3(palette[0], 2.0f / 3.0f, scaleVec3(palette[1], 1.0f / 3.0f));
+    palette[3] = scaleAddVec3(palette[0], 1.0f / 3.0f, scaleVec3(palette[1], 2.0f / 3.0f));
+    f32 distance, closest_distance;
+    u32 closest;
+    for (i = 0; i < 16; i++) {
+        closest = 0;
+        closest_distance = INFINITY;
+        for (j = 0; j < 4; j++) {
+            d = subVec3(colors[i], palette[j]);
+            distance = dotVec3(d, d);
+            if (distance < closest_distance) {
+                closest_distance = distance;
+                closest = j;
+            }
+        }
+        block->indices |= closest << (i << 1);
+    }
+}
+
+void loadTexelBlocks(TextureMip *mip, TextureMipLoader *loader_mip) {
+    // Blocks that overhang the mip repeat its last row/column:
+    vec3 colors[16];
+    u32 x, y, block_x, block_y, src_x, src_y;
+    TexelBlock *block = mip->texel_blocks;
+    for (block_y = 0; block_y < mip->height; block_y += 4)
+        for (block_x = 0; block_x < mip->width; block_x += 4, block++) {
+            for (y = 0; y < 4; y++) {
+                src_y = block_y + y < mip->height ? block_y + y : mip->height - 1;
+                for (x = 0; x < 4; x++) {
+                    src_x = block_x + x < mip->width ? block_x + x : mip->width - 1;
+                    colors[y * 4 + x] = loader_mip->texels[src_y * mip->width + src_x].v3;
+                }
+            }
+            encodeTexelBlock(block, colors);
+        }
+}
+
+void tileTexelData(TextureMip *mip, u32 texel_size, u32 width, u32 height) {
+    // Re-arranges a row-major grid of texels into 4x4 tiles (padding the grid to whole tiles):
+    u8 *tiled_data = (u8*)calloc(getTexelCount(width, height, true), texel_size);
+    for (u32 y = 0; y < height; y++)
+        for (u32 x = 0; x < width; x++)
+            memcpy(tiled_data + texel_size * getTexelIndex(x, y, width, true),
+                   mip->texel_data + texel_size * (y * width + x), texel_size);
+
+    free(mip->texel_data);
+    mip->texel_data = tiled_data;
+}
+
+void loadTexture(Texture *texture, u16 width, u16 height, bool wrap, bool mipmap, bool tiled, TextureFormat format, u8 *texel_components, u8 bit_count) {
     TextureLoader texture_loader;
     loadTextureLoader(&texture_loader, width, height, wrap, mipmap, texel_components, bit_count);
 
     texture->wrap = wrap;
     texture->mipmap = mipmap;
+    texture->format = format;
+    texture->tiled = tiled && format != TextureFormat_BC1;
     texture->width = width;
     texture->height = height;
     texture->mip_count = texture_loader.mip_count;
@@ -337,56 +430,39 @@ void loadTexture(Texture *texture, u16 width, u16 height, bool wrap, bool mipmap
     for (u8 i = 0; i < texture->mip_count; i++, mip++, loader_mip++) {
         mip->width  = loader_mip->width;
         mip->height = loader_mip->height;
-        mip->texel_quads = (TexelQuad*)malloc(sizeof(TexelQuad) * (mip->width + 1) * (mip->height + 1));
-
-        TexelQuad *texel_quad = mip->texel_quads;
-        TexelQuadLoader *loader_texel_quad = loader_mip->texel_quads;
-        u32 texel_quads_count = (u32)(mip->width + 1) * (u32)(mip->height + 1);
-        for (u32 t = 0; t < texel_quads_count; t++, texel_quad++, loader_texel_quad++) {
-            texel_quad->R.TL = (u8)(loader_texel_quad->TL.r);
-            texel_quad->G.TL = (u8)(loader_texel_quad->TL.g);
-            texel_quad->B.TL = (u8)(loader_texel_quad->TL.b);
-
-            texel_quad->R.TR = (u8)(loader_texel_quad->TR.r);
-            texel_quad->G.TR = (u8)(loader_texel_quad->TR.g);
-            texel_quad->B.TR = (u8)(loader_texel_quad->TR.b);
-
-            texel_quad->R.BL = (u8)(loader_texel_quad->BL.r);
-            texel_quad->G.BL = (u8)(loader_texel_quad->BL.g);
-            texel_quad->B.BL = (u8)(loader_texel_quad->BL.b);
-
-            texel_quad->R.BR = (u8)(loader_texel_quad->BR.r);
-            texel_quad->G.BR = (u8)(loader_texel_quad->BR.g);
-            texel_quad->B.BR = (u8)(loader_texel_quad->BR.b);
-
+        mip->texel_data = (u8*)malloc(getTextureMipDataSize(format, mip->width, mip->height, false));
+        switch (format) {
+            case TextureFormat_RGBA8: loadTexelsRGBA8(mip, loader_mip, wrap); break;
+            case TextureFormat_BC1  : loadTexelBlocks(mip, loader_mip);       break;
+            default                 : loadTexelQuads( mip, loader_mip);       break;
+        }
+        if (texture->tiled) {
+            if (format == TextureFormat_RGBA8) tileTexelData(mip, sizeof(TexelRGBA), mip->width + 2, mip->height + 2);
+            else                               tileTexelData(mip, sizeof(TexelQuad), mip->width + 1, mip->height + 1);
         }
     }
 }
 
-int bmp2texture(char* bmp_file_path, char* texture_file_path, bool mipmap, bool wrap) {
-    BITMAPINFOHEADER bitmapInfoHeader;
-    u8* texel_components = LoadBitmapFile(bmp_file_path, &bitmapInfoHeader);
-
-    FILE* file;
-    Texture texture;
-    loadTexture(&texture, bitmapInfoHeader.biWidth, bitmapInfoHeader.biHeight, wrap, mipmap, texel_components, bitmapInfoHeader.biBitCount);
-
-    file = fopen(texture_file_path, "wb");
-
-    fwrite(&texture.width,  sizeof(u16), 1, file);
-    fwrite(&texture.height, sizeof(u16), 1, file);
-    fwrite(&texture.mipmap, sizeof(bool), 1, file);
-    fwrite(&texture.wrap,   sizeof(bool), 1, file);
-    fwrite(&texture.mip_count, sizeof(u8), 1, file);
+void* openFileForWriting(const char* file_path) { return fopen(file_path, "wb"); }
+bool writeToFile(void *out, unsigned long size, void *handle) { return fwrite(out, 1, size, (FILE*)handle) == size; }
+void closeFile(void *handle) { fclose((FILE*)handle); }
 
-    TextureMip *texture_mip = texture.mips;
-    for (u8 mip_index = 0; mip_index < texture.mip_count; mip_index++, texture_mip++) {
-        fwrite(&texture_mip->width,  sizeof(u16), 1, file);
-        fwrite(&texture_mip->height, sizeof(u16), 1, file);
-        fwrite(texture_mip->texel_quads, sizeof(TexelQuad), ((texture_mip->width + 1) * (texture_mip->height + 1)), file);
+int bmp2texture(char* bmp_file_path, char* texture_file_path, bool mipmap, bool wrap, bool tiled, TextureFormat format) {
+    BitmapHeader bitmap_header;
+    u8* texel_components = loadBitmapFile(bmp_file_path, &bitmap_header);
+    if (!texel_components) {
+        printf("Could not load a 24 or 32 bit bitmap from: %s", bmp_file_path);
+        return 1;
     }
 
-    fclose(file);
+    Texture texture;
+    loadTexture(&texture, (u16)bitmap_header.width, (u16)bitmap_header.height, wrap, mipmap, tiled, format, texel_components, (u8)bitmap_header.bit_depth);
+
+    Platform platform;
+    platform.openFileForWriting = openFileForWriting;
+    platform.writeToFile = writeToFile;
+    platform.closeFile = closeFile;
+    saveTextureToFile(&texture, texture_file_path, &platform);
 
     return 0;
 }
@@ -404,7 +480,8 @@ int main(int argc, char *argv[]) {
     // Error if less than 2 arguments were provided
     bool valid_input = argc >= 3 && (EndsWith(argv[1], ".bmp") && (EndsWith(argv[2], ".texture")));
     if (!valid_input) {
-        printf("Exactly 2 file paths need to be provided: A '.bmp' file (input) then a '.text' file (output)");
+        printf("Exactly 2 file paths need to be provided: A '.bmp' file (input) then a '.text' file (output)\n"
+               "Optionally followed by: -m (mipmap) -w (wrap) -t (4x4 tiles) and either -r (RGBA8 texels) or -c (BC1 compressed blocks)");
         return 1;
     }
 
@@ -412,14 +489,19 @@ int main(int argc, char *argv[]) {
     char* trg_file_path = argv[2];
     bool mipmap = false;
     bool wrap = false;
+    bool tiled = false;
+    TextureFormat format = TextureFormat_TexelQuads;
     for (u8 i = 3; i < (u8)argc; i++) {
         if (     argv[i][0] == '-' && argv[i][1] == 'm') mipmap = true;
         else if (argv[i][0] == '-' && argv[i][1] == 'w') wrap = true;
+        else if (argv[i][0] == '-' && argv[i][1] == 't') tiled = true;
+        else if (argv[i][0] == '-' && argv[i][1] == 'r') format = TextureFormat_RGBA8;
+        else if (argv[i][0] == '-' && argv[i][1] == 'c') format = TextureFormat_BC1;
         else {
             printf("Unknown argument: %s", argv[i]);
             valid_input = false;
             break;
         }
     }
-    return valid_input ? bmp2texture(src_file_path, trg_file_path, mipmap, wrap) : 1;
+    return valid_input ? bmp2texture(src_file_path, trg_file_path, mipmap, wrap, tiled, format) : 1;
 }
\ No newline at end of file
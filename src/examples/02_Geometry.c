@@ -72,6 +72,7 @@ void updateAndRender() {
         for (u8 i = PRIM_BOX; i < PRIM_COUNT; i++, prim++)
             if (!(prim_is_manipulated && prim == scene->selection->primitive))
                 prim->rotation = normQuat(mulQuat(prim->rotation, rot));
+        refitOrRebuildSceneBVH(scene, &app->bvh_builder);
         uploadPrimitives(scene);
 
         if (!prim_is_manipulated)
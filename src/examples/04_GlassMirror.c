@@ -88,6 +88,7 @@ void updateAndRender() {
         quat rot = Quat(rotation.axis, rotation.amount / timer->delta_time);
         scene->primitives[PRIM_BOX].rotation = normQuat(mulQuat(scene->primitives[PRIM_BOX].rotation, rot));
         scene->primitives[PRIM_TET].rotation = normQuat(mulQuat(scene->primitives[PRIM_TET].rotation, rot));
+        refitOrRebuildSceneBVH(scene, &app->bvh_builder);
         uploadPrimitives(scene);
 
         if (!prim_is_manipulated)
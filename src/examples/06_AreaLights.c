@@ -28,6 +28,7 @@ enum MATERIAL {
 enum HUD_LINE {
     HUD_LINE_SHADING,
     HUD_LINE_TRANSPARENT,
+    HUD_LINE_SHADOWS,
     HUD_LINE_COUNT
 };
 void updateSceneSelectionInHUD(Scene *scene, Viewport *viewport) {
@@ -41,6 +42,7 @@ void updateSceneSelectionInHUD(Scene *scene, Viewport *viewport) {
     HUDLine *lines = viewport->hud.lines;
     setString(&lines[HUD_LINE_SHADING    ].value.string, shader);
     setString(&lines[HUD_LINE_TRANSPARENT].value.string, transparent);
+    setString(&lines[HUD_LINE_SHADOWS    ].value.string, viewport->trace.soft_shadows ? (char*)"Soft" : (char*)"Hard");
 }
 void updateViewport(Viewport *viewport, Mouse *mouse) {
     if (mouse->is_captured) {
@@ -106,6 +108,7 @@ void onKeyChanged(u8 key, bool is_pressed) {
                 char inc = key == 'X' ? 1 : -1;
                 prim->material_id = (prim->material_id + inc + MATERIAL_COUNT) % MATERIAL_COUNT;
                 uploadPrimitives(scene);
+                updateEmissiveQuads(scene);
             } else if (key == 'T') {
                 if (prim->flags & IS_TRANSPARENT)
                     prim->flags &= ~IS_TRANSPARENT;
@@ -115,6 +118,10 @@ void onKeyChanged(u8 key, bool is_pressed) {
             }
             updateSceneSelectionInHUD(scene, viewport);
         }
+        if (key == 'H') {
+            viewport->trace.soft_shadows = !viewport->trace.soft_shadows;
+            updateSceneSelectionInHUD(scene, viewport);
+        }
     } else if (key == app->controls.key_map.tab) settings->show_hud = !settings->show_hud;
 }
 void onMouseButtonDown(MouseButton *mouse_button) {
@@ -136,8 +143,10 @@ void setupViewport(Viewport *viewport) {
     hud->position.x = hud->position.y = 10;
     setString(&lines[HUD_LINE_SHADING].title,     (char*)"Shading    : ");
     setString(&lines[HUD_LINE_TRANSPARENT].title, (char*)"Transparent: ");
+    setString(&lines[HUD_LINE_SHADOWS].title,     (char*)"Shadows    : ");
     setString(&lines[HUD_LINE_SHADING].value.string,(char*)"");
     setString(&lines[HUD_LINE_TRANSPARENT].value.string, (char*)"Off");
+    setString(&lines[HUD_LINE_SHADOWS].value.string, (char*)"Soft");
 }
 void setupScene(Scene *scene) {
     { // Setup Camera:
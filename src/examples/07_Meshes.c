@@ -89,6 +89,7 @@ void updateAndRender() {
         if (!(prim_is_manipulated && dog == scene->selection->primitive))
             dog->rotation = normQuat(mulQuat(dog->rotation, rot));
 
+        refitOrRebuildSceneBVH(scene, &app->bvh_builder);
         uploadPrimitives(scene);
 
         beginDrawing(viewport);
@@ -117,6 +118,7 @@ void onKeyChanged(u8 key, bool is_pressed) {
     if (key == 'A') move->left     = is_pressed;
     if (key == 'S') move->backward = is_pressed;
     if (key == 'D') move->right    = is_pressed;
+    if (key == 'P' && !is_pressed) app->viewport.settings.use_packets = !app->viewport.settings.use_packets;
 }
 void setupScene(Scene *scene) {
     { // Setup Camera:
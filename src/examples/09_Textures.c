@@ -24,6 +24,8 @@ enum HUD_LINE {
     HUD_LINE_UV_REPEAT,
     HUD_LINE_ROUGHNESS,
     HUD_LINE_BOUNCES,
+    HUD_LINE_SHADING,
+    HUD_LINE_COHERENCE,
     HUD_LINE_COUNT
 };
 enum MATERIAL {
@@ -152,12 +154,20 @@ void updateAndRender() {
 
         beginDrawing(viewport);
             renderScene(scene, viewport);
+            if (viewport->settings.show_hud)
+                printNumberIntoString((i32)(getShadingCoherence(&viewport->stats) * 100), &viewport->hud.lines[HUD_LINE_COHERENCE].value);
             if (viewport->settings.show_BVH) drawBVH(scene, viewport);
             if (viewport->settings.show_selection) drawSelection(scene, viewport, controls);
         endDrawing(viewport);
     endFrame(timer, mouse);
 }
 
+void updateShadingInHUD(ViewportSettings *settings, HUDLine *lines) {
+    char *str = (char*)"Per pixel";
+    if (settings->use_wavefront)
+        str = settings->sort_hits ? (char*)"Sorted" : (char*)"Unsorted";
+    setString(&lines[HUD_LINE_SHADING].value.string, str);
+}
 void onMouseButtonDown(MouseButton *mouse_button) {
     app->controls.mouse.pos_raw_diff = Vec2i(0, 0);
 }
@@ -199,6 +209,7 @@ void onKeyChanged(u8 key, bool is_pressed) {
                 M->use |= (u8)ALBEDO_MAP;
             else
                 M->use &= ~((u8)ALBEDO_MAP);
+            updateMaterialRanks(scene);
             setString(&viewport->hud.lines[HUD_LINE_ALBEDO].value.string, use_albedo_maps ? (char*)"On" : (char*)"Off");
             viewport->hud.lines[HUD_LINE_ALBEDO].value_color = use_albedo_maps ? DarkGreen : DarkRed;
             uploadMaterials(scene);
@@ -211,12 +222,18 @@ void onKeyChanged(u8 key, bool is_pressed) {
                 M->use |= (u8)NORMAL_MAP;
             else
                 M->use &= ~((u8)NORMAL_MAP);
+            updateMaterialRanks(scene);
             setString(&viewport->hud.lines[HUD_LINE_NORMAL].value.string, use_normal_maps ? (char*)"On" : (char*)"Off");
             viewport->hud.lines[HUD_LINE_NORMAL].value_color = use_normal_maps ? BrightGreen : DarkRed;
             uploadMaterials(scene);
         }
         else if (key == 'G') settings->use_GPU  = USE_GPU_BY_DEFAULT ? !settings->use_GPU : false;
         else if (key == 'C') viewport->settings.show_BVH = !viewport->settings.show_BVH;
+        else if (key == 'Q' || key == 'E') {
+            if (key == 'Q') settings->use_wavefront = !settings->use_wavefront;
+            else            settings->sort_hits     = !settings->sort_hits;
+            updateShadingInHUD(settings, viewport->hud.lines);
+        }
         else if (key == app->controls.key_map.ctrl ||
                  key == app->controls.key_map.shift) {
             app->controls.mouse.wheel_scroll_amount = 0;
@@ -313,6 +330,7 @@ void setupViewport(Viewport *viewport) {
                 break;
             case HUD_LINE_FPS:     setString(&line->value.string, (char*)("0")); break;
             case HUD_LINE_BOUNCES: setString(&line->value.string, (char*)("1")); break;
+            case HUD_LINE_COHERENCE: setString(&line->value.string, (char*)("0")); break;
             case HUD_LINE_MODE:    setString(&line->value.string, (char*)("Beauty")); break;
             default:               setString(&line->value.string, (char*)(""));
         }
@@ -330,9 +348,12 @@ void setupViewport(Viewport *viewport) {
             case HUD_LINE_UV_REPEAT: setString(&line->title, (char*)"Rep.: "); break;
             case HUD_LINE_ROUGHNESS: setString(&line->title, (char*)"Rogh: "); break;
             case HUD_LINE_BOUNCES:   setString(&line->title, (char*)"Bnc : "); break;
+            case HUD_LINE_SHADING:   setString(&line->title, (char*)"Shd : "); break;
+            case HUD_LINE_COHERENCE: setString(&line->title, (char*)"Coh%: "); break;
             default: break;
         }
     }
+    updateShadingInHUD(&viewport->settings, viewport->hud.lines);
     viewport->frame_buffer->QCAA = true;
     viewport->settings.antialias = false;
 }
@@ -445,6 +466,12 @@ void setupScene(Scene *scene) {
                 material->reflectivity = lerpVec3(plastic, material->albedo, material->metallic);
         }
     }
+    { // Setup Textures (the floor is mostly seen at grazing angles):
+        scene->textures[TEXTURE_FLOOR_ALBEDO].filter = TextureFilter_Anisotropic;
+        scene->textures[TEXTURE_FLOOR_NORMAL].filter = TextureFilter_Anisotropic;
+        scene->textures[TEXTURE_DOG_ALBEDO].filter   = TextureFilter_Trilinear;
+        scene->textures[TEXTURE_DOG_NORMAL].filter   = TextureFilter_Trilinear;
+    }
 }
 void initApp(Defaults *defaults) {
     static String mesh_files[MESH_COUNT];
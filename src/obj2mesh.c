@@ -7,13 +7,22 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 #include "./SlimTracin/core/types.h"
 #include "./SlimTracin/math/vec3.h"
 #include "./SlimTracin/math/mat3.h"
 #include "./SlimTracin/render/acceleration_structures/builder_top_down.h"
+#include "./SlimTracin/scene/io.h"
 
 enum VertexAttributes {
     VertexAttributes_None,
@@ -22,7 +31,80 @@ enum VertexAttributes {
     VertexAttributes_PositionsUVsAndNormals
 };
 
-int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_order) {
+void* openFileForWriting(const char* file_path) { return fopen(file_path, "wb"); }
+bool writeToFile(void *out, unsigned long size, void *handle) { return fwrite(out, 1, size, (FILE*)handle) == size; }
+void closeFile(void *handle) { fclose((FILE*)handle); }
+
+typedef struct ThreadJob {
+    CallbackForJob job;
+    void *data;
+    u32 thread_index;
+} ThreadJob;
+
+#ifdef _WIN32
+DWORD WINAPI runThreadJob(LPVOID param) {
+    ThreadJob *thread_job = (ThreadJob*)param;
+    thread_job->job(thread_job->data, thread_job->thread_index);
+    return 0;
+}
+
+u32 getProcessorCount() {
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    return (u32)system_info.dwNumberOfProcessors;
+}
+#else
+void* runThreadJob(void *param) {
+    ThreadJob *thread_job = (ThreadJob*)param;
+    thread_job->job(thread_job->data, thread_job->thread_index);
+    return null;
+}
+
+u32 getProcessorCount() {
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpu_count > 0 ? (u32)cpu_count : 1;
+}
+#endif
+
+// A mesh's BVH is built by a handful of parallel jobs at most, so threads are just started for each of them
+// (a thread that fails to start has its part of the job run on the main thread instead):
+void runParallelJob(CallbackForJob job, void *data, u32 thread_count) {
+    ThreadJob thread_jobs[MAX_THREAD_COUNT];
+    bool started[MAX_THREAD_COUNT];
+#ifdef _WIN32
+    HANDLE threads[MAX_THREAD_COUNT];
+#else
+    pthread_t threads[MAX_THREAD_COUNT];
+#endif
+    for (u32 i = 1; i < thread_count; i++) {
+        thread_jobs[i].job = job;
+        thread_jobs[i].data = data;
+        thread_jobs[i].thread_index = i;
+#ifdef _WIN32
+        threads[i] = CreateThread(null, 0, runThreadJob, thread_jobs + i, 0, null);
+        started[i] = threads[i] != null;
+#else
+        started[i] = pthread_create(threads + i, null, runThreadJob, thread_jobs + i) == 0;
+#endif
+    }
+
+    job(data, 0);
+
+    for (u32 i = 1; i < thread_count; i++) {
+        if (!started[i]) {
+            job(data, i);
+            continue;
+        }
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], null);
+#endif
+    }
+}
+
+int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_order, enum BVHBuildStrategy strategy, u8 bin_count, u32 optimization_passes, u32 thread_count) {
     Mesh mesh;
     mesh.aabb.min.x = mesh.aabb.min.y = mesh.aabb.min.z = 0;
     mesh.aabb.max.x = mesh.aabb.max.y = mesh.aabb.max.z = 0;
@@ -32,6 +114,7 @@ int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_orde
     mesh.edge_count = 0;
     mesh.uvs_count = 0;
     mesh.bvh.node_count = 0;
+    mesh.wide_bvh.node_count = 0;
     mesh.vertex_normals          = null;
     mesh.vertex_normal_indices   = null;
     mesh.vertex_uvs              = null;
@@ -66,7 +149,11 @@ int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_orde
     }
     fclose(file);
 
-    mesh.triangles               = (Triangle*             )malloc(sizeof(Triangle             ) * mesh.triangle_count);
+    // Spatial splits may reference some of the triangles more than once:
+    u32 max_reference_count = mesh.triangle_reference_capacity = strategy == BVHBuildStrategy_SpatialSAH ? getMaxTriangleReferenceCount(mesh.triangle_count) : mesh.triangle_count;
+
+    mesh.triangles               = (Triangle*             )malloc(sizeof(Triangle             ) * max_reference_count);
+    mesh.triangle_shading        = (TriangleShading*      )malloc(sizeof(TriangleShading      ) * max_reference_count);
     mesh.vertex_position_indices = (TriangleVertexIndices*)malloc(sizeof(TriangleVertexIndices) * mesh.triangle_count);
     mesh.vertex_positions        = (                 vec3*)malloc(sizeof(vec3                 ) * mesh.vertex_count);
     mesh.edge_vertex_indices     = (    EdgeVertexIndices*)malloc(sizeof(EdgeVertexIndices    ) * mesh.triangle_count * 3);
@@ -81,22 +168,32 @@ int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_orde
         mesh.vertex_uvs_indices    = (TriangleVertexIndices*)malloc(sizeof(TriangleVertexIndices) * mesh.triangle_count);
     }
 
-    mesh.bvh.nodes    = (BVHNode*)malloc(sizeof(BVHNode) * mesh.triangle_count * 2);
-    mesh.bvh.leaf_ids = (u32*    )malloc(sizeof(u32)     * mesh.triangle_count);
+    mesh.bvh.nodes    = (BVHNode*)malloc(sizeof(BVHNode) * max_reference_count * 2);
+    mesh.bvh.leaf_ids = (u32*    )malloc(sizeof(u32)     * max_reference_count);
+
+    // The wide BVH and triangle packets are stored as well, so that loading a mesh file doesn't need to build anything:
+    mesh.wide_bvh.nodes    = (WideBVHNode*   )malloc(getWideBVHMemorySize(max_reference_count));
+    mesh.triangle_packets  = (TrianglePacket*)malloc(sizeof(TrianglePacket) * max_reference_count);
+
+    // Subtrees of the BVH get built in parallel (though spatial splits are only ever made on a single thread):
+    if (thread_count > MAX_THREAD_COUNT) thread_count = MAX_THREAD_COUNT;
+    if (thread_count < 1) thread_count = 1;
+    u64 builder_memory_size = getBVHBuilderMemorySize(max_reference_count, thread_count);
+    Memory builder_memory;
+    initMemory(&builder_memory, (u8*)malloc(builder_memory_size), builder_memory_size);
 
     BVHBuilder builder;
-    builder.build_iterations = (BuildIteration*)malloc(sizeof(BuildIteration) * mesh.triangle_count);
-    builder.leaf_nodes       = (BVHNode*       )malloc(sizeof(BVHNode)        * mesh.triangle_count);
-    builder.leaf_ids         = (u32*           )malloc(sizeof(u32)            * mesh.triangle_count);
-    builder.sort_stack       = (i32*           )malloc(sizeof(i32)            * mesh.triangle_count);
-
-    PartitionAxis *pa = builder.partition_axis;
-    for (u8 i = 0; i < 3; i++, pa++) {
-        pa->sorted_leaf_ids     = (u32* )malloc(sizeof(u32)  * mesh.triangle_count);
-        pa->left.aabbs          = (AABB*)malloc(sizeof(AABB) * mesh.triangle_count);
-        pa->right.aabbs         = (AABB*)malloc(sizeof(AABB) * mesh.triangle_count);
-        pa->left.surface_areas  = (f32* )malloc(sizeof(f32)  * mesh.triangle_count);
-        pa->right.surface_areas = (f32* )malloc(sizeof(f32)  * mesh.triangle_count);
+    initBVHBuilder(&builder, max_reference_count, thread_count, thread_count > 1 ? runParallelJob : null, &builder_memory);
+    builder.strategy = strategy;
+    builder.bin_count = strategy == BVHBuildStrategy_SpatialSAH && !bin_count ? BVH_BUILD_BIN_COUNT : bin_count;
+    builder.node_candidates = null;
+    builder.optimized_nodes = null;
+    builder.parent_ids = builder.node_ids = null;
+    if (optimization_passes) {
+        builder.node_candidates = (BVHNodeCandidate*)malloc(sizeof(BVHNodeCandidate) * max_reference_count * 2);
+        builder.optimized_nodes = (BVHNode*         )malloc(sizeof(BVHNode)          * max_reference_count * 2);
+        builder.parent_ids      = (u32*             )malloc(sizeof(u32)              * max_reference_count * 2);
+        builder.node_ids        = (u32*             )malloc(sizeof(u32)              * max_reference_count * 2);
     }
 
     vec3 *vertex_position = mesh.vertex_positions;
@@ -250,35 +347,15 @@ int obj2mesh(char* obj_file_path, char* mesh_file_path, bool invert_winding_orde
     }
 
     updateMeshBVH(&mesh, &builder);
+    printf("BVH SAH cost: %.3f", getBVHCost(&mesh.bvh));
+    if (optimization_passes) printf(" -> %.3f (optimized)", optimizeMeshBVH(&mesh, &builder, optimization_passes));
+    printf(", %u nodes, height %u\n", mesh.bvh.node_count, mesh.bvh.height);
 
-    file = fopen(mesh_file_path, (char*)"wb");
-
-    fwrite(&mesh.aabb,           sizeof(AABB), 1, file);
-    fwrite(&mesh.vertex_count,   sizeof(u32),  1, file);
-    fwrite(&mesh.triangle_count, sizeof(u32),  1, file);
-    fwrite(&mesh.edge_count,     sizeof(u32),  1, file);
-    fwrite(&mesh.uvs_count,      sizeof(u32),  1, file);
-    fwrite(&mesh.normals_count,  sizeof(u32),  1, file);
-    fwrite(&mesh.bvh.node_count, sizeof(u32),  1, file);
-    fwrite(&mesh.bvh.height,     sizeof(u32),  1, file);
-
-    fwrite( mesh.vertex_positions,        sizeof(vec3)                 , mesh.vertex_count,   file);
-    fwrite( mesh.vertex_position_indices, sizeof(TriangleVertexIndices), mesh.triangle_count, file);
-    fwrite( mesh.edge_vertex_indices,     sizeof(EdgeVertexIndices)    , mesh.edge_count,     file);
-    if (mesh.uvs_count) {
-        fwrite(mesh.vertex_uvs,          sizeof(vec2)                  , mesh.uvs_count,      file);
-        fwrite(mesh.vertex_uvs_indices,  sizeof(TriangleVertexIndices) , mesh.triangle_count, file);
-    }
-    if (mesh.normals_count) {
-        fwrite(mesh.vertex_normals,        sizeof(vec3)                  , mesh.normals_count,  file);
-        fwrite(mesh.vertex_normal_indices, sizeof(TriangleVertexIndices) , mesh.triangle_count, file);
-    }
-
-    fwrite( mesh.triangles,               sizeof(Triangle)             , mesh.triangle_count, file);
-    fwrite( mesh.bvh.nodes,               sizeof(BVHNode)              , mesh.bvh.node_count, file);
-    fwrite( mesh.bvh.leaf_ids,            sizeof(u32)                  , mesh.triangle_count, file);
-
-    fclose(file);
+    Platform platform;
+    platform.openFileForWriting = openFileForWriting;
+    platform.writeToFile = writeToFile;
+    platform.closeFile = closeFile;
+    saveMeshToFile(&mesh, mesh_file_path, &platform);
 
     return 0;
 }
@@ -303,13 +380,37 @@ int main(int argc, char *argv[]) {
     char* src_file_path = argv[1];
     char* trg_file_path = argv[2];
     bool invert_winding_order = false;
+    u8 bin_count = 0;
+    enum BVHBuildStrategy strategy = BVHBuildStrategy_SweepSAH;
+    u32 optimization_passes = 0;
+    u32 thread_count = getProcessorCount();
     for (u8 i = 3; i < (u8)argc; i++) {
         if (argv[i][0] == '-' && argv[i][1] == 'i') invert_winding_order = true;
-        else {
+        else if (argv[i][0] == '-' && argv[i][1] == 's') strategy = BVHBuildStrategy_SpatialSAH; // For meshes with long, thin triangles
+        else if (argv[i][0] == '-' && argv[i][1] == 'u') strategy = BVHBuildStrategy_BottomUp;
+        else if (argv[i][0] == '-' && argv[i][1] == 'b') {
+            // Binned SAH build, optionally followed by the bin count (trading build time for BVH quality):
+            bin_count = BVH_BUILD_BIN_COUNT;
+            if (strategy == BVHBuildStrategy_SweepSAH) strategy = BVHBuildStrategy_BinnedSAH;
+            if (i + 1 < (u8)argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+                int bins = atoi(argv[++i]);
+                bin_count = (u8)(bins < 2 ? 2 : (bins > MAX_BVH_BUILD_BIN_COUNT ? MAX_BVH_BUILD_BIN_COUNT : bins));
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == 'o') {
+            // Optimize the BVH once it's built, optionally followed by the most passes to take over it:
+            optimization_passes = BVH_REINSERTION_MAX_PASSES;
+            if (i + 1 < (u8)argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+                int passes = atoi(argv[++i]);
+                optimization_passes = (u32)(passes < 1 ? 1 : passes);
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == 't' && i + 1 < (u8)argc) {
+            // The number of threads to build the BVH on (all of the processors by default):
+            thread_count = (u32)atoi(argv[++i]);
+        } else {
             printf("Unknown argument: %s", argv[i]);
             valid_input = false;
             break;
         }
     }
-    return valid_input ? obj2mesh(src_file_path, trg_file_path, invert_winding_order) : 1;
+    return valid_input ? obj2mesh(src_file_path, trg_file_path, invert_winding_order, strategy, bin_count, optimization_passes, thread_count) : 1;
 }
\ No newline at end of file